@@ -33,6 +33,7 @@
 #include <chrono>
 #include <condition_variable>
 #include <mutex>
+#include <optional>
 #include <string>
 #include <thread>
 #include <vector>
@@ -140,6 +141,7 @@ void print_packet(const char *label, apacket *p)
     case A_CLSE: tag = "CLSE"; break;
     case A_WRTE: tag = "WRTE"; break;
     case A_AUTH: tag = "AUTH"; break;
+    case A_STRP: tag = "STRP"; break;
     default: tag = "????"; break;
     }
 
@@ -165,16 +167,40 @@ void print_packet(const char *label, apacket *p)
 }
 #endif
 
-static void send_ready(unsigned local, unsigned remote, atransport *t)
-{
+void send_ready(unsigned local, unsigned remote, atransport* t, uint32_t acked_bytes) {
     D("Calling send_ready");
     apacket *p = get_apacket();
     p->msg.command = A_OKAY;
     p->msg.arg0 = local;
     p->msg.arg1 = remote;
+    if (t->has_feature(kFeatureDelayedAck)) {
+        p->payload.resize(sizeof(acked_bytes));
+        memcpy(p->payload.data(), &acked_bytes, sizeof(acked_bytes));
+        p->msg.data_length = p->payload.size();
+    }
     send_packet(p, t);
 }
 
+// Returns the byte count carried by an A_OKAY on a transport using kFeatureDelayedAck.
+static std::optional<uint32_t> get_acked_bytes(const apacket* p) {
+    uint32_t acked_bytes;
+    if (p->payload.size() != sizeof(acked_bytes)) {
+        return std::nullopt;
+    }
+    memcpy(&acked_bytes, p->payload.data(), sizeof(acked_bytes));
+    return acked_bytes;
+}
+
+// The send window for a new remote socket, from the byte count in an A_OPEN or the first A_OKAY.
+// Without one (or with an empty one, which nothing could ever reopen), every A_WRTE waits for an
+// A_OKAY.
+static std::optional<int64_t> initial_send_window(atransport* t, std::optional<uint32_t> bytes) {
+    if (!t->has_feature(kFeatureDelayedAck) || !bytes || *bytes == 0) {
+        return std::nullopt;
+    }
+    return *bytes;
+}
+
 static void send_close(unsigned local, unsigned remote, atransport *t)
 {
     D("Calling send_close");
@@ -220,6 +246,16 @@ void send_connect(atransport* t) {
     cp->msg.arg1 = t->get_max_payload();
 
     std::string connection_str = get_connection_string();
+#if !ADB_HOST
+    // Tell the host how to add connections to a network transport. This only goes out once the
+    // host has authenticated, and the host starts sequencing packets as soon as it sees it.
+    if (t->type == kTransportLocal && t->has_feature(kFeatureTcpStripes)) {
+        StripedConnection* striped_connection = stripe_transport(t);
+        striped_connection->EnableSequencedReads();
+        connection_str += ";stripe_token=" + striped_connection->token();
+    }
+#endif
+
     // Connect and auth packets are limited to MAX_PAYLOAD_V1 because we don't
     // yet know how much data the other size is willing to accept.
     if (connection_str.length() > MAX_PAYLOAD_V1) {
@@ -243,6 +279,7 @@ void parse_banner(const std::string& banner, atransport* t) {
     // Reset the features list or else if the server sends no features we may
     // keep the existing feature set (http://b/24405971).
     t->SetFeatures("");
+    t->stripe_token.clear();
 
     if (pieces.size() > 2) {
         const std::string& props = pieces[2];
@@ -263,6 +300,8 @@ void parse_banner(const std::string& banner, atransport* t) {
                 t->device = value;
             } else if (key == "features") {
                 t->SetFeatures(value);
+            } else if (key == "stripe_token") {
+                t->stripe_token = value;
             }
         }
     }
@@ -298,6 +337,7 @@ static void handle_new_connection(atransport* t, apacket* p) {
 
 #if ADB_HOST
     handle_online(t);
+    connect_tcp_stripes(t);
 #else
     if (!auth_required) {
         handle_online(t);
@@ -319,6 +359,10 @@ void handle_packet(apacket *p, atransport *t)
     print_packet("recv", p);
     CHECK_EQ(p->payload.size(), p->msg.data_length);
 
+    ++t->stats.packets_received;
+    t->stats.bytes_received += p->msg.data_length;
+    auto start = std::chrono::steady_clock::now();
+
     switch(p->msg.command){
     case A_CNXN:  // CONNECT(version, maxdata, "system-id-string")
         handle_new_connection(t, p);
@@ -362,8 +406,9 @@ void handle_packet(apacket *p, atransport *t)
         }
         break;
 
-    case A_OPEN: /* OPEN(local-id, 0, "destination") */
-        if (t->online && p->msg.arg0 != 0 && p->msg.arg1 == 0) {
+    case A_OPEN: /* OPEN(local-id, 0 or initial-window, "destination") */
+        if (t->online && p->msg.arg0 != 0 &&
+            (p->msg.arg1 == 0 || t->has_feature(kFeatureDelayedAck))) {
             std::string_view address(p->payload.begin(), p->payload.size());
 
             // Historically, we received service names as a char*, and stopped at the first NUL
@@ -377,24 +422,45 @@ void handle_packet(apacket *p, atransport *t)
             } else {
                 s->peer = create_remote_socket(p->msg.arg0, t);
                 s->peer->peer = s;
-                send_ready(s->id, s->peer->id, t);
+                s->peer->available_send_bytes = initial_send_window(t, p->msg.arg1);
+                send_ready(s->id, s->peer->id, t, INITIAL_DELAYED_ACK_BYTES);
                 s->ready(s);
             }
         }
         break;
 
-    case A_OKAY: /* READY(local-id, remote-id, "") */
+    case A_OKAY: /* READY(local-id, remote-id, "" or acked-bytes) */
         if (t->online && p->msg.arg0 != 0 && p->msg.arg1 != 0) {
             asocket* s = find_local_socket(p->msg.arg1, 0);
             if (s) {
+                std::optional<uint32_t> acked_bytes;
+                if (t->has_feature(kFeatureDelayedAck)) {
+                    acked_bytes = get_acked_bytes(p);
+                    if (!acked_bytes) {
+                        D("A_OKAY(%d,%d) without acked byte count on transport %s", p->msg.arg0,
+                          p->msg.arg1, t->serial.c_str());
+                    }
+                }
+
                 if(s->peer == nullptr) {
                     /* On first READY message, create the connection. */
                     s->peer = create_remote_socket(p->msg.arg0, t);
                     s->peer->peer = s;
+                    s->peer->available_send_bytes = initial_send_window(t, acked_bytes);
                     s->ready(s);
                 } else if (s->peer->id == p->msg.arg0) {
                     /* Other READY messages must use the same local-id */
-                    s->ready(s);
+                    if (s->peer->available_send_bytes && acked_bytes) {
+                        // With a window, the local socket has only been paused if we ran out.
+                        *s->peer->available_send_bytes += *acked_bytes;
+                        if (*s->peer->available_send_bytes > 0) {
+                            s->peer->stats.FinishOkayWait(&t->stats);
+                            s->ready(s);
+                        }
+                    } else {
+                        s->peer->stats.FinishOkayWait(&t->stats);
+                        s->ready(s);
+                    }
                 } else {
                     D("Invalid A_OKAY(%d,%d), expected A_OKAY(%d,%d) on transport %s", p->msg.arg0,
                       p->msg.arg1, s->peer->id, p->msg.arg1, t->serial.c_str());
@@ -436,10 +502,13 @@ void handle_packet(apacket *p, atransport *t)
         if (t->online && p->msg.arg0 != 0 && p->msg.arg1 != 0) {
             asocket* s = find_local_socket(p->msg.arg1, p->msg.arg0);
             if (s) {
-                unsigned rid = p->msg.arg0;
+                // With kFeatureDelayedAck, the A_OKAY (sent now, or by peer->ready() once the
+                // local socket has caught up) acknowledges these bytes.
+                asocket* remote = s->peer;
+                remote->unacknowledged_bytes += p->payload.size();
                 if (s->enqueue(s, std::move(p->payload)) == 0) {
                     D("Enqueue the socket");
-                    send_ready(s->id, rid, t);
+                    remote->ready(remote);
                 }
             }
         }
@@ -450,6 +519,7 @@ void handle_packet(apacket *p, atransport *t)
     }
 
     put_apacket(p);
+    t->stats.callback_time.Record(std::chrono::steady_clock::now() - start);
 }
 
 #if ADB_HOST
@@ -1151,6 +1221,11 @@ HostRequestResult handle_host_request(std::string_view service, TransportType ty
         return HostRequestResult::Handled;
     }
 
+    if (service == "stats") {
+        SendOkay(reply_fd, format_transport_stats());
+        return HostRequestResult::Handled;
+    }
+
     // remove TCP transport
     if (service.starts_with("disconnect:")) {
         std::string address(service.substr(11));
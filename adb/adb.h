@@ -35,6 +35,10 @@ constexpr size_t MAX_PAYLOAD_V1 = 4 * 1024;
 constexpr size_t MAX_PAYLOAD = 1024 * 1024;
 constexpr size_t MAX_FRAMEWORK_PAYLOAD = 64 * 1024;
 
+// The number of bytes each end of a stream lets the other send before waiting for an A_OKAY,
+// when the transport supports kFeatureDelayedAck.
+constexpr uint32_t INITIAL_DELAYED_ACK_BYTES = 4 * MAX_PAYLOAD;
+
 constexpr size_t LINUX_MAX_SOCKET_SIZE = 4194304;
 
 #define A_SYNC 0x434e5953
@@ -44,6 +48,7 @@ constexpr size_t LINUX_MAX_SOCKET_SIZE = 4194304;
 #define A_CLSE 0x45534c43
 #define A_WRTE 0x45545257
 #define A_AUTH 0x48545541
+#define A_STRP 0x50525453
 
 // ADB protocol version.
 // Version revision:
@@ -60,7 +65,7 @@ constexpr size_t LINUX_MAX_SOCKET_SIZE = 4194304;
 std::string adb_version();
 
 // Increment this when we want to force users to start a new adb server.
-#define ADB_SERVER_VERSION 41
+#define ADB_SERVER_VERSION 47
 
 using TransportId = uint64_t;
 class atransport;
@@ -237,6 +242,10 @@ void handle_offline(atransport* t);
 
 void send_connect(atransport* t);
 
+// Sends an A_OKAY. With kFeatureDelayedAck, |acked_bytes| is the number of bytes the sender of
+// the A_OKAY has consumed (or for the first A_OKAY on a stream, the initial window).
+void send_ready(unsigned local, unsigned remote, atransport* t, uint32_t acked_bytes);
+
 void parse_banner(const std::string&, atransport* t);
 
 // On startup, the adb server needs to wait until all of the connected devices are ready.
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "adb_stats.h"
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include <android-base/stringprintf.h>
+
+using android::base::StringAppendF;
+using android::base::StringPrintf;
+
+void LatencyHistogram::Record(std::chrono::steady_clock::duration duration) {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    uint64_t value = us > 0 ? us : 0;
+
+    size_t bucket = value ? 64 - __builtin_clzll(value) : 0;
+    ++buckets_[std::min(bucket, kBucketCount - 1)];
+    ++count_;
+    total_us_ += value;
+    max_us_ = std::max(max_us_, value);
+}
+
+uint64_t LatencyHistogram::PercentileUs(double percentile) const {
+    if (count_ == 0) {
+        return 0;
+    }
+
+    uint64_t rank = std::max<uint64_t>(1, std::ceil(count_ * percentile / 100));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBucketCount; ++i) {
+        seen += buckets_[i];
+        if (seen >= rank && i < kBucketCount - 1) {
+            return std::min(uint64_t(1) << i, max_us_);
+        }
+    }
+    return max_us_;
+}
+
+std::string LatencyHistogram::ToString() const {
+    return StringPrintf("n=%" PRIu64 " mean=%" PRIu64 "us p50<=%" PRIu64 "us p99<=%" PRIu64
+                        "us max=%" PRIu64 "us",
+                        count_, mean_us(), PercentileUs(50), PercentileUs(99), max_us_);
+}
+
+std::string TransportStats::ToString() const {
+    std::string result;
+    StringAppendF(&result, "  sent: %" PRIu64 " packets, %" PRIu64 " bytes\n", packets_sent,
+                  bytes_sent);
+    StringAppendF(&result, "  received: %" PRIu64 " packets, %" PRIu64 " bytes\n",
+                  packets_received, bytes_received);
+    StringAppendF(&result, "  okay wait: %s\n", okay_wait.ToString().c_str());
+    StringAppendF(&result, "  callbacks: %s\n", callback_time.ToString().c_str());
+    return result;
+}
+
+void SocketStats::StartOkayWait() {
+    if (!okay_wait_start) {
+        okay_wait_start = std::chrono::steady_clock::now();
+    }
+}
+
+void SocketStats::FinishOkayWait(TransportStats* transport) {
+    if (!okay_wait_start) {
+        return;
+    }
+
+    auto duration = std::chrono::steady_clock::now() - *okay_wait_start;
+    okay_wait_start.reset();
+    okay_wait.Record(duration);
+    if (transport) {
+        transport->okay_wait.Record(duration);
+    }
+}
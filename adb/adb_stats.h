@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <chrono>
+#include <optional>
+#include <string>
+
+// Counters for the host:stats service (see SERVICES.TXT).
+//
+// Everything here is only touched on the fdevent main thread, so recording is a handful of plain
+// increments and an occasional clock read, whether or not anyone ever asks for the stats.
+
+// A histogram of durations, in power-of-two buckets of microseconds.
+class LatencyHistogram {
+  public:
+    // Bucket i holds durations in [2^(i-1), 2^i) us; bucket 0 holds anything under 1us.
+    static constexpr size_t kBucketCount = 32;
+
+    void Record(std::chrono::steady_clock::duration duration);
+
+    uint64_t count() const { return count_; }
+    uint64_t max_us() const { return max_us_; }
+    uint64_t mean_us() const { return count_ ? total_us_ / count_ : 0; }
+
+    // An upper bound on the |percentile|th duration (the top of its bucket), in microseconds.
+    uint64_t PercentileUs(double percentile) const;
+
+    // For example, "n=12 mean=40us p50<=32us p99<=128us max=97us".
+    std::string ToString() const;
+
+  private:
+    std::array<uint64_t, kBucketCount> buckets_ = {};
+    uint64_t count_ = 0;
+    uint64_t total_us_ = 0;
+    uint64_t max_us_ = 0;
+};
+
+struct TransportStats {
+    uint64_t packets_sent = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t packets_received = 0;
+    uint64_t bytes_received = 0;
+
+    // How long the transport's sockets waited for an A_OKAY before they could send again.
+    LatencyHistogram okay_wait;
+
+    // Time spent handling incoming packets and in the transport's sockets' fdevent callbacks.
+    LatencyHistogram callback_time;
+
+    std::string ToString() const;
+};
+
+struct SocketStats {
+    // Bytes read from and written to a local socket's fd.
+    uint64_t bytes_read = 0;
+    uint64_t bytes_written = 0;
+
+    // The most that has been queued to be written to the fd at once.
+    size_t max_queued_bytes = 0;
+
+    // For remote sockets: when we ran out of window and started waiting for an A_OKAY.
+    std::optional<std::chrono::steady_clock::time_point> okay_wait_start;
+    LatencyHistogram okay_wait;
+
+    LatencyHistogram callback_time;
+
+    void StartOkayWait();
+
+    // Records the wait, if there was one, here and in |transport|.
+    void FinishOkayWait(TransportStats* transport);
+};
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "adb_stats.h"
+
+#include <chrono>
+
+#include <gtest/gtest.h>
+
+using namespace std::chrono_literals;
+
+TEST(LatencyHistogram, Empty) {
+    LatencyHistogram histogram;
+    EXPECT_EQ(0U, histogram.count());
+    EXPECT_EQ(0U, histogram.PercentileUs(50));
+    EXPECT_EQ("n=0 mean=0us p50<=0us p99<=0us max=0us", histogram.ToString());
+}
+
+TEST(LatencyHistogram, Percentiles) {
+    LatencyHistogram histogram;
+    for (int i = 0; i < 98; ++i) {
+        histogram.Record(3us);
+    }
+    histogram.Record(100us);
+    histogram.Record(5ms);
+
+    EXPECT_EQ(100U, histogram.count());
+    EXPECT_EQ(5000U, histogram.max_us());
+    EXPECT_EQ((98 * 3 + 100 + 5000) / 100U, histogram.mean_us());
+
+    // 3us is in the [2, 4) bucket, and 100us in [64, 128).
+    EXPECT_EQ(4U, histogram.PercentileUs(50));
+    EXPECT_EQ(128U, histogram.PercentileUs(99));
+
+    // The top bucket is clamped to the largest duration seen.
+    EXPECT_EQ(5000U, histogram.PercentileUs(100));
+}
+
+TEST(LatencyHistogram, OutOfRange) {
+    LatencyHistogram histogram;
+    histogram.Record(-1s);
+    histogram.Record(500ns);
+    histogram.Record(std::chrono::hours(24 * 365));
+    EXPECT_EQ(3U, histogram.count());
+    EXPECT_EQ(1U, histogram.PercentileUs(50));
+    EXPECT_EQ(histogram.max_us(), histogram.PercentileUs(100));
+}
+
+TEST(SocketStats, OkayWait) {
+    TransportStats transport;
+    SocketStats socket;
+
+    // Nothing was waiting.
+    socket.FinishOkayWait(&transport);
+    EXPECT_EQ(0U, socket.okay_wait.count());
+
+    socket.StartOkayWait();
+    socket.StartOkayWait();
+    socket.FinishOkayWait(&transport);
+    EXPECT_EQ(1U, socket.okay_wait.count());
+    EXPECT_EQ(1U, transport.okay_wait.count());
+    EXPECT_FALSE(socket.okay_wait_start);
+}
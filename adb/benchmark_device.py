@@ -15,6 +15,7 @@
 # limitations under the License.
 #
 
+import argparse
 import os
 import statistics
 import subprocess
@@ -144,13 +145,124 @@ def benchmark_shell(device=None, file_size_mb=100):
 
     analyze("shell %dMiB" % file_size_mb, speeds)
 
+def set_loopback_rtt(rtt_ms):
+    """Adds latency to the loopback interface with netem (which needs root on the host).
+
+    Packets cross the loopback interface once in each direction, so each gets half the delay.
+    """
+    subprocess.call(["sudo", "tc", "qdisc", "del", "dev", "lo", "root"],
+                    stderr=subprocess.DEVNULL)
+    if rtt_ms > 0:
+        subprocess.check_call(["sudo", "tc", "qdisc", "add", "dev", "lo", "root", "netem",
+                               "delay", "%.1fms" % (rtt_ms / 2.0)])
+
+def benchmark_rtt(device=None, rtts_ms=(0, 1, 5, 20, 50), size_mb=20):
+    """Measures how stream throughput holds up as latency increases.
+
+    This only makes sense for a device reached through the loopback interface, such as an emulator.
+    """
+    if device == None:
+        device = adb.get_device()
+
+    try:
+        for rtt_ms in rtts_ms:
+            set_loopback_rtt(rtt_ms)
+            print("round trip time %dms:" % rtt_ms)
+            benchmark_sink(device, size_mb)
+            benchmark_source(device, size_mb)
+    finally:
+        set_loopback_rtt(0)
+
+def set_adaptive_ffs(device, enabled):
+    """Turns adbd's adaptive FunctionFS transfer sizing on or off, and restarts adbd.
+
+    This needs a rooted (userdebug or eng) device.
+    """
+    device.root()
+    device.wait()
+    device.shell(["setprop", "persist.adb.adaptive_ffs", "1" if enabled else "0"])
+    device.shell_nocheck(["setprop", "ctl.restart", "adbd"])
+    time.sleep(1)
+    device.wait()
+
+def benchmark_ffs_aio(device=None, size_mb=100):
+    """Compares USB throughput with fixed and adaptive FunctionFS aio transfers."""
+    if device == None:
+        device = adb.get_device()
+
+    try:
+        for enabled in (False, True):
+            set_adaptive_ffs(device, enabled)
+            print("adaptive ffs transfers %s:" % ("on" if enabled else "off"))
+            benchmark_sink(device, size_mb)
+            benchmark_source(device, size_mb)
+            benchmark_push(device, size_mb)
+            benchmark_pull(device, size_mb)
+    finally:
+        device.shell_nocheck(["setprop", "persist.adb.adaptive_ffs", "''"])
+        device.shell_nocheck(["setprop", "ctl.restart", "adbd"])
+
+def analyze_latency(name, latencies_ms):
+    median = statistics.median(latencies_ms)
+    mean = statistics.mean(latencies_ms)
+    stddev = statistics.stdev(latencies_ms)
+    msg = "%s: %d runs: median %.2f ms, mean %.2f ms, stddev: %.2f ms"
+    print(msg % (name, len(latencies_ms), median, mean, stddev))
+
+def benchmark_session(device=None, runs=100):
+    """Compares the latency of short commands with and without an `adb session` helper."""
+    if device == None:
+        device = adb.get_device()
+
+    def time_shell_true(env):
+        latencies_ms = list()
+        for _ in range(0, runs):
+            begin = time.time()
+            subprocess.check_call(device.adb_cmd + ["shell", "true"], env=env)
+            end = time.time()
+            latencies_ms.append((end - begin) * 1000.0)
+        return latencies_ms
+
+    env = os.environ.copy()
+    env.pop("ADB_SESSION", None)
+    analyze_latency("shell true", time_shell_true(env))
+
+    with tempfile.TemporaryDirectory() as tmpdir:
+        socket_path = os.path.join(tmpdir, "session")
+        helper = subprocess.Popen(device.adb_cmd + ["session", socket_path], env=env)
+        try:
+            while not os.path.exists(socket_path):
+                if helper.poll() is not None:
+                    raise RuntimeError("adb session exited with %d" % helper.returncode)
+                time.sleep(0.01)
+            env["ADB_SESSION"] = socket_path
+            analyze_latency("shell true (session)", time_shell_true(env))
+        finally:
+            helper.terminate()
+            helper.wait()
+
 def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--session", action="store_true",
+                        help="also time short commands with and without `adb session`")
+    parser.add_argument("--rtt", action="store_true",
+                        help="also measure throughput with added loopback latency (needs sudo)")
+    parser.add_argument("--ffs-aio", action="store_true",
+                        help="also compare fixed and adaptive FunctionFS transfers (needs root)")
+    args = parser.parse_args()
+
     device = adb.get_device()
     unlock(device)
     benchmark_sink(device)
     benchmark_source(device)
     benchmark_push(device)
     benchmark_pull(device)
+    if args.session:
+        benchmark_session(device)
+    if args.rtt:
+        benchmark_rtt(device)
+    if args.ffs_aio:
+        benchmark_ffs_aio(device)
 
 if __name__ == "__main__":
     main()
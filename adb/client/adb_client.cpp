@@ -44,6 +44,7 @@
 
 #include "adb_io.h"
 #include "adb_utils.h"
+#include "client/session.h"
 #include "socket_spec.h"
 #include "sysdeps/chrono.h"
 
@@ -149,13 +150,8 @@ bool adb_status(int fd, std::string* error) {
     return false;
 }
 
-static int _adb_connect(std::string_view service, TransportId* transport, std::string* error) {
-    LOG(DEBUG) << "_adb_connect: " << service;
-    if (service.empty() || service.size() > MAX_PAYLOAD) {
-        *error = android::base::StringPrintf("bad service name length (%zd)", service.size());
-        return -1;
-    }
-
+// Connects to the server, and switches to the selected transport if |switch_transport|.
+static int _adb_connect_server(bool switch_transport, TransportId* transport, std::string* error) {
     std::string reason;
     unique_fd fd;
     if (!socket_spec_connect(&fd, __adb_server_socket_spec, nullptr, nullptr, &reason)) {
@@ -164,7 +160,7 @@ static int _adb_connect(std::string_view service, TransportId* transport, std::s
         return -2;
     }
 
-    if (!service.starts_with("host")) {
+    if (switch_transport) {
         std::optional<TransportId> transport_result = switch_socket_transport(fd.get(), error);
         if (!transport_result) {
             return -1;
@@ -175,6 +171,11 @@ static int _adb_connect(std::string_view service, TransportId* transport, std::s
         }
     }
 
+    return fd.release();
+}
+
+// Sends |service| on a connection to the server, and reads its status.
+static int _adb_open_service(unique_fd fd, std::string_view service, std::string* error) {
     if (!SendProtocolString(fd.get(), service)) {
         *error = perror_str("write failure during connection");
         return -1;
@@ -184,6 +185,22 @@ static int _adb_connect(std::string_view service, TransportId* transport, std::s
         return -1;
     }
 
+    return fd.release();
+}
+
+static int _adb_connect(std::string_view service, TransportId* transport, std::string* error) {
+    LOG(DEBUG) << "_adb_connect: " << service;
+    if (service.empty() || service.size() > MAX_PAYLOAD) {
+        *error = android::base::StringPrintf("bad service name length (%zd)", service.size());
+        return -1;
+    }
+
+    unique_fd fd(_adb_connect_server(!service.starts_with("host"), transport, error));
+    if (fd < 0) {
+        return fd.release();
+    }
+
+    fd.reset(_adb_open_service(std::move(fd), service, error));
     D("_adb_connect: return fd %d", fd.get());
     return fd.release();
 }
@@ -326,6 +343,15 @@ bool adb_check_server_version(std::string* error) {
 int adb_connect(TransportId* transport, std::string_view service, std::string* error) {
     LOG(DEBUG) << "adb_connect: service: " << service;
 
+    // An `adb session` helper has already checked the server's version and switched to the
+    // transport.
+    if (!service.starts_with("host")) {
+        unique_fd fd(session_take_connection(transport));
+        if (fd >= 0) {
+            return _adb_open_service(std::move(fd), service, error);
+        }
+    }
+
     // Query the adb server's version.
     if (!adb_check_server_version(error)) {
         return -1;
@@ -347,6 +373,13 @@ int adb_connect(TransportId* transport, std::string_view service, std::string* e
     return fd.release();
 }
 
+int adb_connect_transport(TransportId* transport, std::string* error) {
+    if (!adb_check_server_version(error)) {
+        return -1;
+    }
+    return _adb_connect_server(true, transport, error);
+}
+
 bool adb_command(const std::string& service) {
     std::string error;
     unique_fd fd(adb_connect(service, &error));
@@ -398,6 +431,10 @@ std::string format_host_command(const char* command) {
 }
 
 bool adb_get_feature_set(FeatureSet* feature_set, std::string* error) {
+    if (session_get_feature_set(feature_set)) {
+        return true;
+    }
+
     std::string result;
     if (adb_query(format_host_command("features"), &result, error)) {
         *feature_set = StringToFeatureSet(result);
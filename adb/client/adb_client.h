@@ -35,6 +35,10 @@ int adb_connect(std::string_view service, std::string* _Nonnull error);
 // Same as above, except returning the TransportId for the service that we've connected to.
 int adb_connect(TransportId* _Nullable id, std::string_view service, std::string* _Nonnull error);
 
+// Connect to adb and switch to the preferred transport, without opening a service yet. The next
+// thing to send on the returned fd is a service name, as for adb_connect.
+int adb_connect_transport(TransportId* _Nullable id, std::string* _Nonnull error);
+
 // Kill the currently running adb server, if it exists.
 bool adb_kill_server();
 
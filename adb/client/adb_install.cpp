@@ -20,26 +20,38 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
+#include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 
 #include "adb.h"
 #include "adb_client.h"
+#include "adb_io.h"
 #include "adb_unique_fd.h"
 #include "adb_utils.h"
 #include "client/file_sync_client.h"
 #include "commandline.h"
 #include "fastdeploy.h"
+#include "sysdeps/chrono.h"
 
 #if defined(ENABLE_FASTDEPLOY)
 static constexpr int kFastDeployMinApi = 24;
 #endif
 
+// How many install-write streams to have open at once, unless $ADB_INSTALL_STREAMS says otherwise.
+static constexpr size_t kDefaultInstallStreams = 4;
+static constexpr size_t kMaxInstallStreams = 16;
+
 static bool can_use_feature(const char* feature) {
     FeatureSet features;
     std::string error;
@@ -132,6 +144,141 @@ static void read_status_line(int fd, char* buf, size_t count) {
     *buf = '\0';
 }
 
+// A file to stream into an install session.
+struct InstallWrite {
+    std::string path;
+    std::string name;
+    int session_id;
+    uint64_t size;
+};
+
+static size_t install_stream_count() {
+    size_t streams = kDefaultInstallStreams;
+    const char* env = getenv("ADB_INSTALL_STREAMS");
+    if (env && !android::base::ParseUint(env, &streams, kMaxInstallStreams)) {
+        fprintf(stderr, "adb: ignoring invalid $ADB_INSTALL_STREAMS '%s'\n", env);
+        streams = kDefaultInstallStreams;
+    }
+    return std::max<size_t>(streams, 1);
+}
+
+static bool install_write(const std::string& install_cmd, const InstallWrite& write,
+                          std::atomic<uint64_t>* bytes_written, std::string* error) {
+    unique_fd local_fd(adb_open(write.path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (local_fd < 0) {
+        *error = android::base::StringPrintf("failed to open %s: %s", write.path.c_str(),
+                                             strerror(errno));
+        return false;
+    }
+
+    std::string cmd = android::base::StringPrintf("%s install-write -S %" PRIu64 " %d %s -",
+                                                  install_cmd.c_str(), write.size,
+                                                  write.session_id, write.name.c_str());
+    unique_fd remote_fd(adb_connect(cmd, error));
+    if (remote_fd < 0) {
+        *error = "connect error for write: " + *error;
+        return false;
+    }
+
+    std::vector<char> buf(32 * 1024);
+    while (true) {
+        int len = adb_read(local_fd.get(), buf.data(), buf.size());
+        if (len == 0) {
+            break;
+        } else if (len < 0) {
+            *error = android::base::StringPrintf("failed to read %s: %s", write.path.c_str(),
+                                                 strerror(errno));
+            return false;
+        }
+        if (!WriteFdExactly(remote_fd.get(), buf.data(), len)) {
+            break;
+        }
+        *bytes_written += len;
+    }
+
+    char status[BUFSIZ];
+    read_status_line(remote_fd.get(), status, sizeof(status));
+    if (strncmp("Success", status, 7)) {
+        *error = android::base::StringPrintf("failed to write %s\n%s", write.path.c_str(), status);
+        return false;
+    }
+    return true;
+}
+
+// Streams |writes| into their sessions over several install-write streams at once, so that a
+// bundle with many splits isn't serialized on a round trip per split. Progress is reported on
+// stderr, if it's a terminal.
+static bool install_write_all(const std::string& install_cmd,
+                              const std::vector<InstallWrite>& writes) {
+    uint64_t total_size = 0;
+    for (const InstallWrite& write : writes) {
+        total_size += write.size;
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t next_write = 0;
+    size_t running = 0;
+    bool failed = false;
+    std::vector<std::string> errors;
+    std::atomic<uint64_t> bytes_written = 0;
+
+    auto worker = [&]() {
+        while (true) {
+            size_t index;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (failed || next_write == writes.size()) {
+                    break;
+                }
+                index = next_write++;
+            }
+
+            std::string error;
+            if (!install_write(install_cmd, writes[index], &bytes_written, &error)) {
+                std::lock_guard<std::mutex> lock(mutex);
+                failed = true;
+                errors.push_back(std::move(error));
+                break;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        --running;
+        cv.notify_one();
+    };
+
+    size_t stream_count = std::min(install_stream_count(), writes.size());
+    std::vector<std::thread> threads;
+    running = stream_count;
+    for (size_t i = 0; i < stream_count; ++i) {
+        threads.emplace_back(worker);
+    }
+
+    const bool show_progress = unix_isatty(STDERR_FILENO) && total_size > 0;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!cv.wait_for(lock, 250ms, [&]() { return running == 0; })) {
+            if (show_progress) {
+                fprintf(stderr, "\rWriting %zu files: %3d%%", writes.size(),
+                        static_cast<int>(100 * bytes_written / total_size));
+            }
+        }
+    }
+    if (show_progress) {
+        fprintf(stderr, "\rWriting %zu files: %3d%%\n", writes.size(),
+                static_cast<int>(100 * bytes_written / total_size));
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (const std::string& error : errors) {
+        fprintf(stderr, "adb: %s\n", error.c_str());
+    }
+    return !failed;
+}
+
 #if defined(ENABLE_FASTDEPLOY)
 static int delete_device_patch_file(const char* apkPath) {
     std::string patchDevicePath = get_patch_path(apkPath);
@@ -460,6 +607,7 @@ int install_multiple_app(int argc, const char** argv) {
 
     // Valid session, now stream the APKs
     int success = 1;
+    std::vector<InstallWrite> writes;
     for (int i = first_apk; i < argc; i++) {
         const char* file = argv[i];
         struct stat sb;
@@ -468,36 +616,12 @@ int install_multiple_app(int argc, const char** argv) {
             success = 0;
             goto finalize_session;
         }
+        writes.push_back({file, android::base::Basename(file), session_id,
+                          static_cast<uint64_t>(sb.st_size)});
+    }
 
-        std::string cmd =
-                android::base::StringPrintf("%s install-write -S %" PRIu64 " %d %s -",
-                                            install_cmd.c_str(), static_cast<uint64_t>(sb.st_size),
-                                            session_id, android::base::Basename(file).c_str());
-
-        unique_fd local_fd(adb_open(file, O_RDONLY | O_CLOEXEC));
-        if (local_fd < 0) {
-            fprintf(stderr, "adb: failed to open %s: %s\n", file, strerror(errno));
-            success = 0;
-            goto finalize_session;
-        }
-
-        std::string error;
-        unique_fd remote_fd(adb_connect(cmd, &error));
-        if (remote_fd < 0) {
-            fprintf(stderr, "adb: connect error for write: %s\n", error.c_str());
-            success = 0;
-            goto finalize_session;
-        }
-
-        copy_to_file(local_fd.get(), remote_fd.get());
-        read_status_line(remote_fd.get(), buf, sizeof(buf));
-
-        if (strncmp("Success", buf, 7)) {
-            fprintf(stderr, "adb: failed to write %s\n", file);
-            fputs(buf, stderr);
-            success = 0;
-            goto finalize_session;
-        }
+    if (!install_write_all(install_cmd, writes)) {
+        success = 0;
     }
 
 finalize_session:
@@ -602,6 +726,7 @@ int install_multi_package(int argc, const char** argv) {
     }
     std::string individual_apex_cmd = individual_cmd + " --apex";
     std::string cmd = "";
+    std::vector<InstallWrite> writes;
     for (int i = first_package; i < argc; i++) {
         const char* file = argv[i];
         char buf[BUFSIZ];
@@ -648,36 +773,19 @@ int install_multi_package(int argc, const char** argv) {
                 goto finalize_multi_package_session;
             }
 
-            std::string cmd = android::base::StringPrintf(
-                    "%s install-write -S %" PRIu64 " %d %d_%s -", install_cmd.c_str(),
-                    static_cast<uint64_t>(sb.st_size), session_id, i,
-                    android::base::Basename(split).c_str());
-
-            unique_fd local_fd(adb_open(split.c_str(), O_RDONLY | O_CLOEXEC));
-            if (local_fd < 0) {
-                fprintf(stderr, "adb: failed to open %s: %s\n", split.c_str(), strerror(errno));
-                goto finalize_multi_package_session;
-            }
-
-            std::string error;
-            unique_fd remote_fd(adb_connect(cmd, &error));
-            if (remote_fd < 0) {
-                fprintf(stderr, "adb: connect error for write: %s\n", error.c_str());
-                goto finalize_multi_package_session;
-            }
-
-            copy_to_file(local_fd.get(), remote_fd.get());
-            read_status_line(remote_fd.get(), buf, sizeof(buf));
-
-            if (strncmp("Success", buf, 7)) {
-                fprintf(stderr, "adb: failed to write %s\n", split.c_str());
-                fputs(buf, stderr);
-                goto finalize_multi_package_session;
-            }
+            writes.push_back({split,
+                              android::base::StringPrintf(
+                                      "%d_%s", i, android::base::Basename(split).c_str()),
+                              session_id, static_cast<uint64_t>(sb.st_size)});
         }
         all_session_ids += android::base::StringPrintf(" %d", session_id);
     }
 
+    // Now that all the child sessions exist, stream every package's APKs at once.
+    if (!install_write_all(install_cmd, writes)) {
+        goto finalize_multi_package_session;
+    }
+
     cmd = android::base::StringPrintf("%s install-add-session %d%s", install_cmd.c_str(),
                                       parent_session_id, all_session_ids.c_str());
     {
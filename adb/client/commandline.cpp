@@ -59,8 +59,10 @@
 #include "adb_utils.h"
 #include "bugreport.h"
 #include "client/file_sync_client.h"
+#include "client/session.h"
 #include "commandline.h"
 #include "fastdeploy.h"
+#include "framebuffer_delta.h"
 #include "services.h"
 #include "shell_protocol.h"
 #include "sysdeps/chrono.h"
@@ -179,6 +181,8 @@ static void help() {
         "     write bugreport to given PATH [default=bugreport.zip];\n"
         "     if PATH is a directory, the bug report is saved in that directory.\n"
         "     devices that don't support zipped bug reports output to stdout.\n"
+        " framebuffer-stream [FPS]\n"
+        "     write raw frames of the screen to stdout as it changes [default FPS=10]\n"
         " jdwp                     list pids of processes hosting a JDWP transport\n"
         " logcat                   show device log (logcat --help for more)\n"
         "\n"
@@ -209,6 +213,9 @@ static void help() {
         " unroot                   restart adbd without root permissions\n"
         " usb                      restart adbd listening on USB\n"
         " tcpip PORT               restart adbd listening on TCP on PORT\n"
+        " session SOCKET\n"
+        "     keep connections to the device ready at the unix domain socket SOCKET,\n"
+        "     for commands run with $ADB_SESSION=SOCKET (not supported on Windows)\n"
         "\n"
         "internal debugging:\n"
         " start-server             ensure that there is a server running\n"
@@ -216,6 +223,7 @@ static void help() {
         " reconnect                kick connection from host side to force reconnect\n"
         " reconnect device         kick connection from device side to force reconnect\n"
         " reconnect offline        reset offline/unauthorized devices to force reconnect\n"
+        " stats                    show traffic and latency counters for each connection\n"
         "\n"
         "environment variables:\n"
         " $ADB_TRACE\n"
@@ -225,6 +233,10 @@ static void help() {
         " $ANDROID_SERIAL          serial number to connect to (see -s)\n"
         " $ANDROID_LOG_TAGS        tags to be used by logcat (see logcat --help)\n"
         " $ADB_LOCAL_TRANSPORT_MAX_PORT max emulator scan port (default 5585, 16 emus)\n"
+        " $ADB_COMPRESSION         set to 0 to disable compression of push/pull/sync data\n"
+        " $ADB_SYNC_TRUST_TIMESTAMPS set to 1 to skip files whose size and time match in sync\n"
+        " $ADB_INSTALL_STREAMS     APKs to write at once in install-multiple(-package) (default 4)\n"
+        " $ADB_SESSION             socket of an `adb session` to take connections from\n"
     );
     // clang-format on
 }
@@ -767,6 +779,104 @@ static int adb_shell(int argc, const char** argv) {
                        service_string);
 }
 
+// The header that the framebuffer: and framebuffer-stream: services start with.
+struct FramebufferInfo {
+    uint32_t version;
+    uint32_t bpp;
+    uint32_t color_space;
+    uint32_t size;
+    uint32_t width;
+    uint32_t height;
+    uint32_t red_offset;
+    uint32_t red_length;
+    uint32_t blue_offset;
+    uint32_t blue_length;
+    uint32_t green_offset;
+    uint32_t green_length;
+    uint32_t alpha_offset;
+    uint32_t alpha_length;
+} __attribute__((packed));
+
+static int framebuffer_stream(int argc, const char** argv) {
+    int fps = kDefaultFramebufferStreamFps;
+    if (argc > 2 ||
+        (argc == 2 && !android::base::ParseInt(argv[1], &fps, 1, kMaxFramebufferStreamFps))) {
+        error_exit("usage: adb framebuffer-stream [FPS]");
+    }
+
+    FeatureSet features;
+    std::string error;
+    if (!adb_get_feature_set(&features, &error)) {
+        fprintf(stderr, "error: %s\n", error.c_str());
+        return 1;
+    }
+    if (!CanUseFeature(features, kFeatureFramebufferStream)) {
+        error_exit("framebuffer-stream is not supported by the device");
+    }
+
+    unique_fd fd(adb_connect(android::base::StringPrintf("framebuffer-stream:%d", fps), &error));
+    if (fd < 0) {
+        fprintf(stderr, "error: %s\n", error.c_str());
+        return 1;
+    }
+
+    FramebufferInfo info;
+    if (!ReadFdExactly(fd.get(), &info, sizeof(info))) {
+        error_exit("failed to read framebuffer info");
+    }
+    if (info.width == 0 || info.width > 16384 || info.height == 0 || info.height > 16384 ||
+        (info.bpp != 16 && info.bpp != 24 && info.bpp != 32)) {
+        error_exit("bad framebuffer info: %ux%u, %u bits per pixel", info.width, info.height,
+                   info.bpp);
+    }
+    fprintf(stderr,
+            "adb: streaming %ux%u frames, %u bits per pixel (red %u:%u, green %u:%u, "
+            "blue %u:%u, alpha %u:%u)\n",
+            info.width, info.height, info.bpp, info.red_offset, info.red_length,
+            info.green_offset, info.green_length, info.blue_offset, info.blue_length,
+            info.alpha_offset, info.alpha_length);
+
+    FramebufferDeltaDecoder decoder(info.width, info.height, info.bpp / 8);
+    const size_t max_compressed_size = 2 * decoder.frame().size() + 1024 * 1024;
+    std::vector<char> compressed;
+
+    int old_stdin_mode = -1;
+    int old_stdout_mode = -1;
+    stdinout_raw_prologue(-1, STDOUT_FILENO, old_stdin_mode, old_stdout_mode);
+
+    // Every frame goes to stdout in full, so that it can be piped into anything that takes raw
+    // video. The stream ends when the device's display changes size.
+    int result = 0;
+    while (true) {
+        FramebufferFrameHeader header;
+        if (!ReadFdExactly(fd.get(), &header, sizeof(header))) {
+            break;
+        }
+        if (header.compressed_size > max_compressed_size) {
+            fprintf(stderr, "adb: bad frame size %u\n", header.compressed_size);
+            result = 1;
+            break;
+        }
+        compressed.resize(header.compressed_size);
+        if (!ReadFdExactly(fd.get(), compressed.data(), compressed.size())) {
+            break;
+        }
+        if (!decoder.Apply(header, compressed.data(), &error)) {
+            fprintf(stderr, "adb: %s\n", error.c_str());
+            result = 1;
+            break;
+        }
+        if (fwrite(decoder.frame().data(), 1, decoder.frame().size(), stdout) !=
+                    decoder.frame().size() ||
+            fflush(stdout) != 0) {
+            break;
+        }
+    }
+
+    stdinout_raw_epilogue(-1, STDOUT_FILENO, old_stdin_mode, old_stdout_mode);
+    return result;
+}
+
 static int adb_abb(int argc, const char** argv) {
     FeatureSet features;
     std::string error_message;
@@ -1889,6 +1999,8 @@ int adb_commandline(int argc, const char** argv) {
     } else if (!strcmp(argv[0], "pubkey")) {
         if (argc != 2) error_exit("pubkey requires an argument");
         return adb_auth_pubkey(argv[1]);
+    } else if (!strcmp(argv[0], "framebuffer-stream")) {
+        return framebuffer_stream(argc, argv);
     } else if (!strcmp(argv[0], "jdwp")) {
         return adb_connect_command("jdwp");
     } else if (!strcmp(argv[0], "track-jdwp")) {
@@ -1900,6 +2012,11 @@ int adb_commandline(int argc, const char** argv) {
             error_exit("usage: adb raw SERVICE");
         }
         return adb_connect_command_bidirectional(argv[1]);
+    } else if (!strcmp(argv[0], "session")) {
+        if (argc != 2) {
+            error_exit("usage: adb session SOCKET");
+        }
+        return adb_session_main(argv[1]);
     }
 
     /* "adb /?" is a common idiom under Windows */
@@ -1926,6 +2043,8 @@ int adb_commandline(int argc, const char** argv) {
         return 0;
     } else if (!strcmp(argv[0], "host-features")) {
         return adb_query_command("host:host-features");
+    } else if (!strcmp(argv[0], "stats")) {
+        return adb_query_command("host:stats");
     } else if (!strcmp(argv[0], "reconnect")) {
         if (argc == 1) {
             return adb_query_command(format_host_command(argv[0]));
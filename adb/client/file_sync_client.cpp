@@ -28,11 +28,16 @@
 #include <unistd.h>
 #include <utime.h>
 
+#include <algorithm>
 #include <chrono>
+#include <deque>
 #include <functional>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "sysdeps.h"
@@ -41,6 +46,8 @@
 #include "adb_client.h"
 #include "adb_io.h"
 #include "adb_utils.h"
+#include "file_sync_compression.h"
+#include "file_sync_hash.h"
 #include "file_sync_protocol.h"
 #include "line_printer.h"
 #include "sysdeps/errno.h"
@@ -52,6 +59,11 @@
 #include <android-base/strings.h>
 #include <android-base/stringprintf.h>
 
+// The maximum number of files we'll send ahead of their ID_OKAY (push), or request ahead of
+// receiving them (pull). This hides the round trip between files, which otherwise dominates
+// when transferring lots of small files.
+static constexpr size_t kMaxPipelinedFiles = 32;
+
 struct syncsendbuf {
     unsigned id;
     unsigned size;
@@ -75,6 +87,19 @@ static bool should_push_file(mode_t mode) {
     return S_ISREG(mode) || S_ISLNK(mode);
 }
 
+// Compression is used whenever adbd supports it, unless $ADB_COMPRESSION is "0".
+static bool compression_enabled() {
+    const char* value = getenv("ADB_COMPRESSION");
+    return value == nullptr || strcmp(value, "0") != 0;
+}
+
+// When adbd can hash files, syncs compare the contents of every file that's already on the device,
+// unless $ADB_SYNC_TRUST_TIMESTAMPS is "1", in which case a matching size and timestamp is enough.
+static bool trust_timestamps() {
+    const char* value = getenv("ADB_SYNC_TRUST_TIMESTAMPS");
+    return value != nullptr && strcmp(value, "1") == 0;
+}
+
 struct copyinfo {
     std::string lpath;
     std::string rpath;
@@ -83,6 +108,14 @@ struct copyinfo {
     uint64_t size = 0;
     bool skip = false;
 
+    // Set by incremental syncs if the remote path is already a regular file.
+    bool remote_regular = false;
+
+    // If set, only |patch_blocks| (see file_sync_hash.h) are sent, totalling |patch_size| bytes.
+    bool patch = false;
+    std::vector<uint64_t> patch_blocks;
+    uint64_t patch_size = 0;
+
     copyinfo(const std::string& local_path,
              const std::string& remote_path,
              const std::string& name,
@@ -202,7 +235,7 @@ struct TransferLedger {
 
 class SyncConnection {
   public:
-    SyncConnection() : expect_done_(false) {
+    SyncConnection() {
         max = SYNC_DATA_MAX; // TODO: decide at runtime.
 
         std::string error;
@@ -210,6 +243,10 @@ class SyncConnection {
             Error("failed to get feature set: %s", error.c_str());
         } else {
             have_stat_v2_ = CanUseFeature(features_, kFeatureStat2);
+            have_deflate_ =
+                    CanUseFeature(features_, kFeatureSendRecvDeflate) && compression_enabled();
+            have_list_recursive_ = CanUseFeature(features_, kFeatureListRecursive);
+            have_hash_ = CanUseFeature(features_, kFeatureSyncHash);
             fd.reset(adb_connect("sync:", &error));
             if (fd < 0) {
                 Error("connect failed: %s", error.c_str());
@@ -235,6 +272,10 @@ class SyncConnection {
 
     const FeatureSet& Features() const { return features_; }
 
+    bool HaveDeflate() const { return have_deflate_; }
+    bool HaveListRecursive() const { return have_list_recursive_; }
+    bool HaveHash() const { return have_hash_; }
+
     bool IsValid() { return fd >= 0; }
 
     bool ReceivedError(const char* from, const char* to) {
@@ -282,6 +323,11 @@ class SyncConnection {
     }
 
     bool SendRequest(int id, const char* path_and_mode) {
+        // Any outstanding ID_OKAYs are ahead of the response to this request.
+        if (!ReadAcknowledgements()) {
+            return false;
+        }
+
         size_t path_length = strlen(path_and_mode);
         if (path_length > 1024) {
             Error("SendRequest failed: path too long: %zu", path_length);
@@ -372,12 +418,53 @@ class SyncConnection {
         return true;
     }
 
+    bool SendHash(const char* path) {
+        return SendRequest(ID_HASH, path);
+    }
+
+    bool FinishHash(uint64_t* size, SyncHash* file_hash, std::vector<SyncHash>* block_hashes) {
+        syncmsg msg;
+        if (!ReadFdExactly(fd.get(), &msg.hash, sizeof(msg.hash))) {
+            PLOG(FATAL) << "protocol fault: failed to read hash response";
+        }
+
+        if (msg.hash.id != ID_HASH) {
+            PLOG(FATAL) << "protocol fault: hash response has wrong message id: " << msg.hash.id;
+        }
+
+        if (msg.hash.error != 0) {
+            errno = errno_from_wire(msg.hash.error);
+            return false;
+        }
+
+        if (msg.hash.block_size != kSyncHashBlockSize ||
+            msg.hash.block_count !=
+                    (msg.hash.size + kSyncHashBlockSize - 1) / kSyncHashBlockSize) {
+            LOG(FATAL) << "protocol fault: bad hash response for " << msg.hash.size
+                       << "-byte file: " << msg.hash.block_count << " blocks of "
+                       << msg.hash.block_size << " bytes";
+        }
+
+        block_hashes->resize(msg.hash.block_count);
+        if (!ReadFdExactly(fd.get(), block_hashes->data(),
+                           block_hashes->size() * sizeof(SyncHash))) {
+            PLOG(FATAL) << "protocol fault: failed to read block hashes";
+        }
+
+        *size = msg.hash.size;
+        memcpy(file_hash->data(), msg.hash.file_hash, file_hash->size());
+        return true;
+    }
+
     // Sending header, payload, and footer in a single write makes a huge
     // difference to "adb sync" performance.
-    bool SendSmallFile(const char* path_and_mode,
+    //
+    // |id| is ID_SEND or ID_SEND_DEFLATE; in the latter case |data| is the compressed form of
+    // a |file_length|-byte file.
+    bool SendSmallFile(uint32_t id, const char* path_and_mode,
                        const char* lpath, const char* rpath,
                        unsigned mtime,
-                       const char* data, size_t data_length) {
+                       const char* data, size_t data_length, size_t file_length) {
         size_t path_length = strlen(path_and_mode);
         if (path_length > 1024) {
             Error("SendSmallFile failed: path too long: %zu", path_length);
@@ -391,7 +478,7 @@ class SyncConnection {
         char* p = &buf[0];
 
         SyncRequest* req_send = reinterpret_cast<SyncRequest*>(p);
-        req_send->id = ID_SEND;
+        req_send->id = id;
         req_send->path_length = path_length;
         p += sizeof(SyncRequest);
         memcpy(p, path_and_mode, path_length);
@@ -410,18 +497,24 @@ class SyncConnection {
         p += sizeof(SyncRequest);
 
         WriteOrDie(lpath, rpath, &buf[0], (p - &buf[0]));
-        expect_done_ = true;
+        pending_copies_.emplace_back(lpath, rpath);
 
-        // RecordFilesTransferred gets called in CopyDone.
-        RecordBytesTransferred(data_length);
-        ReportProgress(rpath, data_length, data_length);
+        // RecordFilesTransferred gets called in ReadAcknowledgements.
+        RecordBytesTransferred(file_length);
+        ReportProgress(rpath, file_length, file_length);
         return true;
     }
 
     bool SendLargeFile(const char* path_and_mode,
                        const char* lpath, const char* rpath,
-                       unsigned mtime) {
-        if (!SendRequest(ID_SEND, path_and_mode)) {
+                       unsigned mtime, bool compressed) {
+        // Don't pipeline large files: ReceivedError below can't tell an early failure apart from
+        // an earlier file's ID_OKAY, and there's no round trip worth hiding anyway.
+        if (!ReadAcknowledgements()) {
+            return false;
+        }
+
+        if (!SendRequest(compressed ? ID_SEND_DEFLATE : ID_SEND, path_and_mode)) {
             Error("failed to send ID_SEND message '%s': %s", path_and_mode, strerror(errno));
             return false;
         }
@@ -441,6 +534,16 @@ class SyncConnection {
             return false;
         }
 
+        std::unique_ptr<SyncDeflater> deflater;
+        std::vector<char> compressed_output;
+        if (compressed) {
+            deflater = std::make_unique<SyncDeflater>();
+            if (!deflater->IsValid()) {
+                Error("failed to initialize compression for '%s'", lpath);
+                return false;
+            }
+        }
+
         syncsendbuf sbuf;
         sbuf.id = ID_DATA;
         while (true) {
@@ -448,13 +551,25 @@ class SyncConnection {
             if (bytes_read == -1) {
                 Error("reading '%s' locally failed: %s", lpath, strerror(errno));
                 return false;
+            }
+
+            if (deflater) {
+                if (!deflater->Deflate(sbuf.data, bytes_read, bytes_read == 0,
+                                       &compressed_output)) {
+                    Error("compressing '%s' failed", lpath);
+                    return false;
+                }
+                WriteCompressedData(lpath, rpath, deflater.get(), &compressed_output);
+                if (bytes_read == 0) {
+                    break;
+                }
             } else if (bytes_read == 0) {
                 break;
+            } else {
+                sbuf.size = bytes_read;
+                WriteOrDie(lpath, rpath, &sbuf, sizeof(SyncRequest) + bytes_read);
             }
 
-            sbuf.size = bytes_read;
-            WriteOrDie(lpath, rpath, &sbuf, sizeof(SyncRequest) + bytes_read);
-
             RecordBytesTransferred(bytes_read);
             bytes_copied += bytes_read;
 
@@ -469,12 +584,99 @@ class SyncConnection {
         syncmsg msg;
         msg.data.id = ID_DONE;
         msg.data.size = mtime;
-        expect_done_ = true;
+        WriteOrDie(lpath, rpath, &msg.data, sizeof(msg.data));
+        pending_copies_.emplace_back(lpath, rpath);
+
+        // RecordFilesTransferred gets called in ReadAcknowledgements.
+        return true;
+    }
+
+    // Overwrites the given blocks of an existing |file_size|-byte remote file (truncating or
+    // extending it as necessary), leaving the rest of it alone.
+    bool SendPatch(const char* lpath, const char* rpath, unsigned mtime, uint64_t file_size,
+                   const std::vector<uint64_t>& blocks) {
+        static_assert(kSyncHashBlockSize <= SYNC_DATA_MAX);
+
+        // As in SendLargeFile, we need to be able to tell whether adbd has given up on us.
+        if (!ReadAcknowledgements()) {
+            return false;
+        }
+
+        std::string path_and_size = android::base::StringPrintf("%s,%" PRIu64, rpath, file_size);
+        if (!SendRequest(ID_PATCH, path_and_size.c_str())) {
+            Error("failed to send ID_PATCH message '%s': %s", path_and_size.c_str(),
+                  strerror(errno));
+            return false;
+        }
+
+        unique_fd lfd(adb_open(lpath, O_RDONLY));
+        if (lfd < 0) {
+            Error("opening '%s' locally failed: %s", lpath, strerror(errno));
+            return false;
+        }
+
+        uint64_t total_size = 0;
+        for (uint64_t block : blocks) {
+            total_size += std::min<uint64_t>(kSyncHashBlockSize,
+                                             file_size - block * kSyncHashBlockSize);
+        }
+
+        // Each block goes out as a single write of header and data.
+        constexpr size_t header_size = sizeof(syncmsg::block);
+        uint64_t bytes_copied = 0;
+        std::vector<char> buf(header_size + kSyncHashBlockSize);
+        for (uint64_t block : blocks) {
+            uint64_t offset = block * kSyncHashBlockSize;
+            size_t length = std::min<uint64_t>(kSyncHashBlockSize, file_size - offset);
+
+            syncmsg* msg = reinterpret_cast<syncmsg*>(&buf[0]);
+            msg->block.id = ID_BLOCK;
+            msg->block.size = length;
+            msg->block.offset = offset;
+            if (adb_lseek(lfd, offset, SEEK_SET) != static_cast<int64_t>(offset) ||
+                !ReadFdExactly(lfd, &buf[header_size], length)) {
+                Error("reading '%s' locally failed: %s", lpath, strerror(errno));
+                return false;
+            }
+            WriteOrDie(lpath, rpath, &buf[0], header_size + length);
+
+            RecordBytesTransferred(length);
+            bytes_copied += length;
+
+            if (ReceivedError(lpath, rpath)) {
+                break;
+            }
+
+            ReportProgress(rpath, bytes_copied, total_size);
+        }
+
+        syncmsg msg;
+        msg.data.id = ID_DONE;
+        msg.data.size = mtime;
+        WriteOrDie(lpath, rpath, &msg.data, sizeof(msg.data));
+        pending_copies_.emplace_back(lpath, rpath);
+
+        // RecordFilesTransferred gets called in ReadAcknowledgements.
+        return true;
+    }
 
-        // RecordFilesTransferred gets called in CopyDone.
-        return WriteOrDie(lpath, rpath, &msg.data, sizeof(msg.data));
+    // Reads the ID_OKAY or ID_FAIL for sent files until no more than |max_pending| remain.
+    // adbd gives up on the connection after a failure, so all other pending copies are dropped.
+    bool ReadAcknowledgements(size_t max_pending = 0) {
+        while (pending_copies_.size() > max_pending) {
+            auto [from, to] = std::move(pending_copies_.front());
+            pending_copies_.pop_front();
+            if (!CopyDone(from.c_str(), to.c_str())) {
+                pending_copies_.clear();
+                return false;
+            }
+        }
+        return true;
     }
 
+    // Forgets the outstanding copies after a failure that has already been reported.
+    void DiscardAcknowledgements() { pending_copies_.clear(); }
+
     bool CopyDone(const char* from, const char* to) {
         syncmsg msg;
         if (!ReadFdExactly(fd, &msg.status, sizeof(msg.status))) {
@@ -482,14 +684,8 @@ class SyncConnection {
             return false;
         }
         if (msg.status.id == ID_OKAY) {
-            if (expect_done_) {
-                expect_done_ = false;
-                RecordFilesTransferred(1);
-                return true;
-            } else {
-                Error("failed to copy '%s' to '%s': received premature success", from, to);
-                return true;
-            }
+            RecordFilesTransferred(1);
+            return true;
         }
         if (msg.status.id != ID_FAIL) {
             Error("failed to copy '%s' to '%s': unknown reason %d", from, to, msg.status.id);
@@ -560,7 +756,7 @@ class SyncConnection {
         for (const copyinfo& ci : file_list) {
             // Unfortunately, this doesn't work for symbolic links, because we'll copy the
             // target of the link rather than just creating a link. (But ci.size is the link size.)
-            if (!ci.skip) current_ledger_.bytes_expected += ci.size;
+            if (!ci.skip) current_ledger_.bytes_expected += ci.patch ? ci.patch_size : ci.size;
         }
         current_ledger_.expect_multiple_files = true;
     }
@@ -575,9 +771,14 @@ class SyncConnection {
     size_t max;
 
   private:
-    bool expect_done_;
+    // Files that have been sent, but whose ID_OKAY hasn't been read yet, oldest first.
+    std::deque<std::pair<std::string, std::string>> pending_copies_;
+
     FeatureSet features_;
     bool have_stat_v2_;
+    bool have_deflate_ = false;
+    bool have_list_recursive_ = false;
+    bool have_hash_ = false;
 
     TransferLedger global_ledger_;
     TransferLedger current_ledger_;
@@ -587,13 +788,31 @@ class SyncConnection {
         return SendRequest(ID_QUIT, ""); // TODO: add a SendResponse?
     }
 
+    // Sends the contents of |output| as ID_DATA chunks, and tells |deflater| how long it took.
+    void WriteCompressedData(const char* from, const char* to, SyncDeflater* deflater,
+                             std::vector<char>* output) {
+        auto start = std::chrono::steady_clock::now();
+        syncsendbuf sbuf;
+        sbuf.id = ID_DATA;
+        for (size_t offset = 0; offset < output->size(); offset += sbuf.size) {
+            sbuf.size = std::min(output->size() - offset, max - sizeof(SyncRequest));
+            memcpy(sbuf.data, output->data() + offset, sbuf.size);
+            WriteOrDie(from, to, &sbuf, sizeof(SyncRequest) + sbuf.size);
+        }
+        deflater->RecordWriteTime(std::chrono::steady_clock::now() - start);
+        output->clear();
+    }
+
     bool WriteOrDie(const char* from, const char* to, const void* data, size_t data_length) {
         if (!WriteFdExactly(fd, data, data_length)) {
             if (errno == ECONNRESET) {
                 // Assume adbd told us why it was closing the connection, and
-                // try to read failure reason from adbd.
+                // try to read failure reason from adbd. If it was one of the
+                // files we already sent that failed, that will report it.
                 syncmsg msg;
-                if (!ReadFdExactly(fd, &msg.status, sizeof(msg.status))) {
+                if (!ReadAcknowledgements()) {
+                    // Already reported.
+                } else if (!ReadFdExactly(fd, &msg.status, sizeof(msg.status))) {
                     Error("failed to copy '%s' to '%s': no response: %s", from, to, strerror(errno));
                 } else if (msg.status.id != ID_FAIL) {
                     Error("failed to copy '%s' to '%s': not ID_FAIL: %d", from, to, msg.status.id);
@@ -633,6 +852,43 @@ static bool sync_ls(SyncConnection& sc, const char* path,
     }
 }
 
+// |name| is relative to the listed directory, using '/' as the separator. |target_mode| is the
+// mode of a symlink's target, or 0 if the target can't be resolved.
+typedef void(sync_ls_recursive_cb)(const struct stat& st, unsigned target_mode, const char* name);
+
+static bool sync_ls_recursive(SyncConnection& sc, const char* path,
+                              const std::function<sync_ls_recursive_cb>& func) {
+    if (!sc.SendRequest(ID_LIST_RECURSIVE, path)) return false;
+
+    std::string name;
+    while (true) {
+        syncmsg msg;
+        if (!ReadFdExactly(sc.fd, &msg.dent_v2, sizeof(msg.dent_v2))) return false;
+
+        if (msg.dent_v2.id == ID_DONE) return true;
+        if (msg.dent_v2.id != ID_DENT_V2) return false;
+
+        size_t len = msg.dent_v2.namelen;
+        if (len == 0 || len > 4096) return false;
+
+        name.resize(len);
+        if (!ReadFdExactly(sc.fd, &name[0], len)) return false;
+
+        struct stat st = {};
+        st.st_dev = msg.dent_v2.dev;
+        st.st_ino = msg.dent_v2.ino;
+        st.st_mode = msg.dent_v2.mode;
+        st.st_nlink = msg.dent_v2.nlink;
+        st.st_uid = msg.dent_v2.uid;
+        st.st_gid = msg.dent_v2.gid;
+        st.st_size = msg.dent_v2.size;
+        st.st_atime = msg.dent_v2.atime;
+        st.st_mtime = msg.dent_v2.mtime;
+        st.st_ctime = msg.dent_v2.ctime;
+        func(st, msg.dent_v2.target_mode, name.c_str());
+    }
+}
+
 static bool sync_stat(SyncConnection& sc, const char* path, struct stat* st) {
     return sc.SendStat(path) && sc.FinishStat(st);
 }
@@ -698,10 +954,11 @@ static bool sync_send(SyncConnection& sc, const char* lpath, const char* rpath,
         }
         buf[data_length++] = '\0';
 
-        if (!sc.SendSmallFile(path_and_mode.c_str(), lpath, rpath, mtime, buf, data_length)) {
+        if (!sc.SendSmallFile(ID_SEND, path_and_mode.c_str(), lpath, rpath, mtime, buf,
+                              data_length, data_length)) {
             return false;
         }
-        return sc.CopyDone(lpath, rpath);
+        return sc.ReadAcknowledgements(kMaxPipelinedFiles);
 #endif
     }
 
@@ -716,26 +973,72 @@ static bool sync_send(SyncConnection& sc, const char* lpath, const char* rpath,
             sc.Error("failed to read all of '%s': %s", lpath, strerror(errno));
             return false;
         }
-        if (!sc.SendSmallFile(path_and_mode.c_str(), lpath, rpath, mtime,
-                              data.data(), data.size())) {
+
+        // Only bother with compression if it actually saves something; this also guarantees
+        // that the compressed data fits in a single ID_DATA chunk.
+        std::vector<char> compressed;
+        if (sc.HaveDeflate()) {
+            SyncDeflater deflater;
+            if (!deflater.Deflate(data.data(), data.size(), true, &compressed) ||
+                compressed.size() >= data.size()) {
+                compressed.clear();
+            }
+        }
+
+        if (!compressed.empty()) {
+            if (!sc.SendSmallFile(ID_SEND_DEFLATE, path_and_mode.c_str(), lpath, rpath, mtime,
+                                  compressed.data(), compressed.size(), data.size())) {
+                return false;
+            }
+        } else if (!sc.SendSmallFile(ID_SEND, path_and_mode.c_str(), lpath, rpath, mtime,
+                                     data.data(), data.size(), data.size())) {
             return false;
         }
     } else {
-        if (!sc.SendLargeFile(path_and_mode.c_str(), lpath, rpath, mtime)) {
+        if (!sc.SendLargeFile(path_and_mode.c_str(), lpath, rpath, mtime, sc.HaveDeflate())) {
             return false;
         }
     }
-    return sc.CopyDone(lpath, rpath);
+    return sc.ReadAcknowledgements(kMaxPipelinedFiles);
 }
 
-static bool sync_recv(SyncConnection& sc, const char* rpath, const char* lpath,
-                      const char* name, uint64_t expected_size) {
-    if (!sc.SendRequest(ID_RECV, rpath)) return false;
+static bool sync_recv_request(SyncConnection& sc, const char* rpath) {
+    return sc.SendRequest(sc.HaveDeflate() ? ID_RECV_DEFLATE : ID_RECV, rpath);
+}
+
+// Reads and throws away the response to an ID_RECV request, so that the connection can still be
+// used after a local failure. Returns false if the connection is no longer usable.
+static bool sync_recv_discard(SyncConnection& sc) {
+    while (true) {
+        syncmsg msg;
+        if (!ReadFdExactly(sc.fd, &msg.data, sizeof(msg.data))) return false;
+        if (msg.data.id == ID_DONE) return true;
+
+        // adbd closes the connection after an ID_FAIL.
+        if (msg.data.id != ID_DATA || msg.data.size > sc.max) return false;
+
+        char buffer[SYNC_DATA_MAX];
+        if (!ReadFdExactly(sc.fd, buffer, msg.data.size)) return false;
+    }
+}
+
+// Receives the response to an ID_RECV request previously sent with sync_recv_request.
+static bool sync_recv_response(SyncConnection& sc, const char* rpath, const char* lpath,
+                               const char* name, uint64_t expected_size) {
+    std::unique_ptr<SyncInflater> inflater;
+    if (sc.HaveDeflate()) {
+        inflater = std::make_unique<SyncInflater>();
+        if (!inflater->IsValid()) {
+            sc.Error("failed to initialize decompression for '%s'", rpath);
+            return false;
+        }
+    }
 
     adb_unlink(lpath);
     unique_fd lfd(adb_creat(lpath, 0644));
     if (lfd < 0) {
         sc.Error("cannot create '%s': %s", lpath, strerror(errno));
+        sync_recv_discard(sc);
         return false;
     }
 
@@ -747,7 +1050,14 @@ static bool sync_recv(SyncConnection& sc, const char* rpath, const char* lpath,
             return false;
         }
 
-        if (msg.data.id == ID_DONE) break;
+        if (msg.data.id == ID_DONE) {
+            if (inflater && !inflater->finished()) {
+                sc.Error("failed to copy '%s' to '%s': truncated compressed data", rpath, lpath);
+                adb_unlink(lpath);
+                return false;
+            }
+            break;
+        }
 
         if (msg.data.id != ID_DATA) {
             adb_unlink(lpath);
@@ -767,15 +1077,38 @@ static bool sync_recv(SyncConnection& sc, const char* rpath, const char* lpath,
             return false;
         }
 
-        if (!WriteFdExactly(lfd, buffer, msg.data.size)) {
-            sc.Error("cannot write '%s': %s", lpath, strerror(errno));
+        size_t bytes_written = 0;
+        bool write_failed = false;
+        auto sink = [&lfd, &bytes_written, &write_failed](const char* data, size_t length) {
+            if (!WriteFdExactly(lfd, data, length)) {
+                write_failed = true;
+                return false;
+            }
+            bytes_written += length;
+            return true;
+        };
+
+        bool success;
+        if (inflater) {
+            success = inflater->Inflate(buffer, msg.data.size, sink);
+        } else {
+            success = sink(buffer, msg.data.size);
+        }
+
+        if (!success) {
+            if (write_failed) {
+                sc.Error("cannot write '%s': %s", lpath, strerror(errno));
+            } else {
+                sc.Error("failed to copy '%s' to '%s': corrupt compressed data", rpath, lpath);
+            }
             adb_unlink(lpath);
+            sync_recv_discard(sc);
             return false;
         }
 
-        bytes_copied += msg.data.size;
+        bytes_copied += bytes_written;
 
-        sc.RecordBytesTransferred(msg.data.size);
+        sc.RecordBytesTransferred(bytes_written);
         sc.ReportProgress(name != nullptr ? name : rpath, bytes_copied, expected_size);
     }
 
@@ -783,6 +1116,12 @@ static bool sync_recv(SyncConnection& sc, const char* rpath, const char* lpath,
     return true;
 }
 
+static bool sync_recv(SyncConnection& sc, const char* rpath, const char* lpath,
+                      const char* name, uint64_t expected_size) {
+    return sync_recv_request(sc, rpath) &&
+           sync_recv_response(sc, rpath, lpath, name, expected_size);
+}
+
 bool do_sync_ls(const char* path) {
     SyncConnection sc;
     if (!sc.IsValid()) return false;
@@ -849,6 +1188,80 @@ static bool local_build_list(SyncConnection& sc, std::vector<copyinfo>* file_lis
     return true;
 }
 
+static bool hash_local_file(const std::string& path, uint64_t size,
+                            std::vector<SyncHash>* block_hashes) {
+    unique_fd fd(unix_open(path, O_RDONLY));
+    if (fd < 0) {
+        return false;
+    }
+    return SyncHashBlocks(fd.get(), size, std::thread::hardware_concurrency(), block_hashes);
+}
+
+// Works out how to update each regular file in |file_list| that's already a regular file on the
+// device: files with the same contents are skipped, whatever their timestamps, files with only a
+// few changed blocks are patched, and anything else is pushed in full. Files whose size and
+// timestamp match are only checked if |check_matches|.
+static bool compare_file_hashes(SyncConnection& sc, std::vector<copyinfo>* file_list,
+                                bool check_matches) {
+    std::vector<copyinfo*> candidates;
+    for (copyinfo& ci : *file_list) {
+        if (S_ISREG(ci.mode) && ci.remote_regular && (!ci.skip || check_matches)) {
+            candidates.push_back(&ci);
+        }
+    }
+
+    // Keep the device busy hashing later files while we hash each one locally.
+    size_t requests_sent = 0;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        while (requests_sent < candidates.size() && requests_sent < i + kMaxPipelinedFiles) {
+            if (!sc.SendHash(candidates[requests_sent]->rpath.c_str())) {
+                sc.Error("failed to send hash request");
+                return false;
+            }
+            ++requests_sent;
+        }
+
+        copyinfo& ci = *candidates[i];
+        std::vector<SyncHash> local_blocks;
+        bool local_hashed = hash_local_file(ci.lpath, ci.size, &local_blocks);
+
+        uint64_t remote_size;
+        SyncHash remote_hash;
+        std::vector<SyncHash> remote_blocks;
+        if (!sc.FinishHash(&remote_size, &remote_hash, &remote_blocks) || !local_hashed) {
+            // Leave it to the size and timestamp check, and the regular push to report any errors.
+            continue;
+        }
+
+        // The device's timestamp is left alone: copying the file just to update it would cost
+        // far more than it's worth.
+        if (remote_size == ci.size && remote_hash == SyncHashFile(local_blocks)) {
+            ci.skip = true;
+            continue;
+        }
+        ci.skip = false;
+
+        std::vector<uint64_t> changed_blocks;
+        uint64_t changed_size = 0;
+        for (size_t block = 0; block < local_blocks.size(); ++block) {
+            if (block >= remote_blocks.size() || local_blocks[block] != remote_blocks[block]) {
+                changed_blocks.push_back(block);
+                changed_size += std::min<uint64_t>(kSyncHashBlockSize,
+                                                   ci.size - block * kSyncHashBlockSize);
+            }
+        }
+
+        // A patch can't use compression, and the device has to copy the unchanged blocks, so
+        // it's only worth it when most of the file is unchanged.
+        if (changed_size < ci.size / 2) {
+            ci.patch = true;
+            ci.patch_blocks = std::move(changed_blocks);
+            ci.patch_size = changed_size;
+        }
+    }
+    return true;
+}
+
 static bool copy_local_dir_remote(SyncConnection& sc, std::string lpath,
                                   std::string rpath, bool check_timestamps,
                                   bool list_only) {
@@ -909,7 +1322,28 @@ static bool copy_local_dir_remote(SyncConnection& sc, std::string lpath,
         }
     }
 
-    if (check_timestamps) {
+    if (check_timestamps && sc.HaveListRecursive()) {
+        // A single listing of the whole tree is much cheaper than an lstat per file.
+        std::unordered_map<std::string, struct stat> remote_files;
+        auto callback = [&](const struct stat& st, unsigned, const char* name) {
+            if (!S_ISDIR(st.st_mode)) {
+                remote_files.emplace(rpath + name, st);
+            }
+        };
+        if (!sync_ls_recursive(sc, rpath.c_str(), callback)) {
+            sc.Error("failed to list '%s'", rpath.c_str());
+            return false;
+        }
+        for (copyinfo& ci : file_list) {
+            auto it = remote_files.find(ci.rpath);
+            if (it == remote_files.end()) continue;
+            const struct stat& st = it->second;
+            if (st.st_size == static_cast<off_t>(ci.size) && st.st_mtime == ci.time) {
+                ci.skip = true;
+            }
+            ci.remote_regular = S_ISREG(st.st_mode);
+        }
+    } else if (check_timestamps) {
         for (const copyinfo& ci : file_list) {
             if (!sc.SendLstat(ci.rpath.c_str())) {
                 sc.Error("failed to send lstat");
@@ -922,16 +1356,32 @@ static bool copy_local_dir_remote(SyncConnection& sc, std::string lpath,
                 if (st.st_size == static_cast<off_t>(ci.size) && st.st_mtime == ci.time) {
                     ci.skip = true;
                 }
+                ci.remote_regular = S_ISREG(st.st_mode);
             }
         }
     }
 
+    // A rebuild changes every timestamp even if the contents don't change, and an edit that keeps
+    // the size can keep the timestamp too (a checkout, `touch -r`, or a build that pins
+    // timestamps), so compare the contents of files that already exist wherever we can.
+    if (check_timestamps && sc.HaveHash() &&
+        !compare_file_hashes(sc, &file_list, !trust_timestamps())) {
+        return false;
+    }
+
     sc.ComputeExpectedTotalBytes(file_list);
 
     for (const copyinfo& ci : file_list) {
         if (!ci.skip) {
             if (list_only) {
-                sc.Println("would push: %s -> %s", ci.lpath.c_str(), ci.rpath.c_str());
+                sc.Println("would %s: %s -> %s", ci.patch ? "patch" : "push", ci.lpath.c_str(),
+                           ci.rpath.c_str());
+            } else if (ci.patch) {
+                if (!sc.SendPatch(ci.lpath.c_str(), ci.rpath.c_str(), ci.time, ci.size,
+                                  ci.patch_blocks) ||
+                    !sc.ReadAcknowledgements(kMaxPipelinedFiles)) {
+                    return false;
+                }
             } else {
                 if (!sync_send(sc, ci.lpath.c_str(), ci.rpath.c_str(), ci.time, ci.mode, false)) {
                     return false;
@@ -942,6 +1392,10 @@ static bool copy_local_dir_remote(SyncConnection& sc, std::string lpath,
         }
     }
 
+    if (!sc.ReadAcknowledgements()) {
+        return false;
+    }
+
     sc.RecordFilesSkipped(skipped);
     sc.ReportTransferRate(lpath, TransferDirection::push);
     return true;
@@ -1033,7 +1487,14 @@ bool do_sync_push(const std::vector<const char*>& srcs, const char* dst, bool sy
 
         sc.NewTransfer();
         sc.SetExpectedTotalBytes(st.st_size);
-        success &= sync_send(sc, src_path, dst_path, st.st_mtime, st.st_mode, sync);
+        // sync_send has already reported its own failure, so don't report it a second time as
+        // an unreadable acknowledgement.
+        if (sync_send(sc, src_path, dst_path, st.st_mtime, st.st_mode, sync)) {
+            success &= sc.ReadAcknowledgements();
+        } else {
+            sc.DiscardAcknowledgements();
+            success = false;
+        }
         sc.ReportTransferRate(src_path, TransferDirection::push);
     }
 
@@ -1041,8 +1502,63 @@ bool do_sync_push(const std::vector<const char*>& srcs, const char* dst, bool sy
     return success;
 }
 
+static bool remote_build_list(SyncConnection& sc, std::vector<copyinfo>* file_list,
+                              const std::string& rpath, const std::string& lpath);
+
+// Like remote_build_list, but lists the whole tree (bar symlinked directories) in one request.
+static bool remote_build_list_recursive(SyncConnection& sc, std::vector<copyinfo>* file_list,
+                                        const std::string& rpath, const std::string& lpath) {
+    std::vector<copyinfo> linked_dirlist;
+
+    // Add an entry for the current directory to ensure it gets created before pulling its contents.
+    copyinfo ci(android::base::Dirname(lpath), android::base::Dirname(rpath),
+                android::base::Basename(lpath), S_IFDIR);
+    file_list->push_back(ci);
+
+    // Directories are always listed before their contents, so they'll be created in time.
+    auto callback = [&](const struct stat& st, unsigned target_mode, const char* name) {
+        copyinfo ci(lpath, rpath, name, st.st_mode);
+        if (S_ISDIR(st.st_mode)) {
+            file_list->push_back(ci);
+        } else if (S_ISLNK(st.st_mode)) {
+            if (target_mode == 0) {
+                sc.Warning("skipping dangling symlink '%s'", ci.rpath.c_str());
+            } else if (S_ISDIR(target_mode)) {
+                linked_dirlist.push_back(ci);
+            } else {
+                file_list->push_back(ci);
+            }
+        } else {
+            if (!should_pull_file(ci.mode)) {
+                sc.Warning("skipping special file '%s' (mode = 0o%o)", ci.rpath.c_str(), ci.mode);
+                ci.skip = true;
+            }
+            ci.time = st.st_mtime;
+            ci.size = st.st_size;
+            file_list->push_back(ci);
+        }
+    };
+
+    if (!sync_ls_recursive(sc, rpath.c_str(), callback)) {
+        return false;
+    }
+
+    // Symlinks to directories are followed, as remote_build_list does.
+    for (copyinfo& link_ci : linked_dirlist) {
+        if (!remote_build_list(sc, file_list, link_ci.rpath, link_ci.lpath)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 static bool remote_build_list(SyncConnection& sc, std::vector<copyinfo>* file_list,
                               const std::string& rpath, const std::string& lpath) {
+    if (sc.HaveListRecursive()) {
+        return remote_build_list_recursive(sc, file_list, rpath, lpath);
+    }
+
     std::vector<copyinfo> dirlist;
     std::vector<copyinfo> linklist;
 
@@ -1134,8 +1650,33 @@ static bool copy_remote_dir_local(SyncConnection& sc, std::string rpath,
 
     sc.ComputeExpectedTotalBytes(file_list);
 
+    // Request the next few files before we've finished receiving the current one, so that adbd
+    // can move on to the next file without waiting for a round trip. adbd handles requests in
+    // order, so the responses arrive in file_list order.
+    size_t next_request = 0;
+    auto send_requests = [&](size_t current) {
+        while (next_request < file_list.size() && next_request - current < kMaxPipelinedFiles) {
+            const copyinfo& ci = file_list[next_request++];
+            if (!ci.skip && !S_ISDIR(ci.mode) && !sync_recv_request(sc, ci.rpath.c_str())) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    // If we have to give up, discard the responses to the requests we've already sent, so that
+    // the connection can still be used for any remaining sources.
+    auto abandon_requests = [&](size_t current) {
+        for (size_t j = current + 1; j < next_request; ++j) {
+            const copyinfo& ci = file_list[j];
+            if (!ci.skip && !S_ISDIR(ci.mode) && !sync_recv_discard(sc)) break;
+        }
+        return false;
+    };
+
     int skipped = 0;
-    for (const copyinfo &ci : file_list) {
+    for (size_t i = 0; i < file_list.size(); ++i) {
+        const copyinfo& ci = file_list[i];
         if (!ci.skip) {
             if (S_ISDIR(ci.mode)) {
                 // Entry is for an empty directory, create it and continue.
@@ -1143,17 +1684,18 @@ static bool copy_remote_dir_local(SyncConnection& sc, std::string rpath,
                 if (!mkdirs(ci.lpath))  {
                     sc.Error("failed to create directory '%s': %s",
                              ci.lpath.c_str(), strerror(errno));
-                    return false;
+                    return abandon_requests(i);
                 }
                 continue;
             }
 
-            if (!sync_recv(sc, ci.rpath.c_str(), ci.lpath.c_str(), nullptr, ci.size)) {
-                return false;
+            if (!send_requests(i) ||
+                !sync_recv_response(sc, ci.rpath.c_str(), ci.lpath.c_str(), nullptr, ci.size)) {
+                return abandon_requests(i);
             }
 
             if (copy_attrs && set_time_and_mode(ci.lpath, ci.time, ci.mode)) {
-                return false;
+                return abandon_requests(i);
             }
         } else {
             skipped++;
@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TRACE_TAG ADB
+
+#include "sysdeps.h"
+#include "client/session.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <android-base/thread_annotations.h>
+#include <cutils/sockets.h>
+
+#if !defined(_WIN32)
+#include <android-base/cmsg.h>
+#endif
+
+#include "adb_client.h"
+#include "adb_io.h"
+
+#if defined(_WIN32)
+
+int adb_session_main(const char*) {
+    fprintf(stderr, "adb: sessions aren't supported on Windows\n");
+    return 1;
+}
+
+unique_fd session_take_connection(TransportId*) {
+    return unique_fd();
+}
+
+bool session_get_feature_set(FeatureSet*) {
+    return false;
+}
+
+#else
+
+// How many connections the helper keeps ready.
+static constexpr size_t kSessionPoolSize = 4;
+
+// What the helper sends along with each connection.
+struct SessionInfo {
+    TransportId transport_id;
+    std::string serial;
+    FeatureSet features;
+};
+
+static std::string SessionInfoToString(const SessionInfo& info) {
+    return std::to_string(info.transport_id) + "\n" + info.serial + "\n" +
+           FeatureSetToString(info.features);
+}
+
+static std::optional<SessionInfo> SessionInfoFromString(const std::string& str) {
+    std::vector<std::string> pieces = android::base::Split(str, "\n");
+    SessionInfo info;
+    if (pieces.size() != 3 || !android::base::ParseUint(pieces[0], &info.transport_id)) {
+        return std::nullopt;
+    }
+    info.serial = pieces[1];
+    info.features = StringToFeatureSet(pieces[2]);
+    return info;
+}
+
+// A pooled connection that the server has closed (because it restarted, say) is readable.
+static bool IsConnectionAlive(int fd) {
+    adb_pollfd pfd = {.fd = fd, .events = POLLIN};
+    return adb_poll(&pfd, 1, 0) == 0;
+}
+
+// The server keeps connections that have switched to a transport open after the transport goes
+// away, so ask it whether the pinned transport is still there.
+static bool IsTransportAlive(std::string* error) {
+    std::string state;
+    return adb_query(format_host_command("get-state"), &state, error);
+}
+
+static bool IsClientWaiting(int server_fd) {
+    adb_pollfd pfd = {.fd = server_fd, .events = POLLIN};
+    return adb_poll(&pfd, 1, 0) == 1;
+}
+
+// The connection goes first, alongside a single byte, followed by the info as a protocol string.
+static bool SendConnection(int client_fd, unique_fd connection, const std::string& info) {
+    char marker = 0;
+    if (android::base::SendFileDescriptors(client_fd, &marker, sizeof(marker), connection.get()) !=
+        sizeof(marker)) {
+        return false;
+    }
+    return SendProtocolString(client_fd, info);
+}
+
+int adb_session_main(const char* socket_path) {
+    // Don't let the helper be a client of some other session.
+    unsetenv("ADB_SESSION");
+
+    std::string error;
+    SessionInfo info;
+    if (!adb_query(format_host_command("get-serialno"), &info.serial, &error) ||
+        !adb_get_feature_set(&info.features, &error)) {
+        fprintf(stderr, "adb: %s\n", error.c_str());
+        return 1;
+    }
+
+    // Pin the transport down, so that every connection we hand out goes to the same device.
+    std::deque<unique_fd> pool;
+    pool.emplace_back(adb_connect_transport(&info.transport_id, &error));
+    if (pool.back() < 0) {
+        fprintf(stderr, "adb: %s\n", error.c_str());
+        return 1;
+    }
+    adb_set_transport(kTransportAny, nullptr, info.transport_id);
+    const std::string info_string = SessionInfoToString(info);
+
+    unique_fd server(
+            socket_local_server(socket_path, ANDROID_SOCKET_NAMESPACE_FILESYSTEM, SOCK_STREAM));
+    if (server < 0) {
+        fprintf(stderr, "adb: failed to listen at %s: %s\n", socket_path, strerror(errno));
+        return 1;
+    }
+    fprintf(stderr, "adb: session for %s listening at %s\n", info.serial.c_str(), socket_path);
+
+    while (true) {
+        // Top up the pool between clients.
+        if (pool.size() < kSessionPoolSize && (pool.empty() || !IsClientWaiting(server.get()))) {
+            unique_fd fd(adb_connect_transport(nullptr, &error));
+            if (fd < 0) {
+                fprintf(stderr, "adb: session for %s ending: %s\n", info.serial.c_str(),
+                        error.c_str());
+                break;
+            }
+            pool.push_back(std::move(fd));
+            continue;
+        }
+
+        unique_fd client(adb_socket_accept(server.get(), nullptr, nullptr));
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            perror("adb: failed to accept session client");
+            break;
+        }
+
+        unique_fd connection = std::move(pool.front());
+        pool.pop_front();
+        if (!IsConnectionAlive(connection.get())) {
+            // Let the client fall back to connecting by itself.
+            D("dropping dead session connection");
+            continue;
+        }
+        if (!IsTransportAlive(&error)) {
+            fprintf(stderr, "adb: session for %s ending: %s\n", info.serial.c_str(),
+                    error.c_str());
+            break;
+        }
+        if (!SendConnection(client.get(), std::move(connection), info_string)) {
+            D("failed to send connection to session client: %s", strerror(errno));
+        }
+    }
+
+    adb_unlink(socket_path);
+    return 1;
+}
+
+static auto& session_mutex = *new std::mutex();
+
+// Whether there's no helper to talk to (or it's for another transport), so that we only try once.
+static bool session_unavailable GUARDED_BY(session_mutex) = false;
+static std::optional<SessionInfo> session_info GUARDED_BY(session_mutex);
+
+// A connection that came along with the info, and hasn't been used yet.
+static auto& session_spare_connection GUARDED_BY(session_mutex) = *new unique_fd();
+
+// Whether the session is for the transport selected by -s/-t/-d/-e or $ANDROID_SERIAL.
+static bool session_matches() REQUIRES(session_mutex) {
+    TransportType type;
+    const char* serial;
+    TransportId transport_id;
+    adb_get_transport(&type, &serial, &transport_id);
+
+    if (transport_id != 0) {
+        return transport_id == session_info->transport_id;
+    } else if (serial) {
+        return session_info->serial == serial;
+    }
+    return type == kTransportAny;
+}
+
+static unique_fd session_request() REQUIRES(session_mutex) {
+    if (session_unavailable) {
+        return unique_fd();
+    }
+
+    const char* path = getenv("ADB_SESSION");
+    if (!path || !*path) {
+        session_unavailable = true;
+        return unique_fd();
+    }
+
+    unique_fd sock(socket_local_client(path, ANDROID_SOCKET_NAMESPACE_FILESYSTEM, SOCK_STREAM));
+    unique_fd connection;
+    char marker;
+    std::string info_string;
+    std::string error;
+    if (sock < 0 ||
+        android::base::ReceiveFileDescriptors(sock.get(), &marker, sizeof(marker), &connection) !=
+                sizeof(marker) ||
+        !ReadProtocolString(sock.get(), &info_string, &error)) {
+        D("failed to get a connection from the session at %s: %s", path, strerror(errno));
+        session_unavailable = true;
+        return unique_fd();
+    }
+
+    session_info = SessionInfoFromString(info_string);
+    if (!session_info) {
+        D("bad session info '%s'", info_string.c_str());
+        session_unavailable = true;
+        return unique_fd();
+    }
+    if (!session_matches()) {
+        // The helper is for some other device, and will stay that way.
+        D("session at %s is for %s", path, session_info->serial.c_str());
+        session_info.reset();
+        session_unavailable = true;
+        return unique_fd();
+    }
+    return connection;
+}
+
+unique_fd session_take_connection(TransportId* transport) {
+    std::lock_guard<std::mutex> lock(session_mutex);
+    unique_fd connection = std::move(session_spare_connection);
+    if (connection < 0) {
+        connection = session_request();
+    }
+    if (connection < 0) {
+        return unique_fd();
+    }
+
+    if (transport) {
+        *transport = session_info->transport_id;
+    }
+    return connection;
+}
+
+bool session_get_feature_set(FeatureSet* feature_set) {
+    std::lock_guard<std::mutex> lock(session_mutex);
+    if (!session_info) {
+        // The connection that comes along with the info is likely to be wanted next.
+        session_spare_connection = session_request();
+    }
+    if (!session_info) {
+        return false;
+    }
+
+    *feature_set = session_info->features;
+    return true;
+}
+
+#endif
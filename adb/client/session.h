@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "adb.h"
+#include "adb_unique_fd.h"
+#include "transport.h"
+
+// Client sessions cut the fixed cost of running many short commands against one device.
+//
+// `adb session SOCKET` is a long-lived helper that checks the server's version once, pins down a
+// transport, and keeps a few connections to the server that have already switched to it. Each
+// client run with $ADB_SESSION=SOCKET gets one of those connections (passed over the unix domain
+// socket), along with the transport's features, instead of going through the version check,
+// feature query and transport switch itself.
+
+// Runs the helper, listening at |socket_path|, until the transport goes away.
+int adb_session_main(const char* _Nonnull socket_path);
+
+// If $ADB_SESSION names a helper for the preferred transport, returns one of its connections,
+// ready for a service name. Otherwise, returns an invalid fd.
+unique_fd session_take_connection(TransportId* _Nullable transport);
+
+// If $ADB_SESSION names a helper for the preferred transport, gets the transport's features from
+// it and returns true.
+bool session_get_feature_set(FeatureSet* _Nonnull feature_set);
@@ -20,20 +20,25 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include <libusb/libusb.h>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 
@@ -87,6 +92,82 @@ struct transfer_info {
     }
 };
 
+// A bulk endpoint with several transfers in flight at once, so that the host controller always
+// has something queued. Transfers complete, and have their results consumed, in the order in
+// which they were submitted.
+struct transfer_queue {
+    struct entry {
+        explicit entry(transfer_queue* queue) : queue(queue), transfer(libusb_alloc_transfer(0)) {}
+        ~entry() { libusb_free_transfer(transfer); }
+
+        transfer_queue* queue;
+        libusb_transfer* transfer;
+        std::unique_ptr<unsigned char[]> buffer;
+        size_t capacity = 0;
+        bool complete = false;
+
+        // How much of a completed read has been handed out by usb_read.
+        size_t offset = 0;
+
+        // Whether this is a read of a message header, which tells us what to read next.
+        bool header = false;
+    };
+
+    transfer_queue(const char* name, size_t depth, size_t max_packet_size)
+        : name(name), depth(depth), max_packet_size(max_packet_size) {}
+
+    const char* name;
+    const size_t depth;
+    const size_t max_packet_size;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::unique_ptr<entry>> entries;
+    std::vector<entry*> idle;
+    std::deque<entry*> in_flight;
+
+    // Reads that we know are coming, as (length, header), that will be submitted once fewer than
+    // |depth| are in flight.
+    std::deque<std::pair<size_t, bool>> predicted_reads;
+
+    // Set once a transfer has failed or been cancelled; everything after it is suspect.
+    bool failed = false;
+};
+
+// The number of writes to keep in flight, overridable with $ADB_LIBUSB_QUEUE_DEPTH. A depth of 1
+// submits each transfer and waits for it to complete.
+static constexpr size_t kDefaultQueueDepth = 4;
+static constexpr size_t kMaxQueueDepth = 64;
+
+// Reads are submitted ahead of usb_read by following the framing of the adb protocol (see
+// queued_read_callback): enough for a header that usb_read hasn't handed out yet, its payload, and
+// the header after that. Setting $ADB_LIBUSB_READ_AHEAD to 0 submits each read when usb_read asks
+// for it instead.
+static constexpr size_t kReadAheadQueueDepth = 3;
+
+static size_t parse_queue_depth(const char* name, size_t default_depth) {
+    const char* env = getenv(name);
+    size_t result = default_depth;
+    if (env && (!android::base::ParseUint(env, &result, kMaxQueueDepth) || result == 0)) {
+        LOG(WARNING) << "ignoring invalid " << name << " '" << env << "'";
+        result = default_depth;
+    }
+    return result;
+}
+
+static size_t get_write_queue_depth() {
+    static const size_t depth = parse_queue_depth("ADB_LIBUSB_QUEUE_DEPTH", kDefaultQueueDepth);
+    return depth;
+}
+
+static size_t get_read_queue_depth() {
+    static const size_t depth = [] {
+        const char* env = getenv("ADB_LIBUSB_READ_AHEAD");
+        return env && strcmp(env, "0") == 0 ? 1 : kReadAheadQueueDepth;
+    }();
+    return depth;
+}
+
 namespace libusb {
 struct usb_handle : public ::usb_handle {
     usb_handle(const std::string& device_address, const std::string& serial,
@@ -98,6 +179,8 @@ struct usb_handle : public ::usb_handle {
           device_handle(device_handle.release()),
           read("read", zero_mask, false),
           write("write", zero_mask, true),
+          read_queue("read", get_read_queue_depth(), max_packet_size),
+          write_queue("write", get_write_queue_depth(), max_packet_size),
           interface(interface),
           bulk_in(bulk_in),
           bulk_out(bulk_out),
@@ -126,11 +209,33 @@ struct usb_handle : public ::usb_handle {
         // Cancel already dispatched transfers.
         libusb_cancel_transfer(read.transfer);
         libusb_cancel_transfer(write.transfer);
+        CancelQueue(&read_queue);
+        CancelQueue(&write_queue);
 
         libusb_release_interface(handle, interface);
         libusb_close(handle);
     }
 
+    // Cancel everything in flight on |queue|, and wait for the callbacks, so that the handle can
+    // be closed (and the transfers freed) safely.
+    void CancelQueue(transfer_queue* queue) {
+        std::unique_lock<std::mutex> lock(queue->mutex);
+        queue->failed = true;
+        for (transfer_queue::entry* entry : queue->in_flight) {
+            if (!entry->complete) {
+                libusb_cancel_transfer(entry->transfer);
+            }
+        }
+        queue->cv.wait(lock, [queue]() {
+            for (transfer_queue::entry* entry : queue->in_flight) {
+                if (!entry->complete) {
+                    return false;
+                }
+            }
+            return true;
+        });
+    }
+
     std::string device_address;
     std::string serial;
 
@@ -141,6 +246,9 @@ struct usb_handle : public ::usb_handle {
     transfer_info read;
     transfer_info write;
 
+    transfer_queue read_queue;
+    transfer_queue write_queue;
+
     uint8_t interface;
     uint8_t bulk_in;
     uint8_t bulk_out;
@@ -562,9 +670,259 @@ static int perform_usb_transfer(usb_handle* h, transfer_info* info,
     return 0;
 }
 
+static LIBUSB_CALL void queued_read_callback(libusb_transfer* transfer);
+
+static LIBUSB_CALL void queued_transfer_callback(libusb_transfer* transfer) {
+    auto entry = static_cast<transfer_queue::entry*>(transfer->user_data);
+    std::lock_guard<std::mutex> lock(entry->queue->mutex);
+    entry->complete = true;
+    entry->queue->cv.notify_all();
+}
+
+// Get an unused transfer with a buffer of at least |size| bytes. Must be called with the queue's
+// mutex held.
+static transfer_queue::entry* acquire_queue_entry(transfer_queue* queue, size_t size) {
+    transfer_queue::entry* entry;
+    if (queue->idle.empty()) {
+        queue->entries.push_back(std::make_unique<transfer_queue::entry>(queue));
+        entry = queue->entries.back().get();
+    } else {
+        entry = queue->idle.back();
+        queue->idle.pop_back();
+    }
+
+    if (entry->capacity < size) {
+        entry->buffer.reset(new unsigned char[size]);
+        entry->capacity = size;
+    }
+    entry->complete = false;
+    entry->offset = 0;
+    entry->header = false;
+    return entry;
+}
+
+// Submit |entry| for |length| bytes. Must be called with the queue's mutex held, and with the
+// device handle known to be open: either with the device handle mutex held, or from the callback
+// of a transfer on a queue that Close hasn't failed yet.
+static bool submit_queue_entry(libusb_device_handle* handle, transfer_queue* queue,
+                               transfer_queue::entry* entry, uint8_t endpoint, size_t length,
+                               libusb_transfer_cb_fn callback) {
+    libusb_fill_bulk_transfer(entry->transfer, handle, endpoint, entry->buffer.get(), length,
+                              callback, entry, 0);
+    int rc = libusb_submit_transfer(entry->transfer);
+    if (rc != 0) {
+        LOG(WARNING) << "failed to submit queued " << queue->name
+                     << " transfer: " << libusb_error_name(rc);
+        queue->idle.push_back(entry);
+        queue->failed = true;
+        return false;
+    }
+    queue->in_flight.push_back(entry);
+    return true;
+}
+
+// Submit a read of |length| bytes, rounded up to the max packet size so that it can't overflow.
+// Must be called under the same conditions as submit_queue_entry.
+static bool submit_queued_read(libusb_device_handle* handle, transfer_queue* queue,
+                               uint8_t endpoint, size_t length, bool header) {
+    size_t packet_size = queue->max_packet_size;
+    length = (length + packet_size - 1) / packet_size * packet_size;
+    transfer_queue::entry* entry = acquire_queue_entry(queue, length);
+    entry->header = header;
+    return submit_queue_entry(handle, queue, entry, endpoint, length, queued_read_callback);
+}
+
+// Submit as many of the predicted reads as there's room for. Must be called under the same
+// conditions as submit_queue_entry.
+static bool submit_predicted_reads(libusb_device_handle* handle, transfer_queue* queue,
+                                   uint8_t endpoint) {
+    while (!queue->predicted_reads.empty() && queue->in_flight.size() < queue->depth) {
+        auto [length, header] = queue->predicted_reads.front();
+        queue->predicted_reads.pop_front();
+        if (!submit_queued_read(handle, queue, endpoint, length, header)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// When a header arrives, predict the reads for what follows it, and submit them without waiting
+// for usb_read to ask: its payload (if any), and then the next header. adbd writes each of those
+// separately, so every read asks for exactly what's coming (up to the max packet size), and
+// completes without the device needing to send a zero-length packet to end it.
+static LIBUSB_CALL void queued_read_callback(libusb_transfer* transfer) {
+    auto entry = static_cast<transfer_queue::entry*>(transfer->user_data);
+    transfer_queue* queue = entry->queue;
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    entry->complete = true;
+    queue->cv.notify_all();
+
+    // Close fails the queue before it closes the device handle, so the handle is still open here.
+    if (queue->failed || !entry->header || transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        return;
+    }
+
+    if (transfer->actual_length == sizeof(amessage)) {
+        amessage msg;
+        memcpy(&msg, transfer->buffer, sizeof(msg));
+        if (msg.data_length > MAX_PAYLOAD) {
+            // The transport is going to give up on this connection when it reads the header.
+            return;
+        }
+        if (msg.data_length != 0) {
+            queue->predicted_reads.emplace_back(msg.data_length, false);
+        }
+    } else if (transfer->actual_length != 0) {
+        // Not a header; leave it to the transport to complain about. (A zero-length packet,
+        // from a device that ends its writes with one, is skipped by usb_read.)
+        return;
+    }
+
+    queue->predicted_reads.emplace_back(sizeof(amessage), true);
+    submit_predicted_reads(transfer->dev_handle, queue, transfer->endpoint);
+}
+
+// Retire completed writes from the front of the queue, waiting if there are more than
+// |max_in_flight| outstanding. Returns false if any of them failed.
+static bool reap_queued_writes(transfer_queue* queue, std::unique_lock<std::mutex>* lock,
+                               size_t max_in_flight) {
+    while (!queue->in_flight.empty()) {
+        transfer_queue::entry* entry = queue->in_flight.front();
+        if (queue->in_flight.size() > max_in_flight) {
+            queue->cv.wait(*lock, [entry]() { return entry->complete; });
+        } else if (!entry->complete) {
+            break;
+        }
+
+        queue->in_flight.pop_front();
+        queue->idle.push_back(entry);
+
+        libusb_transfer* transfer = entry->transfer;
+        if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+            LOG(WARNING) << "queued write transfer failed: " << libusb_error_name(transfer->status);
+            queue->failed = true;
+        } else if (transfer->actual_length != transfer->length) {
+            // We can't resubmit the remainder without reordering it behind later writes.
+            LOG(WARNING) << "queued write transfer incomplete: " << transfer->actual_length << "/"
+                         << transfer->length;
+            queue->failed = true;
+        }
+    }
+    return !queue->failed;
+}
+
+// Copy the data into a queued transfer and return without waiting for it to complete. Errors are
+// reported by a later usb_write.
+static int usb_write_queued(usb_handle* h, const void* d, int len) {
+    transfer_queue* queue = &h->write_queue;
+    bool zero_packet = should_perform_zero_transfer(h->bulk_out, len, h->write.zero_mask);
+    size_t slots = zero_packet ? 2 : 1;
+
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    if (!reap_queued_writes(queue, &lock, queue->depth - slots)) {
+        errno = EIO;
+        return -1;
+    }
+
+    // Reacquire the locks in the same order as Close.
+    lock.unlock();
+    std::unique_lock<std::mutex> device_lock(h->device_handle_mutex);
+    if (!h->device_handle) {
+        errno = EIO;
+        return -1;
+    }
+    lock.lock();
+
+    transfer_queue::entry* entry = acquire_queue_entry(queue, len);
+    memcpy(entry->buffer.get(), d, len);
+    if (!submit_queue_entry(h->device_handle, queue, entry, h->bulk_out, len,
+                            queued_transfer_callback)) {
+        errno = EIO;
+        return -1;
+    }
+
+    // The zero-length packet is queued as a transfer of its own, so that it stays in order.
+    if (zero_packet) {
+        LOG(DEBUG) << "submitting zero-length write";
+        entry = acquire_queue_entry(queue, 0);
+        if (!submit_queue_entry(h->device_handle, queue, entry, h->bulk_out, 0,
+                                queued_transfer_callback)) {
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    return len;
+}
+
+// Hand out data from reads that were submitted ahead of time. Like a single transfer of |len|
+// bytes, this returns what the device sent in one write, or as much of it as fits.
+static int usb_read_queued(usb_handle* h, void* d, int len) {
+    transfer_queue* queue = &h->read_queue;
+
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    while (true) {
+        if (queue->failed) {
+            errno = EIO;
+            return -1;
+        }
+
+        if (queue->in_flight.empty() ||
+            (!queue->predicted_reads.empty() && queue->in_flight.size() < queue->depth)) {
+            // Reacquire the locks in the same order as Close.
+            lock.unlock();
+            std::unique_lock<std::mutex> device_lock(h->device_handle_mutex);
+            if (!h->device_handle) {
+                errno = EIO;
+                return -1;
+            }
+            lock.lock();
+
+            // With nothing read ahead, this has to be the start of a message.
+            if (queue->in_flight.empty() && queue->predicted_reads.empty()) {
+                queue->predicted_reads.emplace_back(len, true);
+            }
+            if (!submit_predicted_reads(h->device_handle, queue, h->bulk_in)) {
+                errno = EIO;
+                return -1;
+            }
+        }
+
+        transfer_queue::entry* entry = queue->in_flight.front();
+        queue->cv.wait(lock, [entry]() { return entry->complete; });
+
+        libusb_transfer* transfer = entry->transfer;
+        if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+            LOG(WARNING) << "queued read transfer failed: " << libusb_error_name(transfer->status);
+            queue->failed = true;
+            errno = EIO;
+            return -1;
+        }
+
+        size_t actual_length = transfer->actual_length;
+        size_t count = std::min(actual_length - entry->offset, static_cast<size_t>(len));
+        memcpy(d, entry->buffer.get() + entry->offset, count);
+        entry->offset += count;
+        if (entry->offset == actual_length) {
+            queue->in_flight.pop_front();
+            queue->idle.push_back(entry);
+        }
+
+        // Skip over a zero-length packet: it ends a previous write that we already returned.
+        if (actual_length != 0) {
+            LOG(DEBUG) << "usb_read_queued(" << len << ") = " << count;
+            return count;
+        }
+    }
+}
+
 int usb_write(usb_handle* h, const void* d, int len) {
     LOG(DEBUG) << "usb_write of length " << len;
 
+    if (h->write_queue.depth > 1) {
+        return usb_write_queued(h, d, len);
+    }
+
     std::unique_lock<std::mutex> lock(h->device_handle_mutex);
     if (!h->device_handle) {
         errno = EIO;
@@ -588,6 +946,10 @@ int usb_write(usb_handle* h, const void* d, int len) {
 int usb_read(usb_handle* h, void* d, int len) {
     LOG(DEBUG) << "usb_read of length " << len;
 
+    if (h->read_queue.depth > 1) {
+        return usb_read_queued(h, d, len);
+    }
+
     std::unique_lock<std::mutex> lock(h->device_handle_mutex);
     if (!h->device_handle) {
         errno = EIO;
@@ -31,12 +31,16 @@
 #include <unistd.h>
 #include <utime.h>
 
+#include <algorithm>
+#include <chrono>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/macros.h>
+#include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 
@@ -45,6 +49,7 @@
 
 #if defined(__ANDROID__)
 #include <selinux/android.h>
+#include <selinux/selinux.h>
 #include <sys/xattr.h>
 #endif
 
@@ -52,6 +57,8 @@
 #include "adb_io.h"
 #include "adb_trace.h"
 #include "adb_utils.h"
+#include "file_sync_compression.h"
+#include "file_sync_hash.h"
 #include "file_sync_protocol.h"
 #include "security_log_tags.h"
 #include "sysdeps/errno.h"
@@ -210,6 +217,98 @@ done:
     return WriteFdExactly(s, &msg.dent, sizeof(msg.dent));
 }
 
+static bool do_list_recursive(int s, const char* path) {
+    syncmsg msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.dent_v2.id = ID_DENT_V2;
+
+    // Directories still to be listed, relative to |path|. Each directory's entry is sent before
+    // any of its contents. Symlinks to directories aren't followed.
+    std::vector<std::string> pending = {""};
+    while (!pending.empty()) {
+        std::string dir = std::move(pending.back());
+        pending.pop_back();
+
+        std::string dir_path = dir.empty() ? path : StringPrintf("%s/%s", path, dir.c_str());
+        std::unique_ptr<DIR, int (*)(DIR*)> d(opendir(dir_path.c_str()), closedir);
+        if (!d) continue;
+
+        std::vector<std::string> subdirs;
+        dirent* de;
+        while ((de = readdir(d.get()))) {
+            if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+
+            std::string name = dir.empty() ? de->d_name : dir + "/" + de->d_name;
+            std::string filename = StringPrintf("%s/%s", path, name.c_str());
+
+            struct stat st;
+            if (lstat(filename.c_str(), &st) != 0) continue;
+
+            msg.dent_v2.dev = st.st_dev;
+            msg.dent_v2.ino = st.st_ino;
+            msg.dent_v2.mode = st.st_mode;
+            msg.dent_v2.nlink = st.st_nlink;
+            msg.dent_v2.uid = st.st_uid;
+            msg.dent_v2.gid = st.st_gid;
+            msg.dent_v2.size = st.st_size;
+            msg.dent_v2.atime = st.st_atime;
+            msg.dent_v2.mtime = st.st_mtime;
+            msg.dent_v2.ctime = st.st_ctime;
+            msg.dent_v2.target_mode = 0;
+            msg.dent_v2.namelen = name.size();
+
+            if (S_ISLNK(st.st_mode)) {
+                struct stat target_st;
+                if (stat(filename.c_str(), &target_st) == 0) {
+                    msg.dent_v2.target_mode = target_st.st_mode;
+                }
+            } else if (S_ISDIR(st.st_mode)) {
+                subdirs.push_back(name);
+            }
+
+            if (!WriteFdExactly(s, &msg.dent_v2, sizeof(msg.dent_v2)) ||
+                !WriteFdExactly(s, name)) {
+                return false;
+            }
+        }
+
+        // Keep the traversal depth-first, in readdir order.
+        pending.insert(pending.end(), std::make_move_iterator(subdirs.rbegin()),
+                       std::make_move_iterator(subdirs.rend()));
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.dent_v2.id = ID_DONE;
+    return WriteFdExactly(s, &msg.dent_v2, sizeof(msg.dent_v2));
+}
+
+static bool do_hash(int s, const char* path) {
+    syncmsg msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.hash.id = ID_HASH;
+    msg.hash.block_size = kSyncHashBlockSize;
+
+    std::vector<SyncHash> block_hashes;
+    unique_fd fd(adb_open(path, O_RDONLY | O_CLOEXEC));
+    struct stat st;
+    if (fd < 0 || fstat(fd.get(), &st) == -1) {
+        msg.hash.error = errno_to_wire(errno);
+    } else if (!S_ISREG(st.st_mode)) {
+        msg.hash.error = errno_to_wire(EINVAL);
+    } else if (!SyncHashBlocks(fd.get(), st.st_size, std::thread::hardware_concurrency(),
+                               &block_hashes)) {
+        msg.hash.error = errno_to_wire(errno);
+    } else {
+        SyncHash file_hash = SyncHashFile(block_hashes);
+        msg.hash.size = st.st_size;
+        msg.hash.block_count = block_hashes.size();
+        memcpy(msg.hash.file_hash, file_hash.data(), sizeof(msg.hash.file_hash));
+    }
+
+    return WriteFdExactly(s, &msg.hash, sizeof(msg.hash)) &&
+           WriteFdExactly(s, block_hashes.data(), block_hashes.size() * sizeof(SyncHash));
+}
+
 // Make sure that SendFail from adb_io.cpp isn't accidentally used in this file.
 #pragma GCC poison SendFail
 
@@ -228,8 +327,12 @@ static bool SendSyncFailErrno(int fd, const std::string& reason) {
 
 static bool handle_send_file(int s, const char* path, uint32_t* timestamp, uid_t uid, gid_t gid,
                              uint64_t capabilities, mode_t mode, std::vector<char>& buffer,
-                             bool do_unlink) {
+                             bool do_unlink, bool compressed) {
     syncmsg msg;
+    std::unique_ptr<SyncInflater> inflater;
+    if (compressed) {
+        inflater = std::make_unique<SyncInflater>();
+    }
 
     __android_log_security_bswrite(SEC_TAG_ADB_SEND_FILE, path);
 
@@ -253,6 +356,9 @@ static bool handle_send_file(int s, const char* path, uint32_t* timestamp, uid_t
     if (fd < 0) {
         SendSyncFailErrno(s, "couldn't create file");
         goto fail;
+    } else if (inflater && !inflater->IsValid()) {
+        SendSyncFail(s, "inflateInit failed");
+        goto fail;
     } else {
         if (fchown(fd.get(), uid, gid) == -1) {
             SendSyncFailErrno(s, "fchown failed");
@@ -275,6 +381,10 @@ static bool handle_send_file(int s, const char* path, uint32_t* timestamp, uid_t
 
         if (msg.data.id != ID_DATA) {
             if (msg.data.id == ID_DONE) {
+                if (inflater && !inflater->finished()) {
+                    SendSyncFail(s, "truncated compressed data");
+                    goto abort;
+                }
                 *timestamp = msg.data.size;
                 break;
             }
@@ -289,7 +399,21 @@ static bool handle_send_file(int s, const char* path, uint32_t* timestamp, uid_t
 
         if (!ReadFdExactly(s, &buffer[0], msg.data.size)) goto abort;
 
-        if (!WriteFdExactly(fd.get(), &buffer[0], msg.data.size)) {
+        if (inflater) {
+            bool write_failed = false;
+            auto sink = [&fd, &write_failed](const char* data, size_t length) {
+                write_failed = !WriteFdExactly(fd.get(), data, length);
+                return !write_failed;
+            };
+            if (!inflater->Inflate(&buffer[0], msg.data.size, sink)) {
+                if (write_failed) {
+                    SendSyncFailErrno(s, "write failed");
+                } else {
+                    SendSyncFail(s, "corrupt compressed data");
+                }
+                goto fail;
+            }
+        } else if (!WriteFdExactly(fd.get(), &buffer[0], msg.data.size)) {
             SendSyncFailErrno(s, "write failed");
             goto fail;
         }
@@ -394,7 +518,7 @@ static bool handle_send_link(int s, const std::string& path, uint32_t* timestamp
 }
 #endif
 
-static bool do_send(int s, const std::string& spec, std::vector<char>& buffer) {
+static bool do_send(int s, const std::string& spec, std::vector<char>& buffer, bool compressed) {
     // 'spec' is of the form "/some/path,0755". Break it up.
     size_t comma = spec.find_last_of(',');
     if (comma == std::string::npos) {
@@ -422,6 +546,10 @@ static bool do_send(int s, const std::string& spec, std::vector<char>& buffer) {
     bool result;
     uint32_t timestamp;
     if (S_ISLNK(mode)) {
+        if (compressed) {
+            SendSyncFail(s, "compressed symlinks are not supported");
+            return false;
+        }
         result = handle_send_link(s, path, &timestamp, buffer);
     } else {
         // Copy user permission bits to "group" and "other" permissions.
@@ -439,7 +567,7 @@ static bool do_send(int s, const std::string& spec, std::vector<char>& buffer) {
         }
 
         result = handle_send_file(s, path.c_str(), &timestamp, uid, gid, capabilities, mode, buffer,
-                                  do_unlink);
+                                  do_unlink, compressed);
     }
 
     if (!result) {
@@ -455,7 +583,178 @@ static bool do_send(int s, const std::string& spec, std::vector<char>& buffer) {
     return true;
 }
 
-static bool do_recv(int s, const char* path, std::vector<char>& buffer) {
+static bool send_compressed_data(int s, SyncDeflater* deflater, std::vector<char>* output) {
+    syncmsg msg;
+    msg.data.id = ID_DATA;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t offset = 0; offset < output->size(); offset += SYNC_DATA_MAX) {
+        msg.data.size = std::min(output->size() - offset, static_cast<size_t>(SYNC_DATA_MAX));
+        if (!WriteFdExactly(s, &msg.data, sizeof(msg.data)) ||
+            !WriteFdExactly(s, output->data() + offset, msg.data.size)) {
+            return false;
+        }
+    }
+    deflater->RecordWriteTime(std::chrono::steady_clock::now() - start);
+    output->clear();
+    return true;
+}
+
+// Gives |fd| the owner, mode, SELinux label and file capabilities of |st|/|path|, so that the
+// patched copy can replace the original without changing anything but its contents.
+static bool copy_file_attributes(const char* path, const struct stat& st, int fd) {
+    if (fchown(fd, st.st_uid, st.st_gid) == -1) return false;
+    // fchown clears the setuid bit, so this has to come afterwards.
+    fchmod(fd, st.st_mode & 07777);
+
+#if defined(__ANDROID__)
+    char* context = nullptr;
+    if (lgetfilecon(path, &context) > 0) {
+        // Not all filesystems support setting SELinux labels. http://b/23530370.
+        fsetfilecon(fd, context);
+        freecon(context);
+    }
+
+    vfs_cap_data cap_data;
+    ssize_t cap_size = getxattr(path, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data));
+    if (cap_size > 0 && fsetxattr(fd, XATTR_NAME_CAPS, &cap_data, cap_size, 0) == -1) {
+        return false;
+    }
+#else
+    UNUSED(path);
+#endif
+    return true;
+}
+
+static bool do_patch(int s, const std::string& spec, std::vector<char>& buffer) {
+    // 'spec' is of the form "/some/path,1234", where the number is the file's final size.
+    size_t comma = spec.find_last_of(',');
+    uint64_t size;
+    if (comma == std::string::npos ||
+        !android::base::ParseUint(spec.substr(comma + 1).c_str(), &size)) {
+        SendSyncFail(s, "missing size in ID_PATCH");
+        return false;
+    }
+    std::string path = spec.substr(0, comma);
+
+    __android_log_security_bswrite(SEC_TAG_ADB_SEND_FILE, path.c_str());
+
+    syncmsg msg;
+    uint32_t timestamp;
+    struct stat st;
+    unique_fd src_fd;
+    unique_fd fd;
+
+    // The destination may be mmapped or executing, so it mustn't be modified in place. As with
+    // ID_SEND, build the new contents in a separate file and then swap it in with rename(2),
+    // which leaves existing users with the old inode. Unlike ID_SEND, the file must already
+    // exist: we only receive the blocks that changed, and copy the rest from the original.
+    std::string temp_path = path + ".adb_patch.XXXXXX";
+
+    if (lstat(path.c_str(), &st) == -1) {
+        SendSyncFailErrno(s, "couldn't stat file");
+        temp_path.clear();
+        goto fail;
+    } else if (!S_ISREG(st.st_mode)) {
+        SendSyncFail(s, "not a regular file");
+        temp_path.clear();
+        goto fail;
+    }
+
+    src_fd.reset(adb_open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    fd.reset(mkostemp(&temp_path[0], O_CLOEXEC));
+    if (src_fd < 0 || fd < 0) {
+        SendSyncFailErrno(s, "couldn't open file");
+        if (fd < 0) temp_path.clear();
+        goto fail;
+    }
+
+    while (true) {
+        int r = adb_read(src_fd.get(), &buffer[0], buffer.size());
+        if (r == 0) break;
+        if (r < 0 || !WriteFdExactly(fd.get(), &buffer[0], r)) {
+            SendSyncFailErrno(s, "copy failed");
+            goto fail;
+        }
+    }
+    src_fd.reset();
+
+    if (!copy_file_attributes(path.c_str(), st, fd.get())) {
+        SendSyncFailErrno(s, "couldn't copy file attributes");
+        goto fail;
+    }
+
+    while (true) {
+        if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) goto abort;
+
+        if (msg.data.id == ID_DONE) {
+            timestamp = msg.data.size;
+            break;
+        } else if (msg.data.id != ID_BLOCK) {
+            SendSyncFail(s, "invalid block message");
+            goto abort;
+        }
+
+        if (msg.block.size > buffer.size()) {
+            SendSyncFail(s, "oversize block message");
+            goto abort;
+        }
+
+        if (!ReadFdExactly(s, &msg.block.offset, sizeof(msg.block.offset)) ||
+            !ReadFdExactly(s, &buffer[0], msg.block.size)) {
+            goto abort;
+        }
+
+        if (adb_lseek(fd.get(), msg.block.offset, SEEK_SET) == -1 ||
+            !WriteFdExactly(fd.get(), &buffer[0], msg.block.size)) {
+            SendSyncFailErrno(s, "write failed");
+            goto fail;
+        }
+    }
+
+    if (ftruncate(fd.get(), size) == -1) {
+        SendSyncFailErrno(s, "ftruncate failed");
+        goto abort;
+    }
+
+    struct timeval tv[2];
+    tv[0].tv_sec = timestamp;
+    tv[0].tv_usec = 0;
+    tv[1].tv_sec = timestamp;
+    tv[1].tv_usec = 0;
+    futimes(fd.get(), tv);
+
+    if (fsync(fd.get()) == -1) {
+        SendSyncFailErrno(s, "fsync failed");
+        goto abort;
+    }
+    fd.reset();
+
+    if (rename(temp_path.c_str(), path.c_str()) == -1) {
+        SendSyncFailErrno(s, "rename failed");
+        goto abort;
+    }
+
+    msg.status.id = ID_OKAY;
+    msg.status.msglen = 0;
+    return WriteFdExactly(s, &msg.status, sizeof(msg.status));
+
+fail:
+    // As in handle_send_file, keep throwing away blocks until the other side notices the error.
+    while (true) {
+        if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) break;
+        if (msg.data.id != ID_BLOCK || msg.block.size > buffer.size()) break;
+        if (!ReadFdExactly(s, &msg.block.offset, sizeof(msg.block.offset)) ||
+            !ReadFdExactly(s, &buffer[0], msg.block.size)) {
+            break;
+        }
+    }
+
+abort:
+    if (!temp_path.empty()) adb_unlink(temp_path.c_str());
+    return false;
+}
+
+static bool do_recv(int s, const char* path, std::vector<char>& buffer, bool compressed) {
     __android_log_security_bswrite(SEC_TAG_ADB_RECV_FILE, path);
 
     unique_fd fd(adb_open(path, O_RDONLY | O_CLOEXEC));
@@ -468,15 +767,36 @@ static bool do_recv(int s, const char* path, std::vector<char>& buffer) {
         D("[ Failed to fadvise: %d ]", errno);
     }
 
+    std::unique_ptr<SyncDeflater> deflater;
+    std::vector<char> compressed_output;
+    if (compressed) {
+        deflater = std::make_unique<SyncDeflater>();
+        if (!deflater->IsValid()) {
+            SendSyncFail(s, "deflateInit failed");
+            return false;
+        }
+    }
+
     syncmsg msg;
     msg.data.id = ID_DATA;
     while (true) {
         int r = adb_read(fd.get(), &buffer[0], buffer.size() - sizeof(msg.data));
-        if (r <= 0) {
-            if (r == 0) break;
+        if (r < 0) {
             SendSyncFailErrno(s, "read failed");
             return false;
         }
+        if (deflater) {
+            if (!deflater->Deflate(&buffer[0], r, r == 0, &compressed_output)) {
+                SendSyncFail(s, "deflate failed");
+                return false;
+            }
+            if (!send_compressed_data(s, deflater.get(), &compressed_output)) {
+                return false;
+            }
+            if (r == 0) break;
+            continue;
+        }
+        if (r == 0) break;
         msg.data.size = r;
         if (!WriteFdExactly(s, &msg.data, sizeof(msg.data)) || !WriteFdExactly(s, &buffer[0], r)) {
             return false;
@@ -498,10 +818,20 @@ static const char* sync_id_to_name(uint32_t id) {
       return "stat_v2";
     case ID_LIST:
       return "list";
+    case ID_LIST_RECURSIVE:
+      return "list_recursive";
+    case ID_HASH:
+      return "hash";
+    case ID_PATCH:
+      return "patch";
     case ID_SEND:
       return "send";
     case ID_RECV:
       return "recv";
+    case ID_SEND_DEFLATE:
+      return "send_deflate";
+    case ID_RECV_DEFLATE:
+      return "recv_deflate";
     case ID_QUIT:
         return "quit";
     default:
@@ -546,11 +876,22 @@ static bool handle_sync_command(int fd, std::vector<char>& buffer) {
         case ID_LIST:
             if (!do_list(fd, name)) return false;
             break;
+        case ID_LIST_RECURSIVE:
+            if (!do_list_recursive(fd, name)) return false;
+            break;
+        case ID_HASH:
+            if (!do_hash(fd, name)) return false;
+            break;
+        case ID_PATCH:
+            if (!do_patch(fd, name, buffer)) return false;
+            break;
         case ID_SEND:
-            if (!do_send(fd, name, buffer)) return false;
+        case ID_SEND_DEFLATE:
+            if (!do_send(fd, name, buffer, request.id == ID_SEND_DEFLATE)) return false;
             break;
         case ID_RECV:
-            if (!do_recv(fd, name, buffer)) return false;
+        case ID_RECV_DEFLATE:
+            if (!do_recv(fd, name, buffer, request.id == ID_RECV_DEFLATE)) return false;
             break;
         case ID_QUIT:
             return false;
@@ -28,12 +28,16 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <chrono>
+#include <vector>
+
 #include "sysdeps.h"
 
 #include "adb.h"
 #include "adb_io.h"
 #include "adb_utils.h"
 #include "fdevent.h"
+#include "framebuffer_delta.h"
 
 /* TODO:
 ** - sync with vsync to avoid tearing
@@ -58,6 +62,88 @@ struct fbinfo {
     unsigned int alpha_length;
 } __attribute__((packed));
 
+static bool fill_fbinfo(struct fbinfo* fbinfo, int w, int h, int f, int c) {
+    fbinfo->version = DDMS_RAWIMAGE_VERSION;
+    fbinfo->colorSpace = c;
+    /* see hardware/hardware.h */
+    switch (f) {
+        case 1: /* RGBA_8888 */
+            fbinfo->bpp = 32;
+            fbinfo->size = w * h * 4;
+            fbinfo->width = w;
+            fbinfo->height = h;
+            fbinfo->red_offset = 0;
+            fbinfo->red_length = 8;
+            fbinfo->green_offset = 8;
+            fbinfo->green_length = 8;
+            fbinfo->blue_offset = 16;
+            fbinfo->blue_length = 8;
+            fbinfo->alpha_offset = 24;
+            fbinfo->alpha_length = 8;
+            break;
+        case 2: /* RGBX_8888 */
+            fbinfo->bpp = 32;
+            fbinfo->size = w * h * 4;
+            fbinfo->width = w;
+            fbinfo->height = h;
+            fbinfo->red_offset = 0;
+            fbinfo->red_length = 8;
+            fbinfo->green_offset = 8;
+            fbinfo->green_length = 8;
+            fbinfo->blue_offset = 16;
+            fbinfo->blue_length = 8;
+            fbinfo->alpha_offset = 24;
+            fbinfo->alpha_length = 0;
+            break;
+        case 3: /* RGB_888 */
+            fbinfo->bpp = 24;
+            fbinfo->size = w * h * 3;
+            fbinfo->width = w;
+            fbinfo->height = h;
+            fbinfo->red_offset = 0;
+            fbinfo->red_length = 8;
+            fbinfo->green_offset = 8;
+            fbinfo->green_length = 8;
+            fbinfo->blue_offset = 16;
+            fbinfo->blue_length = 8;
+            fbinfo->alpha_offset = 24;
+            fbinfo->alpha_length = 0;
+            break;
+        case 4: /* RGB_565 */
+            fbinfo->bpp = 16;
+            fbinfo->size = w * h * 2;
+            fbinfo->width = w;
+            fbinfo->height = h;
+            fbinfo->red_offset = 11;
+            fbinfo->red_length = 5;
+            fbinfo->green_offset = 5;
+            fbinfo->green_length = 6;
+            fbinfo->blue_offset = 0;
+            fbinfo->blue_length = 5;
+            fbinfo->alpha_offset = 0;
+            fbinfo->alpha_length = 0;
+            break;
+        case 5: /* BGRA_8888 */
+            fbinfo->bpp = 32;
+            fbinfo->size = w * h * 4;
+            fbinfo->width = w;
+            fbinfo->height = h;
+            fbinfo->red_offset = 16;
+            fbinfo->red_length = 8;
+            fbinfo->green_offset = 8;
+            fbinfo->green_length = 8;
+            fbinfo->blue_offset = 0;
+            fbinfo->blue_length = 8;
+            fbinfo->alpha_offset = 24;
+            fbinfo->alpha_length = 8;
+           break;
+        default:
+            return false;
+    }
+
+    return true;
+}
+
 void framebuffer_service(unique_fd fd) {
     struct fbinfo fbinfo;
     unsigned int i, bsize;
@@ -91,83 +177,7 @@ void framebuffer_service(unique_fd fd) {
     if(!ReadFdExactly(fd_screencap, &f, 4)) goto done;
     if(!ReadFdExactly(fd_screencap, &c, 4)) goto done;
 
-    fbinfo.version = DDMS_RAWIMAGE_VERSION;
-    fbinfo.colorSpace = c;
-    /* see hardware/hardware.h */
-    switch (f) {
-        case 1: /* RGBA_8888 */
-            fbinfo.bpp = 32;
-            fbinfo.size = w * h * 4;
-            fbinfo.width = w;
-            fbinfo.height = h;
-            fbinfo.red_offset = 0;
-            fbinfo.red_length = 8;
-            fbinfo.green_offset = 8;
-            fbinfo.green_length = 8;
-            fbinfo.blue_offset = 16;
-            fbinfo.blue_length = 8;
-            fbinfo.alpha_offset = 24;
-            fbinfo.alpha_length = 8;
-            break;
-        case 2: /* RGBX_8888 */
-            fbinfo.bpp = 32;
-            fbinfo.size = w * h * 4;
-            fbinfo.width = w;
-            fbinfo.height = h;
-            fbinfo.red_offset = 0;
-            fbinfo.red_length = 8;
-            fbinfo.green_offset = 8;
-            fbinfo.green_length = 8;
-            fbinfo.blue_offset = 16;
-            fbinfo.blue_length = 8;
-            fbinfo.alpha_offset = 24;
-            fbinfo.alpha_length = 0;
-            break;
-        case 3: /* RGB_888 */
-            fbinfo.bpp = 24;
-            fbinfo.size = w * h * 3;
-            fbinfo.width = w;
-            fbinfo.height = h;
-            fbinfo.red_offset = 0;
-            fbinfo.red_length = 8;
-            fbinfo.green_offset = 8;
-            fbinfo.green_length = 8;
-            fbinfo.blue_offset = 16;
-            fbinfo.blue_length = 8;
-            fbinfo.alpha_offset = 24;
-            fbinfo.alpha_length = 0;
-            break;
-        case 4: /* RGB_565 */
-            fbinfo.bpp = 16;
-            fbinfo.size = w * h * 2;
-            fbinfo.width = w;
-            fbinfo.height = h;
-            fbinfo.red_offset = 11;
-            fbinfo.red_length = 5;
-            fbinfo.green_offset = 5;
-            fbinfo.green_length = 6;
-            fbinfo.blue_offset = 0;
-            fbinfo.blue_length = 5;
-            fbinfo.alpha_offset = 0;
-            fbinfo.alpha_length = 0;
-            break;
-        case 5: /* BGRA_8888 */
-            fbinfo.bpp = 32;
-            fbinfo.size = w * h * 4;
-            fbinfo.width = w;
-            fbinfo.height = h;
-            fbinfo.red_offset = 16;
-            fbinfo.red_length = 8;
-            fbinfo.green_offset = 8;
-            fbinfo.green_length = 8;
-            fbinfo.blue_offset = 0;
-            fbinfo.blue_length = 8;
-            fbinfo.alpha_offset = 24;
-            fbinfo.alpha_length = 8;
-           break;
-        default:
-            goto done;
-    }
+    if (!fill_fbinfo(&fbinfo, w, h, f, c)) goto done;
 
     /* write header */
     if (!WriteFdExactly(fd.get(), &fbinfo, sizeof(fbinfo))) goto done;
@@ -186,3 +196,96 @@ done:
 
     TEMP_FAILURE_RETRY(waitpid(pid, nullptr, 0));
 }
+
+// Runs screencap for a single frame.
+static bool capture_screen(struct fbinfo* fbinfo, std::vector<char>* pixels) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) return false;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        adb_close(fds[0]);
+        adb_close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        adb_close(fds[0]);
+        adb_close(fds[1]);
+        const char* command = "screencap";
+        const char* args[2] = {command, nullptr};
+        execvp(command, (char**)args);
+        perror_exit("exec screencap failed");
+    }
+
+    adb_close(fds[1]);
+    unique_fd fd_screencap(fds[0]);
+
+    int header[4];
+    bool result = ReadFdExactly(fd_screencap.get(), header, sizeof(header)) &&
+                  fill_fbinfo(fbinfo, header[0], header[1], header[2], header[3]);
+    if (result) {
+        pixels->resize(fbinfo->size);
+        result = ReadFdExactly(fd_screencap.get(), pixels->data(), pixels->size());
+    }
+
+    fd_screencap.reset();
+    TEMP_FAILURE_RETRY(waitpid(pid, nullptr, 0));
+    return result;
+}
+
+// Even when nothing seems to change, send everything every so often, to cover hash collisions.
+static constexpr auto kKeyframeInterval = std::chrono::seconds(10);
+
+void framebuffer_stream_service(unique_fd fd, int fps) {
+    using namespace std::chrono;
+
+    struct fbinfo fbinfo;
+    std::vector<char> pixels;
+    if (!capture_screen(&fbinfo, &pixels)) return;
+    if (!WriteFdExactly(fd.get(), &fbinfo, sizeof(fbinfo))) return;
+
+    FramebufferDeltaEncoder encoder(fbinfo.width, fbinfo.height, fbinfo.bpp / 8);
+    std::vector<char> packet;
+    const auto frame_interval = duration_cast<steady_clock::duration>(seconds(1)) / fps;
+    auto next_frame = steady_clock::now();
+    auto next_keyframe = next_frame;
+    bool keyframe_requested = false;
+
+    while (true) {
+        auto now = steady_clock::now();
+        bool keyframe = keyframe_requested || now >= next_keyframe;
+        if (keyframe) {
+            keyframe_requested = false;
+            next_keyframe = now + kKeyframeInterval;
+        }
+
+        if (!encoder.Encode(pixels.data(), keyframe, &packet)) return;
+        if (!packet.empty() && !WriteFdExactly(fd.get(), packet.data(), packet.size())) return;
+
+        // If we fell behind, drop frames rather than trying to catch up.
+        next_frame = std::max(next_frame + frame_interval, steady_clock::now());
+
+        // Wait for the next frame, or for the client to ask for a keyframe or to go away.
+        while (true) {
+            auto timeout = duration_cast<milliseconds>(next_frame - steady_clock::now());
+            adb_pollfd pfd = {.fd = fd.get(), .events = POLLIN};
+            int rc = adb_poll(&pfd, 1, std::max<int>(timeout.count(), 0));
+            if (rc < 0 && errno != EINTR) return;
+            if (rc <= 0) break;
+
+            char buf[64];
+            if (adb_read(fd.get(), buf, sizeof(buf)) <= 0) return;
+            keyframe_requested = true;
+        }
+
+        struct fbinfo next_fbinfo;
+        if (!capture_screen(&next_fbinfo, &pixels)) return;
+        if (next_fbinfo.width != fbinfo.width || next_fbinfo.height != fbinfo.height ||
+            next_fbinfo.bpp != fbinfo.bpp) {
+            // The display was rotated or reconfigured; the client has to start over.
+            return;
+        }
+    }
+}
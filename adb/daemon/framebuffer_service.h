@@ -20,4 +20,7 @@
 
 #if defined(__ANDROID__)
 void framebuffer_service(unique_fd fd);
+
+// Streams delta-encoded frames at up to |fps| frames per second (see framebuffer_delta.h).
+void framebuffer_stream_service(unique_fd fd, int fps);
 #endif
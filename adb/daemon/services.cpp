@@ -46,6 +46,7 @@
 #include "adb_io.h"
 #include "adb_unique_fd.h"
 #include "adb_utils.h"
+#include "framebuffer_delta.h"
 #include "services.h"
 #include "socket_spec.h"
 #include "sysdeps.h"
@@ -250,6 +251,16 @@ unique_fd daemon_service_to_fd(std::string_view name, atransport* transport) {
 #if defined(__ANDROID__)
     if (name.starts_with("framebuffer:")) {
         return create_service_thread("fb", framebuffer_service);
+    } else if (android::base::ConsumePrefix(&name, "framebuffer-stream:")) {
+        int fps = kDefaultFramebufferStreamFps;
+        if (!name.empty() && !android::base::ParseInt(std::string(name), &fps, 1,
+                                                      kMaxFramebufferStreamFps)) {
+            LOG(ERROR) << "bad framebuffer-stream frame rate: " << name;
+            return unique_fd{};
+        }
+        return create_service_thread("fb-stream",
+                                     std::bind(framebuffer_stream_service, std::placeholders::_1,
+                                               fps));
     } else if (android::base::ConsumePrefix(&name, "remount:")) {
         std::string arg(name);
         return create_service_thread("remount",
@@ -89,6 +89,7 @@
 #include <sys/stat.h>
 #include <termios.h>
 
+#include <chrono>
 #include <memory>
 #include <string>
 #include <thread>
@@ -114,6 +115,16 @@
 
 namespace {
 
+using namespace std::chrono_literals;
+
+// Once a stream's output is coming in packets at least this big, it's treated as bulk output.
+constexpr size_t kBulkOutputThreshold = 16 * 1024;
+
+// How long to wait for more bulk output before sending a partially filled packet. Output that
+// isn't bulk (for example, keystrokes being echoed) is never held back.
+constexpr auto kRawCoalesceWindow = 2ms;
+constexpr auto kPtyCoalesceWindow = 1ms;
+
 static std::string GetShellPath() {
     std::string shell = android::base::GetProperty("persist.sys.adb.shell", "");
     struct stat st;
@@ -141,6 +152,16 @@ std::string ReadAll(int fd) {
     return received;
 }
 
+// Raw output can be produced much faster than the default socket buffers drain, so let up to a
+// packet's worth queue up between reads. The kernel may clamp this, which is fine.
+void GrowSocketBuffers(int fd) {
+    int size = MAX_PAYLOAD;
+    if (adb_setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) != 0 ||
+        adb_setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) != 0) {
+        PLOG(WARNING) << "failed to grow socket buffers for fd " << fd;
+    }
+}
+
 // Creates a socketpair and saves the endpoints to |fd1| and |fd2|.
 bool CreateSocketpair(unique_fd* fd1, unique_fd* fd2) {
     int sockets[2];
@@ -196,6 +217,10 @@ class Subprocess {
     unique_fd* PassInput();
     unique_fd* PassOutput(unique_fd* sfd, ShellProtocol::Id id);
 
+    // Waits for more output on |fd| if the last packet of output was bulk output, and returns
+    // whether any arrived within the coalescing window.
+    bool WaitForMoreOutput(int fd);
+
     const std::string command_;
     const std::string terminal_type_;
     SubprocessType type_;
@@ -208,6 +233,7 @@ class Subprocess {
     unique_fd stdinout_sfd_, stderr_sfd_, protocol_sfd_;
     std::unique_ptr<ShellProtocol> input_, output_;
     size_t input_bytes_left_ = 0;
+    size_t last_output_length_ = 0;
 
     DISALLOW_COPY_AND_ASSIGN(Subprocess);
 };
@@ -306,6 +332,8 @@ bool Subprocess::ForkAndExec(std::string* error) {
                                                  strerror(errno));
             return false;
         }
+        GrowSocketBuffers(stdinout_sfd_.get());
+        GrowSocketBuffers(child_stdinout_sfd.get());
         // Raw subprocess + shell protocol allows for splitting stderr.
         if (protocol_ == SubprocessProtocol::kShell &&
                 !CreateSocketpair(&stderr_sfd_, &child_stderr_sfd)) {
@@ -462,6 +490,8 @@ bool Subprocess::ConnectProtocolEndpoints(std::string* _Nonnull error) {
             return false;
         }
         D("protocol FD = %d", protocol_sfd_.get());
+        GrowSocketBuffers(protocol_sfd_.get());
+        GrowSocketBuffers(local_socket_sfd_.get());
 
         input_ = std::make_unique<ShellProtocol>(protocol_sfd_);
         output_ = std::make_unique<ShellProtocol>(protocol_sfd_);
@@ -717,25 +747,52 @@ unique_fd* Subprocess::PassInput() {
     return nullptr;
 }
 
+bool Subprocess::WaitForMoreOutput(int fd) {
+    if (last_output_length_ < kBulkOutputThreshold) {
+        return false;
+    }
+
+    auto window = type_ == SubprocessType::kRaw ? kRawCoalesceWindow : kPtyCoalesceWindow;
+    adb_pollfd pfd = {.fd = fd, .events = POLLIN};
+    return adb_poll(&pfd, 1, std::chrono::milliseconds(window).count()) == 1;
+}
+
 unique_fd* Subprocess::PassOutput(unique_fd* sfd, ShellProtocol::Id id) {
-    int bytes = adb_read(*sfd, output_->data(), output_->data_capacity());
-    if (bytes == 0 || (bytes < 0 && errno != EAGAIN)) {
-        // read() returns EIO if a PTY closes; don't report this as an error,
-        // it just means the subprocess completed.
-        if (bytes < 0 && !(type_ == SubprocessType::kPty && errno == EIO)) {
-            PLOG(ERROR) << "error reading output FD " << *sfd;
+    // Send everything that's available as a single packet, rather than one packet per read.
+    char* buffer = output_->data();
+    size_t capacity = output_->data_capacity();
+    size_t length = 0;
+    bool closed = false;
+    while (length < capacity) {
+        int bytes = adb_read(*sfd, buffer + length, capacity - length);
+        if (bytes > 0) {
+            length += bytes;
+        } else if (bytes < 0 && errno == EAGAIN) {
+            if (length == 0 || !WaitForMoreOutput(sfd->get())) {
+                break;
+            }
+        } else {
+            // read() returns EIO if a PTY closes; don't report this as an error,
+            // it just means the subprocess completed.
+            if (bytes < 0 && !(type_ == SubprocessType::kPty && errno == EIO)) {
+                PLOG(ERROR) << "error reading output FD " << *sfd;
+            }
+            closed = true;
+            break;
         }
-        return sfd;
     }
 
-    if (bytes > 0 && !output_->Write(id, bytes)) {
-        if (errno != 0) {
-            PLOG(ERROR) << "error reading protocol FD " << protocol_sfd_;
+    if (length > 0) {
+        last_output_length_ = length;
+        if (!output_->Write(id, length)) {
+            if (errno != 0) {
+                PLOG(ERROR) << "error reading protocol FD " << protocol_sfd_;
+            }
+            return &protocol_sfd_;
         }
-        return &protocol_sfd_;
     }
 
-    return nullptr;
+    return closed ? sfd : nullptr;
 }
 
 void Subprocess::WaitForExit() {
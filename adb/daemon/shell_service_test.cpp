@@ -184,6 +184,23 @@ TEST_F(ShellServiceTest, RawShellProtocolSubprocess) {
     ExpectLinesEqual(stderr, {"bar"});
 }
 
+// Tests that bulk output, which gets coalesced into large packets, arrives intact and in order
+// with the shell protocol.
+TEST_F(ShellServiceTest, RawShellProtocolBulkOutput) {
+    ASSERT_NO_FATAL_FAILURE(StartTestSubprocess(
+            "seq 1 200000; echo done >&2; seq 200001 300000",
+            SubprocessType::kRaw, SubprocessProtocol::kShell));
+
+    std::string stdout, stderr;
+    EXPECT_EQ(0, ReadShellProtocol(command_fd_, &stdout, &stderr));
+    std::vector<std::string> lines = android::base::Split(stdout, "\n");
+    ASSERT_EQ(300001u, lines.size());
+    for (size_t i = 0; i < 300000; ++i) {
+        ASSERT_EQ(std::to_string(i + 1), lines[i]);
+    }
+    ExpectLinesEqual(stderr, {"done"});
+}
+
 // Tests a PTY subprocess with the shell protocol.
 TEST_F(ShellServiceTest, PtyShellProtocolSubprocess) {
     ASSERT_NO_FATAL_FAILURE(StartTestSubprocess(
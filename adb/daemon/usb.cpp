@@ -57,14 +57,95 @@ using android::base::StringPrintf;
 // We can't find out whether we have support for AIO on ffs endpoints until we submit a read.
 static std::optional<bool> gFfsAioSupported;
 
-// Not all USB controllers support operations larger than 16k, so don't go above that.
-// Also, each submitted operation does an allocation in the kernel of that size, so we want to
-// minimize our queue depth while still maintaining a deep enough queue to keep the USB stack fed.
-static constexpr size_t kUsbReadQueueDepth = 8;
-static constexpr size_t kUsbReadSize = 4 * PAGE_SIZE;
+// Each submitted operation does an allocation in the kernel of its size, so we want to minimize
+// our queue depth and transfer size while still keeping the USB stack fed. The first level is
+// used for everything by default, and is known to work on every controller (not all of them
+// support operations larger than 16k). The rest are stepped up to under sustained bulk traffic
+// when adaptive transfers are enabled, and dropped once the link goes idle.
+struct AioLevel {
+    size_t size;
+    size_t depth;
+};
+
+static constexpr AioLevel kAioLevels[] = {
+        {4 * PAGE_SIZE, 8},
+        {16 * PAGE_SIZE, 12},
+        {64 * PAGE_SIZE, 16},
+};
+
+// Levels are in increasing order of size and depth.
+static constexpr size_t kUsbMaxQueueDepth = kAioLevels[std::size(kAioLevels) - 1].depth;
+
+// How long a direction has to go without completing a request before it's considered idle.
+static constexpr auto kAioIdleTimeout = 1s;
+
+// Larger operations aren't supported by every controller, so devices opt in with
+// ro.adb.adaptive_ffs once they've been verified.
+static bool adaptive_transfers_enabled() {
+    static const bool default_enabled =
+            android::base::GetBoolProperty("ro.adb.adaptive_ffs", false);
+    static const bool enabled =
+            android::base::GetBoolProperty("persist.adb.adaptive_ffs", default_enabled);
+    return enabled;
+}
+
+// Picks the size and number of aio requests to keep in flight in one direction. A full queue's
+// worth of consecutive requests that were saturated (reads that came back full, or writes with
+// more queued behind them) moves it up a level.
+class AioSizer {
+  public:
+    size_t size() const { return kAioLevels[level_].size; }
+    size_t depth() const { return kAioLevels[level_].depth; }
+
+    // Drop back down to the first level if nothing has happened for a while.
+    void CheckIdle() {
+        auto now = std::chrono::steady_clock::now();
+        if (level_ != 0 && now - last_activity_ > kAioIdleTimeout) {
+            LOG(VERBOSE) << "aio: idle, dropping to level 0";
+            level_ = 0;
+            streak_ = 0;
+        }
+        last_activity_ = now;
+    }
+
+    // When the sizer will count as idle if nothing happens in the meantime, if it's above the
+    // first level.
+    std::optional<std::chrono::steady_clock::time_point> IdleDeadline() const {
+        if (level_ == 0) {
+            return std::nullopt;
+        }
+        return last_activity_ + kAioIdleTimeout;
+    }
+
+    // Drop back down to the first level now.
+    void Reset() {
+        LOG(VERBOSE) << "aio: resetting to level 0";
+        level_ = 0;
+        streak_ = 0;
+    }
+
+    // Record a completed request.
+    void Update(bool saturated) {
+        CheckIdle();
+        if (!saturated) {
+            streak_ = 0;
+            return;
+        }
 
-static constexpr size_t kUsbWriteQueueDepth = 8;
-static constexpr size_t kUsbWriteSize = 4 * PAGE_SIZE;
+        if (++streak_ >= depth() && level_ + 1 < std::size(kAioLevels) &&
+            adaptive_transfers_enabled()) {
+            ++level_;
+            streak_ = 0;
+            LOG(VERBOSE) << "aio: stepping up to level " << level_ << " (" << size() << " x "
+                         << depth() << ")";
+        }
+    }
+
+  private:
+    size_t level_ = 0;
+    size_t streak_ = 0;
+    std::chrono::steady_clock::time_point last_activity_;
+};
 
 static const char* to_string(enum usb_functionfs_event_type type) {
     switch (type) {
@@ -119,6 +200,7 @@ struct TransferId {
 
 struct IoBlock {
     bool pending = false;
+    bool cancelled = false;
     struct iocb control = {};
     std::shared_ptr<Block> payload;
 
@@ -188,7 +270,7 @@ struct UsbFfsConnection : public Connection {
             PLOG(FATAL) << "failed to create eventfd";
         }
 
-        aio_context_ = ScopedAioContext::Create(kUsbReadQueueDepth + kUsbWriteQueueDepth);
+        aio_context_ = ScopedAioContext::Create(2 * kUsbMaxQueueDepth);
     }
 
     ~UsbFfsConnection() {
@@ -212,6 +294,7 @@ struct UsbFfsConnection : public Connection {
         memcpy(header.data(), &packet->msg, sizeof(packet->msg));
 
         std::lock_guard<std::mutex> lock(write_mutex_);
+        write_sizer_.CheckIdle();
         write_requests_.push_back(CreateWriteBlock(std::move(header), next_write_id_++));
         if (!packet->payload.empty()) {
             // The kernel attempts to allocate a contiguous block of memory for each write,
@@ -222,7 +305,7 @@ struct UsbFfsConnection : public Connection {
             size_t len = payload->size();
 
             while (len > 0) {
-                size_t write_size = std::min(kUsbWriteSize, len);
+                size_t write_size = std::min(write_sizer_.size(), len);
                 write_requests_.push_back(
                         CreateWriteBlock(payload, offset, write_size, next_write_id_++));
                 len -= write_size;
@@ -415,16 +498,37 @@ struct UsbFfsConnection : public Connection {
         worker_started_ = true;
         worker_thread_ = std::thread([this]() {
             adb_thread_setname("UsbFfs-worker");
-            for (size_t i = 0; i < kUsbReadQueueDepth; ++i) {
-                read_requests_[i] = CreateReadBlock(next_read_id_++);
-                if (!SubmitRead(&read_requests_[i])) {
-                    return;
-                }
+            for (size_t i = 0; i < kUsbMaxQueueDepth; ++i) {
+                read_requests_[i] = CreateReadBlock();
+            }
+            if (!SubmitReads()) {
+                return;
             }
 
             while (!stopped_) {
+                // Reads submitted at a larger size stay outstanding while the link is idle, so
+                // wake up when the read sizer goes idle to shrink them.
+                int timeout_ms = -1;
+                if (auto deadline = read_sizer_.IdleDeadline()) {
+                    auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+                            *deadline - std::chrono::steady_clock::now());
+                    timeout_ms = std::max<int64_t>(0, remaining.count());
+                }
+
+                adb_pollfd pfd = {.fd = worker_event_fd_.get(), .events = POLLIN, .revents = 0};
+                int rc = adb_poll(&pfd, 1, timeout_ms);
+                if (rc == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    PLOG(FATAL) << "failed to poll eventfd";
+                } else if (rc == 0) {
+                    ShrinkIdleReads();
+                    continue;
+                }
+
                 uint64_t dummy;
-                ssize_t rc = adb_read(worker_event_fd_.get(), &dummy, sizeof(dummy));
+                rc = adb_read(worker_event_fd_.get(), &dummy, sizeof(dummy));
                 if (rc == -1) {
                     PLOG(FATAL) << "failed to read from eventfd";
                 } else if (rc == 0) {
@@ -466,15 +570,14 @@ struct UsbFfsConnection : public Connection {
 
     void PrepareReadBlock(IoBlock* block, uint64_t id) {
         block->pending = false;
-        block->payload = std::make_shared<Block>(kUsbReadSize);
+        block->payload = std::make_shared<Block>(read_sizer_.size());
         block->control.aio_data = static_cast<uint64_t>(TransferId::read(id));
         block->control.aio_buf = reinterpret_cast<uintptr_t>(block->payload->data());
         block->control.aio_nbytes = block->payload->size();
     }
 
-    IoBlock CreateReadBlock(uint64_t id) {
+    IoBlock CreateReadBlock() {
         IoBlock block;
-        PrepareReadBlock(&block, id);
         block.control.aio_rw_flags = 0;
         block.control.aio_lio_opcode = IOCB_CMD_PREAD;
         block.control.aio_reqprio = 0;
@@ -486,7 +589,7 @@ struct UsbFfsConnection : public Connection {
     }
 
     void ReadEvents() {
-        static constexpr size_t kMaxEvents = kUsbReadQueueDepth + kUsbWriteQueueDepth;
+        static constexpr size_t kMaxEvents = 2 * kUsbMaxQueueDepth;
         struct io_event events[kMaxEvents];
         struct timespec timeout = {.tv_sec = 0, .tv_nsec = 0};
         int rc = io_getevents(aio_context_.get(), 0, kMaxEvents, events, &timeout);
@@ -499,6 +602,12 @@ struct UsbFfsConnection : public Connection {
             auto& event = events[event_idx];
             TransferId id = TransferId::from_value(event.data);
 
+            if (event.res <= 0 && id.direction == TransferDirection::READ &&
+                read_requests_[id.id % kUsbMaxQueueDepth].cancelled) {
+                HandleCancelledRead(id);
+                continue;
+            }
+
             if (event.res < 0) {
                 std::string error =
                         StringPrintf("%s %" PRIu64 " failed with error %s",
@@ -517,9 +626,14 @@ struct UsbFfsConnection : public Connection {
     }
 
     void HandleRead(TransferId id, int64_t size) {
-        uint64_t read_idx = id.id % kUsbReadQueueDepth;
+        uint64_t read_idx = id.id % kUsbMaxQueueDepth;
         IoBlock* block = &read_requests_[read_idx];
         block->pending = false;
+        if (block->cancelled) {
+            HandleError(StringPrintf("read %" PRIu64 " completed after being cancelled", id.id));
+            return;
+        }
+        read_sizer_.Update(static_cast<uint64_t>(size) == block->control.aio_nbytes);
         block->payload->resize(size);
 
         // Notification for completed reads can be received out of order.
@@ -529,15 +643,17 @@ struct UsbFfsConnection : public Connection {
             return;
         }
 
-        for (uint64_t id = needed_read_id_;; ++id) {
-            size_t read_idx = id % kUsbReadQueueDepth;
+        for (uint64_t id = needed_read_id_; id < next_read_id_; ++id) {
+            size_t read_idx = id % kUsbMaxQueueDepth;
             IoBlock* current_block = &read_requests_[read_idx];
-            if (current_block->pending) {
+            if (current_block->pending || current_block->cancelled) {
                 break;
             }
             ProcessRead(current_block);
             ++needed_read_id_;
         }
+
+        SubmitReads();
     }
 
     void ProcessRead(IoBlock* block) {
@@ -568,8 +684,77 @@ struct UsbFfsConnection : public Connection {
             }
         }
 
-        PrepareReadBlock(block, block->id().id + kUsbReadQueueDepth);
-        SubmitRead(block);
+        // Release the buffer now, rather than when the slot is next used.
+        block->payload.reset();
+    }
+
+    // Top up the outstanding reads to the current queue depth. Reads are handed out to slots in
+    // order, so as long as there are never more than kUsbMaxQueueDepth outstanding, the next
+    // slot is always free.
+    bool SubmitReads() {
+        // Wait for cancelled reads to come back first, so that they can be resubmitted in order.
+        if (cancelled_reads_ != 0) {
+            return true;
+        }
+
+        while (next_read_id_ - needed_read_id_ < read_sizer_.depth()) {
+            IoBlock* block = &read_requests_[next_read_id_ % kUsbMaxQueueDepth];
+            PrepareReadBlock(block, next_read_id_++);
+            if (!SubmitRead(block)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Once the read sizer has gone idle, cancel the reads that are still outstanding at a larger
+    // size, and resubmit them at the first level, so that an idle connection doesn't hold on to
+    // the kernel's allocations for them. They're cancelled newest first, so that data arriving in
+    // the meantime lands in a read that's still queued. (FunctionFS discards whatever a cancelled
+    // read had already received, so a transfer that starts right as we cancel is lost, and the
+    // connection with it.)
+    void ShrinkIdleReads() {
+        if (cancelled_reads_ != 0) {
+            return;
+        }
+
+        read_sizer_.Reset();
+        for (uint64_t id = next_read_id_; id-- > needed_read_id_;) {
+            IoBlock* block = &read_requests_[id % kUsbMaxQueueDepth];
+            if (!block->pending) {
+                break;
+            }
+
+            // The cancellation is reported through io_getevents, like a completion.
+            struct io_event event;
+            if (io_cancel(aio_context_.get(), &block->control, &event) != 0 &&
+                errno != EINPROGRESS) {
+                // It's already completed, and so has everything before it.
+                break;
+            }
+            block->cancelled = true;
+            ++cancelled_reads_;
+        }
+        LOG(VERBOSE) << "aio: cancelled " << cancelled_reads_ << " idle reads";
+    }
+
+    void HandleCancelledRead(TransferId id) {
+        IoBlock* block = &read_requests_[id.id % kUsbMaxQueueDepth];
+        block->pending = false;
+        block->payload.reset();
+        if (--cancelled_reads_ != 0) {
+            return;
+        }
+
+        // The cancelled reads were the newest ones, so resubmit them under the same IDs.
+        uint64_t first_cancelled = next_read_id_;
+        while (first_cancelled > needed_read_id_ &&
+               read_requests_[(first_cancelled - 1) % kUsbMaxQueueDepth].cancelled) {
+            --first_cancelled;
+            read_requests_[first_cancelled % kUsbMaxQueueDepth].cancelled = false;
+        }
+        next_read_id_ = first_cancelled;
+        SubmitReads();
     }
 
     bool SubmitRead(IoBlock* block) {
@@ -602,6 +787,8 @@ struct UsbFfsConnection : public Connection {
         size_t outstanding_writes = --writes_submitted_;
         LOG(DEBUG) << "USB write: reaped, down to " << outstanding_writes;
 
+        write_sizer_.Update(write_requests_.size() > writes_submitted_);
+
         SubmitWrites();
     }
 
@@ -629,18 +816,19 @@ struct UsbFfsConnection : public Connection {
     }
 
     void SubmitWrites() REQUIRES(write_mutex_) {
-        if (writes_submitted_ == kUsbWriteQueueDepth) {
+        size_t depth = write_sizer_.depth();
+        if (writes_submitted_ >= depth) {
             return;
         }
 
-        ssize_t writes_to_submit = std::min(kUsbWriteQueueDepth - writes_submitted_,
-                                            write_requests_.size() - writes_submitted_);
+        ssize_t writes_to_submit =
+                std::min(depth - writes_submitted_, write_requests_.size() - writes_submitted_);
         CHECK_GE(writes_to_submit, 0);
         if (writes_to_submit == 0) {
             return;
         }
 
-        struct iocb* iocbs[kUsbWriteQueueDepth];
+        struct iocb* iocbs[kUsbMaxQueueDepth];
         for (int i = 0; i < writes_to_submit; ++i) {
             CHECK(!write_requests_[writes_submitted_ + i]->pending);
             write_requests_[writes_submitted_ + i]->pending = true;
@@ -689,8 +877,9 @@ struct UsbFfsConnection : public Connection {
     std::optional<amessage> incoming_header_;
     IOVector incoming_payload_;
 
-    std::array<IoBlock, kUsbReadQueueDepth> read_requests_;
+    std::array<IoBlock, kUsbMaxQueueDepth> read_requests_;
     IOVector read_data_;
+    AioSizer read_sizer_;
 
     // ID of the next request that we're going to send out.
     size_t next_read_id_ = 0;
@@ -698,10 +887,14 @@ struct UsbFfsConnection : public Connection {
     // ID of the next packet we're waiting for.
     size_t needed_read_id_ = 0;
 
+    // How many reads ShrinkIdleReads has cancelled that haven't been reported back yet.
+    size_t cancelled_reads_ = 0;
+
     std::mutex write_mutex_;
     std::deque<std::unique_ptr<IoBlock>> write_requests_ GUARDED_BY(write_mutex_);
     size_t next_write_id_ GUARDED_BY(write_mutex_) = 0;
     size_t writes_submitted_ GUARDED_BY(write_mutex_) = 0;
+    AioSizer write_sizer_ GUARDED_BY(write_mutex_);
 
     static constexpr int kInterruptionSignal = SIGUSR1;
 };
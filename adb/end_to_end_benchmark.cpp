@@ -0,0 +1,460 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Throughput and latency for push, pull and shell, through the real client and daemon code.
+//
+// The host side is the adb server's transport and socket layers, running on a thread of their own
+// in this process, and the client code (do_sync_push, do_sync_pull and send_shell_command) talking
+// to them over a loopback smartsocket, as `adb push` and friends do. The device side is adbd's
+// transport and services, linked from libadbd_core and libadbd_services into the
+// adbd_end_to_end_benchmark_device helper with authentication turned off. The transport between
+// them is a socketpair, a TCP loopback connection, or a socketpair relayed with an emulated round
+// trip time. Files are pushed from and pulled to a temporary directory.
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <benchmark/benchmark.h>
+
+#include "adb.h"
+#include "adb_io.h"
+#include "adb_listeners.h"
+#include "adb_trace.h"
+#include "adb_unique_fd.h"
+#include "client/adb_client.h"
+#include "client/commandline.h"
+#include "client/file_sync_client.h"
+#include "fdevent.h"
+#include "sysdeps.h"
+#include "sysdeps/network.h"
+#include "transport.h"
+
+using namespace std::chrono_literals;
+
+enum TransportKind : int64_t {
+    kSocketpair,
+    kTcpLoopback,
+    kEmulatedLatency,
+};
+
+// The round trip time of the emulated-latency transport.
+static constexpr auto kEmulatedRtt = 10ms;
+
+// Forwards bytes from one socket to another, holding each read back for a fixed delay.
+class DelayRelay {
+  public:
+    DelayRelay(int in, int out, std::chrono::microseconds delay)
+        : in_(in), out_(out), delay_(delay) {
+        reader_ = std::thread([this]() { ReadLoop(); });
+        writer_ = std::thread([this]() { WriteLoop(); });
+    }
+
+    // Returns once |in| has hit EOF and everything read from it has been forwarded.
+    ~DelayRelay() {
+        reader_.join();
+        writer_.join();
+    }
+
+  private:
+    void ReadLoop() {
+        while (true) {
+            std::string chunk(64 * 1024, '\0');
+            int rc = adb_read(in_, &chunk[0], chunk.size());
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (rc <= 0) {
+                eof_ = true;
+                cv_.notify_one();
+                return;
+            }
+            chunk.resize(rc);
+            queue_.emplace_back(std::chrono::steady_clock::now() + delay_, std::move(chunk));
+            cv_.notify_one();
+        }
+    }
+
+    void WriteLoop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [this]() { return eof_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                break;
+            }
+
+            auto [deadline, chunk] = std::move(queue_.front());
+            queue_.pop_front();
+            lock.unlock();
+            std::this_thread::sleep_until(deadline);
+            bool written = WriteFdExactly(out_, chunk.data(), chunk.size());
+            lock.lock();
+            if (!written) {
+                break;
+            }
+        }
+        adb_shutdown(out_, SHUT_WR);
+    }
+
+    const int in_;
+    const int out_;
+    const std::chrono::microseconds delay_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::pair<std::chrono::steady_clock::time_point, std::string>> queue_;
+    bool eof_ = false;
+
+    std::thread reader_;
+    std::thread writer_;
+};
+
+struct TransportPair {
+    unique_fd host;
+    unique_fd device;
+
+    // For the emulated-latency transport, the relays' ends of the two socketpairs. The relays are
+    // declared after them, so that they're joined before the sockets are closed.
+    unique_fd host_relay;
+    unique_fd device_relay;
+    std::unique_ptr<DelayRelay> upstream;
+    std::unique_ptr<DelayRelay> downstream;
+};
+
+static TransportPair MakeTransportPair(TransportKind kind) {
+    TransportPair pair;
+    int fds[2];
+
+    switch (kind) {
+        case kSocketpair:
+            if (adb_socketpair(fds) != 0) {
+                PLOG(FATAL) << "failed to create socketpair";
+            }
+            pair.host.reset(fds[0]);
+            pair.device.reset(fds[1]);
+            break;
+
+        case kTcpLoopback: {
+            std::string error;
+            unique_fd server(network_loopback_server(0, SOCK_STREAM, &error));
+            if (server < 0) {
+                LOG(FATAL) << "failed to listen on loopback: " << error;
+            }
+            int port = adb_socket_get_local_port(server.get());
+            pair.host.reset(network_loopback_client(port, SOCK_STREAM, &error));
+            if (pair.host < 0) {
+                LOG(FATAL) << "failed to connect to loopback: " << error;
+            }
+            pair.device.reset(adb_socket_accept(server.get(), nullptr, nullptr));
+            if (pair.device < 0) {
+                PLOG(FATAL) << "failed to accept loopback connection";
+            }
+            disable_tcp_nagle(pair.host.get());
+            disable_tcp_nagle(pair.device.get());
+            break;
+        }
+
+        case kEmulatedLatency:
+            if (adb_socketpair(fds) != 0) {
+                PLOG(FATAL) << "failed to create socketpair";
+            }
+            pair.host.reset(fds[0]);
+            pair.host_relay.reset(fds[1]);
+            if (adb_socketpair(fds) != 0) {
+                PLOG(FATAL) << "failed to create socketpair";
+            }
+            pair.device_relay.reset(fds[0]);
+            pair.device.reset(fds[1]);
+
+            // Each direction gets half of the round trip.
+            pair.upstream = std::make_unique<DelayRelay>(pair.host_relay.get(),
+                                                         pair.device_relay.get(), kEmulatedRtt / 2);
+            pair.downstream = std::make_unique<DelayRelay>(
+                    pair.device_relay.get(), pair.host_relay.get(), kEmulatedRtt / 2);
+            break;
+    }
+    return pair;
+}
+
+// commandline.cpp runs the server for `adb server`, which this never does.
+int adb_server_main(int, const std::string&, int) {
+    LOG(FATAL) << "adb_end_to_end_benchmark doesn't run a standalone server";
+    return 1;
+}
+
+// Starts the server's side of the host: transport registration, a smartsocket listener on an
+// ephemeral loopback port for the client code to connect to, and the fdevent loop.
+static void StartServer() {
+    static std::once_flag once;
+    std::call_once(once, []() {
+        init_transport_registration();
+
+        int port;
+        std::string error;
+        if (install_listener("tcp:0", "*smartsocket*", nullptr, 0, &port, &error) !=
+            INSTALL_STATUS_OK) {
+            LOG(FATAL) << "could not install *smartsocket* listener: " << error;
+        }
+        static auto& socket_spec = *new std::string(android::base::StringPrintf("tcp:%d", port));
+        adb_set_socket_spec(socket_spec.c_str());
+
+        std::thread([]() { fdevent_loop(); }).detach();
+    });
+}
+
+// Where to find the device helper: $ADB_END_TO_END_BENCHMARK_DEVICE, or next to this binary.
+static std::string DeviceHelperPath() {
+    const char* env = getenv("ADB_END_TO_END_BENCHMARK_DEVICE");
+    if (env) {
+        return env;
+    }
+    return android::base::GetExecutableDirectory() + "/adbd_end_to_end_benchmark_device";
+}
+
+// The device helper, serving adbd's end of the transport on |fd|.
+class DeviceProcess {
+  public:
+    explicit DeviceProcess(unique_fd fd) {
+        std::string path = DeviceHelperPath();
+        if (access(path.c_str(), X_OK) != 0) {
+            PLOG(FATAL) << "can't run " << path << " (set $ADB_END_TO_END_BENCHMARK_DEVICE?)";
+        }
+        std::string fd_arg = std::to_string(fd.get());
+
+        pid_ = fork();
+        if (pid_ == -1) {
+            PLOG(FATAL) << "fork failed";
+        } else if (pid_ == 0) {
+            fcntl(fd.get(), F_SETFD, 0);
+            execl(path.c_str(), path.c_str(), fd_arg.c_str(), nullptr);
+            _exit(127);
+        }
+    }
+
+    // Killing the device closes its end of the transport, and the server drops the transport.
+    ~DeviceProcess() {
+        kill(pid_, SIGTERM);
+        waitpid(pid_, nullptr, 0);
+    }
+
+    pid_t pid() const { return pid_; }
+
+  private:
+    pid_t pid_;
+};
+
+// Connects a new device over |kind| of transport, and makes it the client's target.
+struct EndToEnd {
+    explicit EndToEnd(TransportKind kind)
+        : transport(MakeTransportPair(kind)), device(std::move(transport.device)) {
+        StartServer();
+
+        // Each connection gets a serial of its own, since the last one may not have gone yet.
+        static int connections = 0;
+        serial = android::base::StringPrintf("end-to-end-%d", ++connections);
+        int error;
+        if (!register_socket_transport(std::move(transport.host), serial, 0, 0,
+                                       [](atransport*) { return ReconnectResult::Abort; },
+                                       &error)) {
+            LOG(FATAL) << "failed to connect to device: " << strerror(error);
+        }
+        adb_set_transport(kTransportAny, serial.c_str(), 0);
+    }
+
+    TransportPair transport;
+    DeviceProcess device;
+    std::string serial;
+    TemporaryDir dir;
+};
+
+// The sync client reports what it did on stdout, which is where the results go.
+class QuietStdout {
+  public:
+    QuietStdout() : saved_(dup(STDOUT_FILENO)) {
+        fflush(stdout);
+        unique_fd null(adb_open("/dev/null", O_WRONLY | O_CLOEXEC));
+        dup2(null.get(), STDOUT_FILENO);
+    }
+
+    ~QuietStdout() {
+        fflush(stdout);
+        dup2(saved_.get(), STDOUT_FILENO);
+    }
+
+  private:
+    unique_fd saved_;
+};
+
+// Random contents, so that compression doesn't flatter the sync numbers.
+static void WriteRandomFile(const std::string& path, uint64_t size) {
+    std::mt19937 rng(size);
+    std::vector<uint32_t> buffer(256 * 1024 / sizeof(uint32_t));
+    unique_fd fd(adb_open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC));
+    if (fd < 0) {
+        PLOG(FATAL) << "failed to create " << path;
+    }
+    while (size > 0) {
+        std::generate(buffer.begin(), buffer.end(), rng);
+        size_t length = std::min<uint64_t>(size, buffer.size() * sizeof(uint32_t));
+        if (!WriteFdExactly(fd.get(), buffer.data(), length)) {
+            PLOG(FATAL) << "failed to write " << path;
+        }
+        size -= length;
+    }
+}
+
+// The CPU time used so far by this process and the device helper.
+static double CpuSeconds(pid_t device) {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    auto seconds = [](const timeval& tv) { return tv.tv_sec + tv.tv_usec / 1e6; };
+    double result = seconds(usage.ru_utime) + seconds(usage.ru_stime);
+
+    // utime and stime are the 14th and 15th fields, after the parenthesized command name.
+    std::string stat;
+    if (android::base::ReadFileToString(android::base::StringPrintf("/proc/%d/stat", device),
+                                        &stat)) {
+        unsigned long utime, stime;
+        size_t end = stat.rfind(')');
+        if (end != std::string::npos &&
+            sscanf(stat.c_str() + end + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                   &utime, &stime) == 2) {
+            result += static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+        }
+    }
+    return result;
+}
+
+// Runs |op| once per iteration, and reports latency percentiles and the CPU time (for both ends
+// together) per GiB moved alongside the throughput.
+template <typename Op>
+static void RunOps(benchmark::State& state, const EndToEnd& e2e, uint64_t size, Op&& op) {
+    std::vector<double> latencies_us;
+    double cpu_begin = CpuSeconds(e2e.device.pid());
+    for (auto _ : state) {
+        auto begin = std::chrono::steady_clock::now();
+        op();
+        auto end = std::chrono::steady_clock::now();
+        latencies_us.push_back(std::chrono::duration<double, std::micro>(end - begin).count());
+    }
+    double cpu_seconds = CpuSeconds(e2e.device.pid()) - cpu_begin;
+
+    uint64_t total_bytes = state.iterations() * size;
+    state.SetBytesProcessed(total_bytes);
+    if (total_bytes != 0) {
+        state.counters["cpu_s_per_GiB"] = cpu_seconds / (total_bytes / (1024.0 * 1024 * 1024));
+    }
+
+    if (!latencies_us.empty()) {
+        std::sort(latencies_us.begin(), latencies_us.end());
+        auto percentile = [&latencies_us](double p) {
+            size_t index = std::min(latencies_us.size() - 1,
+                                    static_cast<size_t>(p / 100 * latencies_us.size()));
+            return latencies_us[index];
+        };
+        state.counters["p50_us"] = percentile(50);
+        state.counters["p90_us"] = percentile(90);
+        state.counters["p99_us"] = percentile(99);
+    }
+}
+
+static void BM_Push(benchmark::State& state) {
+    EndToEnd e2e(static_cast<TransportKind>(state.range(0)));
+    uint64_t size = state.range(1);
+    std::string local = e2e.dir.path + std::string("/push");
+    std::string remote = e2e.dir.path + std::string("/pushed");
+    WriteRandomFile(local, size);
+
+    QuietStdout quiet;
+    RunOps(state, e2e, size,
+           [&]() { CHECK(do_sync_push({local.c_str()}, remote.c_str(), false)); });
+}
+
+static void BM_Pull(benchmark::State& state) {
+    EndToEnd e2e(static_cast<TransportKind>(state.range(0)));
+    uint64_t size = state.range(1);
+    std::string remote = e2e.dir.path + std::string("/pull");
+    std::string local = e2e.dir.path + std::string("/pulled");
+    WriteRandomFile(remote, size);
+
+    QuietStdout quiet;
+    RunOps(state, e2e, size,
+           [&]() { CHECK(do_sync_pull({remote.c_str()}, local.c_str(), false)); });
+}
+
+static void BM_Shell(benchmark::State& state) {
+    EndToEnd e2e(static_cast<TransportKind>(state.range(0)));
+    uint64_t size = state.range(1);
+    std::string command =
+            size == 0 ? "true" : android::base::StringPrintf("head -c %" PRIu64 " /dev/zero", size);
+
+    SilentStandardStreamsCallbackInterface callback;
+    RunOps(state, e2e, size,
+           [&]() { CHECK_EQ(0, send_shell_command(command, false, &callback)); });
+}
+
+static void TransferArgs(benchmark::internal::Benchmark* b) {
+    b->ArgNames({"transport", "bytes"});
+    for (int64_t transport : {kSocketpair, kTcpLoopback, kEmulatedLatency}) {
+        for (int64_t size : {4 * 1024, 1024 * 1024, 64 * 1024 * 1024}) {
+            b->Args({transport, size});
+        }
+    }
+}
+
+static void ShellArgs(benchmark::internal::Benchmark* b) {
+    b->ArgNames({"transport", "bytes"});
+    for (int64_t transport : {kSocketpair, kTcpLoopback, kEmulatedLatency}) {
+        // Zero bytes of output is the equivalent of `adb shell true`.
+        for (int64_t size : {0, 1024 * 1024, 64 * 1024 * 1024}) {
+            b->Args({transport, size});
+        }
+    }
+}
+
+BENCHMARK(BM_Push)->Apply(TransferArgs)->UseRealTime();
+BENCHMARK(BM_Pull)->Apply(TransferArgs)->UseRealTime();
+BENCHMARK(BM_Shell)->Apply(ShellArgs)->UseRealTime();
+
+int main(int argc, char** argv) {
+    // The relays can be left writing to a socket that's already been closed during teardown, as
+    // can the server.
+    signal(SIGPIPE, SIG_IGN);
+
+    android::base::SetMinimumLogSeverity(android::base::WARNING);
+    adb_trace_init(argv);
+    ::benchmark::Initialize(&argc, argv);
+    if (::benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+    ::benchmark::RunSpecifiedBenchmarks();
+}
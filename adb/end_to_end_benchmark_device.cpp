@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The device side of adb_end_to_end_benchmark: adbd's transport and services, serving a single
+// connection to the host that's inherited as the fd named by the only argument. Authentication
+// is turned off, so the host's CNXN goes straight through.
+
+#include <signal.h>
+#include <sys/stat.h>
+
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+
+#include "adb.h"
+#include "adb_auth.h"
+#include "adb_trace.h"
+#include "adb_unique_fd.h"
+#include "fdevent.h"
+#include "transport.h"
+
+int main(int argc, char** argv) {
+    int fd;
+    if (argc != 2 || !android::base::ParseInt(argv[1], &fd, 0)) {
+        fprintf(stderr, "usage: %s FD\n", argv[0]);
+        return 1;
+    }
+
+    umask(0);
+    signal(SIGPIPE, SIG_IGN);
+    android::base::SetMinimumLogSeverity(android::base::WARNING);
+    adb_trace_init(argv);
+
+    auth_required = false;
+    init_transport_registration();
+    if (!register_socket_transport(unique_fd(fd), "host", 0, 1,
+                                   [](atransport*) { return ReconnectResult::Abort; })) {
+        LOG(FATAL) << "failed to register transport on fd " << fd;
+    }
+
+    fdevent_loop();
+    return 0;
+}
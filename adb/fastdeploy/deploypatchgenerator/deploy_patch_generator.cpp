@@ -0,0 +1,287 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "deploy_patch_generator.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <map>
+#include <tuple>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+#include <ziparchive/zip_archive.h>
+
+using android::base::StringPrintf;
+using android::base::unique_fd;
+
+static constexpr size_t kBufferSize = 128 * 1024;
+
+static bool WriteFormattedLong(int fd, int64_t value) {
+    uint64_t y = value;
+    if (value < 0) {
+        y = static_cast<uint64_t>(-value) | (1ULL << 63);
+    }
+
+    uint8_t bytes[8];
+    for (uint8_t& byte : bytes) {
+        byte = y & 0xff;
+        y >>= 8;
+    }
+    return android::base::WriteFully(fd, bytes, sizeof(bytes));
+}
+
+static bool CopyData(int local_fd, uint64_t offset, uint64_t length, int output_fd) {
+    std::vector<char> buffer(std::min<uint64_t>(kBufferSize, length));
+    while (length > 0) {
+        size_t chunk = std::min<uint64_t>(buffer.size(), length);
+        if (!android::base::ReadFullyAtOffset(local_fd, buffer.data(), chunk, offset) ||
+            !android::base::WriteFully(output_fd, buffer.data(), chunk)) {
+            return false;
+        }
+        offset += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+static void PrintEntry(const DeployPatchGenerator::APKEntry& entry) {
+    fprintf(stderr,
+            "Filename: %s\nCRC32: 0x%08" PRIX64 "\nData Offset: %" PRId64
+            "\nCompressed Size: %" PRId64 "\nUncompressed Size: %" PRId64 "\n",
+            entry.filename().c_str(), entry.crc32(), entry.dataoffset(), entry.compressedsize(),
+            entry.uncompressedsize());
+}
+
+bool DeployPatchGenerator::GetApkMetaData(const char* apk_path, APKMetaData* metadata,
+                                          std::string* error) {
+    ZipArchiveHandle zip;
+    int32_t result = OpenArchive(apk_path, &zip);
+    if (result != 0) {
+        *error = StringPrintf("failed to open %s: %s", apk_path, ErrorCodeString(result));
+        CloseArchive(zip);
+        return false;
+    }
+
+    void* cookie;
+    result = StartIteration(zip, &cookie, nullptr, nullptr);
+    if (result != 0) {
+        *error = StringPrintf("failed to read %s: %s", apk_path, ErrorCodeString(result));
+        CloseArchive(zip);
+        return false;
+    }
+
+    std::vector<APKEntry> entries;
+    ZipEntry zip_entry;
+    ZipString name;
+    while ((result = Next(cookie, &zip_entry, &name)) == 0) {
+        std::string filename(reinterpret_cast<const char*>(name.name), name.name_length);
+        if (!filename.empty() && filename.back() == '/') {
+            continue;
+        }
+
+        APKEntry& entry = entries.emplace_back();
+        entry.set_crc32(zip_entry.crc32);
+        entry.set_filename(std::move(filename));
+        entry.set_dataoffset(zip_entry.offset);
+        entry.set_compressedsize(zip_entry.compressed_length);
+        entry.set_uncompressedsize(zip_entry.uncompressed_length);
+    }
+    EndIteration(cookie);
+    CloseArchive(zip);
+
+    if (result != -1) {
+        *error = StringPrintf("failed to read %s: %s", apk_path, ErrorCodeString(result));
+        return false;
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const APKEntry& lhs, const APKEntry& rhs) {
+        return lhs.dataoffset() < rhs.dataoffset();
+    });
+    metadata->Clear();
+    for (APKEntry& entry : entries) {
+        *metadata->add_entries() = std::move(entry);
+    }
+    return true;
+}
+
+bool DeployPatchGenerator::ReadDelimitedMetaData(int fd, APKMetaData* metadata,
+                                                 std::string* error) {
+    google::protobuf::io::FileInputStream input(fd);
+    google::protobuf::io::CodedInputStream coded_input(&input);
+    uint32_t size;
+    if (!coded_input.ReadVarint32(&size)) {
+        *error = "failed to read metadata size";
+        return false;
+    }
+
+    auto limit = coded_input.PushLimit(size);
+    if (!metadata->ParseFromCodedStream(&coded_input) || !coded_input.ConsumedEntireMessage()) {
+        *error = "failed to parse metadata";
+        return false;
+    }
+    coded_input.PopLimit(limit);
+    return true;
+}
+
+std::vector<DeployPatchGenerator::EntryPair> DeployPatchGenerator::FindIdenticalEntries(
+        const APKMetaData& device_metadata, const APKMetaData& local_metadata) {
+    // The old data gets copied in place of the new, so only the compressed bytes' length has to
+    // match exactly; the CRC and uncompressed size make it the same contents.
+    using Key = std::tuple<int64_t, int64_t, int64_t>;
+    std::multimap<Key, const APKEntry*> device_entries;
+    for (const APKEntry& entry : device_metadata.entries()) {
+        device_entries.emplace(
+                Key(entry.crc32(), entry.compressedsize(), entry.uncompressedsize()), &entry);
+    }
+
+    std::vector<EntryPair> identical_entries;
+    for (const APKEntry& local_entry : local_metadata.entries()) {
+        auto [begin, end] = device_entries.equal_range(Key(
+                local_entry.crc32(), local_entry.compressedsize(), local_entry.uncompressedsize()));
+        if (begin == end) {
+            continue;
+        }
+
+        const APKEntry* device_entry = begin->second;
+        for (auto it = begin; it != end; ++it) {
+            if (it->second->filename() == local_entry.filename()) {
+                device_entry = it->second;
+                break;
+            }
+        }
+        identical_entries.emplace_back(device_entry, &local_entry);
+    }
+
+    std::sort(identical_entries.begin(), identical_entries.end(),
+              [](const EntryPair& lhs, const EntryPair& rhs) {
+                  return lhs.second->dataoffset() < rhs.second->dataoffset();
+              });
+    return identical_entries;
+}
+
+bool DeployPatchGenerator::WritePatch(const std::vector<EntryPair>& identical_entries,
+                                      int local_fd, uint64_t local_size, int output_fd,
+                                      std::string* error) {
+    if (!android::base::WriteFully(output_fd, kSignature, strlen(kSignature)) ||
+        !WriteFormattedLong(output_fd, local_size)) {
+        *error = StringPrintf("failed to write patch: %s", strerror(errno));
+        return false;
+    }
+
+    uint64_t local_offset = 0;
+    for (const auto& [device_entry, local_entry] : identical_entries) {
+        uint64_t new_data_offset = local_entry->dataoffset();
+        uint64_t old_data_length = device_entry->compressedsize();
+        if (new_data_offset < local_offset || new_data_offset + old_data_length > local_size) {
+            // Overlapping or truncated entries; just send the data.
+            continue;
+        }
+
+        uint64_t new_data_length = new_data_offset - local_offset;
+        if (!WriteFormattedLong(output_fd, new_data_length) ||
+            !CopyData(local_fd, local_offset, new_data_length, output_fd) ||
+            !WriteFormattedLong(output_fd, device_entry->dataoffset()) ||
+            !WriteFormattedLong(output_fd, old_data_length)) {
+            *error = StringPrintf("failed to write patch: %s", strerror(errno));
+            return false;
+        }
+        local_offset = new_data_offset + old_data_length;
+    }
+
+    uint64_t remainder_length = local_size - local_offset;
+    if (!WriteFormattedLong(output_fd, remainder_length) ||
+        !CopyData(local_fd, local_offset, remainder_length, output_fd) ||
+        !WriteFormattedLong(output_fd, 0) || !WriteFormattedLong(output_fd, 0)) {
+        *error = StringPrintf("failed to write patch: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void DeployPatchGenerator::ReportIdenticalEntries(const std::vector<EntryPair>& identical_entries,
+                                                  uint64_t local_size) {
+    uint64_t equal_bytes = 0;
+    for (const auto& [device_entry, local_entry] : identical_entries) {
+        equal_bytes += local_entry->compressedsize();
+        if (is_verbose_) {
+            PrintEntry(*local_entry);
+        }
+    }
+
+    fprintf(stderr, "Detected %zu equal APK entries\n", identical_entries.size());
+    fprintf(stderr, "%" PRIu64 " bytes are equal out of %" PRIu64 " (%.2f%%)\n", equal_bytes,
+            local_size, local_size ? equal_bytes * 100.0 / local_size : 0.0);
+}
+
+bool DeployPatchGenerator::CreatePatch(const char* local_apk_path, const char* device_metadata_path,
+                                       const char* patch_path, std::string* error) {
+    unique_fd metadata_fd(
+            TEMP_FAILURE_RETRY(open(device_metadata_path, O_RDONLY | O_BINARY | O_CLOEXEC)));
+    if (metadata_fd < 0) {
+        *error = StringPrintf("failed to open %s: %s", device_metadata_path, strerror(errno));
+        return false;
+    }
+    APKMetaData device_metadata;
+    if (!ReadDelimitedMetaData(metadata_fd.get(), &device_metadata, error)) {
+        return false;
+    }
+    fprintf(stderr, "Device Entries (%d)\n", device_metadata.entries_size());
+    if (is_verbose_) {
+        for (const APKEntry& entry : device_metadata.entries()) {
+            PrintEntry(entry);
+        }
+    }
+
+    APKMetaData local_metadata;
+    if (!GetApkMetaData(local_apk_path, &local_metadata, error)) {
+        return false;
+    }
+    fprintf(stderr, "Host Entries (%d)\n", local_metadata.entries_size());
+    if (is_verbose_) {
+        for (const APKEntry& entry : local_metadata.entries()) {
+            PrintEntry(entry);
+        }
+    }
+
+    unique_fd local_fd(TEMP_FAILURE_RETRY(open(local_apk_path, O_RDONLY | O_BINARY | O_CLOEXEC)));
+    struct stat st;
+    if (local_fd < 0 || fstat(local_fd.get(), &st) != 0) {
+        *error = StringPrintf("failed to open %s: %s", local_apk_path, strerror(errno));
+        return false;
+    }
+
+    std::vector<EntryPair> identical_entries =
+            FindIdenticalEntries(device_metadata, local_metadata);
+    ReportIdenticalEntries(identical_entries, st.st_size);
+
+    unique_fd patch_fd(TEMP_FAILURE_RETRY(
+            open(patch_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY | O_CLOEXEC, 0644)));
+    if (patch_fd < 0) {
+        *error = StringPrintf("failed to open %s: %s", patch_path, strerror(errno));
+        return false;
+    }
+    return WritePatch(identical_entries, local_fd.get(), st.st_size, patch_fd.get(), error);
+}
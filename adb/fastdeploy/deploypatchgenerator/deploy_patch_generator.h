@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "fastdeploy/proto/ApkEntry.pb.h"
+
+// A native counterpart to deploypatchgenerator.jar, producing the same patches without starting a
+// JVM for every `adb install --fastdeploy`.
+//
+// A patch rebuilds a local APK on the device out of the copy that's already installed there, given
+// that copy's metadata (from `deployagent extract`). It consists of the signature "HAMADI/IHD" and
+// the local APK's size, followed by records of
+//     [length of new data] [new data] [offset of old data] [length of old data]
+// until the local APK is complete. The last record holds whatever follows the last reused entry,
+// with [0] [0] for its old data.
+// Integers are 64-bit little-endian, in sign-magnitude form.
+class DeployPatchGenerator {
+  public:
+    using APKEntry = com::android::fastdeploy::APKEntry;
+    using APKMetaData = com::android::fastdeploy::APKMetaData;
+
+    // A device entry, and a local entry with identical contents.
+    using EntryPair = std::pair<const APKEntry*, const APKEntry*>;
+
+    static constexpr const char* kSignature = "HAMADI/IHD";
+
+    explicit DeployPatchGenerator(bool is_verbose) : is_verbose_(is_verbose) {}
+
+    // Writes a patch to |patch_path| for the APK at |local_apk_path| against the installed APK
+    // described by the (delimited) APKMetaData at |device_metadata_path|.
+    bool CreatePatch(const char* local_apk_path, const char* device_metadata_path,
+                     const char* patch_path, std::string* error);
+
+    // Reads the entries of the APK at |apk_path|, ordered by data offset.
+    static bool GetApkMetaData(const char* apk_path, APKMetaData* metadata, std::string* error);
+
+    // Reads a length-delimited APKMetaData, as written by the device agent.
+    static bool ReadDelimitedMetaData(int fd, APKMetaData* metadata, std::string* error);
+
+    // Pairs up entries with the same CRC and sizes (preferring ones with the same name too),
+    // ordered by the local entry's data offset.
+    static std::vector<EntryPair> FindIdenticalEntries(const APKMetaData& device_metadata,
+                                                       const APKMetaData& local_metadata);
+
+    // Writes the patch, copying new data from |local_fd|.
+    static bool WritePatch(const std::vector<EntryPair>& identical_entries, int local_fd,
+                           uint64_t local_size, int output_fd, std::string* error);
+
+  private:
+    void ReportIdenticalEntries(const std::vector<EntryPair>& identical_entries,
+                                uint64_t local_size);
+
+    bool is_verbose_;
+};
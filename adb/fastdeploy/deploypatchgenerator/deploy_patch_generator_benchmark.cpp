@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Time to patch for the native patch generator, and for deploypatchgenerator.jar if
+// $DEPLOYPATCHGENERATOR_JAR points at it.
+//
+// By default, both run against a synthetic pair of large APKs that mostly share their contents.
+// Set $FASTDEPLOY_OLD_APK and $FASTDEPLOY_NEW_APK to use real ones instead.
+
+#include "deploy_patch_generator.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <random>
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/test_utils.h>
+#include <benchmark/benchmark.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <ziparchive/zip_writer.h>
+
+static constexpr size_t kEntryCount = 2000;
+static constexpr size_t kEntrySize = 32 * 1024;
+
+// Every tenth entry differs between the old and new APKs.
+static void WriteSyntheticApk(const std::string& path, bool is_new) {
+    std::mt19937 rng(0);
+    std::string contents(kEntrySize, '\0');
+
+    FILE* fp = fopen(path.c_str(), "wb");
+    CHECK(fp) << "failed to create " << path;
+    ZipWriter writer(fp);
+    for (size_t i = 0; i < kEntryCount; ++i) {
+        // Half random bytes and half zeroes, for a realistic compression ratio.
+        for (size_t j = 0; j < contents.size() / 2; ++j) {
+            contents[j] = static_cast<char>(rng());
+        }
+        if (is_new && i % 10 == 0) {
+            contents[0] ^= 1;
+        }
+        std::string name = android::base::StringPrintf("res/raw/entry%zu", i);
+        CHECK_EQ(0, writer.StartEntry(name.c_str(), ZipWriter::kCompress));
+        CHECK_EQ(0, writer.WriteBytes(contents.data(), contents.size()));
+        CHECK_EQ(0, writer.FinishEntry());
+    }
+    CHECK_EQ(0, writer.Finish());
+    fclose(fp);
+}
+
+class PatchGeneratorFixture : public benchmark::Fixture {
+  public:
+    void SetUp(const benchmark::State&) override {
+        if (!metadata_path_.empty()) {
+            return;
+        }
+
+        const char* old_apk = getenv("FASTDEPLOY_OLD_APK");
+        const char* new_apk = getenv("FASTDEPLOY_NEW_APK");
+        if (old_apk && new_apk) {
+            old_apk_path_ = old_apk;
+            new_apk_path_ = new_apk;
+        } else {
+            old_apk_path_ = std::string(dir_.path) + "/old.apk";
+            new_apk_path_ = std::string(dir_.path) + "/new.apk";
+            WriteSyntheticApk(old_apk_path_, false);
+            WriteSyntheticApk(new_apk_path_, true);
+        }
+
+        // Stand in for `deployagent extract` on the device.
+        DeployPatchGenerator::APKMetaData metadata;
+        std::string error;
+        CHECK(DeployPatchGenerator::GetApkMetaData(old_apk_path_.c_str(), &metadata, &error))
+                << error;
+        std::string serialized;
+        {
+            google::protobuf::io::StringOutputStream output(&serialized);
+            google::protobuf::io::CodedOutputStream coded_output(&output);
+            coded_output.WriteVarint32(metadata.ByteSizeLong());
+            CHECK(metadata.SerializeToCodedStream(&coded_output));
+        }
+        metadata_path_ = std::string(dir_.path) + "/old.metadata";
+        patch_path_ = std::string(dir_.path) + "/new.patch";
+        CHECK(android::base::WriteStringToFile(serialized, metadata_path_));
+    }
+
+  protected:
+    TemporaryDir dir_;
+    std::string old_apk_path_;
+    std::string new_apk_path_;
+    std::string metadata_path_;
+    std::string patch_path_;
+};
+
+BENCHMARK_F(PatchGeneratorFixture, Native)(benchmark::State& state) {
+    // The generator's summary goes to stderr, which would drown out the results.
+    CHECK(freopen("/dev/null", "w", stderr));
+    for (auto _ : state) {
+        DeployPatchGenerator generator(false);
+        std::string error;
+        CHECK(generator.CreatePatch(new_apk_path_.c_str(), metadata_path_.c_str(),
+                                    patch_path_.c_str(), &error))
+                << error;
+    }
+}
+
+BENCHMARK_F(PatchGeneratorFixture, Java)(benchmark::State& state) {
+    const char* jar = getenv("DEPLOYPATCHGENERATOR_JAR");
+    if (!jar) {
+        state.SkipWithError("$DEPLOYPATCHGENERATOR_JAR isn't set");
+        return;
+    }
+
+    std::string command = android::base::StringPrintf(
+            R"(java -jar "%s" "%s" "%s" > "%s" 2> /dev/null)", jar, new_apk_path_.c_str(),
+            metadata_path_.c_str(), patch_path_.c_str());
+    for (auto _ : state) {
+        CHECK_EQ(0, system(command.c_str())) << command;
+    }
+}
+
+BENCHMARK_MAIN();
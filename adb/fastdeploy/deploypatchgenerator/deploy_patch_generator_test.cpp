@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "deploy_patch_generator.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <gtest/gtest.h>
+#include <ziparchive/zip_writer.h>
+
+using APKMetaData = DeployPatchGenerator::APKMetaData;
+
+static void WriteApk(const std::string& path,
+                     const std::vector<std::pair<std::string, std::string>>& files) {
+    FILE* fp = fopen(path.c_str(), "wb");
+    ASSERT_NE(nullptr, fp);
+    ZipWriter writer(fp);
+    for (const auto& [name, contents] : files) {
+        ASSERT_EQ(0, writer.StartEntry(name.c_str(), ZipWriter::kCompress));
+        ASSERT_EQ(0, writer.WriteBytes(contents.data(), contents.size()));
+        ASSERT_EQ(0, writer.FinishEntry());
+    }
+    ASSERT_EQ(0, writer.Finish());
+    fclose(fp);
+}
+
+static void WriteDelimitedMetaData(const std::string& path, const APKMetaData& metadata) {
+    std::string serialized;
+    {
+        google::protobuf::io::StringOutputStream output(&serialized);
+        google::protobuf::io::CodedOutputStream coded_output(&output);
+        coded_output.WriteVarint32(metadata.ByteSizeLong());
+        ASSERT_TRUE(metadata.SerializeToCodedStream(&coded_output));
+    }
+    ASSERT_TRUE(android::base::WriteStringToFile(serialized, path));
+}
+
+static int64_t ReadFormattedLong(const std::string& patch, size_t* offset) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value |= static_cast<uint64_t>(static_cast<uint8_t>(patch[(*offset)++])) << (8 * i);
+    }
+    if (value & (1ULL << 63)) {
+        return -static_cast<int64_t>(value & ~(1ULL << 63));
+    }
+    return value;
+}
+
+// Rebuilds the new APK the way the device agent does.
+static std::string ApplyPatch(const std::string& old_apk, const std::string& patch,
+                              size_t* reused_bytes) {
+    EXPECT_EQ(DeployPatchGenerator::kSignature, patch.substr(0, 10));
+    size_t offset = 10;
+    int64_t new_size = ReadFormattedLong(patch, &offset);
+
+    std::string result;
+    *reused_bytes = 0;
+    while (static_cast<int64_t>(result.size()) < new_size) {
+        int64_t new_data_length = ReadFormattedLong(patch, &offset);
+        result += patch.substr(offset, new_data_length);
+        offset += new_data_length;
+
+        int64_t old_data_offset = ReadFormattedLong(patch, &offset);
+        int64_t old_data_length = ReadFormattedLong(patch, &offset);
+        result += old_apk.substr(old_data_offset, old_data_length);
+        *reused_bytes += old_data_length;
+    }
+    EXPECT_EQ(patch.size(), offset);
+    EXPECT_EQ(new_size, static_cast<int64_t>(result.size()));
+    return result;
+}
+
+TEST(DeployPatchGenerator, GetApkMetaData) {
+    TemporaryDir dir;
+    std::string apk_path = std::string(dir.path) + "/test.apk";
+    WriteApk(apk_path, {{"AndroidManifest.xml", "manifest"},
+                        {"classes.dex", std::string(4096, 'x')},
+                        {"res/", ""}});
+
+    APKMetaData metadata;
+    std::string error;
+    ASSERT_TRUE(DeployPatchGenerator::GetApkMetaData(apk_path.c_str(), &metadata, &error))
+            << error;
+    ASSERT_EQ(2, metadata.entries_size());
+    EXPECT_EQ("AndroidManifest.xml", metadata.entries(0).filename());
+    EXPECT_EQ("classes.dex", metadata.entries(1).filename());
+    EXPECT_LT(metadata.entries(0).dataoffset(), metadata.entries(1).dataoffset());
+    EXPECT_EQ(4096, metadata.entries(1).uncompressedsize());
+
+    std::string apk;
+    ASSERT_TRUE(android::base::ReadFileToString(apk_path, &apk));
+    const auto& manifest = metadata.entries(0);
+    EXPECT_EQ(8, manifest.uncompressedsize());
+    EXPECT_LE(static_cast<size_t>(manifest.dataoffset() + manifest.compressedsize()), apk.size());
+}
+
+TEST(DeployPatchGenerator, CreatePatch) {
+    TemporaryDir dir;
+    std::string old_apk_path = std::string(dir.path) + "/old.apk";
+    std::string new_apk_path = std::string(dir.path) + "/new.apk";
+    std::string metadata_path = std::string(dir.path) + "/old.metadata";
+    std::string patch_path = std::string(dir.path) + "/new.patch";
+
+    std::string unchanged(64 * 1024, 'u');
+    for (size_t i = 0; i < unchanged.size(); ++i) {
+        unchanged[i] = static_cast<char>(i * 7 % 251);
+    }
+    WriteApk(old_apk_path, {{"AndroidManifest.xml", "old manifest"},
+                            {"classes.dex", "old code"},
+                            {"res/raw/big", unchanged},
+                            {"res/raw/renamed", "contents that moved"}});
+    WriteApk(new_apk_path, {{"AndroidManifest.xml", "new manifest"},
+                            {"res/raw/moved", "contents that moved"},
+                            {"classes.dex", "new code"},
+                            {"res/raw/big", unchanged}});
+
+    APKMetaData old_metadata;
+    std::string error;
+    ASSERT_TRUE(DeployPatchGenerator::GetApkMetaData(old_apk_path.c_str(), &old_metadata, &error))
+            << error;
+    WriteDelimitedMetaData(metadata_path, old_metadata);
+
+    DeployPatchGenerator generator(false);
+    ASSERT_TRUE(generator.CreatePatch(new_apk_path.c_str(), metadata_path.c_str(),
+                                      patch_path.c_str(), &error))
+            << error;
+
+    std::string old_apk, new_apk, patch;
+    ASSERT_TRUE(android::base::ReadFileToString(old_apk_path, &old_apk));
+    ASSERT_TRUE(android::base::ReadFileToString(new_apk_path, &new_apk));
+    ASSERT_TRUE(android::base::ReadFileToString(patch_path, &patch));
+
+    size_t reused_bytes;
+    EXPECT_EQ(new_apk, ApplyPatch(old_apk, patch, &reused_bytes));
+
+    // The big resource and the renamed one come from the old APK.
+    EXPECT_LT(patch.size(), new_apk.size());
+    size_t expected_reused_bytes = 0;
+    for (const auto& entry : old_metadata.entries()) {
+        if (entry.filename() == "res/raw/big" || entry.filename() == "res/raw/renamed") {
+            expected_reused_bytes += entry.compressedsize();
+        }
+    }
+    EXPECT_EQ(expected_reused_bytes, reused_bytes);
+}
+
+TEST(DeployPatchGenerator, NothingInCommon) {
+    TemporaryDir dir;
+    std::string old_apk_path = std::string(dir.path) + "/old.apk";
+    std::string new_apk_path = std::string(dir.path) + "/new.apk";
+    std::string metadata_path = std::string(dir.path) + "/old.metadata";
+    std::string patch_path = std::string(dir.path) + "/new.patch";
+
+    WriteApk(old_apk_path, {{"classes.dex", "old code"}});
+    WriteApk(new_apk_path, {{"classes.dex", "new code"}});
+
+    APKMetaData old_metadata;
+    std::string error;
+    ASSERT_TRUE(DeployPatchGenerator::GetApkMetaData(old_apk_path.c_str(), &old_metadata, &error));
+    WriteDelimitedMetaData(metadata_path, old_metadata);
+
+    DeployPatchGenerator generator(false);
+    ASSERT_TRUE(generator.CreatePatch(new_apk_path.c_str(), metadata_path.c_str(),
+                                      patch_path.c_str(), &error))
+            << error;
+
+    std::string old_apk, new_apk, patch;
+    ASSERT_TRUE(android::base::ReadFileToString(old_apk_path, &old_apk));
+    ASSERT_TRUE(android::base::ReadFileToString(new_apk_path, &new_apk));
+    ASSERT_TRUE(android::base::ReadFileToString(patch_path, &patch));
+
+    size_t reused_bytes;
+    EXPECT_EQ(new_apk, ApplyPatch(old_apk, patch, &reused_bytes));
+    EXPECT_EQ(0U, reused_bytes);
+}
+
+TEST(DeployPatchGenerator, BadMetaData) {
+    TemporaryDir dir;
+    std::string apk_path = std::string(dir.path) + "/test.apk";
+    std::string metadata_path = std::string(dir.path) + "/bad.metadata";
+    std::string patch_path = std::string(dir.path) + "/test.patch";
+    WriteApk(apk_path, {{"classes.dex", "code"}});
+    ASSERT_TRUE(android::base::WriteStringToFile("\x7f garbage", metadata_path));
+
+    DeployPatchGenerator generator(false);
+    std::string error;
+    EXPECT_FALSE(generator.CreatePatch(apk_path.c_str(), metadata_path.c_str(),
+                                       patch_path.c_str(), &error));
+    EXPECT_FALSE(error.empty());
+}
@@ -27,13 +27,19 @@
 #include <string.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#endif
+
 #include <atomic>
 #include <deque>
 #include <functional>
 #include <list>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <variant>
 #include <vector>
@@ -58,26 +64,29 @@
 #define FDE_PENDING    0x0200
 #define FDE_CREATED    0x0400
 
-struct PollNode {
-  fdevent* fde;
-  adb_pollfd pollfd;
+// The mechanism used to wait for events on the installed fdevents.
+class FdeventBackend {
+  public:
+    virtual ~FdeventBackend() = default;
 
-  explicit PollNode(fdevent* fde) : fde(fde) {
-      memset(&pollfd, 0, sizeof(pollfd));
-      pollfd.fd = fde->fd.get();
+    virtual void Register(fdevent* fde) = 0;
+    virtual void Unregister(fdevent* fde) = 0;
 
-#if defined(__linux__)
-      // Always enable POLLRDHUP, so the host server can take action when some clients disconnect.
-      // Then we can avoid leaving many sockets in CLOSE_WAIT state. See http://b/23314034.
-      pollfd.events = POLLRDHUP;
-#endif
-  }
+    // Sets the FDE_READ and FDE_WRITE events |fde| should be woken up for.
+    virtual void Update(fdevent* fde, unsigned events) = 0;
+
+    // Waits for up to |timeout| (or forever), appending any fdevents with events to |result|.
+    virtual void Wait(std::optional<std::chrono::milliseconds> timeout,
+                      std::vector<std::pair<fdevent*, unsigned>>* result) = 0;
 };
 
 // All operations to fdevent should happen only in the main thread.
 // That's why we don't need a lock for fdevent.
-static auto& g_poll_node_map = *new std::unordered_map<int, PollNode>();
+static auto& g_fdevent_map = *new std::unordered_map<int, fdevent*>();
+static auto& g_timeout_set = *new std::unordered_set<fdevent*>();
 static auto& g_pending_list = *new std::list<fdevent*>();
+static auto& g_backend = *new std::unique_ptr<FdeventBackend>();
+static bool g_use_poll = false;
 static std::atomic<bool> terminate_loop(false);
 static bool main_thread_valid;
 static uint64_t main_thread_id;
@@ -100,6 +109,258 @@ void set_main_thread() {
     main_thread_id = android::base::GetThreadId();
 }
 
+static std::string dump_pollfds(const std::vector<adb_pollfd>& pollfds) {
+    std::string result;
+    for (const auto& pollfd : pollfds) {
+        std::string op;
+        if (pollfd.events & POLLIN) {
+            op += "R";
+        }
+        if (pollfd.events & POLLOUT) {
+            op += "W";
+        }
+        android::base::StringAppendF(&result, " %d(%s)", pollfd.fd, op.c_str());
+    }
+    return result;
+}
+
+class PollBackend : public FdeventBackend {
+  public:
+    void Register(fdevent* fde) override {
+        poll_node_map_.emplace(fde->fd.get(), PollNode(fde));
+    }
+
+    void Unregister(fdevent* fde) override {
+        poll_node_map_.erase(fde->fd.get());
+    }
+
+    void Update(fdevent* fde, unsigned events) override {
+        auto it = poll_node_map_.find(fde->fd.get());
+        CHECK(it != poll_node_map_.end());
+        PollNode& node = it->second;
+        if (events & FDE_READ) {
+            node.pollfd.events |= POLLIN;
+        } else {
+            node.pollfd.events &= ~POLLIN;
+        }
+
+        if (events & FDE_WRITE) {
+            node.pollfd.events |= POLLOUT;
+        } else {
+            node.pollfd.events &= ~POLLOUT;
+        }
+    }
+
+    void Wait(std::optional<std::chrono::milliseconds> timeout,
+              std::vector<std::pair<fdevent*, unsigned>>* result) override {
+        std::vector<adb_pollfd> pollfds;
+        for (const auto& pair : poll_node_map_) {
+            pollfds.push_back(pair.second.pollfd);
+        }
+        CHECK_GT(pollfds.size(), 0u);
+        D("poll(), pollfds = %s", dump_pollfds(pollfds).c_str());
+
+        int timeout_ms;
+        if (!timeout) {
+            timeout_ms = -1;
+        } else {
+            timeout_ms = timeout->count();
+        }
+
+        int ret = adb_poll(&pollfds[0], pollfds.size(), timeout_ms);
+        if (ret == -1) {
+            PLOG(ERROR) << "poll(), ret = " << ret;
+            return;
+        }
+
+        for (const auto& pollfd : pollfds) {
+            if (pollfd.revents != 0) {
+                D("for fd %d, revents = %x", pollfd.fd, pollfd.revents);
+            }
+            unsigned events = 0;
+            if (pollfd.revents & POLLIN) {
+                events |= FDE_READ;
+            }
+            if (pollfd.revents & POLLOUT) {
+                events |= FDE_WRITE;
+            }
+            if (pollfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                // We fake a read, as the rest of the code assumes that errors will
+                // be detected at that point.
+                events |= FDE_READ | FDE_ERROR;
+            }
+#if defined(__linux__)
+            if (pollfd.revents & POLLRDHUP) {
+                events |= FDE_READ | FDE_ERROR;
+            }
+#endif
+            if (events != 0) {
+                auto it = poll_node_map_.find(pollfd.fd);
+                CHECK(it != poll_node_map_.end());
+                CHECK_EQ(it->second.fde->fd.get(), pollfd.fd);
+                result->emplace_back(it->second.fde, events);
+            }
+        }
+    }
+
+  private:
+    struct PollNode {
+        fdevent* fde;
+        adb_pollfd pollfd;
+
+        explicit PollNode(fdevent* fde) : fde(fde) {
+            memset(&pollfd, 0, sizeof(pollfd));
+            pollfd.fd = fde->fd.get();
+
+#if defined(__linux__)
+            // Always enable POLLRDHUP, so the host server can take action when some clients
+            // disconnect. Then we can avoid leaving many sockets in CLOSE_WAIT state.
+            // See http://b/23314034.
+            pollfd.events = POLLRDHUP;
+#endif
+        }
+    };
+
+    std::unordered_map<int, PollNode> poll_node_map_;
+};
+
+#if defined(__linux__)
+// Unlike PollBackend, the cost of a wakeup doesn't depend on how many fdevents are installed,
+// only on how many of them have events.
+//
+// This is level-triggered, like poll: callers are allowed to leave data unread (or unwritten)
+// and expect to be woken up again. The kernel's interest set is only touched when an fdevent's
+// requested events change.
+class EpollBackend : public FdeventBackend {
+  public:
+    EpollBackend() : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)) {
+        if (epoll_fd_ == -1) {
+            PLOG(FATAL) << "failed to create epoll fd";
+        }
+    }
+
+    void Register(fdevent* fde) override {
+        struct epoll_event ev = MakeEvent(fde, 0);
+        if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_ADD, fde->fd.get(), &ev) != 0) {
+            // poll(2) accepts fds that epoll(7) rejects: regular files and the like (which are
+            // always ready), and invalid fds (which get POLLNVAL). Emulate poll for those.
+            D("epoll_ctl(EPOLL_CTL_ADD) failed for fd %d: %s", fde->fd.get(), strerror(errno));
+            unpollable_.emplace(fde, errno);
+        }
+    }
+
+    void Unregister(fdevent* fde) override {
+        if (unpollable_.erase(fde) != 0) {
+            return;
+        }
+        if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_DEL, fde->fd.get(), nullptr) != 0) {
+            PLOG(ERROR) << "failed to remove fd " << fde->fd.get() << " from epoll set";
+        }
+    }
+
+    void Update(fdevent* fde, unsigned events) override {
+        if (unpollable_.count(fde) != 0) {
+            return;
+        }
+        struct epoll_event ev = MakeEvent(fde, events);
+        if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_MOD, fde->fd.get(), &ev) != 0) {
+            PLOG(FATAL) << "failed to update epoll events for fd " << fde->fd.get();
+        }
+    }
+
+    void Wait(std::optional<std::chrono::milliseconds> timeout,
+              std::vector<std::pair<fdevent*, unsigned>>* result) override {
+        // fds that epoll won't take are serviced here, once per call. Only skip blocking when one
+        // of them actually has something to report: an fd that's registered but not asking for
+        // events mustn't turn the loop into a busy-wait.
+        for (const auto& [fde, error] : unpollable_) {
+            unsigned events;
+            if (error == EPERM) {
+                events = fde->state & (FDE_READ | FDE_WRITE);
+            } else {
+                events = FDE_READ | FDE_ERROR;
+            }
+            if (events != 0) {
+                result->emplace_back(fde, events);
+            }
+        }
+
+        int timeout_ms;
+        if (!result->empty()) {
+            timeout_ms = 0;
+        } else if (!timeout) {
+            timeout_ms = -1;
+        } else {
+            timeout_ms = timeout->count();
+        }
+
+        // Anything beyond the first kMaxEvents will still be ready next time around.
+        int ret = epoll_wait(epoll_fd_.get(), events_, kMaxEvents, timeout_ms);
+        if (ret == -1) {
+            PLOG(ERROR) << "epoll_wait(), ret = " << ret;
+            return;
+        }
+
+        for (int i = 0; i < ret; ++i) {
+            const struct epoll_event& ev = events_[i];
+            fdevent* fde = static_cast<fdevent*>(ev.data.ptr);
+            D("for fd %d, events = %x", fde->fd.get(), ev.events);
+
+            unsigned events = 0;
+            if (ev.events & EPOLLIN) {
+                events |= FDE_READ;
+            }
+            if (ev.events & EPOLLOUT) {
+                events |= FDE_WRITE;
+            }
+            if (ev.events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+                // As with poll, fake a read so that the error is noticed.
+                events |= FDE_READ | FDE_ERROR;
+            }
+            if (events != 0) {
+                result->emplace_back(fde, events);
+            }
+        }
+    }
+
+  private:
+    static struct epoll_event MakeEvent(fdevent* fde, unsigned events) {
+        struct epoll_event ev = {};
+        // See the comment about POLLRDHUP in PollBackend.
+        ev.events = EPOLLRDHUP;
+        if (events & FDE_READ) {
+            ev.events |= EPOLLIN;
+        }
+        if (events & FDE_WRITE) {
+            ev.events |= EPOLLOUT;
+        }
+        ev.data.ptr = fde;
+        return ev;
+    }
+
+    static constexpr int kMaxEvents = 256;
+
+    unique_fd epoll_fd_;
+    struct epoll_event events_[kMaxEvents];
+
+    // fdevents that epoll wouldn't take, and the errno it gave.
+    std::unordered_map<fdevent*, int> unpollable_;
+};
+#endif
+
+static FdeventBackend* fdevent_backend() {
+    if (!g_backend) {
+#if defined(__linux__)
+        if (!g_use_poll) {
+            g_backend = std::make_unique<EpollBackend>();
+            return g_backend.get();
+        }
+#endif
+        g_backend = std::make_unique<PollBackend>();
+    }
+    return g_backend.get();
+}
+
 static std::string dump_fde(const fdevent* fde) {
     std::string state;
     if (fde->state & FDE_ACTIVE) {
@@ -141,8 +402,9 @@ static fdevent* fdevent_create_impl(int fd, F func, void* arg) {
         // to handle it.
         LOG(ERROR) << "failed to set non-blocking mode for fd " << fd;
     }
-    auto pair = g_poll_node_map.emplace(fde->fd.get(), PollNode(fde));
+    auto pair = g_fdevent_map.emplace(fde->fd.get(), fde);
     CHECK(pair.second) << "install existing fd " << fd;
+    fdevent_backend()->Register(fde);
 
     fde->state |= FDE_CREATED;
     return fde;
@@ -166,9 +428,10 @@ unique_fd fdevent_release(fdevent* fde) {
         LOG(FATAL) << "destroying fde not created by fdevent_create(): " << dump_fde(fde);
     }
 
-    unique_fd result = std::move(fde->fd);
     if (fde->state & FDE_ACTIVE) {
-        g_poll_node_map.erase(result.get());
+        fdevent_backend()->Unregister(fde);
+        g_fdevent_map.erase(fde->fd.get());
+        g_timeout_set.erase(fde);
 
         if (fde->state & FDE_PENDING) {
             g_pending_list.remove(fde);
@@ -177,6 +440,7 @@ unique_fd fdevent_release(fdevent* fde) {
         fde->events = 0;
     }
 
+    unique_fd result = std::move(fde->fd);
     delete fde;
     return result;
 }
@@ -187,20 +451,7 @@ void fdevent_destroy(fdevent* fde) {
 }
 
 static void fdevent_update(fdevent* fde, unsigned events) {
-    auto it = g_poll_node_map.find(fde->fd.get());
-    CHECK(it != g_poll_node_map.end());
-    PollNode& node = it->second;
-    if (events & FDE_READ) {
-        node.pollfd.events |= POLLIN;
-    } else {
-        node.pollfd.events &= ~POLLIN;
-    }
-
-    if (events & FDE_WRITE) {
-        node.pollfd.events |= POLLOUT;
-    } else {
-        node.pollfd.events &= ~POLLOUT;
-    }
+    fdevent_backend()->Update(fde, events);
     fde->state = (fde->state & FDE_STATEMASK) | events;
 }
 
@@ -240,21 +491,11 @@ void fdevent_set_timeout(fdevent* fde, std::optional<std::chrono::milliseconds>
     check_main_thread();
     fde->timeout = timeout;
     fde->last_active = std::chrono::steady_clock::now();
-}
-
-static std::string dump_pollfds(const std::vector<adb_pollfd>& pollfds) {
-    std::string result;
-    for (const auto& pollfd : pollfds) {
-        std::string op;
-        if (pollfd.events & POLLIN) {
-            op += "R";
-        }
-        if (pollfd.events & POLLOUT) {
-            op += "W";
-        }
-        android::base::StringAppendF(&result, " %d(%s)", pollfd.fd, op.c_str());
+    if (timeout) {
+        g_timeout_set.insert(fde);
+    } else {
+        g_timeout_set.erase(fde);
     }
-    return result;
 }
 
 static std::optional<std::chrono::milliseconds> calculate_timeout() {
@@ -262,21 +503,17 @@ static std::optional<std::chrono::milliseconds> calculate_timeout() {
     auto now = std::chrono::steady_clock::now();
     check_main_thread();
 
-    for (const auto& [fd, pollnode] : g_poll_node_map) {
-        UNUSED(fd);
-        auto timeout_opt = pollnode.fde->timeout;
-        if (timeout_opt) {
-            auto deadline = pollnode.fde->last_active + *timeout_opt;
-            auto time_left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now);
-            if (time_left < std::chrono::milliseconds::zero()) {
-                time_left = std::chrono::milliseconds::zero();
-            }
+    for (fdevent* fde : g_timeout_set) {
+        auto deadline = fde->last_active + *fde->timeout;
+        auto time_left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now);
+        if (time_left < std::chrono::milliseconds::zero()) {
+            time_left = std::chrono::milliseconds::zero();
+        }
 
-            if (!result) {
-                result = time_left;
-            } else {
-                result = std::min(*result, time_left);
-            }
+        if (!result) {
+            result = time_left;
+        } else {
+            result = std::min(*result, time_left);
         }
     }
 
@@ -284,69 +521,28 @@ static std::optional<std::chrono::milliseconds> calculate_timeout() {
 }
 
 static void fdevent_process() {
-    std::vector<adb_pollfd> pollfds;
-    for (const auto& pair : g_poll_node_map) {
-        pollfds.push_back(pair.second.pollfd);
-    }
-    CHECK_GT(pollfds.size(), 0u);
-    D("poll(), pollfds = %s", dump_pollfds(pollfds).c_str());
-
-    auto timeout = calculate_timeout();
-    int timeout_ms;
-    if (!timeout) {
-        timeout_ms = -1;
-    } else {
-        timeout_ms = timeout->count();
-    }
-
-    int ret = adb_poll(&pollfds[0], pollfds.size(), timeout_ms);
-    if (ret == -1) {
-        PLOG(ERROR) << "poll(), ret = " << ret;
-        return;
-    }
+    static auto& backend_events = *new std::vector<std::pair<fdevent*, unsigned>>();
+    backend_events.clear();
+    fdevent_backend()->Wait(calculate_timeout(), &backend_events);
 
     auto post_poll = std::chrono::steady_clock::now();
 
-    for (const auto& pollfd : pollfds) {
-        if (pollfd.revents != 0) {
-            D("for fd %d, revents = %x", pollfd.fd, pollfd.revents);
-        }
-        unsigned events = 0;
-        if (pollfd.revents & POLLIN) {
-            events |= FDE_READ;
-        }
-        if (pollfd.revents & POLLOUT) {
-            events |= FDE_WRITE;
-        }
-        if (pollfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
-            // We fake a read, as the rest of the code assumes that errors will
-            // be detected at that point.
-            events |= FDE_READ | FDE_ERROR;
-        }
-#if defined(__linux__)
-        if (pollfd.revents & POLLRDHUP) {
-            events |= FDE_READ | FDE_ERROR;
-        }
-#endif
-        auto it = g_poll_node_map.find(pollfd.fd);
-        CHECK(it != g_poll_node_map.end());
-        fdevent* fde = it->second.fde;
-
-        if (events == 0) {
-            // Check for timeout.
-            if (fde->timeout) {
-                auto deadline = fde->last_active + *fde->timeout;
-                if (deadline < post_poll) {
-                    events |= FDE_TIMEOUT;
-                }
-            }
+    for (const auto& [fde, events] : backend_events) {
+        fde->events |= events;
+        fde->last_active = post_poll;
+        D("%s got events %x", dump_fde(fde).c_str(), events);
+        if (!(fde->state & FDE_PENDING)) {
+            fde->state |= FDE_PENDING;
+            g_pending_list.push_back(fde);
         }
+    }
 
-        if (events != 0) {
-            CHECK_EQ(fde->fd.get(), pollfd.fd);
-            fde->events |= events;
+    // Anything that got an event above has just had its deadline pushed back.
+    for (fdevent* fde : g_timeout_set) {
+        if (!(fde->state & FDE_PENDING) && fde->last_active + *fde->timeout < post_poll) {
+            fde->events |= FDE_TIMEOUT;
             fde->last_active = post_poll;
-            D("%s got events %x", dump_fde(fde).c_str(), events);
+            D("%s got events %x", dump_fde(fde).c_str(), FDE_TIMEOUT);
             fde->state |= FDE_PENDING;
             g_pending_list.push_back(fde);
         }
@@ -537,12 +733,14 @@ void fdevent_terminate_loop() {
 }
 
 size_t fdevent_installed_count() {
-    return g_poll_node_map.size();
+    return g_fdevent_map.size();
 }
 
 void fdevent_reset() {
-    g_poll_node_map.clear();
+    g_fdevent_map.clear();
+    g_timeout_set.clear();
     g_pending_list.clear();
+    g_backend.reset();
 
     std::lock_guard<std::mutex> lock(run_queue_mutex);
     run_queue_notify_fd.reset();
@@ -551,3 +749,7 @@ void fdevent_reset() {
     main_thread_valid = false;
     terminate_loop = false;
 }
+
+void fdevent_set_use_poll(bool use_poll) {
+    g_use_poll = use_poll;
+}
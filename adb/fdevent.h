@@ -87,4 +87,8 @@ size_t fdevent_installed_count();
 void fdevent_reset();
 void set_main_thread();
 
+// On Linux, fdevent uses epoll(7) rather than poll(2) by default. This switches between them,
+// taking effect at the next fdevent_reset(). Elsewhere, poll(2) is always used.
+void fdevent_set_use_poll(bool use_poll);
+
 #endif
@@ -18,6 +18,8 @@
 
 #include <gtest/gtest.h>
 
+#include <stdio.h>
+
 #include <chrono>
 #include <limits>
 #include <memory>
@@ -116,7 +118,9 @@ TEST_F(FdeventTest, fdevent_terminate) {
 }
 
 TEST_F(FdeventTest, smoke) {
-    for (bool use_new_callback : {true, false}) {
+    for (auto [use_poll, use_new_callback] :
+         {std::pair(false, true), std::pair(false, false), std::pair(true, true)}) {
+        fdevent_set_use_poll(use_poll);
         fdevent_reset();
         const size_t PIPE_COUNT = 10;
         const size_t MESSAGE_LOOP_COUNT = 100;
@@ -357,3 +361,69 @@ TEST_F(FdeventTest, timeout) {
     ASSERT_LT(diff[1], delta.count() * 0.5);
     ASSERT_LT(diff[2], delta.count() * 0.5);
 }
+
+static void EchoCallback(int fd, unsigned events, void*) {
+    if (events & FDE_READ) {
+        char buf[64];
+        ssize_t rc = adb_read(fd, buf, sizeof(buf));
+        if (rc > 0) {
+            CHECK_EQ(rc, adb_write(fd, buf, rc));
+        }
+    }
+}
+
+// Not so much a test as a benchmark: how the latency of a round trip through the fdevent loop
+// grows with the number of other (idle) fdevents installed.
+TEST_F(FdeventTest, idle_fdevent_scaling) {
+    static constexpr size_t kRoundTrips = 2000;
+
+    for (bool use_poll : {true, false}) {
+#if !defined(__linux__)
+        // Without epoll, there's only one backend to measure.
+        if (!use_poll) continue;
+#endif
+        for (size_t idle_count : {0, 64, 256, 512}) {
+            fdevent_set_use_poll(use_poll);
+            fdevent_reset();
+
+            std::vector<fdevent*> fdes;
+            for (size_t i = 0; i < idle_count / 2; ++i) {
+                int fds[2];
+                ASSERT_EQ(0, adb_socketpair(fds));
+                for (int fd : fds) {
+                    fdes.push_back(fdevent_create(fd, EchoCallback, nullptr));
+                    fdevent_add(fdes.back(), FDE_READ);
+                }
+            }
+
+            int fds[2];
+            ASSERT_EQ(0, adb_socketpair(fds));
+            unique_fd client(fds[0]);
+            fdes.push_back(fdevent_create(fds[1], EchoCallback, nullptr));
+            fdevent_add(fdes.back(), FDE_READ);
+
+            PrepareThread();
+
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < kRoundTrips; ++i) {
+                char c = static_cast<char>(i);
+                ASSERT_TRUE(WriteFdExactly(client, &c, 1));
+                ASSERT_TRUE(ReadFdExactly(client, &c, 1));
+                ASSERT_EQ(static_cast<char>(i), c);
+            }
+            auto elapsed = std::chrono::steady_clock::now() - start;
+
+            printf("%s, %3zu idle fdevents: %6.2f us per round trip\n", use_poll ? " poll" : "epoll",
+                   idle_count,
+                   std::chrono::duration<double, std::micro>(elapsed).count() / kRoundTrips);
+
+            fdevent_run_on_main_thread([&fdes]() {
+                for (fdevent* fde : fdes) {
+                    fdevent_destroy(fde);
+                }
+            });
+            WaitForFdeventLoop();
+            TerminateThread();
+        }
+    }
+}
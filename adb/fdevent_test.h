@@ -55,6 +55,7 @@ class FdeventTest : public ::testing::Test {
     }
 
     void SetUp() override {
+        fdevent_set_use_poll(false);
         fdevent_reset();
         ASSERT_EQ(0u, fdevent_installed_count());
     }
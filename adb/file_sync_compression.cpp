@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TRACE_TAG SYNC
+
+#include "file_sync_compression.h"
+
+#include "adb_trace.h"
+
+// Size of the increments in which output buffers are grown.
+static constexpr size_t kChunkSize = 64 * 1024;
+
+// Don't make any decisions until we've seen this much input: the first few blocks are dominated
+// by deflate's startup costs and by the socket buffers soaking up writes.
+static constexpr uint64_t kMinimumSampleSize = 1024 * 1024;
+
+// Give up on data that doesn't shrink by at least this much.
+static constexpr double kMaximumUsefulRatio = 0.9;
+
+SyncDeflater::SyncDeflater() {
+    // Level 1 is several times faster than the default and gets most of the ratio on the kind
+    // of data we push (dex, native libraries, text).
+    valid_ = deflateInit(&stream_, 1) == Z_OK;
+}
+
+SyncDeflater::~SyncDeflater() {
+    if (valid_) {
+        deflateEnd(&stream_);
+    }
+}
+
+void SyncDeflater::RecordWriteTime(std::chrono::steady_clock::duration duration) {
+    write_time_ += duration;
+}
+
+void SyncDeflater::MaybeStopCompressing() {
+    if (!compressing_ || bytes_in_ < kMinimumSampleSize || bytes_out_ == 0) {
+        return;
+    }
+
+    double ratio = static_cast<double>(bytes_out_) / bytes_in_;
+    if (ratio > kMaximumUsefulRatio) {
+        D("sync: compression ratio %.2f, switching to stored blocks", ratio);
+        compressing_ = false;
+        level_change_pending_ = true;
+        return;
+    }
+
+    if (write_time_ == write_time_.zero()) {
+        return;
+    }
+
+    // If the link would have drained the uncompressed bytes faster than we could compress and
+    // send them, we're CPU-bound and compression is only slowing us down.
+    double uncompressed_write_time = write_time_.count() / ratio;
+    double compressed_time = (deflate_time_ + write_time_).count();
+    if (compressed_time >= uncompressed_write_time) {
+        D("sync: compression is CPU-bound (ratio %.2f), switching to stored blocks", ratio);
+        compressing_ = false;
+        level_change_pending_ = true;
+    }
+}
+
+bool SyncDeflater::Run(int flush, std::vector<char>* output) {
+    int rc;
+    do {
+        size_t offset = output->size();
+        output->resize(offset + kChunkSize);
+        stream_.next_out = reinterpret_cast<Bytef*>(output->data() + offset);
+        stream_.avail_out = kChunkSize;
+        rc = deflate(&stream_, flush);
+        output->resize(offset + kChunkSize - stream_.avail_out);
+        bytes_out_ += kChunkSize - stream_.avail_out;
+        if (rc == Z_STREAM_ERROR) {
+            return false;
+        }
+    } while (stream_.avail_out == 0);
+
+    return flush != Z_FINISH || rc == Z_STREAM_END;
+}
+
+bool SyncDeflater::Deflate(const void* data, size_t length, bool finish,
+                           std::vector<char>* output) {
+    if (!valid_) {
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    if (level_change_pending_) {
+        // deflateParams flushes the current block, and needs room in the output to do so.
+        int rc;
+        do {
+            size_t offset = output->size();
+            output->resize(offset + kChunkSize);
+            stream_.next_out = reinterpret_cast<Bytef*>(output->data() + offset);
+            stream_.avail_out = kChunkSize;
+            rc = deflateParams(&stream_, Z_NO_COMPRESSION, Z_DEFAULT_STRATEGY);
+            output->resize(offset + kChunkSize - stream_.avail_out);
+            bytes_out_ += kChunkSize - stream_.avail_out;
+        } while (rc == Z_BUF_ERROR && stream_.avail_out == 0);
+        if (rc == Z_STREAM_ERROR) {
+            return false;
+        }
+        // On Z_BUF_ERROR the old level is still in effect, so try again on the next call.
+        level_change_pending_ = rc != Z_OK;
+    }
+
+    stream_.next_in = reinterpret_cast<Bytef*>(const_cast<void*>(data));
+    stream_.avail_in = length;
+    bytes_in_ += length;
+    bool result = Run(finish ? Z_FINISH : Z_NO_FLUSH, output);
+
+    deflate_time_ += std::chrono::steady_clock::now() - start;
+    MaybeStopCompressing();
+    return result;
+}
+
+SyncInflater::SyncInflater() : buffer_(kChunkSize) {
+    valid_ = inflateInit(&stream_) == Z_OK;
+}
+
+SyncInflater::~SyncInflater() {
+    if (valid_) {
+        inflateEnd(&stream_);
+    }
+}
+
+bool SyncInflater::Inflate(const void* data, size_t length, const Sink& sink) {
+    if (!valid_) {
+        return false;
+    }
+
+    stream_.next_in = reinterpret_cast<Bytef*>(const_cast<void*>(data));
+    stream_.avail_in = length;
+    while (true) {
+        if (finished_) {
+            // Anything after the end of the stream is garbage.
+            return stream_.avail_in == 0;
+        }
+
+        stream_.next_out = reinterpret_cast<Bytef*>(buffer_.data());
+        stream_.avail_out = buffer_.size();
+        int rc = inflate(&stream_, Z_NO_FLUSH);
+        if (rc == Z_STREAM_END) {
+            finished_ = true;
+        } else if (rc == Z_BUF_ERROR) {
+            // No progress possible without more input.
+            return true;
+        } else if (rc != Z_OK) {
+            D("sync: inflate failed: %d", rc);
+            return false;
+        }
+
+        size_t produced = buffer_.size() - stream_.avail_out;
+        if (produced != 0 && !sink(buffer_.data(), produced)) {
+            return false;
+        }
+
+        if (stream_.avail_in == 0 && stream_.avail_out != 0) {
+            return true;
+        }
+    }
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <functional>
+#include <vector>
+
+#include <android-base/macros.h>
+
+#include <zlib.h>
+
+// Streaming deflate used for the ID_DATA payloads of ID_SEND_DEFLATE and ID_RECV_DEFLATE.
+//
+// The whole file is a single zlib stream split across as many ID_DATA chunks as needed; chunk
+// boundaries carry no meaning to the inflater.
+//
+// Compression is only worth it while the link, rather than the CPU, is the bottleneck. The
+// sender reports how long it spent writing compressed output to the socket via
+// RecordWriteTime(). If deflate() can't keep up with the rate at which the link drains
+// uncompressed data, or the data turns out to be incompressible, the stream switches to
+// storing (Z_NO_COMPRESSION) for the rest of the file. The stream format stays the same, so the
+// receiver doesn't need to know.
+class SyncDeflater {
+  public:
+    SyncDeflater();
+    ~SyncDeflater();
+
+    bool IsValid() const { return valid_; }
+
+    // Compresses |length| bytes of |data|, appending whatever output is ready to |output|.
+    // If |finish| is true, the stream is terminated and all remaining output is flushed.
+    bool Deflate(const void* data, size_t length, bool finish, std::vector<char>* output);
+
+    // Records the time taken to write compressed output to the link.
+    void RecordWriteTime(std::chrono::steady_clock::duration duration);
+
+    bool compressing() const { return compressing_; }
+    uint64_t bytes_in() const { return bytes_in_; }
+    uint64_t bytes_out() const { return bytes_out_; }
+
+  private:
+    void MaybeStopCompressing();
+    bool Run(int flush, std::vector<char>* output);
+
+    z_stream stream_ = {};
+    bool valid_ = false;
+    bool compressing_ = true;
+    bool level_change_pending_ = false;
+
+    uint64_t bytes_in_ = 0;
+    uint64_t bytes_out_ = 0;
+    std::chrono::steady_clock::duration deflate_time_ = std::chrono::steady_clock::duration::zero();
+    std::chrono::steady_clock::duration write_time_ = std::chrono::steady_clock::duration::zero();
+
+    DISALLOW_COPY_AND_ASSIGN(SyncDeflater);
+};
+
+class SyncInflater {
+  public:
+    // Called with each run of decompressed output. Returns false to abort.
+    using Sink = std::function<bool(const char* data, size_t length)>;
+
+    SyncInflater();
+    ~SyncInflater();
+
+    bool IsValid() const { return valid_; }
+
+    // Decompresses |length| bytes of |data|, passing the output to |sink|.
+    // Returns false on corrupt input, trailing data after the end of the stream, or if |sink|
+    // returned false.
+    bool Inflate(const void* data, size_t length, const Sink& sink);
+
+    // Returns true once the end of the zlib stream has been seen.
+    bool finished() const { return finished_; }
+
+  private:
+    z_stream stream_ = {};
+    bool valid_ = false;
+    bool finished_ = false;
+    std::vector<char> buffer_;
+
+    DISALLOW_COPY_AND_ASSIGN(SyncInflater);
+};
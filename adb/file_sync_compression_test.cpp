@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "file_sync_compression.h"
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+static std::string MakeText(size_t length) {
+    std::string result;
+    while (result.size() < length) {
+        result += "the quick brown fox jumps over the lazy dog ";
+        result += std::to_string(result.size());
+        result += "\n";
+    }
+    result.resize(length);
+    return result;
+}
+
+static std::string MakeNoise(size_t length) {
+    std::mt19937 rng(42);
+    std::string result(length, '\0');
+    for (char& c : result) {
+        c = static_cast<char>(rng());
+    }
+    return result;
+}
+
+// Compresses |input| in |chunk_size| pieces, and inflates the result in |chunk_size| pieces.
+static std::string RoundTrip(const std::string& input, size_t chunk_size,
+                             SyncDeflater* deflater = nullptr) {
+    SyncDeflater local_deflater;
+    if (!deflater) deflater = &local_deflater;
+
+    std::vector<char> compressed;
+    size_t offset = 0;
+    while (true) {
+        size_t length = std::min(chunk_size, input.size() - offset);
+        EXPECT_TRUE(deflater->Deflate(input.data() + offset, length, length == 0, &compressed));
+        if (length == 0) break;
+        offset += length;
+    }
+
+    SyncInflater inflater;
+    std::string output;
+    auto sink = [&output](const char* data, size_t length) {
+        output.append(data, length);
+        return true;
+    };
+    for (offset = 0; offset < compressed.size(); offset += chunk_size) {
+        size_t length = std::min(chunk_size, compressed.size() - offset);
+        EXPECT_TRUE(inflater.Inflate(compressed.data() + offset, length, sink));
+    }
+    EXPECT_TRUE(inflater.finished());
+    return output;
+}
+
+TEST(file_sync_compression, empty) {
+    ASSERT_EQ("", RoundTrip("", 1024));
+}
+
+TEST(file_sync_compression, round_trip) {
+    std::string text = MakeText(4 * 1024 * 1024);
+    SyncDeflater deflater;
+    ASSERT_EQ(text, RoundTrip(text, 64 * 1024, &deflater));
+    ASSERT_LT(deflater.bytes_out(), deflater.bytes_in() / 2);
+}
+
+TEST(file_sync_compression, round_trip_small_chunks) {
+    std::string text = MakeText(256 * 1024);
+    ASSERT_EQ(text, RoundTrip(text, 7));
+}
+
+TEST(file_sync_compression, incompressible) {
+    std::string noise = MakeNoise(4 * 1024 * 1024);
+    SyncDeflater deflater;
+    ASSERT_EQ(noise, RoundTrip(noise, 64 * 1024, &deflater));
+    ASSERT_FALSE(deflater.compressing());
+}
+
+TEST(file_sync_compression, cpu_bound) {
+    // Pretend that the link is infinitely fast: compression can only slow things down.
+    std::string text = MakeText(4 * 1024 * 1024);
+    SyncDeflater deflater;
+    std::vector<char> compressed;
+    for (size_t offset = 0; offset < text.size(); offset += 64 * 1024) {
+        ASSERT_TRUE(deflater.Deflate(text.data() + offset, 64 * 1024, false, &compressed));
+        deflater.RecordWriteTime(std::chrono::nanoseconds(1));
+    }
+    ASSERT_TRUE(deflater.Deflate(nullptr, 0, true, &compressed));
+    ASSERT_FALSE(deflater.compressing());
+
+    SyncInflater inflater;
+    std::string output;
+    ASSERT_TRUE(inflater.Inflate(compressed.data(), compressed.size(),
+                                 [&output](const char* data, size_t length) {
+                                     output.append(data, length);
+                                     return true;
+                                 }));
+    ASSERT_TRUE(inflater.finished());
+    ASSERT_EQ(text, output);
+}
+
+TEST(file_sync_compression, truncated) {
+    std::string text = MakeText(64 * 1024);
+    SyncDeflater deflater;
+    std::vector<char> compressed;
+    ASSERT_TRUE(deflater.Deflate(text.data(), text.size(), true, &compressed));
+
+    SyncInflater inflater;
+    auto sink = [](const char*, size_t) { return true; };
+    ASSERT_TRUE(inflater.Inflate(compressed.data(), compressed.size() - 4, sink));
+    ASSERT_FALSE(inflater.finished());
+}
+
+TEST(file_sync_compression, trailing_garbage) {
+    std::string text = MakeText(1024);
+    SyncDeflater deflater;
+    std::vector<char> compressed;
+    ASSERT_TRUE(deflater.Deflate(text.data(), text.size(), true, &compressed));
+    compressed.push_back('x');
+
+    SyncInflater inflater;
+    auto sink = [](const char*, size_t) { return true; };
+    ASSERT_FALSE(inflater.Inflate(compressed.data(), compressed.size(), sink));
+}
+
+TEST(file_sync_compression, sink_failure) {
+    std::string text = MakeText(1024);
+    SyncDeflater deflater;
+    std::vector<char> compressed;
+    ASSERT_TRUE(deflater.Deflate(text.data(), text.size(), true, &compressed));
+
+    SyncInflater inflater;
+    auto sink = [](const char*, size_t) { return false; };
+    ASSERT_FALSE(inflater.Inflate(compressed.data(), compressed.size(), sink));
+}
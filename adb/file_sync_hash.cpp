@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "file_sync_hash.h"
+
+#include <errno.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include <android-base/file.h>
+
+// Below this many blocks per thread, starting threads costs more than it saves.
+static constexpr size_t kMinimumBlocksPerThread = 64;
+
+SyncHash SyncHashBlock(const void* data, size_t length) {
+    SyncHash result;
+    SHA256(reinterpret_cast<const uint8_t*>(data), length, result.data());
+    return result;
+}
+
+SyncHash SyncHashFile(const std::vector<SyncHash>& block_hashes) {
+    SyncHash result;
+    SHA256(reinterpret_cast<const uint8_t*>(block_hashes.data()),
+           block_hashes.size() * sizeof(SyncHash), result.data());
+    return result;
+}
+
+bool SyncHashBlocks(int fd, uint64_t size, size_t thread_count,
+                    std::vector<SyncHash>* block_hashes) {
+    size_t block_count = (size + kSyncHashBlockSize - 1) / kSyncHashBlockSize;
+    block_hashes->resize(block_count);
+
+    // std::thread::hardware_concurrency() may return 0, and clamp() needs lo <= hi.
+    thread_count = std::max<size_t>(1, thread_count);
+    thread_count = std::clamp<size_t>(block_count / kMinimumBlocksPerThread, 1, thread_count);
+    size_t blocks_per_thread = (block_count + thread_count - 1) / thread_count;
+
+    std::atomic<bool> failed(false);
+    std::atomic<int> saved_errno(0);
+
+    // Each thread takes a contiguous range of blocks, to keep the reads sequential.
+    auto hash_range = [&](size_t first_block) {
+        std::vector<char> buffer(kSyncHashBlockSize);
+        size_t last_block = std::min(first_block + blocks_per_thread, block_count);
+        for (size_t i = first_block; i < last_block && !failed; ++i) {
+            uint64_t offset = static_cast<uint64_t>(i) * kSyncHashBlockSize;
+            size_t length = std::min<uint64_t>(kSyncHashBlockSize, size - offset);
+            errno = EIO;
+            if (!android::base::ReadFullyAtOffset(fd, buffer.data(), length, offset)) {
+                saved_errno = errno;
+                failed = true;
+                return;
+            }
+            (*block_hashes)[i] = SyncHashBlock(buffer.data(), length);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; ++i) {
+        threads.emplace_back(hash_range, i * blocks_per_thread);
+    }
+    hash_range(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    if (failed) {
+        errno = saved_errno;
+        return false;
+    }
+    return true;
+}
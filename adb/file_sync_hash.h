@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <vector>
+
+#include <openssl/sha.h>
+
+// Content hashes used by ID_HASH and ID_PATCH to work out which parts of a file need updating.
+//
+// A file is split into kSyncHashBlockSize-byte blocks (the last one may be short), each of which
+// is hashed with SHA-256. The hash of the whole file is the SHA-256 of its concatenated block
+// hashes, so that the blocks can be hashed in any order.
+constexpr size_t kSyncHashBlockSize = 64 * 1024;
+
+using SyncHash = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
+
+SyncHash SyncHashBlock(const void* data, size_t length);
+SyncHash SyncHashFile(const std::vector<SyncHash>& block_hashes);
+
+// Hashes the first |size| bytes of |fd| into |block_hashes|, spreading large files across up to
+// |thread_count| threads. |fd| must be a real file descriptor (on Windows, from unix_open).
+// Returns false and sets errno on failure.
+bool SyncHashBlocks(int fd, uint64_t size, size_t thread_count,
+                    std::vector<SyncHash>* block_hashes);
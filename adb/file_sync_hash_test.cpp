@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "file_sync_hash.h"
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+
+static std::string MakeNoise(size_t length) {
+    std::mt19937 rng(42);
+    std::string result(length, '\0');
+    for (char& c : result) {
+        c = static_cast<char>(rng());
+    }
+    return result;
+}
+
+static std::vector<SyncHash> HashContents(const std::string& contents, size_t thread_count) {
+    TemporaryFile tf;
+    EXPECT_TRUE(android::base::WriteStringToFd(contents, tf.fd));
+    std::vector<SyncHash> result;
+    EXPECT_TRUE(SyncHashBlocks(tf.fd, contents.size(), thread_count, &result));
+    return result;
+}
+
+TEST(file_sync_hash, empty) {
+    std::vector<SyncHash> blocks = HashContents("", 4);
+    ASSERT_TRUE(blocks.empty());
+    ASSERT_EQ(SyncHashFile(blocks), SyncHashBlock("", 0));
+}
+
+TEST(file_sync_hash, blocks) {
+    std::string contents = MakeNoise(3 * kSyncHashBlockSize + 123);
+    std::vector<SyncHash> blocks = HashContents(contents, 1);
+    ASSERT_EQ(4U, blocks.size());
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        std::string block = contents.substr(i * kSyncHashBlockSize, kSyncHashBlockSize);
+        ASSERT_EQ(SyncHashBlock(block.data(), block.size()), blocks[i]) << "block " << i;
+    }
+}
+
+TEST(file_sync_hash, threads) {
+    // Large enough to be split between threads, with a short last block.
+    std::string contents = MakeNoise(1000 * kSyncHashBlockSize + 1);
+    std::vector<SyncHash> serial = HashContents(contents, 1);
+    ASSERT_EQ(1001U, serial.size());
+    ASSERT_EQ(serial, HashContents(contents, 3));
+    ASSERT_EQ(serial, HashContents(contents, 64));
+
+    // std::thread::hardware_concurrency() can return 0.
+    ASSERT_EQ(serial, HashContents(contents, 0));
+}
+
+TEST(file_sync_hash, changed_block) {
+    std::string contents = MakeNoise(8 * kSyncHashBlockSize);
+    std::vector<SyncHash> before = HashContents(contents, 1);
+    contents[5 * kSyncHashBlockSize + 17] ^= 1;
+    std::vector<SyncHash> after = HashContents(contents, 1);
+
+    ASSERT_NE(SyncHashFile(before), SyncHashFile(after));
+    for (size_t i = 0; i < before.size(); ++i) {
+        if (i == 5) {
+            ASSERT_NE(before[i], after[i]);
+        } else {
+            ASSERT_EQ(before[i], after[i]) << "block " << i;
+        }
+    }
+}
+
+TEST(file_sync_hash, short_file) {
+    // Asking for more than the file contains is an error.
+    TemporaryFile tf;
+    ASSERT_TRUE(android::base::WriteStringToFd("hello", tf.fd));
+    std::vector<SyncHash> blocks;
+    ASSERT_FALSE(SyncHashBlocks(tf.fd, kSyncHashBlockSize, 1, &blocks));
+}
@@ -31,6 +31,19 @@
 #define ID_FAIL MKID('F', 'A', 'I', 'L')
 #define ID_QUIT MKID('Q', 'U', 'I', 'T')
 
+// Like ID_SEND and ID_RECV, but the concatenated ID_DATA payloads form a single zlib stream.
+#define ID_SEND_DEFLATE MKID('S', 'N', 'D', 'Z')
+#define ID_RECV_DEFLATE MKID('R', 'C', 'V', 'Z')
+
+// Lists a whole directory tree, replying with an ID_DENT_V2 for each entry.
+#define ID_LIST_RECURSIVE MKID('R', 'L', 'S', 'T')
+#define ID_DENT_V2 MKID('D', 'N', 'T', '2')
+
+// Content hashing (see file_sync_hash.h), and updating only parts of a file.
+#define ID_HASH MKID('H', 'A', 'S', 'H')
+#define ID_PATCH MKID('P', 'T', 'C', 'H')
+#define ID_BLOCK MKID('B', 'L', 'C', 'K')
+
 struct SyncRequest {
     uint32_t id;           // ID_STAT, et cetera.
     uint32_t path_length;  // <= 1024
@@ -65,6 +78,34 @@ union syncmsg {
         uint32_t time;
         uint32_t namelen;
     } dent;
+    struct __attribute__((packed)) {
+        uint32_t id;
+        uint64_t dev;
+        uint64_t ino;
+        uint32_t mode;
+        uint32_t nlink;
+        uint32_t uid;
+        uint32_t gid;
+        uint64_t size;
+        int64_t atime;
+        int64_t mtime;
+        int64_t ctime;
+        uint32_t target_mode;  // For symlinks, the mode of the target, or 0 if it's dangling.
+        uint32_t namelen;      // Followed by the path relative to the listed directory.
+    } dent_v2;
+    struct __attribute__((packed)) {
+        uint32_t id;
+        uint32_t error;
+        uint64_t size;
+        uint32_t block_size;
+        uint32_t block_count;  // Followed by 'block_count' 32-byte block hashes.
+        uint8_t file_hash[32];
+    } hash;
+    struct __attribute__((packed)) {
+        uint32_t id;
+        uint32_t size;
+        uint64_t offset;  // Followed by 'size' bytes of data.
+    } block;
     struct __attribute__((packed)) {
         uint32_t id;
         uint32_t size;
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "framebuffer_delta.h"
+
+#include <string.h>
+
+#include <functional>
+#include <string_view>
+
+#include <android-base/stringprintf.h>
+
+#include <zlib.h>
+
+FramebufferTiling::FramebufferTiling(uint32_t width, uint32_t height, uint32_t bytes_per_pixel)
+    : width_(width),
+      height_(height),
+      bytes_per_pixel_(bytes_per_pixel),
+      tiles_x_((width + kFramebufferTileSize - 1) / kFramebufferTileSize),
+      tiles_y_((height + kFramebufferTileSize - 1) / kFramebufferTileSize) {}
+
+size_t FramebufferTiling::TileSize(uint32_t tile) const {
+    size_t size = 0;
+    ForEachRow(tile, [&size](size_t, size_t length) { size += length; });
+    return size;
+}
+
+FramebufferDeltaEncoder::FramebufferDeltaEncoder(uint32_t width, uint32_t height,
+                                                 uint32_t bytes_per_pixel)
+    : tiling_(width, height, bytes_per_pixel), tile_hashes_(tiling_.tile_count()) {}
+
+bool FramebufferDeltaEncoder::Encode(const char* frame, bool keyframe, std::vector<char>* packet) {
+    keyframe |= !have_previous_;
+    have_previous_ = true;
+
+    tiles_.clear();
+    last_tile_count_ = 0;
+    for (uint32_t tile = 0; tile < tiling_.tile_count(); ++tile) {
+        uint64_t hash = 0;
+        tiling_.ForEachRow(tile, [&](size_t offset, size_t length) {
+            hash = hash * 0x9e3779b97f4a7c15ULL ^
+                   std::hash<std::string_view>()(std::string_view(frame + offset, length));
+        });
+        if (!keyframe && hash == tile_hashes_[tile]) {
+            continue;
+        }
+        tile_hashes_[tile] = hash;
+
+        size_t index_offset = tiles_.size();
+        tiles_.resize(index_offset + sizeof(tile));
+        memcpy(tiles_.data() + index_offset, &tile, sizeof(tile));
+        tiling_.ForEachRow(tile, [&](size_t offset, size_t length) {
+            tiles_.insert(tiles_.end(), frame + offset, frame + offset + length);
+        });
+        ++last_tile_count_;
+    }
+
+    packet->clear();
+    if (last_tile_count_ == 0) {
+        return true;
+    }
+
+    uLongf compressed_size = compressBound(tiles_.size());
+    packet->resize(sizeof(FramebufferFrameHeader) + compressed_size);
+    if (compress2(reinterpret_cast<Bytef*>(packet->data() + sizeof(FramebufferFrameHeader)),
+                  &compressed_size, reinterpret_cast<const Bytef*>(tiles_.data()), tiles_.size(),
+                  Z_BEST_SPEED) != Z_OK) {
+        return false;
+    }
+    packet->resize(sizeof(FramebufferFrameHeader) + compressed_size);
+
+    FramebufferFrameHeader header = {
+            .flags = keyframe ? kFramebufferKeyframe : 0,
+            .tile_count = last_tile_count_,
+            .uncompressed_size = static_cast<uint32_t>(tiles_.size()),
+            .compressed_size = static_cast<uint32_t>(compressed_size),
+    };
+    memcpy(packet->data(), &header, sizeof(header));
+    return true;
+}
+
+FramebufferDeltaDecoder::FramebufferDeltaDecoder(uint32_t width, uint32_t height,
+                                                 uint32_t bytes_per_pixel)
+    : tiling_(width, height, bytes_per_pixel), frame_(tiling_.frame_size()) {}
+
+bool FramebufferDeltaDecoder::Apply(const FramebufferFrameHeader& header, const char* compressed,
+                                    std::string* error) {
+    // No frame's tiles can add up to more than a keyframe's.
+    size_t max_size = tiling_.frame_size() + size_t(tiling_.tile_count()) * sizeof(uint32_t);
+    if (header.tile_count > tiling_.tile_count() || header.uncompressed_size > max_size) {
+        *error = android::base::StringPrintf("bad frame header: %u tiles, %u bytes",
+                                             header.tile_count, header.uncompressed_size);
+        return false;
+    }
+
+    tiles_.resize(header.uncompressed_size);
+    uLongf size = tiles_.size();
+    if (uncompress(reinterpret_cast<Bytef*>(tiles_.data()), &size,
+                   reinterpret_cast<const Bytef*>(compressed), header.compressed_size) != Z_OK ||
+        size != tiles_.size()) {
+        *error = "failed to inflate frame";
+        return false;
+    }
+
+    size_t pos = 0;
+    for (uint32_t i = 0; i < header.tile_count; ++i) {
+        uint32_t tile;
+        if (tiles_.size() - pos < sizeof(tile)) {
+            *error = "truncated frame";
+            return false;
+        }
+        memcpy(&tile, tiles_.data() + pos, sizeof(tile));
+        pos += sizeof(tile);
+
+        if (tile >= tiling_.tile_count() || tiles_.size() - pos < tiling_.TileSize(tile)) {
+            *error = android::base::StringPrintf("bad tile %u", tile);
+            return false;
+        }
+        tiling_.ForEachRow(tile, [&](size_t offset, size_t length) {
+            memcpy(frame_.data() + offset, tiles_.data() + pos, length);
+            pos += length;
+        });
+    }
+
+    if (pos != tiles_.size()) {
+        *error = "trailing data in frame";
+        return false;
+    }
+    return true;
+}
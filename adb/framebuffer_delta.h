@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Delta encoding of frames for the framebuffer-stream: service (see SERVICES.TXT).
+//
+// Frames are divided into kFramebufferTileSize square tiles (clipped at the right and bottom
+// edges). Each frame on the wire is a FramebufferFrameHeader followed by |compressed_size| bytes
+// of zlib data, which inflate to |tile_count| tiles, each a uint32_t tile index (row-major)
+// followed by the tile's pixels, row by row. Only the tiles that changed since the previous frame
+// are sent, except in keyframes, which have all of them.
+static constexpr uint32_t kFramebufferTileSize = 32;
+
+// The frame rate asked for by framebuffer-stream:FPS.
+static constexpr int kDefaultFramebufferStreamFps = 10;
+static constexpr int kMaxFramebufferStreamFps = 60;
+
+static constexpr uint32_t kFramebufferKeyframe = 1;
+
+struct FramebufferFrameHeader {
+    uint32_t flags;
+    uint32_t tile_count;
+    uint32_t uncompressed_size;
+    uint32_t compressed_size;
+} __attribute__((packed));
+
+class FramebufferTiling {
+  public:
+    FramebufferTiling(uint32_t width, uint32_t height, uint32_t bytes_per_pixel);
+
+    uint32_t tile_count() const { return tiles_x_ * tiles_y_; }
+    size_t frame_size() const { return size_t(width_) * height_ * bytes_per_pixel_; }
+
+    // The size of a tile's pixels, in bytes.
+    size_t TileSize(uint32_t tile) const;
+
+    // Calls |fn| with the offset into the frame and the length of each of |tile|'s rows.
+    template <typename Fn>
+    void ForEachRow(uint32_t tile, Fn fn) const {
+        uint32_t x = (tile % tiles_x_) * kFramebufferTileSize;
+        uint32_t y = (tile / tiles_x_) * kFramebufferTileSize;
+        uint32_t w = std::min(kFramebufferTileSize, width_ - x);
+        uint32_t h = std::min(kFramebufferTileSize, height_ - y);
+        size_t stride = size_t(width_) * bytes_per_pixel_;
+        for (uint32_t row = 0; row < h; ++row) {
+            fn((y + row) * stride + size_t(x) * bytes_per_pixel_, size_t(w) * bytes_per_pixel_);
+        }
+    }
+
+  private:
+    uint32_t width_;
+    uint32_t height_;
+    uint32_t bytes_per_pixel_;
+    uint32_t tiles_x_;
+    uint32_t tiles_y_;
+};
+
+class FramebufferDeltaEncoder {
+  public:
+    FramebufferDeltaEncoder(uint32_t width, uint32_t height, uint32_t bytes_per_pixel);
+
+    // Encodes |frame| (width * height * bytes_per_pixel bytes) into |packet|, as a header and its
+    // compressed tiles. The first frame is always a keyframe. If nothing changed since the last
+    // frame, |packet| is left empty.
+    bool Encode(const char* frame, bool keyframe, std::vector<char>* packet);
+
+    uint32_t last_tile_count() const { return last_tile_count_; }
+
+  private:
+    FramebufferTiling tiling_;
+    std::vector<uint64_t> tile_hashes_;
+    bool have_previous_ = false;
+    uint32_t last_tile_count_ = 0;
+    std::vector<char> tiles_;
+};
+
+class FramebufferDeltaDecoder {
+  public:
+    FramebufferDeltaDecoder(uint32_t width, uint32_t height, uint32_t bytes_per_pixel);
+
+    // Applies a frame's |compressed| tiles, described by |header|, to the current frame.
+    bool Apply(const FramebufferFrameHeader& header, const char* compressed, std::string* error);
+
+    const std::vector<char>& frame() const { return frame_; }
+
+  private:
+    FramebufferTiling tiling_;
+    std::vector<char> frame_;
+    std::vector<char> tiles_;
+};
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "framebuffer_delta.h"
+
+#include <string.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+// Not a multiple of the tile size, to cover the clipped tiles at the edges.
+static constexpr uint32_t kWidth = 100;
+static constexpr uint32_t kHeight = 70;
+static constexpr uint32_t kBytesPerPixel = 4;
+
+static std::vector<char> RandomFrame(std::mt19937* rng) {
+    std::vector<char> frame(kWidth * kHeight * kBytesPerPixel);
+    for (char& c : frame) {
+        c = static_cast<char>((*rng)());
+    }
+    return frame;
+}
+
+static void SetPixel(std::vector<char>* frame, uint32_t x, uint32_t y, char value) {
+    memset(frame->data() + (y * kWidth + x) * kBytesPerPixel, value, kBytesPerPixel);
+}
+
+static FramebufferFrameHeader ApplyPacket(FramebufferDeltaDecoder* decoder,
+                                          const std::vector<char>& packet) {
+    FramebufferFrameHeader header;
+    EXPECT_GE(packet.size(), sizeof(header));
+    memcpy(&header, packet.data(), sizeof(header));
+    EXPECT_EQ(packet.size(), sizeof(header) + header.compressed_size);
+
+    std::string error;
+    EXPECT_TRUE(decoder->Apply(header, packet.data() + sizeof(header), &error)) << error;
+    return header;
+}
+
+TEST(FramebufferDelta, Keyframe) {
+    std::mt19937 rng(0);
+    std::vector<char> frame = RandomFrame(&rng);
+
+    FramebufferDeltaEncoder encoder(kWidth, kHeight, kBytesPerPixel);
+    FramebufferDeltaDecoder decoder(kWidth, kHeight, kBytesPerPixel);
+    std::vector<char> packet;
+    ASSERT_TRUE(encoder.Encode(frame.data(), false, &packet));
+
+    FramebufferFrameHeader header = ApplyPacket(&decoder, packet);
+    EXPECT_EQ(kFramebufferKeyframe, header.flags);
+    EXPECT_EQ(4U * 3U, header.tile_count);
+    EXPECT_EQ(frame, decoder.frame());
+}
+
+TEST(FramebufferDelta, OnlyChangedTiles) {
+    std::mt19937 rng(0);
+    std::vector<char> frame = RandomFrame(&rng);
+
+    FramebufferDeltaEncoder encoder(kWidth, kHeight, kBytesPerPixel);
+    FramebufferDeltaDecoder decoder(kWidth, kHeight, kBytesPerPixel);
+    std::vector<char> packet;
+    ASSERT_TRUE(encoder.Encode(frame.data(), false, &packet));
+    ApplyPacket(&decoder, packet);
+
+    // Nothing changed, so there's nothing to send.
+    ASSERT_TRUE(encoder.Encode(frame.data(), false, &packet));
+    EXPECT_TRUE(packet.empty());
+
+    // One pixel in the first tile, and one in the clipped bottom right tile.
+    SetPixel(&frame, 0, 0, 1);
+    SetPixel(&frame, kWidth - 1, kHeight - 1, 2);
+    ASSERT_TRUE(encoder.Encode(frame.data(), false, &packet));
+    FramebufferFrameHeader header = ApplyPacket(&decoder, packet);
+    EXPECT_EQ(0U, header.flags);
+    EXPECT_EQ(2U, header.tile_count);
+    EXPECT_EQ(frame, decoder.frame());
+
+    // Asking for a keyframe sends everything, even though nothing changed.
+    ASSERT_TRUE(encoder.Encode(frame.data(), true, &packet));
+    header = ApplyPacket(&decoder, packet);
+    EXPECT_EQ(kFramebufferKeyframe, header.flags);
+    EXPECT_EQ(12U, header.tile_count);
+    EXPECT_EQ(frame, decoder.frame());
+}
+
+TEST(FramebufferDelta, Compresses) {
+    std::vector<char> frame(kWidth * kHeight * kBytesPerPixel, 0x55);
+
+    FramebufferDeltaEncoder encoder(kWidth, kHeight, kBytesPerPixel);
+    std::vector<char> packet;
+    ASSERT_TRUE(encoder.Encode(frame.data(), false, &packet));
+    EXPECT_LT(packet.size(), frame.size() / 10);
+}
+
+TEST(FramebufferDelta, BadFrames) {
+    std::mt19937 rng(0);
+    std::vector<char> frame = RandomFrame(&rng);
+
+    FramebufferDeltaEncoder encoder(kWidth, kHeight, kBytesPerPixel);
+    std::vector<char> packet;
+    ASSERT_TRUE(encoder.Encode(frame.data(), false, &packet));
+    FramebufferFrameHeader header;
+    memcpy(&header, packet.data(), sizeof(header));
+    const char* compressed = packet.data() + sizeof(header);
+
+    FramebufferDeltaDecoder decoder(kWidth, kHeight, kBytesPerPixel);
+    std::string error;
+
+    FramebufferFrameHeader too_many_tiles = header;
+    too_many_tiles.tile_count = 13;
+    EXPECT_FALSE(decoder.Apply(too_many_tiles, compressed, &error));
+
+    FramebufferFrameHeader wrong_size = header;
+    wrong_size.uncompressed_size -= 1;
+    EXPECT_FALSE(decoder.Apply(wrong_size, compressed, &error));
+
+    FramebufferFrameHeader too_few_tiles = header;
+    too_few_tiles.tile_count = 11;
+    EXPECT_FALSE(decoder.Apply(too_few_tiles, compressed, &error));
+
+    EXPECT_TRUE(decoder.Apply(header, compressed, &error)) << error;
+    EXPECT_EQ(frame, decoder.frame());
+}
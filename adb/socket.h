@@ -21,8 +21,10 @@
 
 #include <deque>
 #include <memory>
+#include <optional>
 #include <string>
 
+#include "adb_stats.h"
 #include "adb_unique_fd.h"
 #include "fdevent.h"
 #include "types.h"
@@ -65,8 +67,19 @@ struct asocket {
     // queue of data waiting to be written
     IOVector packet_queue;
 
+    // For remote asockets on transports with kFeatureDelayedAck: how many more bytes we may send
+    // before waiting for an A_OKAY. This can go negative, since a whole packet is sent as long as
+    // any of the window remains. Unset if every A_WRTE must be acknowledged before the next.
+    std::optional<int64_t> available_send_bytes;
+
+    // For remote asockets: bytes received from the other side that our peer has accepted, but
+    // that we haven't acknowledged yet.
+    size_t unacknowledged_bytes = 0;
+
     std::string smart_socket_data;
 
+    SocketStats stats;
+
     /* enqueue is called by our peer when it has data
      * for us.  It should return 0 if we can accept more
      * data or 1 if not.  If we return 1, we must call
@@ -103,6 +116,9 @@ void install_local_socket(asocket *s);
 void remove_socket(asocket *s);
 void close_all_sockets(atransport *t);
 
+// Formats the stats of the local sockets on |t|, for host:stats.
+std::string format_socket_stats(atransport* t);
+
 asocket* create_local_socket(unique_fd fd);
 asocket* create_local_service_socket(std::string_view destination, atransport* transport);
 
@@ -27,12 +27,18 @@
 
 #include <unistd.h>
 
+#include <android-base/stringprintf.h>
+
+// sysdeps.h renames close() and shutdown(), which must happen before asocket is declared.
+#include "sysdeps.h"
+
 #include "adb.h"
 #include "adb_io.h"
 #include "fdevent_test.h"
 #include "socket.h"
-#include "sysdeps.h"
+#include "socket_spec.h"
 #include "sysdeps/chrono.h"
+#include "transport.h"
 
 using namespace std::string_literals;
 using namespace std::string_view_literals;
@@ -306,6 +312,245 @@ TEST_F(LocalSocketTest, close_socket_in_CLOSE_WAIT_state) {
 
 #endif  // defined(__linux__)
 
+// A Connection that records the packets sent over it.
+struct RecordingConnection : public Connection {
+    bool Write(std::unique_ptr<apacket> packet) override {
+        written.push_back(std::move(packet));
+        return true;
+    }
+    void Start() override {}
+    void Stop() override {}
+
+    std::vector<std::unique_ptr<apacket>> written;
+};
+
+// Exercises the stream credit of kFeatureDelayedAck: a fake local socket, opened by the other
+// side of a transport that records what we send back.
+class DelayedAckTest : public FdeventTest {
+  protected:
+    static constexpr unsigned kRemoteId = 1234;
+
+    static int enqueue_result;
+    static size_t enqueued_bytes;
+    static size_t ready_count;
+
+    void SetUp() override {
+        FdeventTest::SetUp();
+        auto connection = std::make_unique<RecordingConnection>();
+        connection_ = connection.get();
+        transport_.SetConnection(std::move(connection));
+        transport_.SetFeatures(kFeatureDelayedAck);
+        transport_.online = true;
+
+        enqueue_result = 0;
+        enqueued_bytes = 0;
+        ready_count = 0;
+
+        local_ = new asocket();
+        local_->enqueue = [](asocket*, apacket::payload_type data) {
+            enqueued_bytes += data.size();
+            return enqueue_result;
+        };
+        local_->ready = [](asocket*) { ++ready_count; };
+        local_->shutdown = nullptr;
+        local_->close = [](asocket* s) {
+            remove_socket(s);
+            delete s;
+        };
+        install_local_socket(local_);
+    }
+
+    void TearDown() override {
+        // Closing the remote socket takes its local peer with it.
+        if (local_->peer) {
+            local_->peer->close(local_->peer);
+        } else {
+            local_->close(local_);
+        }
+    }
+
+    void Receive(uint32_t command, uint32_t arg0, uint32_t arg1, std::string_view payload) {
+        apacket* p = get_apacket();
+        p->msg.command = command;
+        p->msg.arg0 = arg0;
+        p->msg.arg1 = arg1;
+        p->msg.data_length = payload.size();
+        p->payload = apacket::payload_type(payload.begin(), payload.end());
+        handle_packet(p, &transport_);
+    }
+
+    void ReceiveOkay(std::optional<uint32_t> acked_bytes) {
+        std::string payload;
+        if (acked_bytes) {
+            payload.assign(reinterpret_cast<const char*>(&*acked_bytes), sizeof(*acked_bytes));
+        }
+        Receive(A_OKAY, kRemoteId, local_->id, payload);
+    }
+
+    void ReceiveWrite(size_t length) {
+        Receive(A_WRTE, kRemoteId, local_->id, std::string(length, 'x'));
+    }
+
+    // Send a packet from the local socket to the other side, as the local socket would.
+    int Send(size_t length) {
+        return local_->peer->enqueue(local_->peer, apacket::payload_type(length));
+    }
+
+    // The acked byte count of the last packet we sent, which must be an A_OKAY.
+    std::optional<uint32_t> LastAckedBytes() {
+        EXPECT_FALSE(connection_->written.empty());
+        if (connection_->written.empty()) return std::nullopt;
+        const apacket* p = connection_->written.back().get();
+        EXPECT_EQ(static_cast<uint32_t>(A_OKAY), p->msg.command);
+        EXPECT_EQ(local_->id, p->msg.arg0);
+        EXPECT_EQ(kRemoteId, p->msg.arg1);
+        if (p->payload.size() != sizeof(uint32_t)) return std::nullopt;
+        uint32_t acked_bytes;
+        memcpy(&acked_bytes, p->payload.data(), sizeof(acked_bytes));
+        return acked_bytes;
+    }
+
+    atransport transport_;
+    RecordingConnection* connection_ = nullptr;
+    asocket* local_ = nullptr;
+};
+
+int DelayedAckTest::enqueue_result;
+size_t DelayedAckTest::enqueued_bytes;
+size_t DelayedAckTest::ready_count;
+
+TEST_F(DelayedAckTest, window_exhaustion_and_resume) {
+    ReceiveOkay(2 * MAX_PAYLOAD);
+    ASSERT_NE(nullptr, local_->peer);
+    ASSERT_EQ(1u, ready_count);
+    ASSERT_EQ(static_cast<int64_t>(2 * MAX_PAYLOAD), local_->peer->available_send_bytes);
+
+    // The whole window can be sent without waiting.
+    EXPECT_EQ(0, Send(MAX_PAYLOAD));
+    EXPECT_EQ(1, Send(MAX_PAYLOAD));
+    EXPECT_EQ(0, local_->peer->available_send_bytes);
+    EXPECT_EQ(2u, connection_->written.size());
+
+    ReceiveOkay(MAX_PAYLOAD);
+    EXPECT_EQ(2u, ready_count);
+    EXPECT_EQ(static_cast<int64_t>(MAX_PAYLOAD), local_->peer->available_send_bytes);
+    EXPECT_EQ(1, Send(MAX_PAYLOAD));
+}
+
+TEST_F(DelayedAckTest, partial_acks) {
+    // A packet goes out whole as long as any of the window remains, so the window can go negative.
+    ReceiveOkay(MAX_PAYLOAD + 100);
+    ASSERT_EQ(1u, ready_count);
+    EXPECT_EQ(0, Send(MAX_PAYLOAD));
+    EXPECT_EQ(1, Send(MAX_PAYLOAD));
+    EXPECT_EQ(100 - static_cast<int64_t>(MAX_PAYLOAD), local_->peer->available_send_bytes);
+
+    // Acks that don't make up the deficit don't resume the local socket.
+    ReceiveOkay(MAX_PAYLOAD / 2);
+    EXPECT_EQ(1u, ready_count);
+    ReceiveOkay(MAX_PAYLOAD / 2 - 100);
+    EXPECT_EQ(1u, ready_count);
+    EXPECT_EQ(0, local_->peer->available_send_bytes);
+
+    ReceiveOkay(1);
+    EXPECT_EQ(2u, ready_count);
+    EXPECT_EQ(1, local_->peer->available_send_bytes);
+}
+
+TEST_F(DelayedAckTest, zero_acked_count) {
+    ReceiveOkay(MAX_PAYLOAD);
+    ASSERT_EQ(1, Send(MAX_PAYLOAD));
+
+    ReceiveOkay(0);
+    EXPECT_EQ(1u, ready_count);
+    EXPECT_EQ(0, local_->peer->available_send_bytes);
+}
+
+TEST_F(DelayedAckTest, missing_acked_count) {
+    ReceiveOkay(MAX_PAYLOAD);
+    ASSERT_EQ(1, Send(MAX_PAYLOAD));
+
+    // An A_OKAY without a count still resumes the local socket, rather than stalling it forever.
+    ReceiveOkay(std::nullopt);
+    EXPECT_EQ(2u, ready_count);
+}
+
+TEST_F(DelayedAckTest, empty_initial_window) {
+    // An empty window could never be reopened, so every packet waits for an A_OKAY instead.
+    ReceiveOkay(0);
+    ASSERT_NE(nullptr, local_->peer);
+    EXPECT_EQ(1u, ready_count);
+    EXPECT_FALSE(local_->peer->available_send_bytes);
+
+    EXPECT_EQ(1, Send(100));
+    ReceiveOkay(100);
+    EXPECT_EQ(2u, ready_count);
+    EXPECT_EQ(1, Send(100));
+    ReceiveOkay(std::nullopt);
+    EXPECT_EQ(3u, ready_count);
+}
+
+TEST_F(DelayedAckTest, missing_initial_window) {
+    ReceiveOkay(std::nullopt);
+    ASSERT_NE(nullptr, local_->peer);
+    EXPECT_EQ(1u, ready_count);
+    EXPECT_FALSE(local_->peer->available_send_bytes);
+    EXPECT_EQ(1, Send(100));
+}
+
+TEST_F(DelayedAckTest, acknowledge_received_bytes) {
+    ReceiveOkay(MAX_PAYLOAD);
+    size_t sent = connection_->written.size();
+
+    // Bytes the local socket accepts right away are acknowledged right away.
+    ReceiveWrite(1000);
+    EXPECT_EQ(1000u, enqueued_bytes);
+    ASSERT_EQ(sent + 1, connection_->written.size());
+    EXPECT_EQ(1000u, LastAckedBytes());
+
+    // Otherwise they're acknowledged together once it catches up.
+    enqueue_result = 1;
+    ReceiveWrite(1000);
+    ReceiveWrite(500);
+    EXPECT_EQ(2500u, enqueued_bytes);
+    EXPECT_EQ(sent + 1, connection_->written.size());
+
+    local_->peer->ready(local_->peer);
+    ASSERT_EQ(sent + 2, connection_->written.size());
+    EXPECT_EQ(1500u, LastAckedBytes());
+
+    // With nothing left to acknowledge, there's nothing to send.
+    local_->peer->ready(local_->peer);
+    EXPECT_EQ(sent + 2, connection_->written.size());
+}
+
+TEST_F(DelayedAckTest, open_with_empty_window) {
+    std::string error;
+    int port;
+    unique_fd listener(socket_spec_listen("tcp:0", &error, &port));
+    ASSERT_GE(listener.get(), 0) << error;
+    std::string service = android::base::StringPrintf("tcp:localhost:%d", port);
+
+    for (uint32_t window : {0u, INITIAL_DELAYED_ACK_BYTES}) {
+        connection_->written.clear();
+        Receive(A_OPEN, kRemoteId + 1, window, service);
+        ASSERT_EQ(1u, connection_->written.size());
+        const apacket* reply = connection_->written.back().get();
+        ASSERT_EQ(static_cast<uint32_t>(A_OKAY), reply->msg.command);
+        ASSERT_EQ(kRemoteId + 1, reply->msg.arg1);
+
+        asocket* s = find_local_socket(reply->msg.arg0, kRemoteId + 1);
+        ASSERT_NE(nullptr, s);
+        ASSERT_NE(nullptr, s->peer);
+        if (window == 0) {
+            EXPECT_FALSE(s->peer->available_send_bytes);
+        } else {
+            EXPECT_EQ(window, s->peer->available_send_bytes);
+        }
+        s->close(s);
+    }
+}
+
 #if ADB_HOST
 
 #define VerifyParseHostServiceFailed(s)                                         \
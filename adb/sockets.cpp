@@ -20,6 +20,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,6 +32,7 @@
 #include <string>
 #include <vector>
 
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 
 #if !ADB_HOST
@@ -112,6 +114,35 @@ restart:
     }
 }
 
+// Local sockets on the device don't have a transport of their own; their remote peer does.
+static atransport* local_socket_transport(asocket* s) {
+    return s->peer && s->peer->transport ? s->peer->transport : s->transport;
+}
+
+std::string format_socket_stats(atransport* t) {
+    std::lock_guard<std::recursive_mutex> lock(local_socket_list_lock);
+
+    std::string result;
+    for (asocket* s : local_socket_list) {
+        if (local_socket_transport(s) != t) {
+            continue;
+        }
+        android::base::StringAppendF(
+                &result,
+                "  socket %u -> %u: %" PRIu64 " bytes read, %" PRIu64
+                " bytes written, %zu bytes queued (max %zu)\n",
+                s->id, s->peer ? s->peer->id : 0, s->stats.bytes_read, s->stats.bytes_written,
+                s->packet_queue.size(), s->stats.max_queued_bytes);
+        if (s->peer) {
+            android::base::StringAppendF(&result, "    okay wait: %s\n",
+                                         s->peer->stats.okay_wait.ToString().c_str());
+        }
+        android::base::StringAppendF(&result, "    callbacks: %s\n",
+                                     s->stats.callback_time.ToString().c_str());
+    }
+    return result;
+}
+
 enum class SocketFlushResult {
     Destroyed,
     TryAgain,
@@ -122,6 +153,9 @@ static SocketFlushResult local_socket_flush_incoming(asocket* s) {
     if (!s->packet_queue.empty()) {
         std::vector<adb_iovec> iov = s->packet_queue.iovecs();
         ssize_t rc = adb_writev(s->fd, iov.data(), iov.size());
+        if (rc > 0) {
+            s->stats.bytes_written += rc;
+        }
         if (rc > 0 && static_cast<size_t>(rc) == s->packet_queue.size()) {
             s->packet_queue.clear();
         } else if (rc > 0) {
@@ -182,6 +216,7 @@ static bool local_socket_flush_outgoing(asocket* s) {
 
     if (avail != max_payload && s->peer) {
         data.resize(max_payload - avail);
+        s->stats.bytes_read += data.size();
 
         // s->peer->enqueue() may call s->close() and free s,
         // so save variables for debug printing below.
@@ -223,6 +258,7 @@ static int local_socket_enqueue(asocket* s, apacket::payload_type data) {
     D("LS(%d): enqueue %zu", s->id, data.size());
 
     s->packet_queue.append(std::move(data));
+    s->stats.max_queued_bytes = std::max(s->stats.max_queued_bytes, s->packet_queue.size());
     switch (local_socket_flush_incoming(s)) {
         case SocketFlushResult::Destroyed:
             return -1;
@@ -349,17 +385,15 @@ static void local_socket_close(asocket* s) {
     CHECK_EQ(FDE_WRITE, s->fde->state & FDE_WRITE);
 }
 
-static void local_socket_event_func(int fd, unsigned ev, void* _s) {
-    asocket* s = reinterpret_cast<asocket*>(_s);
-    D("LS(%d): event_func(fd=%d(==%d), ev=%04x)", s->id, s->fd, fd, ev);
-
+// Returns false if the socket has been closed and destroyed as a side-effect of this function.
+static bool local_socket_handle_event(asocket* s, unsigned ev) {
     /* put the FDE_WRITE processing before the FDE_READ
     ** in order to simplify the code.
     */
     if (ev & FDE_WRITE) {
         switch (local_socket_flush_incoming(s)) {
             case SocketFlushResult::Destroyed:
-                return;
+                return false;
 
             case SocketFlushResult::TryAgain:
                 break;
@@ -372,7 +406,7 @@ static void local_socket_event_func(int fd, unsigned ev, void* _s) {
 
     if (ev & FDE_READ) {
         if (!local_socket_flush_outgoing(s)) {
-            return;
+            return false;
         }
     }
 
@@ -382,7 +416,24 @@ static void local_socket_event_func(int fd, unsigned ev, void* _s) {
         ** bytes of readable data.
         */
         D("LS(%d): FDE_ERROR (fd=%d)", s->id, s->fd);
-        return;
+    }
+    return true;
+}
+
+static void local_socket_event_func(int fd, unsigned ev, void* _s) {
+    asocket* s = reinterpret_cast<asocket*>(_s);
+    D("LS(%d): event_func(fd=%d(==%d), ev=%04x)", s->id, s->fd, fd, ev);
+
+    // The transport outlives its sockets, so it's still safe to use if the socket goes away.
+    atransport* t = local_socket_transport(s);
+    auto start = std::chrono::steady_clock::now();
+    bool alive = local_socket_handle_event(s, ev);
+    auto duration = std::chrono::steady_clock::now() - start;
+    if (alive) {
+        s->stats.callback_time.Record(duration);
+    }
+    if (t) {
+        t->stats.callback_time.Record(duration);
     }
 }
 
@@ -443,18 +494,31 @@ static int remote_socket_enqueue(asocket* s, apacket::payload_type data) {
 
     p->payload = std::move(data);
     p->msg.data_length = p->payload.size();
+    size_t length = p->msg.data_length;
 
     send_packet(p, s->transport);
+
+    // Without a window, we have to wait for an A_OKAY after every packet.
+    if (!s->available_send_bytes) {
+        s->stats.StartOkayWait();
+        return 1;
+    }
+    *s->available_send_bytes -= length;
+    if (*s->available_send_bytes > 0) {
+        return 0;
+    }
+    s->stats.StartOkayWait();
     return 1;
 }
 
 static void remote_socket_ready(asocket* s) {
     D("entered remote_socket_ready RS(%d) OKAY fd=%d peer.fd=%d", s->id, s->fd, s->peer->fd);
-    apacket* p = get_apacket();
-    p->msg.command = A_OKAY;
-    p->msg.arg0 = s->peer->id;
-    p->msg.arg1 = s->id;
-    send_packet(p, s->transport);
+    if (s->available_send_bytes && s->unacknowledged_bytes == 0) {
+        // Nothing to acknowledge, and the other side isn't waiting for us.
+        return;
+    }
+    send_ready(s->peer->id, s->id, s->transport, s->unacknowledged_bytes);
+    s->unacknowledged_bytes = 0;
 }
 
 static void remote_socket_shutdown(asocket* s) {
@@ -508,6 +572,9 @@ void connect_to_remote(asocket* s, std::string_view destination) {
     LOG(VERBOSE) << "LS(" << s->id << ": connect(" << destination << ")";
     p->msg.command = A_OPEN;
     p->msg.arg0 = s->id;
+    if (s->transport->has_feature(kFeatureDelayedAck)) {
+        p->msg.arg1 = INITIAL_DELAYED_ACK_BYTES;
+    }
 
     // adbd used to expect a null-terminated string.
     // Keep doing so to maintain backward compatibility.
@@ -36,4 +36,7 @@ using adb_iovec = struct iovec;
 
 #endif
 
+// The most iovecs that are passed to a single adb_writev call (IOV_MAX on Linux and Darwin).
+constexpr size_t ADB_IOV_MAX = 1024;
+
 #pragma GCC poison writev
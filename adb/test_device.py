@@ -1187,6 +1187,39 @@ class FileOperationsTest(DeviceTest):
             if temp_dir is not None:
                 shutil.rmtree(temp_dir)
 
+    def test_push_sync_same_size_edit(self):
+        """Sync a file whose edit kept its size and timestamp."""
+
+        try:
+            temp_dir = tempfile.mkdtemp()
+            temp_files = make_random_host_files(in_dir=temp_dir, num_files=4)
+
+            device_dir = posixpath.join(self.DEVICE_TEMP_DIR, 'sync_same_size')
+
+            # Clean up any stale files on the device.
+            device = adb.get_device()  # pylint: disable=no-member
+            device.shell(['rm', '-rf', device_dir])
+
+            device.push(temp_dir, device_dir, sync=True)
+
+            # Rewrite one file with new contents of the same size, and put its timestamps back.
+            temp_file = temp_files[0]
+            st = os.stat(temp_file.full_path)
+            new_contents = os.urandom(st.st_size)
+            with open(temp_file.full_path, 'wb') as f:
+                f.write(new_contents)
+            os.utime(temp_file.full_path, (st.st_atime, st.st_mtime))
+            temp_file.checksum = compute_md5(new_contents)
+
+            device.push(temp_dir, device_dir, sync=True)
+
+            self.verify_sync(device, temp_files, device_dir)
+
+            self.device.shell(['rm', '-rf', self.DEVICE_TEMP_DIR])
+        finally:
+            if temp_dir is not None:
+                shutil.rmtree(temp_dir)
+
     def test_unicode_paths(self):
         """Ensure that we can support non-ASCII paths, even on Windows."""
         name = u'로보카 폴리'
@@ -35,6 +35,7 @@
 #include <mutex>
 #include <set>
 #include <thread>
+#include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/parsenetaddress.h>
@@ -63,6 +64,10 @@ static auto& pending_list = *new std::list<atransport*>();
 
 static auto& transport_lock = *new std::recursive_mutex();
 
+// The most a BlockingConnectionAdapter hands to its connection's WriteBatch at once (though a
+// single packet may exceed it).
+static constexpr size_t kMaxWriteBatchBytes = MAX_PAYLOAD;
+
 const char* const kFeatureShell2 = "shell_v2";
 const char* const kFeatureCmd = "cmd";
 const char* const kFeatureStat2 = "stat_v2";
@@ -73,6 +78,12 @@ const char* const kFeatureFixedPushMkdir = "fixed_push_mkdir";
 const char* const kFeatureAbb = "abb";
 const char* const kFeatureFixedPushSymlinkTimestamp = "fixed_push_symlink_timestamp";
 const char* const kFeatureAbbExec = "abb_exec";
+const char* const kFeatureSendRecvDeflate = "sendrecv_deflate";
+const char* const kFeatureListRecursive = "ls_recursive";
+const char* const kFeatureSyncHash = "sync_hash";
+const char* const kFeatureDelayedAck = "delayed_ack";
+const char* const kFeatureTcpStripes = "tcp_stripes";
+const char* const kFeatureFramebufferStream = "framebuffer_stream";
 
 namespace {
 
@@ -262,6 +273,15 @@ void Connection::Reset() {
     Stop();
 }
 
+bool BlockingConnection::WriteBatch(const std::vector<std::unique_ptr<apacket>>& packets) {
+    for (const auto& packet : packets) {
+        if (!Write(packet.get())) {
+            return false;
+        }
+    }
+    return true;
+}
+
 BlockingConnectionAdapter::BlockingConnectionAdapter(std::unique_ptr<BlockingConnection> connection)
     : underlying_(std::move(connection)) {}
 
@@ -303,11 +323,18 @@ void BlockingConnectionAdapter::Start() {
                 return;
             }
 
-            std::unique_ptr<apacket> packet = std::move(this->write_queue_.front());
-            this->write_queue_.pop_front();
+            // Take everything that's queued up, up to a limit, so that the underlying connection
+            // can send it with as few syscalls as possible.
+            std::vector<std::unique_ptr<apacket>> packets;
+            size_t batch_bytes = 0;
+            while (!this->write_queue_.empty() && batch_bytes < kMaxWriteBatchBytes) {
+                batch_bytes += sizeof(amessage) + this->write_queue_.front()->payload.size();
+                packets.push_back(std::move(this->write_queue_.front()));
+                this->write_queue_.pop_front();
+            }
             lock.unlock();
 
-            if (!this->underlying_->Write(packet.get())) {
+            if (!this->underlying_->WriteBatch(packets)) {
                 break;
             }
         }
@@ -407,22 +434,92 @@ bool FdConnection::Read(apacket* packet) {
     return true;
 }
 
+static void AppendPacketIovecs(std::vector<adb_iovec>* iovs, apacket* packet) {
+    adb_iovec header;
+    header.iov_base = &packet->msg;
+    header.iov_len = sizeof(packet->msg);
+    iovs->push_back(header);
+
+    if (packet->msg.data_length) {
+        adb_iovec payload;
+        payload.iov_base = &packet->payload[0];
+        payload.iov_len = packet->msg.data_length;
+        iovs->push_back(payload);
+    }
+}
+
 bool FdConnection::Write(apacket* packet) {
-    if (!WriteFdExactly(fd_.get(), &packet->msg, sizeof(packet->msg))) {
-        D("remote local: write terminated");
-        return false;
+    std::vector<adb_iovec> iovs;
+    AppendPacketIovecs(&iovs, packet);
+    return WriteIovecs(&iovs);
+}
+
+bool FdConnection::WriteBatch(const std::vector<std::unique_ptr<apacket>>& packets) {
+    std::vector<adb_iovec> iovs;
+    iovs.reserve(packets.size() * 2);
+    for (const auto& packet : packets) {
+        AppendPacketIovecs(&iovs, packet.get());
     }
+    return WriteIovecs(&iovs);
+}
 
-    if (packet->msg.data_length) {
-        if (!WriteFdExactly(fd_.get(), &packet->payload[0], packet->msg.data_length)) {
+bool FdConnection::WriteIovecs(std::vector<adb_iovec>* iovs) {
+    bool corked = false;
+    size_t index = 0;
+    while (index < iovs->size()) {
+        size_t count = std::min(iovs->size() - index, ADB_IOV_MAX);
+        ssize_t rc = adb_writev(fd_.get(), &(*iovs)[index], count);
+        if (rc == -1 && errno == EINTR) {
+            continue;
+        } else if (rc <= 0) {
             D("remote local: write terminated");
+            if (corked) {
+                Cork(false);
+            }
             return false;
         }
+
+        // Skip past everything that was written, and trim a partially written iovec.
+        size_t written = rc;
+        while (index < iovs->size() && written >= (*iovs)[index].iov_len) {
+            written -= (*iovs)[index].iov_len;
+            ++index;
+        }
+        if (written > 0) {
+            adb_iovec& iov = (*iovs)[index];
+            iov.iov_base = static_cast<char*>(iov.iov_base) + written;
+            iov.iov_len -= written;
+        }
+
+        // We're not done in one writev: hold back partial segments until we are.
+        if (index < iovs->size() && cork_ && !corked) {
+            corked = Cork(true);
+        }
     }
 
+    if (corked) {
+        Cork(false);
+    }
     return true;
 }
 
+bool FdConnection::Cork(bool value) {
+#if defined(__linux__)
+    int optval = value;
+    if (adb_setsockopt(fd_.get(), IPPROTO_TCP, TCP_CORK, &optval, sizeof(optval)) == 0) {
+        return true;
+    }
+
+    // Not TCP (e.g. vsock). Don't bother trying again.
+    D("remote local: failed to set TCP_CORK: %s", strerror(errno));
+    cork_ = false;
+#else
+    (void)value;
+    cork_ = false;
+#endif
+    return false;
+}
+
 void FdConnection::Close() {
     adb_shutdown(fd_.get());
     fd_.reset();
@@ -443,6 +540,9 @@ void send_packet(apacket* p, atransport* t) {
         LOG(FATAL) << "Transport is null";
     }
 
+    ++t->stats.packets_sent;
+    t->stats.bytes_sent += p->msg.data_length;
+
     if (t->Write(p) != 0) {
         D("%s: failed to enqueue packet, closing transport", t->serial.c_str());
         t->Kick();
@@ -647,6 +747,56 @@ static int transport_write_action(int fd, struct tmsg* m) {
     return 0;
 }
 
+static bool handle_remote_packet(atransport* t, Connection* connection,
+                                 std::unique_ptr<apacket> p) {
+    // Once adbd has striped a transport, the connection it started out with still delivers here,
+    // and its packets have to be put in sequence with the host's other connections' first.
+    StripedConnection* striped_connection = t->striped_connection;
+    if (striped_connection && connection != striped_connection) {
+        return striped_connection->HandleRead(std::move(p));
+    }
+
+    if (!check_header(p.get(), t)) {
+        D("%s: remote read: bad header", t->serial.c_str());
+        return false;
+    }
+
+    VLOG(TRANSPORT) << dump_packet(t->serial.c_str(), "from remote", p.get());
+    apacket* packet = p.release();
+
+    // TODO: Does this need to run on the main thread?
+    fdevent_run_on_main_thread([packet, t]() { handle_packet(packet, t); });
+    return true;
+}
+
+#if !ADB_HOST
+StripedConnection* stripe_transport(atransport* t) {
+    check_main_thread();
+    if (StripedConnection* striped_connection = t->striped_connection) {
+        return striped_connection;
+    }
+
+    // The original connection keeps the transport's callbacks, including the error callback
+    // that takes the transport down, so pass any other connection's failure on to it.
+    std::shared_ptr<Connection> primary = t->connection();
+    std::unique_ptr<StripedConnection> striped_connection = StripedConnection::Adopt(primary);
+    striped_connection->SetTransportName(t->serial_name());
+    striped_connection->SetReadCallback([t](Connection* connection, std::unique_ptr<apacket> p) {
+        return handle_remote_packet(t, connection, std::move(p));
+    });
+    striped_connection->SetErrorCallback([primary](Connection*, const std::string& error) {
+        LOG(INFO) << "striped connection terminated: " << error;
+        primary->Stop();
+    });
+    striped_connection->Start();
+
+    StripedConnection* result = striped_connection.get();
+    t->SetConnection(std::move(striped_connection));
+    t->striped_connection = result;
+    return result;
+}
+#endif
+
 static void transport_registration_func(int _fd, unsigned ev, void*) {
     tmsg m;
     atransport* t;
@@ -681,18 +831,8 @@ static void transport_registration_func(int _fd, unsigned ev, void*) {
         // upon a read/write error.
         t->ref_count++;
         t->connection()->SetTransportName(t->serial_name());
-        t->connection()->SetReadCallback([t](Connection*, std::unique_ptr<apacket> p) {
-            if (!check_header(p.get(), t)) {
-                D("%s: remote read: bad header", t->serial.c_str());
-                return false;
-            }
-
-            VLOG(TRANSPORT) << dump_packet(t->serial.c_str(), "from remote", p.get());
-            apacket* packet = p.release();
-
-            // TODO: Does this need to run on the main thread?
-            fdevent_run_on_main_thread([packet, t]() { handle_packet(packet, t); });
-            return true;
+        t->connection()->SetReadCallback([t](Connection* connection, std::unique_ptr<apacket> p) {
+            return handle_remote_packet(t, connection, std::move(p));
         });
         t->connection()->SetErrorCallback([t](Connection*, const std::string& error) {
             LOG(INFO) << t->serial_name() << ": connection terminated: " << error;
@@ -1053,6 +1193,12 @@ const FeatureSet& supported_features() {
             kFeatureAbb,
             kFeatureFixedPushSymlinkTimestamp,
             kFeatureAbbExec,
+            kFeatureSendRecvDeflate,
+            kFeatureListRecursive,
+            kFeatureSyncHash,
+            kFeatureDelayedAck,
+            kFeatureTcpStripes,
+            kFeatureFramebufferStream,
             // Increment ADB_SERVER_VERSION when adding a feature that adbd needs
             // to know about. Otherwise, the client can be stuck running an old
             // version of the server even after upgrading their copy of adb.
@@ -1211,6 +1357,20 @@ std::string list_transports(bool long_listing) {
     return result;
 }
 
+std::string format_transport_stats() {
+    std::lock_guard<std::recursive_mutex> lock(transport_lock);
+
+    std::string result;
+    for (const auto& t : transport_list) {
+        android::base::StringAppendF(&result, "%s transport_id:%" PRIu64 " %s\n",
+                                     t->serial_name().c_str(), t->id,
+                                     t->connection_state_name().c_str());
+        result += t->stats.ToString();
+        result += format_socket_stats(t);
+    }
+    return result;
+}
+
 void close_usb_devices(std::function<bool(const atransport*)> predicate, bool reset) {
     std::lock_guard<std::recursive_mutex> lock(transport_lock);
     for (auto& t : transport_list) {
@@ -30,13 +30,16 @@
 #include <string>
 #include <string_view>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include <android-base/macros.h>
 #include <android-base/thread_annotations.h>
 #include <openssl/rsa.h>
 
 #include "adb.h"
+#include "adb_stats.h"
 #include "adb_unique_fd.h"
 #include "usb.h"
 
@@ -69,6 +72,18 @@ extern const char* const kFeatureFixedPushMkdir;
 extern const char* const kFeatureAbb;
 // adbd properly updates symlink timestamps on push.
 extern const char* const kFeatureFixedPushSymlinkTimestamp;
+// adbd supports deflate-compressed push/pull (ID_SEND_DEFLATE/ID_RECV_DEFLATE).
+extern const char* const kFeatureSendRecvDeflate;
+// adbd supports recursive directory listings (ID_LIST_RECURSIVE).
+extern const char* const kFeatureListRecursive;
+// adbd supports content hashing and partial file updates (ID_HASH/ID_PATCH).
+extern const char* const kFeatureSyncHash;
+// Streams use a byte-based flow control window rather than acknowledging every A_WRTE.
+extern const char* const kFeatureDelayedAck;
+// Network transports can be striped across several TCP connections (see StripedConnection).
+extern const char* const kFeatureTcpStripes;
+// adbd supports the delta-encoded framebuffer-stream: service.
+extern const char* const kFeatureFramebufferStream;
 
 TransportId NextTransportId();
 
@@ -123,6 +138,10 @@ struct BlockingConnection {
     virtual bool Read(apacket* packet) = 0;
     virtual bool Write(apacket* packet) = 0;
 
+    // Write several packets, in order. Connections that can coalesce them into fewer syscalls
+    // should override this; the default calls Write on each packet.
+    virtual bool WriteBatch(const std::vector<std::unique_ptr<apacket>>& packets);
+
     // Terminate a connection.
     // This method must be thread-safe, and must cause concurrent Reads/Writes to terminate.
     // Formerly known as 'Kick' in atransport.
@@ -158,17 +177,97 @@ struct BlockingConnectionAdapter : public Connection {
     std::once_flag error_flag_;
 };
 
+// A Connection that spreads its packets across several underlying connections to the same peer,
+// to get past the limits of a single TCP congestion window. It starts out with one, and only
+// passes packets through. Once a second connection is added, every packet written carries a
+// sequence number (starting at 1) in its data_check field, which the peer's StripedConnection
+// uses to put packets back in order, so that no stream ever sees its packets reordered.
+//
+// The peer has to support kFeatureTcpStripes, and EnableSequencedReads must have been called on
+// both ends before the first extra connection is added.
+struct StripedConnection : public Connection {
+    explicit StripedConnection(std::unique_ptr<Connection> primary);
+    ~StripedConnection();
+
+    // Stripe a connection that is already running with a transport's callbacks, which is how
+    // adbd does it once the host's banner shows that it supports striping. Start doesn't start
+    // |primary| again, and the transport has to pass |primary|'s packets to HandleRead itself.
+    static std::unique_ptr<StripedConnection> Adopt(std::shared_ptr<Connection> primary);
+
+    bool Write(std::unique_ptr<apacket> packet) override final;
+
+    void Start() override final;
+    void Stop() override final;
+
+    // Add another connection to the peer, and start striping across it.
+    void AddConnection(std::unique_ptr<Connection> connection);
+
+    // Interpret nonzero data_check values from the peer as sequence numbers. This must happen
+    // after the CNXN/AUTH handshake, since those packets can carry checksums.
+    void EnableSequencedReads();
+
+    // A secret that the peer presents to join another connection to this one, advertised in the
+    // device's CNXN banner once the host has authenticated.
+    const std::string& token() const { return token_; }
+
+    // Find the started StripedConnection with |token| and add |connection| to it.
+    static bool Join(const std::string& token, std::unique_ptr<Connection> connection);
+
+    // Whether any StripedConnection is running, and so might be joined.
+    static bool Joinable();
+
+    // Put a packet from one of the connections back in sequence, and pass on whatever is ready.
+    bool HandleRead(std::unique_ptr<apacket> packet);
+
+  private:
+    StripedConnection(std::shared_ptr<Connection> primary, bool primary_started);
+
+    void StartConnection(Connection* connection);
+    // Release any reads waiting for space in the reorder buffer, so their threads can exit.
+    void ReleaseReads();
+    void HandleError(const std::string& error);
+
+    const std::string token_;
+    const bool primary_started_;
+
+    std::mutex connections_mutex_;
+    std::vector<std::shared_ptr<Connection>> connections_ GUARDED_BY(connections_mutex_);
+    bool started_ GUARDED_BY(connections_mutex_) = false;
+    bool stopped_ GUARDED_BY(connections_mutex_) = false;
+    uint32_t next_write_sequence_ GUARDED_BY(connections_mutex_) = 1;
+    size_t next_write_connection_ GUARDED_BY(connections_mutex_) = 0;
+
+    std::mutex read_mutex_;
+    std::condition_variable read_cv_;
+    bool sequenced_reads_ GUARDED_BY(read_mutex_) = false;
+    bool read_stopped_ GUARDED_BY(read_mutex_) = false;
+    uint32_t next_read_sequence_ GUARDED_BY(read_mutex_) = 1;
+    std::unordered_map<uint32_t, std::unique_ptr<apacket>> reorder_buffer_ GUARDED_BY(read_mutex_);
+    size_t reorder_buffer_bytes_ GUARDED_BY(read_mutex_) = 0;
+
+    std::once_flag error_flag_;
+};
+
 struct FdConnection : public BlockingConnection {
     explicit FdConnection(unique_fd fd) : fd_(std::move(fd)) {}
 
     bool Read(apacket* packet) override final;
     bool Write(apacket* packet) override final;
+    bool WriteBatch(const std::vector<std::unique_ptr<apacket>>& packets) override final;
 
     void Close() override;
     virtual void Reset() override final { Close(); }
 
+    // Cork the socket (TCP_CORK) while a batch takes more than one writev, so that its tail
+    // doesn't go out in undersized segments. Silently does nothing for sockets that can't cork.
+    void SetCorking(bool value) { cork_ = value; }
+
   private:
+    bool WriteIovecs(std::vector<adb_iovec>* iovs);
+    bool Cork(bool value);
+
     unique_fd fd_;
+    bool cork_ = false;
 };
 
 struct UsbConnection : public BlockingConnection {
@@ -279,6 +378,12 @@ class atransport {
 
     bool IsTcpDevice() const { return type == kTransportLocal; }
 
+    // For network transports that have been striped: the connection (owned by this transport),
+    // and on the host, the token the device sent for joining more connections to it. adbd only
+    // sets the connection up after the host's banner, while the transport is running.
+    std::atomic<StripedConnection*> striped_connection = nullptr;
+    std::string stripe_token;
+
 #if ADB_HOST
     std::shared_ptr<RSA> NextKey();
     void ResetKeys();
@@ -287,6 +392,9 @@ class atransport {
     char token[TOKEN_SIZE] = {};
     size_t failed_auth_attempts = 0;
 
+    // Only touched on the main thread.
+    TransportStats stats;
+
     std::string serial_name() const { return !serial.empty() ? serial : "<unknown>"; }
     std::string connection_state_name() const;
 
@@ -389,6 +497,8 @@ void init_reconnect_handler(void);
 void init_transport_registration(void);
 void init_mdns_transport_discovery(void);
 std::string list_transports(bool long_listing);
+// Formats the stats of every transport and its sockets, for host:stats.
+std::string format_transport_stats();
 atransport* find_transport(const char* serial);
 void kick_all_tcp_devices();
 void kick_all_transports();
@@ -400,6 +510,16 @@ void register_usb_transport(usb_handle* h, const char* serial,
 /* Connect to a network address and register it as a device */
 void connect_device(const std::string& address, std::string* response);
 
+#if ADB_HOST
+// Open the extra connections that $ADB_TCP_STRIPES asks for to a network device that supports
+// kFeatureTcpStripes, in the background.
+void connect_tcp_stripes(atransport* t);
+#else
+// Move a running network transport onto a StripedConnection, once the host has shown that it
+// supports kFeatureTcpStripes, and return it.
+StripedConnection* stripe_transport(atransport* t);
+#endif
+
 /* cause new transports to be init'd and added to the list */
 bool register_socket_transport(unique_fd s, std::string serial, int port, int local,
                                atransport::ReconnectCallback reconnect, int* error = nullptr);
@@ -51,6 +51,44 @@ std::unique_ptr<Connection> MakeConnection<NonblockingFdConnection>(unique_fd fd
     return Connection::FromFd(std::move(fd));
 }
 
+static void SetBlockPoolCounters(benchmark::State& state) {
+    BlockPool::Stats stats = BlockPool::GetStats();
+    state.counters["pool_hits"] = stats.hits;
+    state.counters["pool_misses"] = stats.misses;
+    state.counters["pool_discards"] = stats.discards;
+    BlockPool::ResetStats();
+}
+
+// Allocates and frees a packet-sized Block per iteration, touching every page the way a read
+// into it would. range(1) selects whether the BlockPool is enabled.
+void BM_Block_Allocate(benchmark::State& state) {
+    size_t size = state.range(0);
+    bool pooled = state.range(1);
+    BlockPool::SetMaxCachedBytes(pooled ? BlockPool::kDefaultMaxCachedBytes : 0);
+    BlockPool::ResetStats();
+
+    for (auto _ : state) {
+        Block block(size);
+        for (size_t i = 0; i < size; i += 4096) {
+            block[i] = 0;
+        }
+        benchmark::DoNotOptimize(block.data());
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * size);
+    SetBlockPoolCounters(state);
+
+    BlockPool::SetMaxCachedBytes(BlockPool::kDefaultMaxCachedBytes);
+}
+
+BENCHMARK(BM_Block_Allocate)
+        ->ArgNames({"size", "pooled"})
+        ->Args({4096, 0})
+        ->Args({4096, 1})
+        ->Args({65536, 0})
+        ->Args({65536, 1})
+        ->Args({MAX_PAYLOAD, 0})
+        ->Args({MAX_PAYLOAD, 1});
+
 template <typename ConnectionType>
 void BM_Connection_Unidirectional(benchmark::State& state) {
     int fds[2];
@@ -94,6 +132,7 @@ void BM_Connection_Unidirectional(benchmark::State& state) {
         }
     }
     state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+    SetBlockPoolCounters(state);
 
     client->Stop();
     server->Stop();
@@ -168,6 +207,7 @@ void BM_Connection_Echo(benchmark::State& state) {
         }
     }
     state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+    SetBlockPoolCounters(state);
 
     client->Stop();
     server->Stop();
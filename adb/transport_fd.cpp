@@ -16,6 +16,7 @@
 
 #include <stdint.h>
 
+#include <algorithm>
 #include <deque>
 #include <memory>
 #include <mutex>
@@ -171,7 +172,7 @@ struct NonblockingFdConnection : public Connection {
     WriteResult DispatchWrites() REQUIRES(write_mutex_) {
         CHECK(!write_buffer_.empty());
         auto iovs = write_buffer_.iovecs();
-        ssize_t rc = adb_writev(fd_.get(), iovs.data(), iovs.size());
+        ssize_t rc = adb_writev(fd_.get(), iovs.data(), std::min(iovs.size(), ADB_IOV_MAX));
         if (rc == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 writable_ = false;
@@ -205,6 +206,12 @@ struct NonblockingFdConnection : public Connection {
             write_buffer_.append(std::make_unique<IOVector::block_type>(std::move(packet->payload)));
         }
 
+        // If we're already waiting for POLLOUT, the poll thread will send this along with
+        // everything else that's queued, once the socket drains.
+        if (!writable_) {
+            return true;
+        }
+
         WriteResult result = DispatchWrites();
         if (result == WriteResult::TryAgain) {
             WakeThread();
@@ -25,6 +25,8 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
 #include <functional>
 #include <memory>
@@ -33,6 +35,7 @@
 #include <unordered_map>
 #include <vector>
 
+#include <android-base/parseint.h>
 #include <android-base/parsenetaddress.h>
 #include <android-base/stringprintf.h>
 #include <android-base/thread_annotations.h>
@@ -80,6 +83,34 @@ static auto& local_transports GUARDED_BY(local_transports_lock) =
     *new std::unordered_map<int, atransport*>();
 #endif /* ADB_HOST */
 
+// The longest token a host may present to join a connection to a striped transport.
+static constexpr size_t kMaxStripeTokenLength = 64;
+
+static std::unique_ptr<Connection> make_tcp_connection(unique_fd fd) {
+    auto fd_connection = std::make_unique<FdConnection>(std::move(fd));
+    fd_connection->SetCorking(true);
+    return std::make_unique<BlockingConnectionAdapter>(std::move(fd_connection));
+}
+
+#if ADB_HOST
+// How many TCP connections to stripe each network device's traffic across, from
+// $ADB_TCP_STRIPES. Devices without kFeatureTcpStripes only ever get one.
+static constexpr size_t kMaxTcpStripes = 16;
+
+static size_t tcp_stripe_count() {
+    static const size_t count = []() {
+        const char* env = getenv("ADB_TCP_STRIPES");
+        size_t result = 1;
+        if (env && !android::base::ParseUint(env, &result, kMaxTcpStripes)) {
+            LOG(WARNING) << "ignoring invalid ADB_TCP_STRIPES '" << env << "'";
+            result = 1;
+        }
+        return std::max<size_t>(result, 1);
+    }();
+    return count;
+}
+#endif
+
 bool local_connect(int port) {
     std::string dummy;
     return local_connect_arbitrary_ports(port - 1, port, &dummy) == 0;
@@ -147,6 +178,46 @@ void connect_device(const std::string& address, std::string* response) {
     }
 }
 
+#if ADB_HOST
+void connect_tcp_stripes(atransport* t) {
+    StripedConnection* striped_connection = t->striped_connection;
+    if (!striped_connection || t->stripe_token.empty() || !t->has_feature(kFeatureTcpStripes)) {
+        return;
+    }
+    striped_connection->EnableSequencedReads();
+
+    // Hold a reference to the connection, so that it outlives the thread even if the transport
+    // goes away. Connections added after it's stopped are just dropped.
+    std::shared_ptr<Connection> connection = t->connection();
+    std::thread([connection, striped_connection, address = t->serial, token = t->stripe_token]() {
+        adb_thread_setname("tcp stripes");
+        for (size_t i = 1; i < tcp_stripe_count(); ++i) {
+            std::string error;
+            unique_fd fd;
+            int port;
+            std::string serial;
+            std::tie(fd, port, serial) = tcp_connect(address, &error);
+            if (fd == -1) {
+                LOG(WARNING) << "failed to open extra connection to " << address << ": " << error;
+                return;
+            }
+            disable_tcp_nagle(fd.get());
+
+            amessage msg = {};
+            msg.command = A_STRP;
+            msg.arg0 = i;
+            msg.data_length = token.size();
+            msg.magic = A_STRP ^ 0xffffffff;
+            if (!WriteFdExactly(fd.get(), &msg, sizeof(msg)) || !WriteFdExactly(fd.get(), token)) {
+                PLOG(WARNING) << "failed to join extra connection to " << address;
+                return;
+            }
+
+            striped_connection->AddConnection(make_tcp_connection(std::move(fd)));
+        }
+    }).detach();
+}
+#endif
 
 int local_connect_arbitrary_ports(int console_port, int adb_port, std::string* error) {
     unique_fd fd;
@@ -248,6 +319,68 @@ static void client_socket_thread(int) {
 
 #else  // !ADB_HOST
 
+// How long a new connection has to send its first packet, and how many connections can be
+// waiting to do so at once. Each one ties up a thread until it does.
+static constexpr auto kHandshakeTimeout = 10s;
+static constexpr size_t kMaxPendingHandshakes = 32;
+static std::atomic<size_t> pending_handshakes;
+
+static bool set_receive_timeout(int fd, std::chrono::milliseconds timeout) {
+    struct timeval tv;
+    tv.tv_sec = timeout.count() / 1000;
+    tv.tv_usec = (timeout.count() % 1000) * 1000;
+    return adb_setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0;
+}
+
+static void register_new_socket(unique_fd fd, int port) {
+    std::string serial = android::base::StringPrintf("host-%d", fd.get());
+    register_socket_transport(std::move(fd), std::move(serial), port, 1,
+                              [](atransport*) { return ReconnectResult::Abort; });
+}
+
+// A host adding a connection to a striped transport sends an A_STRP packet with the transport's
+// token, instead of the usual A_CNXN. While any transport has handed out a token, peek at the
+// first packet to tell the two apart.
+static void handshake(unique_fd fd, int port) {
+    if (!set_receive_timeout(fd.get(), kHandshakeTimeout)) {
+        D("server: failed to set handshake timeout: %s", strerror(errno));
+        return;
+    }
+
+    amessage msg;
+    ssize_t rc = TEMP_FAILURE_RETRY(recv(fd.get(), &msg, sizeof(msg), MSG_PEEK | MSG_WAITALL));
+    if (rc != sizeof(msg)) {
+        D("server: no first packet from new connection: %s",
+          rc < 0 ? strerror(errno) : "connection closed");
+        return;
+    }
+
+    if (msg.command == A_STRP && msg.magic == (A_STRP ^ 0xffffffff) &&
+        msg.data_length <= kMaxStripeTokenLength) {
+        std::string token(msg.data_length, '\0');
+        if (!ReadFdExactly(fd.get(), &msg, sizeof(msg)) ||
+            !ReadFdExactly(fd.get(), &token[0], token.size())) {
+            D("server: failed to read stripe token");
+            return;
+        }
+
+        set_receive_timeout(fd.get(), 0ms);
+        if (!StripedConnection::Join(token, make_tcp_connection(std::move(fd)))) {
+            D("server: rejecting connection with unknown stripe token");
+        }
+        return;
+    }
+
+    // The transport's reads have to be able to wait indefinitely.
+    set_receive_timeout(fd.get(), 0ms);
+    register_new_socket(std::move(fd), port);
+}
+
+static void handle_new_socket(unique_fd fd, int port) {
+    handshake(std::move(fd), port);
+    --pending_handshakes;
+}
+
 void server_socket_thread(std::function<unique_fd(int, std::string*)> listen_func, int port) {
     adb_thread_setname("server socket");
 
@@ -275,9 +408,17 @@ void server_socket_thread(std::function<unique_fd(int, std::string*)> listen_fun
             D("server: new connection on fd %d", fd.get());
             close_on_exec(fd.get());
             disable_tcp_nagle(fd.get());
-            std::string serial = android::base::StringPrintf("host-%d", fd.get());
-            register_socket_transport(std::move(fd), std::move(serial), port, 1,
-                                      [](atransport*) { return ReconnectResult::Abort; });
+            if (!StripedConnection::Joinable()) {
+                register_new_socket(std::move(fd), port);
+                continue;
+            }
+
+            if (pending_handshakes >= kMaxPendingHandshakes) {
+                D("server: too many pending connections, dropping fd %d", fd.get());
+                continue;
+            }
+            ++pending_handshakes;
+            std::thread(handle_new_socket, std::move(fd), port).detach();
         }
     }
     D("transport: server_socket_thread() exiting");
@@ -392,8 +533,17 @@ int init_socket_transport(atransport* t, unique_fd fd, int adb_port, int local)
     }
 #endif
 
-    // Regular tcp connection.
-    auto fd_connection = std::make_unique<FdConnection>(std::move(fd));
-    t->SetConnection(std::make_unique<BlockingConnectionAdapter>(std::move(fd_connection)));
+    // Regular tcp connection. The host stripes it from the start when it's been asked to; adbd
+    // waits for the host's banner (see stripe_transport).
+    std::unique_ptr<Connection> connection = make_tcp_connection(std::move(fd));
+    t->striped_connection = nullptr;
+#if ADB_HOST
+    if (tcp_stripe_count() > 1) {
+        auto striped_connection = std::make_unique<StripedConnection>(std::move(connection));
+        t->striped_connection = striped_connection.get();
+        connection = std::move(striped_connection);
+    }
+#endif
+    t->SetConnection(std::move(connection));
     return fail;
 }
@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TRACE_TAG TRANSPORT
+
+#include "sysdeps.h"
+#include "transport.h"
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/thread_annotations.h>
+#include <openssl/rand.h>
+
+#include "adb.h"
+
+// Started StripedConnections, by token.
+static auto& striped_connections_mutex = *new std::mutex();
+static auto& striped_connections GUARDED_BY(striped_connections_mutex) =
+        *new std::unordered_map<std::string, StripedConnection*>();
+
+static std::string GenerateToken() {
+    uint8_t bytes[16];
+    if (RAND_bytes(bytes, sizeof(bytes)) != 1) {
+        LOG(FATAL) << "failed to generate stripe token";
+    }
+
+    std::string result;
+    for (uint8_t byte : bytes) {
+        result += android::base::StringPrintf("%02x", byte);
+    }
+    return result;
+}
+
+// How much payload can be held waiting for an earlier packet before reads from the connections
+// that are ahead stop. The connection carrying the next packet is never the one that waits, since
+// everything it carried before that packet has already been delivered.
+static constexpr size_t kMaxReorderBufferBytes = 16 * MAX_PAYLOAD;
+
+// Sequence numbers skip 0, which marks a packet as unsequenced.
+static uint32_t NextSequence(uint32_t sequence) {
+    return sequence == UINT32_MAX ? 1 : sequence + 1;
+}
+
+StripedConnection::StripedConnection(std::unique_ptr<Connection> primary)
+    : StripedConnection(std::move(primary), false) {}
+
+StripedConnection::StripedConnection(std::shared_ptr<Connection> primary, bool primary_started)
+    : token_(GenerateToken()), primary_started_(primary_started) {
+    connections_.push_back(std::move(primary));
+}
+
+std::unique_ptr<StripedConnection> StripedConnection::Adopt(std::shared_ptr<Connection> primary) {
+    return std::unique_ptr<StripedConnection>(new StripedConnection(std::move(primary), true));
+}
+
+StripedConnection::~StripedConnection() {
+    Stop();
+}
+
+void StripedConnection::StartConnection(Connection* connection) {
+    connection->SetTransportName(transport_name_);
+    connection->SetReadCallback([this](Connection*, std::unique_ptr<apacket> packet) {
+        return HandleRead(std::move(packet));
+    });
+    connection->SetErrorCallback(
+            [this](Connection*, const std::string& error) { HandleError(error); });
+    connection->Start();
+}
+
+void StripedConnection::Start() {
+    std::vector<std::shared_ptr<Connection>> connections;
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        if (started_) {
+            LOG(FATAL) << "StripedConnection(" << transport_name_ << "): started multiple times";
+        }
+        started_ = true;
+        connections = connections_;
+    }
+
+    for (size_t i = primary_started_ ? 1 : 0; i < connections.size(); ++i) {
+        StartConnection(connections[i].get());
+    }
+
+    std::lock_guard<std::mutex> lock(striped_connections_mutex);
+    striped_connections[token_] = this;
+}
+
+void StripedConnection::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(striped_connections_mutex);
+        striped_connections.erase(token_);
+    }
+
+    std::vector<std::shared_ptr<Connection>> connections;
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        if (!started_ || stopped_) {
+            return;
+        }
+        stopped_ = true;
+        connections = connections_;
+    }
+
+    ReleaseReads();
+
+    for (auto& connection : connections) {
+        connection->Stop();
+    }
+    HandleError("requested stop");
+}
+
+void StripedConnection::AddConnection(std::unique_ptr<Connection> connection) {
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    if (!started_ || stopped_) {
+        LOG(INFO) << "StripedConnection(" << transport_name_
+                  << "): dropping connection added while not running";
+        return;
+    }
+
+    StartConnection(connection.get());
+    connections_.push_back(std::move(connection));
+    LOG(INFO) << "StripedConnection(" << transport_name_ << "): striping across "
+              << connections_.size() << " connections";
+}
+
+bool StripedConnection::Join(const std::string& token, std::unique_ptr<Connection> connection) {
+    std::lock_guard<std::mutex> lock(striped_connections_mutex);
+    auto it = striped_connections.find(token);
+    if (it == striped_connections.end()) {
+        return false;
+    }
+    it->second->AddConnection(std::move(connection));
+    return true;
+}
+
+bool StripedConnection::Joinable() {
+    std::lock_guard<std::mutex> lock(striped_connections_mutex);
+    return !striped_connections.empty();
+}
+
+bool StripedConnection::Write(std::unique_ptr<apacket> packet) {
+    // Writes happen with the lock held, so that packets hit each connection's queue in sequence
+    // order. In particular, the first sequenced packet has to go out on the primary connection,
+    // behind everything that was sent before striping started.
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    if (connections_.size() == 1) {
+        return connections_[0]->Write(std::move(packet));
+    }
+
+    packet->msg.data_check = next_write_sequence_;
+    next_write_sequence_ = NextSequence(next_write_sequence_);
+    auto& connection = connections_[next_write_connection_++ % connections_.size()];
+    return connection->Write(std::move(packet));
+}
+
+void StripedConnection::EnableSequencedReads() {
+    std::lock_guard<std::mutex> lock(read_mutex_);
+    sequenced_reads_ = true;
+}
+
+bool StripedConnection::HandleRead(std::unique_ptr<apacket> packet) {
+    std::unique_lock<std::mutex> lock(read_mutex_);
+    uint32_t sequence = packet->msg.data_check;
+    if (!sequenced_reads_ || sequence == 0) {
+        return read_callback_(this, std::move(packet));
+    }
+
+    packet->msg.data_check = 0;
+    read_cv_.wait(lock, [this, sequence]() {
+        return read_stopped_ || sequence == next_read_sequence_ ||
+               reorder_buffer_bytes_ < kMaxReorderBufferBytes;
+    });
+    if (read_stopped_) {
+        return false;
+    }
+
+    if (sequence != next_read_sequence_) {
+        size_t size = packet->payload.size();
+        if (!reorder_buffer_.emplace(sequence, std::move(packet)).second) {
+            LOG(ERROR) << "StripedConnection(" << transport_name_ << "): duplicate sequence number "
+                       << sequence;
+            return false;
+        }
+        reorder_buffer_bytes_ += size;
+        return true;
+    }
+
+    while (packet) {
+        if (!read_callback_(this, std::move(packet))) {
+            return false;
+        }
+        next_read_sequence_ = NextSequence(next_read_sequence_);
+
+        auto it = reorder_buffer_.find(next_read_sequence_);
+        if (it != reorder_buffer_.end()) {
+            packet = std::move(it->second);
+            reorder_buffer_.erase(it);
+            reorder_buffer_bytes_ -= packet->payload.size();
+        }
+    }
+    read_cv_.notify_all();
+    return true;
+}
+
+void StripedConnection::ReleaseReads() {
+    {
+        std::lock_guard<std::mutex> lock(read_mutex_);
+        read_stopped_ = true;
+    }
+    read_cv_.notify_all();
+}
+
+void StripedConnection::HandleError(const std::string& error) {
+    // Nothing after the failed connection's packets can be delivered anyway, and the connections
+    // can't be stopped while their threads are stuck waiting for them.
+    ReleaseReads();
+    std::call_once(error_flag_, [&]() { error_callback_(this, error); });
+}
@@ -16,9 +16,17 @@
 
 #include "transport.h"
 
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
 #include <gtest/gtest.h>
 
 #include "adb.h"
+#include "sysdeps.h"
+#include "sysdeps/chrono.h"
 #include "fdevent_test.h"
 
 struct TransportTest : public FdeventTest {};
@@ -183,3 +191,248 @@ TEST_F(TransportTest, test_matches_target_local) {
         EXPECT_FALSE(t.MatchesTarget("abc:100.100.100.100"));
     }
 }
+
+TEST(FdConnection, WriteBatch) {
+    int fds[2];
+    ASSERT_EQ(0, adb_socketpair(fds));
+    FdConnection writer{unique_fd(fds[0])};
+    FdConnection reader{unique_fd(fds[1])};
+
+    // Not a TCP socket, so this should quietly fall back to not corking.
+    writer.SetCorking(true);
+
+    // Enough packets to need more than one writev, with a mix of empty and nonempty payloads.
+    constexpr size_t kPacketCount = ADB_IOV_MAX + 10;
+    std::vector<std::unique_ptr<apacket>> packets;
+    for (size_t i = 0; i < kPacketCount; ++i) {
+        auto packet = std::make_unique<apacket>();
+        memset(&packet->msg, 0, sizeof(packet->msg));
+        packet->msg.command = A_WRTE;
+        packet->msg.arg0 = i;
+        packet->msg.data_length = i % 3 == 0 ? 0 : i;
+        packet->payload.resize(packet->msg.data_length);
+        if (!packet->payload.empty()) {
+            memset(&packet->payload[0], static_cast<char>(i), packet->payload.size());
+        }
+        packets.push_back(std::move(packet));
+    }
+
+    std::thread write_thread([&]() { ASSERT_TRUE(writer.WriteBatch(packets)); });
+
+    for (size_t i = 0; i < kPacketCount; ++i) {
+        apacket packet;
+        ASSERT_TRUE(reader.Read(&packet));
+        ASSERT_EQ(i, packet.msg.arg0);
+        ASSERT_EQ(packets[i]->msg.data_length, packet.msg.data_length);
+        ASSERT_EQ(packets[i]->payload, packet.payload);
+    }
+
+    write_thread.join();
+}
+
+// A Connection that records what's written to it, and lets the test inject reads.
+struct FakeConnection : public Connection {
+    bool Write(std::unique_ptr<apacket> packet) override {
+        written.push_back(std::move(packet));
+        return true;
+    }
+    void Start() override {}
+    void Stop() override {}
+
+    bool Inject(uint32_t arg0, uint32_t sequence, size_t payload_size = 0) {
+        auto packet = std::make_unique<apacket>();
+        memset(&packet->msg, 0, sizeof(packet->msg));
+        packet->msg.command = A_WRTE;
+        packet->msg.arg0 = arg0;
+        packet->msg.data_check = sequence;
+        packet->msg.data_length = payload_size;
+        packet->payload = apacket::payload_type(payload_size);
+        return read_callback_(this, std::move(packet));
+    }
+
+    std::vector<std::unique_ptr<apacket>> written;
+};
+
+static std::unique_ptr<apacket> MakeStripedPacket(uint32_t arg0) {
+    auto packet = std::make_unique<apacket>();
+    memset(&packet->msg, 0, sizeof(packet->msg));
+    packet->msg.command = A_WRTE;
+    packet->msg.arg0 = arg0;
+    return packet;
+}
+
+TEST(StripedConnection, Write) {
+    auto primary_owner = std::make_unique<FakeConnection>();
+    auto secondary_owner = std::make_unique<FakeConnection>();
+    FakeConnection* primary = primary_owner.get();
+    FakeConnection* secondary = secondary_owner.get();
+
+    StripedConnection striped(std::move(primary_owner));
+    striped.SetReadCallback([](Connection*, std::unique_ptr<apacket>) { return true; });
+    striped.SetErrorCallback([](Connection*, const std::string&) {});
+    striped.Start();
+
+    // With a single connection, packets pass through untouched.
+    ASSERT_TRUE(striped.Write(MakeStripedPacket(0)));
+    ASSERT_EQ(1u, primary->written.size());
+    ASSERT_EQ(0u, primary->written[0]->msg.data_check);
+
+    // Otherwise, they're sequenced and alternate, starting with the primary.
+    ASSERT_TRUE(StripedConnection::Join(striped.token(), std::move(secondary_owner)));
+    ASSERT_FALSE(StripedConnection::Join("bogus", std::make_unique<FakeConnection>()));
+    for (uint32_t i = 1; i <= 4; ++i) {
+        ASSERT_TRUE(striped.Write(MakeStripedPacket(i)));
+    }
+    ASSERT_EQ(3u, primary->written.size());
+    ASSERT_EQ(2u, secondary->written.size());
+    ASSERT_EQ(1u, primary->written[1]->msg.data_check);
+    ASSERT_EQ(2u, secondary->written[0]->msg.data_check);
+    ASSERT_EQ(3u, primary->written[2]->msg.data_check);
+    ASSERT_EQ(4u, secondary->written[1]->msg.data_check);
+
+    striped.Stop();
+}
+
+TEST(StripedConnection, Reorder) {
+    auto primary_owner = std::make_unique<FakeConnection>();
+    auto secondary_owner = std::make_unique<FakeConnection>();
+    FakeConnection* primary = primary_owner.get();
+    FakeConnection* secondary = secondary_owner.get();
+
+    std::vector<uint32_t> received;
+    StripedConnection striped(std::move(primary_owner));
+    striped.SetReadCallback([&received](Connection*, std::unique_ptr<apacket> packet) {
+        received.push_back(packet->msg.arg0);
+        return true;
+    });
+    striped.SetErrorCallback([](Connection*, const std::string&) {});
+    striped.Start();
+    striped.AddConnection(std::move(secondary_owner));
+
+    // Before sequenced reads are enabled, data_check is left alone (it may be a checksum).
+    ASSERT_TRUE(primary->Inject(100, 1234));
+    ASSERT_EQ(std::vector<uint32_t>({100}), received);
+
+    striped.EnableSequencedReads();
+    received.clear();
+    ASSERT_TRUE(primary->Inject(101, 0));
+    ASSERT_TRUE(secondary->Inject(2, 2));
+    ASSERT_TRUE(secondary->Inject(4, 4));
+    ASSERT_EQ(std::vector<uint32_t>({101}), received);
+    ASSERT_TRUE(primary->Inject(1, 1));
+    ASSERT_EQ(std::vector<uint32_t>({101, 1, 2}), received);
+    ASSERT_TRUE(primary->Inject(3, 3));
+    ASSERT_EQ(std::vector<uint32_t>({101, 1, 2, 3, 4}), received);
+
+    striped.Stop();
+}
+
+TEST(StripedConnection, ReorderLimit) {
+    auto primary_owner = std::make_unique<FakeConnection>();
+    auto secondary_owner = std::make_unique<FakeConnection>();
+    FakeConnection* primary = primary_owner.get();
+    FakeConnection* secondary = secondary_owner.get();
+
+    std::atomic<size_t> received = 0;
+    StripedConnection striped(std::move(primary_owner));
+    striped.SetReadCallback([&received](Connection*, std::unique_ptr<apacket>) {
+        ++received;
+        return true;
+    });
+    striped.SetErrorCallback([](Connection*, const std::string&) {});
+    striped.Start();
+    striped.AddConnection(std::move(secondary_owner));
+    striped.EnableSequencedReads();
+
+    // Fill the reorder buffer from the connection that's ahead.
+    uint32_t sequence = 2;
+    for (; sequence < 2 + 16; ++sequence) {
+        ASSERT_TRUE(secondary->Inject(sequence, sequence, MAX_PAYLOAD));
+    }
+    ASSERT_EQ(0u, received);
+
+    // Its next read has to wait until the missing packet arrives.
+    std::atomic<bool> done = false;
+    std::thread ahead([&]() {
+        ASSERT_TRUE(secondary->Inject(sequence, sequence, MAX_PAYLOAD));
+        done = true;
+    });
+    std::this_thread::sleep_for(100ms);
+    ASSERT_FALSE(done);
+
+    ASSERT_TRUE(primary->Inject(1, 1));
+    ahead.join();
+    ASSERT_EQ(sequence, received);
+
+    // Duplicate sequence numbers are an error.
+    ASSERT_TRUE(secondary->Inject(100, sequence + 2));
+    ASSERT_FALSE(secondary->Inject(100, sequence + 2));
+
+    striped.Stop();
+}
+
+TEST(StripedConnection, ReorderLimitStop) {
+    auto primary_owner = std::make_unique<FakeConnection>();
+    auto secondary_owner = std::make_unique<FakeConnection>();
+    FakeConnection* secondary = secondary_owner.get();
+
+    StripedConnection striped(std::move(primary_owner));
+    striped.SetReadCallback([](Connection*, std::unique_ptr<apacket>) { return true; });
+    striped.SetErrorCallback([](Connection*, const std::string&) {});
+    striped.Start();
+    striped.AddConnection(std::move(secondary_owner));
+    striped.EnableSequencedReads();
+
+    uint32_t sequence = 2;
+    for (; sequence < 2 + 16; ++sequence) {
+        ASSERT_TRUE(secondary->Inject(sequence, sequence, MAX_PAYLOAD));
+    }
+
+    // Stopping releases a read that's waiting for room.
+    std::thread ahead([&]() { ASSERT_FALSE(secondary->Inject(sequence, sequence)); });
+    std::this_thread::sleep_for(100ms);
+    striped.Stop();
+    ahead.join();
+}
+
+TEST(StripedConnection, Adopt) {
+    // adbd stripes a connection that the transport has already started with its own callbacks.
+    std::shared_ptr<FakeConnection> primary = std::make_shared<FakeConnection>();
+    auto secondary_owner = std::make_unique<FakeConnection>();
+    FakeConnection* secondary = secondary_owner.get();
+
+    std::unique_ptr<StripedConnection> striped;
+    std::vector<uint32_t> received;
+    auto read_callback = [&striped, &received](Connection* connection,
+                                               std::unique_ptr<apacket> packet) {
+        if (striped && connection != striped.get()) {
+            return striped->HandleRead(std::move(packet));
+        }
+        received.push_back(packet->msg.arg0);
+        return true;
+    };
+    primary->SetReadCallback(read_callback);
+    primary->SetErrorCallback([](Connection*, const std::string&) {});
+
+    ASSERT_FALSE(StripedConnection::Joinable());
+    striped = StripedConnection::Adopt(primary);
+    striped->SetReadCallback(read_callback);
+    std::string error;
+    striped->SetErrorCallback([&error](Connection*, const std::string& e) { error = e; });
+    striped->Start();
+    ASSERT_TRUE(StripedConnection::Joinable());
+    striped->EnableSequencedReads();
+
+    ASSERT_TRUE(striped->Write(MakeStripedPacket(0)));
+    ASSERT_EQ(1u, primary->written.size());
+
+    ASSERT_TRUE(StripedConnection::Join(striped->token(), std::move(secondary_owner)));
+    ASSERT_TRUE(secondary->Inject(2, 2));
+    ASSERT_TRUE(received.empty());
+    ASSERT_TRUE(primary->Inject(1, 1));
+    ASSERT_EQ(std::vector<uint32_t>({1, 2}), received);
+
+    striped->Stop();
+    ASSERT_FALSE(StripedConnection::Joinable());
+    ASSERT_EQ("requested stop", error);
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "types.h"
+
+#include <array>
+#include <mutex>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+
+#include "adb.h"
+
+static_assert(BlockPool::kMaximumSize >= MAX_PAYLOAD, "largest packets can't be pooled");
+
+namespace {
+
+// One free list per power-of-two size class, kMinimumSize to kMaximumSize inclusive.
+constexpr size_t kSizeClassCount = __builtin_ctzll(BlockPool::kMaximumSize) -
+                                   __builtin_ctzll(BlockPool::kMinimumSize) + 1;
+
+struct Pool {
+    std::mutex mutex;
+    std::array<std::vector<char*>, kSizeClassCount> free_lists GUARDED_BY(mutex);
+    size_t max_cached_bytes GUARDED_BY(mutex) = BlockPool::kDefaultMaxCachedBytes;
+    BlockPool::Stats stats GUARDED_BY(mutex);
+};
+
+Pool& GetPool() {
+    static Pool& pool = *new Pool();
+    return pool;
+}
+
+// Returns the size class that |size| rounds up to, or -1 if it isn't pooled.
+int SizeClass(size_t size) {
+    if (size < BlockPool::kMinimumSize || size > BlockPool::kMaximumSize) {
+        return -1;
+    }
+    int log2 = 64 - __builtin_clzll(size - 1);
+    return log2 - __builtin_ctzll(BlockPool::kMinimumSize);
+}
+
+size_t SizeClassBytes(int size_class) {
+    return BlockPool::kMinimumSize << size_class;
+}
+
+}  // namespace
+
+char* BlockPool::Allocate(size_t size, size_t* capacity) {
+    int size_class = SizeClass(size);
+    if (size_class == -1) {
+        *capacity = size;
+        return new char[size];
+    }
+
+    Pool& pool = GetPool();
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        auto& free_list = pool.free_lists[size_class];
+        if (!free_list.empty()) {
+            char* result = free_list.back();
+            free_list.pop_back();
+            *capacity = SizeClassBytes(size_class);
+            pool.stats.cached_bytes -= *capacity;
+            ++pool.stats.hits;
+            return result;
+        }
+        ++pool.stats.misses;
+    }
+
+    // Deliberately not `new char[n]()`, which would zero the buffer.
+    *capacity = SizeClassBytes(size_class);
+    return new char[*capacity];
+}
+
+void BlockPool::Free(char* data, size_t capacity) {
+    int size_class = SizeClass(capacity);
+    if (size_class != -1 && SizeClassBytes(size_class) == capacity) {
+        Pool& pool = GetPool();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if (pool.stats.cached_bytes + capacity <= pool.max_cached_bytes) {
+            pool.free_lists[size_class].push_back(data);
+            pool.stats.cached_bytes += capacity;
+            return;
+        }
+        ++pool.stats.discards;
+    }
+    delete[] data;
+}
+
+void BlockPool::SetMaxCachedBytes(size_t max_cached_bytes) {
+    std::vector<char*> excess;
+    {
+        Pool& pool = GetPool();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.max_cached_bytes = max_cached_bytes;
+
+        // Drop the largest buffers first.
+        for (int size_class = kSizeClassCount - 1;
+             size_class >= 0 && pool.stats.cached_bytes > max_cached_bytes; --size_class) {
+            auto& free_list = pool.free_lists[size_class];
+            while (!free_list.empty() && pool.stats.cached_bytes > max_cached_bytes) {
+                excess.push_back(free_list.back());
+                free_list.pop_back();
+                pool.stats.cached_bytes -= SizeClassBytes(size_class);
+            }
+        }
+    }
+
+    for (char* data : excess) {
+        delete[] data;
+    }
+}
+
+BlockPool::Stats BlockPool::GetStats() {
+    Pool& pool = GetPool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    return pool.stats;
+}
+
+void BlockPool::ResetStats() {
+    Pool& pool = GetPool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    size_t cached_bytes = pool.stats.cached_bytes;
+    pool.stats = {};
+    pool.stats.cached_bytes = cached_bytes;
+}
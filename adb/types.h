@@ -16,6 +16,9 @@
 
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <algorithm>
 #include <deque>
 #include <memory>
@@ -27,6 +30,36 @@
 
 #include "sysdeps/uio.h"
 
+// A process-wide cache of payload buffers, so that every packet doesn't have to go to the
+// allocator (and get cold memory back) for up to MAX_PAYLOAD bytes. Buffers are rounded up to
+// power-of-two size classes between kMinimumSize and kMaximumSize; anything outside that range
+// isn't cached. Safe to use from any thread.
+class BlockPool {
+  public:
+    static constexpr size_t kMinimumSize = 4 * 1024;
+    static constexpr size_t kMaximumSize = 1024 * 1024;
+    static constexpr size_t kDefaultMaxCachedBytes = 4 * 1024 * 1024;
+
+    struct Stats {
+        uint64_t hits = 0;      // Allocations satisfied from the cache.
+        uint64_t misses = 0;    // Cacheable allocations that had to go to the allocator.
+        uint64_t discards = 0;  // Cacheable frees that didn't fit in the cache.
+        size_t cached_bytes = 0;
+    };
+
+    // Returns a buffer of at least |size| bytes, and sets |*capacity| to its actual size.
+    static char* Allocate(size_t size, size_t* capacity);
+
+    // Returns a buffer from Allocate, along with the capacity it returned.
+    static void Free(char* data, size_t capacity);
+
+    // Limits the total size of the free buffers kept, freeing any excess. 0 disables caching.
+    static void SetMaxCachedBytes(size_t max_cached_bytes);
+
+    static Stats GetStats();
+    static void ResetStats();
+};
+
 // Essentially std::vector<char>, except without zero initialization or reallocation.
 struct Block {
     using iterator = char*;
@@ -37,7 +70,7 @@ struct Block {
 
     template <typename Iterator>
     Block(Iterator begin, Iterator end) : Block(end - begin) {
-        std::copy(begin, end, data_.get());
+        std::copy(begin, end, data_);
     }
 
     Block(const Block& copy) = delete;
@@ -73,11 +106,14 @@ struct Block {
     void assign(InputIt begin, InputIt end) {
         clear();
         allocate(end - begin);
-        std::copy(begin, end, data_.get());
+        std::copy(begin, end, data_);
     }
 
     void clear() {
-        data_.reset();
+        if (data_) {
+            BlockPool::Free(data_, capacity_);
+            data_ = nullptr;
+        }
         capacity_ = 0;
         size_ = 0;
     }
@@ -86,11 +122,11 @@ struct Block {
     size_t size() const { return size_; }
     bool empty() const { return size() == 0; }
 
-    char* data() { return data_.get(); }
-    const char* data() const { return data_.get(); }
+    char* data() { return data_; }
+    const char* data() const { return data_; }
 
-    char* begin() { return data_.get(); }
-    const char* begin() const { return data_.get(); }
+    char* begin() { return data_; }
+    const char* begin() const { return data_; }
 
     char* end() { return data() + size_; }
     const char* end() const { return data() + size_; }
@@ -108,16 +144,13 @@ struct Block {
         CHECK_EQ(0ULL, capacity_);
         CHECK_EQ(0ULL, size_);
         if (size != 0) {
-            // This isn't std::make_unique because that's equivalent to `new char[size]()`, which
-            // value-initializes the array instead of leaving it uninitialized. As an optimization,
-            // call new without parentheses to avoid this costly initialization.
-            data_.reset(new char[size]);
-            capacity_ = size;
+            // The buffer is left uninitialized, since zeroing it would be costly.
+            data_ = BlockPool::Allocate(size, &capacity_);
             size_ = size;
         }
     }
 
-    std::unique_ptr<char[]> data_;
+    char* data_ = nullptr;
     size_t capacity_ = 0;
     size_t size_ = 0;
 };
@@ -17,6 +17,7 @@
 #include <gtest/gtest.h>
 
 #include <memory>
+#include <vector>
 #include "types.h"
 
 static std::unique_ptr<IOVector::block_type> create_block(const std::string& string) {
@@ -117,3 +118,60 @@ TEST(IOVector, misaligned_split) {
     ASSERT_EQ(1ULL, bc.size());
     ASSERT_EQ(*create_block("x"), bc.coalesce());
 }
+
+TEST(BlockPool, reuse) {
+    BlockPool::SetMaxCachedBytes(0);
+    BlockPool::SetMaxCachedBytes(BlockPool::kDefaultMaxCachedBytes);
+    BlockPool::ResetStats();
+
+    const char* first_data;
+    {
+        Block block(10000);
+        ASSERT_EQ(16384ULL, block.capacity());
+        ASSERT_EQ(10000ULL, block.size());
+        first_data = block.data();
+    }
+    ASSERT_EQ(16384ULL, BlockPool::GetStats().cached_bytes);
+
+    // Anything in the same size class gets the same buffer back.
+    Block block(16384);
+    ASSERT_EQ(first_data, block.data());
+
+    BlockPool::Stats stats = BlockPool::GetStats();
+    ASSERT_EQ(1ULL, stats.hits);
+    ASSERT_EQ(1ULL, stats.misses);
+    ASSERT_EQ(0ULL, stats.cached_bytes);
+}
+
+TEST(BlockPool, unpooled_sizes) {
+    BlockPool::ResetStats();
+    {
+        Block small(100);
+        ASSERT_EQ(100ULL, small.capacity());
+        Block large(BlockPool::kMaximumSize + 1);
+        ASSERT_EQ(BlockPool::kMaximumSize + 1, large.capacity());
+    }
+    BlockPool::Stats stats = BlockPool::GetStats();
+    ASSERT_EQ(0ULL, stats.hits);
+    ASSERT_EQ(0ULL, stats.misses);
+    ASSERT_EQ(0ULL, stats.discards);
+}
+
+TEST(BlockPool, bounded) {
+    BlockPool::SetMaxCachedBytes(0);
+    BlockPool::SetMaxCachedBytes(2 * BlockPool::kMaximumSize);
+    BlockPool::ResetStats();
+    {
+        std::vector<Block> blocks;
+        for (size_t i = 0; i < 4; ++i) {
+            blocks.emplace_back(BlockPool::kMaximumSize);
+        }
+    }
+    BlockPool::Stats stats = BlockPool::GetStats();
+    ASSERT_EQ(2 * BlockPool::kMaximumSize, stats.cached_bytes);
+    ASSERT_EQ(2ULL, stats.discards);
+
+    BlockPool::SetMaxCachedBytes(0);
+    ASSERT_EQ(0ULL, BlockPool::GetStats().cached_bytes);
+    BlockPool::SetMaxCachedBytes(BlockPool::kDefaultMaxCachedBytes);
+}
@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "compressed_sparse.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include <sparse/sparse.h>
+#include <zlib.h>
+
+#include "util.h"
+
+namespace {
+
+// The on-disk sparse image format, from libsparse's sparse_format.h.
+struct SparseHeader {
+    uint32_t magic;
+    uint16_t major_version;
+    uint16_t minor_version;
+    uint16_t file_hdr_sz;
+    uint16_t chunk_hdr_sz;
+    uint32_t blk_sz;
+    uint32_t total_blks;
+    uint32_t total_chunks;
+    uint32_t image_checksum;
+} __attribute__((packed));
+
+struct SparseChunkHeader {
+    uint16_t chunk_type;
+    uint16_t reserved1;
+    uint32_t chunk_sz;
+    uint32_t total_sz;
+} __attribute__((packed));
+
+constexpr uint16_t CHUNK_TYPE_RAW = 0xCAC1;
+
+// A chunk of the output: its header, and its data, which is compressed if that helped.
+struct Chunk {
+    SparseChunkHeader header;
+    std::vector<char> data;
+};
+
+void Compress(Chunk* chunk) {
+    uLongf len = compressBound(chunk->data.size());
+    std::vector<char> compressed(len);
+    if (compress2(reinterpret_cast<Bytef*>(compressed.data()), &len,
+                  reinterpret_cast<const Bytef*>(chunk->data.data()), chunk->data.size(),
+                  Z_BEST_SPEED) != Z_OK ||
+        len >= chunk->data.size()) {
+        return;
+    }
+    compressed.resize(len);
+    chunk->data = std::move(compressed);
+    chunk->header.chunk_type = kChunkTypeDeflate;
+}
+
+// Takes the sparse image a piece at a time from sparse_file_callback(), and appends it to |out|
+// with its raw chunks split up and compressed. Only a few deflate chunks' worth of raw data is
+// held at once, rather than the whole image.
+class SparseCompressor {
+  public:
+    explicit SparseCompressor(std::vector<char>* out)
+        : out_(out),
+          thread_count_(std::max(1U, std::thread::hardware_concurrency())),
+          batch_size_(thread_count_ * kDeflateChunkSize) {}
+
+    static int Callback(void* priv, const void* data, size_t len);
+
+    // Writes out what's left, once the whole image has been seen.
+    bool Finish(std::string* error);
+
+    const std::string& error() const { return error_; }
+    size_t in_size() const { return in_size_; }
+
+  private:
+    enum class State { kFileHeader, kChunkHeader, kChunkData, kDone };
+
+    bool Write(const char* data, size_t len);
+    bool ParseHeader();
+    void AddData(const char* data, size_t len);
+    void FinishPiece();
+    void Flush();
+
+    std::vector<char>* out_;
+    std::string error_;
+    size_t in_size_ = 0;
+
+    State state_ = State::kFileHeader;
+    // The header being read, and how long it is.
+    std::vector<char> header_buf_;
+    size_t header_len_ = sizeof(SparseHeader);
+
+    SparseHeader header_;
+    uint32_t chunk_blocks_ = 0;
+    uint32_t chunks_seen_ = 0;
+    uint32_t chunks_out_ = 0;
+
+    // The chunk being read, how much of its data is still to come, and the piece of it that's
+    // being filled.
+    SparseChunkHeader chunk_header_;
+    uint64_t chunk_remaining_ = 0;
+    Chunk piece_;
+
+    // Finished pieces, waiting to be compressed (if raw) and written out, in order.
+    std::vector<Chunk> pending_;
+    size_t pending_raw_ = 0;
+    size_t thread_count_;
+    size_t batch_size_;
+};
+
+int SparseCompressor::Callback(void* priv, const void* data, size_t len) {
+    auto self = reinterpret_cast<SparseCompressor*>(priv);
+    self->in_size_ += len;
+    return self->Write(reinterpret_cast<const char*>(data), len) ? 0 : -1;
+}
+
+bool SparseCompressor::Write(const char* data, size_t len) {
+    while (len > 0) {
+        size_t n;
+        switch (state_) {
+            case State::kFileHeader:
+            case State::kChunkHeader:
+                n = std::min(len, header_len_ - header_buf_.size());
+                header_buf_.insert(header_buf_.end(), data, data + n);
+                if (header_buf_.size() == header_len_ && !ParseHeader()) {
+                    return false;
+                }
+                break;
+
+            case State::kChunkData:
+                n = std::min<uint64_t>(len, chunk_remaining_);
+                if (chunk_header_.chunk_type == CHUNK_TYPE_RAW) {
+                    n = std::min(n, size_t(chunk_blocks_) * header_.blk_sz - piece_.data.size());
+                }
+                AddData(data, n);
+                break;
+
+            case State::kDone:
+                error_ = "Sparse file has trailing data";
+                return false;
+        }
+        if (data) data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool SparseCompressor::ParseHeader() {
+    if (state_ == State::kFileHeader) {
+        if (header_len_ == sizeof(header_)) {
+            memcpy(&header_, header_buf_.data(), sizeof(header_));
+            if (header_.file_hdr_sz < sizeof(header_) ||
+                header_.chunk_hdr_sz < sizeof(chunk_header_) || header_.blk_sz == 0 ||
+                header_.blk_sz % sizeof(uint32_t) != 0) {
+                error_ = "Bad sparse file header";
+                return false;
+            }
+            chunk_blocks_ = std::max<uint32_t>(1, kDeflateChunkSize / header_.blk_sz);
+            // Any more of the header is ignored.
+            if (header_.file_hdr_sz > sizeof(header_)) {
+                header_len_ = header_.file_hdr_sz;
+                return true;
+            }
+        }
+
+        // The chunk count is filled in once the raw chunks have been split.
+        out_->clear();
+        out_->resize(header_.file_hdr_sz);
+        memcpy(out_->data(), &header_, sizeof(header_));
+        state_ = header_.total_chunks > 0 ? State::kChunkHeader : State::kDone;
+    } else {
+        memcpy(&chunk_header_, header_buf_.data(), sizeof(chunk_header_));
+        if (chunk_header_.total_sz < header_.chunk_hdr_sz) {
+            error_ = "Bad sparse chunk header";
+            return false;
+        }
+        chunk_remaining_ = chunk_header_.total_sz - header_.chunk_hdr_sz;
+        if (chunk_header_.chunk_type == CHUNK_TYPE_RAW &&
+            chunk_remaining_ != uint64_t(chunk_header_.chunk_sz) * header_.blk_sz) {
+            error_ = "Bad sparse raw chunk size";
+            return false;
+        }
+        piece_.header = chunk_header_;
+        piece_.data.clear();
+        state_ = State::kChunkData;
+        if (chunk_remaining_ == 0) {
+            AddData(nullptr, 0);
+        }
+    }
+    header_buf_.clear();
+    header_len_ = header_.chunk_hdr_sz;
+    return true;
+}
+
+void SparseCompressor::AddData(const char* data, size_t len) {
+    if (data) {
+        piece_.data.insert(piece_.data.end(), data, data + len);
+    } else {
+        piece_.data.resize(piece_.data.size() + len);
+    }
+    chunk_remaining_ -= len;
+
+    bool raw = chunk_header_.chunk_type == CHUNK_TYPE_RAW;
+    if (raw && piece_.data.size() == size_t(chunk_blocks_) * header_.blk_sz) {
+        FinishPiece();
+    }
+    if (chunk_remaining_ == 0) {
+        if (!raw || !piece_.data.empty()) {
+            FinishPiece();
+        }
+        if (++chunks_seen_ == header_.total_chunks) {
+            state_ = State::kDone;
+        } else {
+            state_ = State::kChunkHeader;
+        }
+    }
+}
+
+void SparseCompressor::FinishPiece() {
+    if (piece_.header.chunk_type == CHUNK_TYPE_RAW) {
+        piece_.header.chunk_sz = piece_.data.size() / header_.blk_sz;
+        pending_raw_ += piece_.data.size();
+    }
+    pending_.push_back(std::move(piece_));
+    piece_.header = chunk_header_;
+    piece_.data.clear();
+
+    if (pending_raw_ >= batch_size_) {
+        Flush();
+    }
+}
+
+void SparseCompressor::Flush() {
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i; (i = next++) < pending_.size();) {
+            if (pending_[i].header.chunk_type == CHUNK_TYPE_RAW) {
+                Compress(&pending_[i]);
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min(thread_count_, pending_.size()); ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (auto& chunk : pending_) {
+        chunk.header.total_sz = header_.chunk_hdr_sz + chunk.data.size();
+        size_t pos = out_->size();
+        out_->resize(pos + header_.chunk_hdr_sz);
+        memcpy(&(*out_)[pos], &chunk.header, sizeof(chunk.header));
+        out_->insert(out_->end(), chunk.data.begin(), chunk.data.end());
+    }
+    chunks_out_ += pending_.size();
+    pending_.clear();
+    pending_raw_ = 0;
+}
+
+bool SparseCompressor::Finish(std::string* error) {
+    if (state_ != State::kDone) {
+        *error = "Sparse file is truncated";
+        return false;
+    }
+    Flush();
+
+    header_.total_chunks = chunks_out_;
+    memcpy(out_->data(), &header_, sizeof(header_));
+    return true;
+}
+
+}  // namespace
+
+bool CompressSparseFile(sparse_file* s, std::vector<char>* out, std::string* error) {
+    double start = now();
+    SparseCompressor compressor(out);
+    if (sparse_file_callback(s, true, false, SparseCompressor::Callback, &compressor) < 0) {
+        *error = compressor.error().empty() ? "Error reading sparse file" : compressor.error();
+        return false;
+    }
+    if (!compressor.Finish(error)) {
+        return false;
+    }
+
+    verbose("compressed %zu bytes of sparse data to %zu in %.3fs", compressor.in_size(),
+            out->size(), now() - start);
+    return true;
+}
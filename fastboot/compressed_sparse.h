@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+struct sparse_file;
+
+// A sparse chunk holding a zlib stream that inflates to chunk_sz * blk_sz bytes of raw data. Only
+// sent to devices reporting "deflate" in the "sparse-compression" variable; see
+// libsparse/sparse_format.h.
+static constexpr uint16_t kChunkTypeDeflate = 0xCAC5;
+
+// The most raw data compressed into a single deflate chunk. Larger raw chunks are split, so the
+// pieces can be compressed in parallel.
+static constexpr uint32_t kDeflateChunkSize = 1024 * 1024;
+
+// Writes |s| to |out| in the sparse format, with its raw data in deflate chunks wherever that
+// makes it smaller.
+bool CompressSparseFile(sparse_file* s, std::vector<char>* out, std::string* error);
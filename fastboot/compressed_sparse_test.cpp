@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "compressed_sparse.h"
+
+#include <string.h>
+
+#include <random>
+
+#include <gtest/gtest.h>
+#include <sparse/sparse.h>
+#include <zlib.h>
+
+static constexpr unsigned int kBlockSize = 4096;
+
+static int AppendCallback(void* priv, const void* data, size_t len) {
+    auto image = reinterpret_cast<std::string*>(priv);
+    if (data) {
+        image->append(reinterpret_cast<const char*>(data), len);
+    } else {
+        image->append(len, '\0');
+    }
+    return 0;
+}
+
+// Expands a sparse image, inflating any deflate chunks with zlib's uncompress(). This checks what
+// the host produces; fastbootd's streaming decoder isn't built for the host, so it isn't covered.
+static std::string Expand(const std::vector<char>& sparse, size_t* deflate_chunks) {
+    struct {
+        uint32_t magic;
+        uint16_t major_version;
+        uint16_t minor_version;
+        uint16_t file_hdr_sz;
+        uint16_t chunk_hdr_sz;
+        uint32_t blk_sz;
+        uint32_t total_blks;
+        uint32_t total_chunks;
+        uint32_t image_checksum;
+    } __attribute__((packed)) header;
+    struct {
+        uint16_t chunk_type;
+        uint16_t reserved1;
+        uint32_t chunk_sz;
+        uint32_t total_sz;
+    } __attribute__((packed)) chunk;
+
+    std::string image;
+    *deflate_chunks = 0;
+    memcpy(&header, sparse.data(), sizeof(header));
+    size_t offset = header.file_hdr_sz;
+    for (uint32_t i = 0; i < header.total_chunks; ++i) {
+        memcpy(&chunk, &sparse[offset], sizeof(chunk));
+        const char* data = &sparse[offset + header.chunk_hdr_sz];
+        size_t data_len = chunk.total_sz - header.chunk_hdr_sz;
+        size_t len = size_t(chunk.chunk_sz) * header.blk_sz;
+        switch (chunk.chunk_type) {
+            case 0xCAC1:
+                image.append(data, data_len);
+                break;
+            case 0xCAC2:
+                for (size_t j = 0; j < len; j += sizeof(uint32_t)) {
+                    image.append(data, sizeof(uint32_t));
+                }
+                break;
+            case 0xCAC3:
+                image.append(len, '\0');
+                break;
+            case kChunkTypeDeflate: {
+                std::string inflated(len, '\0');
+                uLongf inflated_len = len;
+                EXPECT_EQ(Z_OK, uncompress(reinterpret_cast<Bytef*>(&inflated[0]), &inflated_len,
+                                           reinterpret_cast<const Bytef*>(data), data_len));
+                EXPECT_EQ(len, inflated_len);
+                image += inflated;
+                ++*deflate_chunks;
+                break;
+            }
+        }
+        offset += chunk.total_sz;
+    }
+    EXPECT_EQ(sparse.size(), offset);
+    return image;
+}
+
+TEST(CompressedSparse, RoundTrip) {
+    // Compressible text, then random data, then a fill, then a gap, then more text spanning
+    // several deflate chunks.
+    std::string text;
+    while (text.size() < kBlockSize * 3) {
+        text += "the quick brown fox jumps over the lazy dog ";
+    }
+    text.resize(kBlockSize * 3);
+
+    std::string random(kBlockSize * 2, '\0');
+    std::mt19937 rng(42);
+    for (auto& c : random) {
+        c = rng();
+    }
+
+    std::string big;
+    while (big.size() < kDeflateChunkSize * 2 + kBlockSize) {
+        big += text;
+    }
+    big.resize(kDeflateChunkSize * 2 + kBlockSize);
+
+    sparse_file* s = sparse_file_new(kBlockSize, 64 * 1024 * 1024);
+    ASSERT_NE(nullptr, s);
+    ASSERT_EQ(0, sparse_file_add_data(s, &text[0], text.size(), 0));
+    ASSERT_EQ(0, sparse_file_add_data(s, &random[0], random.size(), 3));
+    ASSERT_EQ(0, sparse_file_add_fill(s, 0x12345678, kBlockSize * 4, 5));
+    ASSERT_EQ(0, sparse_file_add_data(s, &big[0], big.size(), 100));
+
+    std::vector<char> compressed;
+    std::string error;
+    ASSERT_TRUE(CompressSparseFile(s, &compressed, &error)) << error;
+    EXPECT_LT(compressed.size(), static_cast<size_t>(sparse_file_len(s, true, false)));
+
+    std::string expected;
+    ASSERT_EQ(0, sparse_file_callback(s, false, false, AppendCallback, &expected));
+    size_t deflate_chunks;
+    EXPECT_EQ(expected, Expand(compressed, &deflate_chunks));
+
+    // The text and the three pieces of the big chunk; the random data doesn't compress.
+    EXPECT_EQ(4U, deflate_chunks);
+
+    sparse_file_destroy(s);
+}
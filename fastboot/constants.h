@@ -19,6 +19,7 @@
 #define FB_CMD_DOWNLOAD "download"
 #define FB_CMD_UPLOAD "upload"
 #define FB_CMD_FLASH "flash"
+#define FB_CMD_FLASH_STREAM "flash-stream"
 #define FB_CMD_ERASE "erase"
 #define FB_CMD_BOOT "boot"
 #define FB_CMD_SET_ACTIVE "set_active"
@@ -34,6 +35,7 @@
 #define FB_CMD_UPDATE_SUPER "update-super"
 #define FB_CMD_OEM "oem"
 #define FB_CMD_GSI "gsi"
+#define FB_CMD_HASH_BLOCKS "hash-blocks"
 
 #define RESPONSE_OKAY "OKAY"
 #define RESPONSE_FAIL "FAIL"
@@ -66,3 +68,6 @@
 #define FB_VAR_BATTERY_VOLTAGE "battery-voltage"
 #define FB_VAR_BATTERY_SOC_OK "battery-soc-ok"
 #define FB_VAR_SUPER_PARTITION_NAME "super-partition-name"
+#define FB_VAR_HAS_FLASH_STREAM "has-flash-stream"
+#define FB_VAR_HAS_HASH_BLOCKS "has-hash-blocks"
+#define FB_VAR_SPARSE_COMPRESSION "sparse-compression"
@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "block_writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <android-base/logging.h>
+#include <asyncio/AsyncIO.h>
+
+BlockWriter::BlockWriter(const std::string& path, int fd) : fd_(fd) {
+    // Direct writes have to be aligned to the logical block size, but keep them to whole pages
+    // too, so the buffered writes of any unaligned ends never share a page with them.
+    int block_size;
+    if (ioctl(fd_, BLKSSZGET, &block_size) == 0 && block_size > 0) {
+        alignment_ = std::max<size_t>(alignment_, block_size);
+    }
+
+    direct_fd_.reset(TEMP_FAILURE_RETRY(open(path.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC)));
+    if (direct_fd_ < 0) {
+        PLOG(WARNING) << "Couldn't open " << path << " for direct I/O";
+        return;
+    }
+
+    buffers_.resize(kBufferCount);
+    for (size_t i = 0; i < buffers_.size(); ++i) {
+        void* data;
+        if (posix_memalign(&data, alignment_, kBufferSize) != 0) {
+            LOG(WARNING) << "Couldn't allocate direct I/O buffers";
+            buffers_.clear();
+            return;
+        }
+        buffers_[i].data.reset(static_cast<char*>(data));
+    }
+
+    if (io_setup(kBufferCount, &aio_context_) != 0) {
+        PLOG(WARNING) << "Couldn't set up aio";
+        aio_context_ = 0;
+        buffers_.clear();
+    }
+}
+
+BlockWriter::~BlockWriter() {
+    if (in_flight_ > 0) {
+        Reap(in_flight_);
+    }
+    if (aio_context_ != 0) {
+        io_destroy(aio_context_);
+    }
+}
+
+int BlockWriter::Write(const char* data, size_t len) {
+    while (len > 0 && error_ == 0) {
+        if (!current_) {
+            if (!direct() || offset_ % alignment_ != 0) {
+                // Buffered writes only go as far as the next aligned offset.
+                size_t n = len;
+                if (direct()) {
+                    n = std::min<uint64_t>(n, alignment_ - offset_ % alignment_);
+                }
+                if (WriteBuffered(data, n, offset_) < 0) {
+                    return error_;
+                }
+                data += n;
+                len -= n;
+                offset_ += n;
+                continue;
+            }
+
+            auto free_buffer = [](const Buffer& buffer) { return !buffer.in_flight; };
+            if (in_flight_ == buffers_.size() && Reap(1) < 0) {
+                return error_;
+            }
+            current_ = &*std::find_if(buffers_.begin(), buffers_.end(), free_buffer);
+            current_len_ = 0;
+            current_offset_ = offset_;
+        }
+
+        size_t n = std::min(len, kBufferSize - current_len_);
+        memcpy(current_->data.get() + current_len_, data, n);
+        data += n;
+        len -= n;
+        current_len_ += n;
+        offset_ += n;
+        if (current_len_ == kBufferSize) {
+            Flush();
+        }
+    }
+    return error_;
+}
+
+int BlockWriter::Skip(uint64_t len) {
+    // This must not discard: a sparse image that was split to fit the download buffer relies on
+    // its "don't care" chunks to leave the earlier pieces' data alone.
+    if (Flush() < 0) {
+        return error_;
+    }
+    offset_ += len;
+    return 0;
+}
+
+int BlockWriter::Fill(uint32_t value, uint64_t len) {
+    if (value == 0 && zeroout_supported_ && offset_ % alignment_ == 0 && len % alignment_ == 0) {
+        if (Flush() < 0) {
+            return error_;
+        }
+        uint64_t range[2] = {offset_, len};
+        if (ioctl(fd_, BLKZEROOUT, &range) == 0) {
+            offset_ += len;
+            return 0;
+        }
+        if (errno != ENOTTY && errno != EOPNOTSUPP && errno != EINVAL) {
+            PLOG(ERROR) << "Failed to zero out " << len << " bytes at " << offset_;
+            error_ = -errno;
+            return error_;
+        }
+        zeroout_supported_ = false;
+    }
+
+    std::vector<uint32_t> fill(std::min<uint64_t>(len, kBufferSize) / sizeof(value), value);
+    while (len > 0) {
+        size_t n = std::min<uint64_t>(len, fill.size() * sizeof(value));
+        if (Write(reinterpret_cast<const char*>(fill.data()), n) < 0) {
+            return error_;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+int BlockWriter::Finish() {
+    if (Flush() < 0 || (in_flight_ > 0 && Reap(in_flight_) < 0)) {
+        return error_;
+    }
+    if (fsync(fd_) < 0) {
+        PLOG(ERROR) << "Failed to flush writes";
+        error_ = -errno;
+    }
+    return error_;
+}
+
+int BlockWriter::Flush() {
+    if (!current_) {
+        return error_;
+    }
+    Buffer* buffer = current_;
+    size_t len = current_len_;
+    current_ = nullptr;
+    current_len_ = 0;
+
+    size_t aligned = len - len % alignment_;
+    if (aligned > 0 && Submit(buffer, aligned, current_offset_) < 0) {
+        return error_;
+    }
+    if (aligned < len) {
+        WriteBuffered(buffer->data.get() + aligned, len - aligned, current_offset_ + aligned);
+    }
+    return error_;
+}
+
+int BlockWriter::Submit(Buffer* buffer, size_t len, uint64_t offset) {
+    io_prep_pwrite(&buffer->control, direct_fd_.get(), buffer->data.get(), len, offset);
+    buffer->control.aio_data = buffer - buffers_.data();
+
+    iocb* control = &buffer->control;
+    if (TEMP_FAILURE_RETRY(io_submit(aio_context_, 1, &control)) != 1) {
+        PLOG(ERROR) << "Failed to submit a write of " << len << " bytes at " << offset;
+        error_ = -errno;
+        return error_;
+    }
+    buffer->in_flight = true;
+    ++in_flight_;
+    return 0;
+}
+
+int BlockWriter::WriteBuffered(const char* data, size_t len, uint64_t offset) {
+    // Let any direct writes finish first, so they don't race with reading in the page cache.
+    if (in_flight_ > 0 && Reap(in_flight_) < 0) {
+        return error_;
+    }
+    while (len > 0) {
+        ssize_t n = TEMP_FAILURE_RETRY(pwrite64(fd_, data, len, offset));
+        if (n < 0) {
+            PLOG(ERROR) << "Failed to write " << len << " bytes at " << offset;
+            error_ = -errno;
+            return error_;
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+int BlockWriter::Reap(long min_events) {
+    io_event events[kBufferCount];
+    while (min_events > 0) {
+        int n = io_getevents(aio_context_, min_events, kBufferCount, events, nullptr);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PLOG(ERROR) << "Failed to wait for writes";
+            // There's no telling what state the writes are in; don't wait for them again.
+            in_flight_ = 0;
+            error_ = -errno;
+            return error_;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            Buffer& buffer = buffers_[events[i].data];
+            buffer.in_flight = false;
+            --in_flight_;
+            if (events[i].res != static_cast<int64_t>(buffer.control.aio_nbytes) && error_ == 0) {
+                LOG(ERROR) << "Write of " << buffer.control.aio_nbytes << " bytes at "
+                           << buffer.control.aio_offset << " failed: " << events[i].res;
+                error_ = events[i].res < 0 ? events[i].res : -EIO;
+            }
+        }
+        min_events -= n;
+    }
+    return error_;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <linux/aio_abi.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
+// Writes sequentially to a block device, bypassing the page cache: data is staged in aligned
+// buffers and written with O_DIRECT, several requests at a time, through kernel aio.
+//
+// Anything that isn't aligned to the device's logical block size is written through the regular
+// fd instead, as is everything if the device can't be opened with O_DIRECT or aio isn't available.
+//
+// All methods return 0, or -errno. Once one fails, they all do.
+class BlockWriter {
+  public:
+    static constexpr size_t kBufferSize = 1024 * 1024;
+    static constexpr size_t kBufferCount = 8;
+
+    // |fd| is |path| opened for writing normally. It must outlive the BlockWriter.
+    BlockWriter(const std::string& path, int fd);
+    ~BlockWriter();
+
+    // Writes |len| bytes at the current offset.
+    int Write(const char* data, size_t len);
+
+    // Leaves the next |len| bytes of the device as they are.
+    int Skip(uint64_t len);
+
+    // Fills the next |len| bytes with copies of |value|, zeroing them out on the device itself
+    // if it's zero and the device supports it.
+    int Fill(uint32_t value, uint64_t len);
+
+    // Waits for all of the writes to finish and flushes them to storage.
+    int Finish();
+
+  private:
+    struct Buffer {
+        std::unique_ptr<char, decltype(&free)> data{nullptr, free};
+        iocb control = {};
+        bool in_flight = false;
+    };
+
+    bool direct() const { return aio_context_ != 0; }
+
+    // Submits the buffer being filled, writing any unaligned tail through the regular fd.
+    int Flush();
+    int Submit(Buffer* buffer, size_t len, uint64_t offset);
+    int WriteBuffered(const char* data, size_t len, uint64_t offset);
+
+    // Waits for at least |min_events| writes to finish.
+    int Reap(long min_events);
+
+    int fd_;
+    android::base::unique_fd direct_fd_;
+    aio_context_t aio_context_ = 0;
+    size_t alignment_ = 4096;
+    bool zeroout_supported_ = true;
+    int error_ = 0;
+
+    std::vector<Buffer> buffers_;
+    size_t in_flight_ = 0;
+
+    // The buffer being filled, if any, how much is in it, and where it goes on the device.
+    Buffer* current_ = nullptr;
+    size_t current_len_ = 0;
+    uint64_t current_offset_ = 0;
+
+    // Where the next byte goes.
+    uint64_t offset_ = 0;
+};
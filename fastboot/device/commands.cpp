@@ -102,7 +102,10 @@ bool GetVarHandler(FastbootDevice* device, const std::vector<std::string>& args)
             {FB_VAR_BATTERY_VOLTAGE, {GetBatteryVoltage, nullptr}},
             {FB_VAR_BATTERY_SOC_OK, {GetBatterySoCOk, nullptr}},
             {FB_VAR_HW_REVISION, {GetHardwareRevision, nullptr}},
-            {FB_VAR_SUPER_PARTITION_NAME, {GetSuperPartitionName, nullptr}}};
+            {FB_VAR_SUPER_PARTITION_NAME, {GetSuperPartitionName, nullptr}},
+            {FB_VAR_HAS_FLASH_STREAM, {GetHasFlashStream, nullptr}},
+            {FB_VAR_HAS_HASH_BLOCKS, {GetHasHashBlocks, nullptr}},
+            {FB_VAR_SPARSE_COMPRESSION, {GetSparseCompression, nullptr}}};
 
     if (args.size() < 2) {
         return device->WriteFail("Missing argument");
@@ -212,6 +215,43 @@ bool FlashHandler(FastbootDevice* device, const std::vector<std::string>& args)
     return device->WriteStatus(FastbootResult::OKAY, "Flashing succeeded");
 }
 
+bool FlashStreamHandler(FastbootDevice* device, const std::vector<std::string>& args) {
+    if (args.size() < 3) {
+        return device->WriteStatus(FastbootResult::FAIL, "Invalid arguments");
+    }
+
+    if (GetDeviceLockStatus()) {
+        return device->WriteStatus(FastbootResult::FAIL,
+                                   "Flashing is not allowed on locked devices");
+    }
+
+    // The image doesn't have to fit in memory, so it isn't limited to the max download size.
+    unsigned int size;
+    if (!android::base::ParseUint("0x" + args[2], &size)) {
+        return device->WriteStatus(FastbootResult::FAIL, "Invalid size");
+    }
+    return FlashStream(device, args[1], size);
+}
+
+bool HashBlocksHandler(FastbootDevice* device, const std::vector<std::string>& args) {
+    if (args.size() < 4) {
+        return device->WriteStatus(FastbootResult::FAIL, "Invalid arguments");
+    }
+
+    if (GetDeviceLockStatus()) {
+        return device->WriteStatus(FastbootResult::FAIL,
+                                   "Hashing partitions is not allowed on locked devices");
+    }
+
+    uint32_t extent_size;
+    uint64_t length;
+    if (!android::base::ParseUint("0x" + args[2], &extent_size) ||
+        !android::base::ParseUint("0x" + args[3], &length)) {
+        return device->WriteStatus(FastbootResult::FAIL, "Invalid size");
+    }
+    return HashBlocks(device, args[1], extent_size, length);
+}
+
 bool SetActiveHandler(FastbootDevice* device, const std::vector<std::string>& args) {
     if (args.size() < 2) {
         return device->WriteStatus(FastbootResult::FAIL, "Missing slot argument");
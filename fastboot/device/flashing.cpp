@@ -20,20 +20,28 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <ext4_utils/ext4_utils.h>
 #include <fs_mgr_overlayfs.h>
 #include <fstab/fstab.h>
 #include <liblp/builder.h>
 #include <liblp/liblp.h>
-#include <sparse/sparse.h>
+#include <openssl/sha.h>
+#include <zlib.h>
 
+#include "block_writer.h"
 #include "fastboot_device.h"
 #include "utility.h"
 
@@ -67,57 +75,373 @@ void WipeOverlayfsForPartition(FastbootDevice* device, const std::string& partit
     }
 }
 
-}  // namespace
+// The on-disk sparse image format, from libsparse's sparse_format.h.
+struct SparseHeader {
+    uint32_t magic;
+    uint16_t major_version;
+    uint16_t minor_version;
+    uint16_t file_hdr_sz;
+    uint16_t chunk_hdr_sz;
+    uint32_t blk_sz;
+    uint32_t total_blks;
+    uint32_t total_chunks;
+    uint32_t image_checksum;
+} __attribute__((packed));
+
+struct SparseChunkHeader {
+    uint16_t chunk_type;
+    uint16_t reserved1;
+    uint32_t chunk_sz;
+    uint32_t total_sz;
+} __attribute__((packed));
+
+constexpr uint16_t CHUNK_TYPE_RAW = 0xCAC1;
+constexpr uint16_t CHUNK_TYPE_FILL = 0xCAC2;
+constexpr uint16_t CHUNK_TYPE_DONT_CARE = 0xCAC3;
+constexpr uint16_t CHUNK_TYPE_CRC32 = 0xCAC4;
+// Only sent by the host, when we report it in "sparse-compression".
+constexpr uint16_t CHUNK_TYPE_DEFLATE = 0xCAC5;
 
-int FlashRawDataChunk(int fd, const char* data, size_t len) {
-    size_t ret = 0;
-    while (ret < len) {
-        int this_len = std::min(static_cast<size_t>(1048576UL * 8), len - ret);
-        int this_ret = write(fd, data, this_len);
-        if (this_ret < 0) {
-            PLOG(ERROR) << "Failed to flash data of len " << len;
-            return -1;
+// Writes a raw or sparse image to a block device piece by piece, as it's received, so the whole
+// image never has to be in memory at once. Flash() also uses it, for a completed download.
+class StreamingImageWriter {
+  public:
+    StreamingImageWriter(BlockWriter* block_writer, uint64_t device_size)
+        : block_writer_(block_writer), device_size_(device_size) {}
+    ~StreamingImageWriter() {
+        if (inflater_initialized_) {
+            inflateEnd(&inflater_);
         }
-        data += this_ret;
-        ret += this_ret;
     }
-    return 0;
+
+    // Returns 0, or -errno if the data couldn't be written or isn't a valid image.
+    int Write(const char* data, size_t len);
+
+    // Checks that a complete image was written, once all of it has been passed to Write(), and
+    // waits for it to reach storage.
+    int Finish();
+
+  private:
+    enum class State {
+        kMagic,
+        kSparseHeader,
+        kChunkHeader,
+        kChunkData,
+        kSkip,
+        kDone,
+        kRaw,
+    };
+
+    // Accumulates the next |needed| bytes of the image in header_, returning true once it has them.
+    bool Collect(const char** data, size_t* len, size_t needed);
+
+    int StartChunk();
+
+    // Inflates the next |len| bytes of a deflate chunk's data and writes them out.
+    int Inflate(const char* data, size_t len);
+
+    BlockWriter* block_writer_;
+    uint64_t device_size_;
+    State state_ = State::kMagic;
+    std::vector<char> header_;
+
+    SparseHeader sparse_header_ = {};
+    SparseChunkHeader chunk_header_ = {};
+    uint32_t chunks_seen_ = 0;
+    uint64_t blocks_seen_ = 0;
+
+    // Bytes of the current chunk's data (or the header padding) still to come, and the bytes
+    // written so far for raw images.
+    uint64_t remaining_ = 0;
+    uint64_t raw_size_ = 0;
+
+    // For deflate chunks: the bytes of output still to come, and whether the stream has ended.
+    z_stream inflater_ = {};
+    bool inflater_initialized_ = false;
+    std::vector<char> inflated_;
+    uint64_t inflate_remaining_ = 0;
+    bool inflate_done_ = false;
+};
+
+bool StreamingImageWriter::Collect(const char** data, size_t* len, size_t needed) {
+    size_t n = std::min(needed - header_.size(), *len);
+    header_.insert(header_.end(), *data, *data + n);
+    *data += n;
+    *len -= n;
+    return header_.size() == needed;
 }
 
-int FlashRawData(int fd, const std::vector<char>& downloaded_data) {
-    int ret = FlashRawDataChunk(fd, downloaded_data.data(), downloaded_data.size());
-    if (ret < 0) {
-        return -errno;
+int StreamingImageWriter::Write(const char* data, size_t len) {
+    while (len > 0) {
+        switch (state_) {
+            case State::kMagic: {
+                if (!Collect(&data, &len, sizeof(uint32_t))) {
+                    break;
+                }
+                uint32_t magic;
+                memcpy(&magic, header_.data(), sizeof(magic));
+                if (magic == SPARSE_HEADER_MAGIC) {
+                    state_ = State::kSparseHeader;
+                    break;
+                }
+
+                state_ = State::kRaw;
+                std::vector<char> start = std::move(header_);
+                header_.clear();
+                if (int ret = Write(start.data(), start.size()); ret < 0) {
+                    return ret;
+                }
+                break;
+            }
+
+            case State::kSparseHeader: {
+                if (!Collect(&data, &len, sizeof(SparseHeader))) {
+                    break;
+                }
+                memcpy(&sparse_header_, header_.data(), sizeof(sparse_header_));
+                header_.clear();
+                const SparseHeader& h = sparse_header_;
+                if (h.major_version != 1 || h.file_hdr_sz < sizeof(SparseHeader) ||
+                    h.chunk_hdr_sz < sizeof(SparseChunkHeader) || h.blk_sz == 0 ||
+                    h.blk_sz % 4 != 0) {
+                    LOG(ERROR) << "Invalid sparse image header";
+                    return -EINVAL;
+                }
+                if (uint64_t(h.total_blks) * h.blk_sz > device_size_) {
+                    return -EOVERFLOW;
+                }
+                remaining_ = h.file_hdr_sz - sizeof(SparseHeader);
+                if (remaining_) {
+                    state_ = State::kSkip;
+                } else {
+                    state_ = h.total_chunks ? State::kChunkHeader : State::kDone;
+                }
+                break;
+            }
+
+            case State::kChunkHeader: {
+                if (!Collect(&data, &len, sparse_header_.chunk_hdr_sz)) {
+                    break;
+                }
+                memcpy(&chunk_header_, header_.data(), sizeof(chunk_header_));
+                header_.clear();
+                if (int ret = StartChunk(); ret < 0) {
+                    return ret;
+                }
+                break;
+            }
+
+            case State::kChunkData: {
+                if (chunk_header_.chunk_type == CHUNK_TYPE_RAW) {
+                    size_t n = std::min<uint64_t>(remaining_, len);
+                    if (int ret = block_writer_->Write(data, n); ret < 0) {
+                        return ret;
+                    }
+                    data += n;
+                    len -= n;
+                    remaining_ -= n;
+                } else if (chunk_header_.chunk_type == CHUNK_TYPE_DEFLATE) {
+                    size_t n = std::min<uint64_t>(remaining_, len);
+                    if (int ret = Inflate(data, n); ret < 0) {
+                        return ret;
+                    }
+                    data += n;
+                    len -= n;
+                    remaining_ -= n;
+                    if (remaining_ == 0 && (!inflate_done_ || inflate_remaining_ != 0)) {
+                        LOG(ERROR) << "Deflate chunk doesn't match its size";
+                        return -EINVAL;
+                    }
+                } else if (Collect(&data, &len, sizeof(uint32_t))) {
+                    uint32_t value;
+                    memcpy(&value, header_.data(), sizeof(value));
+                    header_.clear();
+                    remaining_ = 0;
+                    if (chunk_header_.chunk_type == CHUNK_TYPE_FILL) {
+                        int ret = block_writer_->Fill(value, uint64_t(chunk_header_.chunk_sz) *
+                                                                     sparse_header_.blk_sz);
+                        if (ret < 0) {
+                            return ret;
+                        }
+                    }
+                }
+                if (remaining_ == 0 && header_.empty()) {
+                    state_ = chunks_seen_ == sparse_header_.total_chunks ? State::kDone
+                                                                         : State::kChunkHeader;
+                }
+                break;
+            }
+
+            case State::kSkip: {
+                size_t n = std::min<uint64_t>(remaining_, len);
+                data += n;
+                len -= n;
+                remaining_ -= n;
+                if (remaining_ == 0) {
+                    state_ = sparse_header_.total_chunks ? State::kChunkHeader : State::kDone;
+                }
+                break;
+            }
+
+            case State::kDone:
+                LOG(ERROR) << "Trailing data after sparse image";
+                return -EINVAL;
+
+            case State::kRaw:
+                if (raw_size_ + len > device_size_) {
+                    return -EOVERFLOW;
+                }
+                if (int ret = block_writer_->Write(data, len); ret < 0) {
+                    return ret;
+                }
+                raw_size_ += len;
+                len = 0;
+                break;
+        }
     }
-    return ret;
+    return 0;
 }
 
-int WriteCallback(void* priv, const void* data, size_t len) {
-    int fd = reinterpret_cast<long long>(priv);
-    if (!data) {
-        return lseek64(fd, len, SEEK_CUR) >= 0 ? 0 : -errno;
+int StreamingImageWriter::StartChunk() {
+    const SparseChunkHeader& c = chunk_header_;
+    if (c.total_sz < sparse_header_.chunk_hdr_sz) {
+        return -EINVAL;
+    }
+    uint64_t size = uint64_t(c.chunk_sz) * sparse_header_.blk_sz;
+    uint64_t data_size = c.total_sz - sparse_header_.chunk_hdr_sz;
+
+    ++chunks_seen_;
+    blocks_seen_ += c.chunk_sz;
+    if (blocks_seen_ > sparse_header_.total_blks) {
+        LOG(ERROR) << "Sparse image has more blocks than its header says";
+        return -EINVAL;
+    }
+
+    switch (c.chunk_type) {
+        case CHUNK_TYPE_RAW:
+            if (data_size != size) {
+                return -EINVAL;
+            }
+            remaining_ = size;
+            break;
+
+        case CHUNK_TYPE_FILL:
+        case CHUNK_TYPE_CRC32:
+            if (data_size != sizeof(uint32_t)) {
+                return -EINVAL;
+            }
+            remaining_ = sizeof(uint32_t);
+            break;
+
+        case CHUNK_TYPE_DEFLATE:
+            if (data_size == 0) {
+                return -EINVAL;
+            }
+            if (!inflater_initialized_) {
+                if (inflateInit(&inflater_) != Z_OK) {
+                    return -ENOMEM;
+                }
+                inflater_initialized_ = true;
+                inflated_.resize(256 * 1024);
+            } else if (inflateReset(&inflater_) != Z_OK) {
+                return -EINVAL;
+            }
+            inflate_remaining_ = size;
+            inflate_done_ = false;
+            remaining_ = data_size;
+            break;
+
+        case CHUNK_TYPE_DONT_CARE:
+            if (data_size != 0) {
+                return -EINVAL;
+            }
+            if (int ret = block_writer_->Skip(size); ret < 0) {
+                return ret;
+            }
+            remaining_ = 0;
+            break;
+
+        default:
+            LOG(ERROR) << "Unknown sparse chunk type " << c.chunk_type;
+            return -EINVAL;
+    }
+
+    if (remaining_ > 0) {
+        state_ = State::kChunkData;
+    } else {
+        state_ = chunks_seen_ == sparse_header_.total_chunks ? State::kDone : State::kChunkHeader;
     }
-    return FlashRawDataChunk(fd, reinterpret_cast<const char*>(data), len);
+    return 0;
 }
 
-int FlashSparseData(int fd, std::vector<char>& downloaded_data) {
-    struct sparse_file* file = sparse_file_import_buf(downloaded_data.data(), true, false);
-    if (!file) {
-        return -ENOENT;
+int StreamingImageWriter::Inflate(const char* data, size_t len) {
+    if (inflate_done_) {
+        LOG(ERROR) << "Trailing data in deflate chunk";
+        return -EINVAL;
+    }
+    inflater_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    inflater_.avail_in = len;
+    for (;;) {
+        inflater_.next_out = reinterpret_cast<Bytef*>(inflated_.data());
+        inflater_.avail_out = inflated_.size();
+        int ret = inflate(&inflater_, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            LOG(ERROR) << "Invalid deflate chunk: " << ret;
+            return -EINVAL;
+        }
+
+        size_t produced = inflated_.size() - inflater_.avail_out;
+        if (produced > inflate_remaining_) {
+            LOG(ERROR) << "Deflate chunk doesn't match its size";
+            return -EINVAL;
+        }
+        if (int ret = block_writer_->Write(inflated_.data(), produced); ret < 0) {
+            return ret;
+        }
+        inflate_remaining_ -= produced;
+
+        if (ret == Z_STREAM_END) {
+            inflate_done_ = true;
+            break;
+        }
+        // Stop once it's used up all of the input and has no more output waiting.
+        if ((inflater_.avail_in == 0 && inflater_.avail_out != 0) ||
+            (ret == Z_BUF_ERROR && produced == 0)) {
+            break;
+        }
     }
-    return sparse_file_callback(file, false, false, WriteCallback, reinterpret_cast<void*>(fd));
+    if (inflater_.avail_in != 0) {
+        LOG(ERROR) << "Trailing data in deflate chunk";
+        return -EINVAL;
+    }
+    return 0;
 }
 
-int FlashBlockDevice(int fd, std::vector<char>& downloaded_data) {
-    lseek64(fd, 0, SEEK_SET);
-    if (downloaded_data.size() >= sizeof(SPARSE_HEADER_MAGIC) &&
-        *reinterpret_cast<uint32_t*>(downloaded_data.data()) == SPARSE_HEADER_MAGIC) {
-        return FlashSparseData(fd, downloaded_data);
-    } else {
-        return FlashRawData(fd, downloaded_data);
+int StreamingImageWriter::Finish() {
+    switch (state_) {
+        case State::kMagic:
+            // Too short to have been a sparse image.
+            if (header_.empty()) {
+                return -EINVAL;
+            }
+            if (int ret = block_writer_->Write(header_.data(), header_.size()); ret < 0) {
+                return ret;
+            }
+            break;
+
+        case State::kRaw:
+        case State::kDone:
+            break;
+
+        default:
+            LOG(ERROR) << "Truncated sparse image";
+            return -EINVAL;
     }
+    return block_writer_->Finish();
 }
 
+}  // namespace
+
 int Flash(FastbootDevice* device, const std::string& partition_name) {
     PartitionHandle handle;
     if (!OpenPartition(device, partition_name, &handle)) {
@@ -127,11 +451,158 @@ int Flash(FastbootDevice* device, const std::string& partition_name) {
     std::vector<char> data = std::move(device->download_data());
     if (data.size() == 0) {
         return -EINVAL;
-    } else if (data.size() > get_block_device_size(handle.fd())) {
+    }
+    uint64_t device_size = get_block_device_size(handle.fd());
+    if (data.size() > device_size) {
         return -EOVERFLOW;
     }
     WipeOverlayfsForPartition(device, partition_name);
-    return FlashBlockDevice(handle.fd(), data);
+
+    BlockWriter block_writer(handle.path(), handle.fd());
+    StreamingImageWriter writer(&block_writer, device_size);
+    if (int ret = writer.Write(data.data(), data.size()); ret < 0) {
+        return ret;
+    }
+    return writer.Finish();
+}
+
+bool FlashStream(FastbootDevice* device, const std::string& partition_name, uint32_t size) {
+    PartitionHandle handle;
+    if (!OpenPartition(device, partition_name, &handle)) {
+        return device->WriteFail(strerror(ENOENT));
+    }
+    uint64_t device_size = get_block_device_size(handle.fd());
+    if (size == 0) {
+        return device->WriteFail(strerror(EINVAL));
+    } else if (size > device_size) {
+        return device->WriteFail(strerror(EOVERFLOW));
+    }
+
+    if (!device->WriteStatus(FastbootResult::DATA, android::base::StringPrintf("%08x", size))) {
+        return false;
+    }
+    WipeOverlayfsForPartition(device, partition_name);
+
+    // This thread receives into a few buffers while another writes them out, so storage writes
+    // overlap with USB transfers. After an error, the rest of the data is read and dropped, to
+    // keep the protocol in step.
+    static constexpr size_t kBufferSize = 1024 * 1024;
+    static constexpr size_t kBufferCount = 4;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::vector<char>> free_buffers(kBufferCount);
+    std::deque<std::vector<char>> full_buffers;
+    bool received_all = false;
+
+    BlockWriter block_writer(handle.path(), handle.fd());
+    StreamingImageWriter writer(&block_writer, device_size);
+    int result = 0;
+    std::thread write_thread([&]() {
+        for (;;) {
+            std::vector<char> buffer;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() { return !full_buffers.empty() || received_all; });
+                if (full_buffers.empty()) {
+                    return;
+                }
+                buffer = std::move(full_buffers.front());
+                full_buffers.pop_front();
+            }
+            if (result == 0) {
+                result = writer.Write(buffer.data(), buffer.size());
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                free_buffers.push_back(std::move(buffer));
+            }
+            cv.notify_all();
+        }
+    });
+
+    bool received = true;
+    for (uint32_t remaining = size; remaining > 0;) {
+        std::vector<char> buffer;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]() { return !free_buffers.empty(); });
+            buffer = std::move(free_buffers.front());
+            free_buffers.pop_front();
+        }
+        buffer.resize(std::min<size_t>(remaining, kBufferSize));
+        if (!device->HandleData(true, &buffer)) {
+            received = false;
+            break;
+        }
+        remaining -= buffer.size();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            full_buffers.push_back(std::move(buffer));
+        }
+        cv.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        received_all = true;
+    }
+    cv.notify_all();
+    write_thread.join();
+
+    if (!received) {
+        PLOG(ERROR) << "Couldn't download data";
+        return device->WriteFail("Couldn't download data");
+    }
+    if (result == 0) {
+        result = writer.Finish();
+    }
+    if (result < 0) {
+        return device->WriteFail(strerror(-result));
+    }
+    return device->WriteOkay("Flashing succeeded");
+}
+
+bool HashBlocks(FastbootDevice* device, const std::string& partition_name, uint32_t extent_size,
+                uint64_t length) {
+    static constexpr uint32_t kMaxExtentSize = 16 * 1024 * 1024;
+    if (extent_size == 0 || extent_size > kMaxExtentSize || length == 0) {
+        return device->WriteFail(strerror(EINVAL));
+    }
+
+    PartitionHandle handle;
+    if (!OpenPartition(device, partition_name, &handle, O_RDONLY)) {
+        return device->WriteFail(strerror(ENOENT));
+    }
+    if (length > get_block_device_size(handle.fd())) {
+        return device->WriteFail(strerror(EOVERFLOW));
+    }
+    uint64_t count = (length - 1) / extent_size + 1;
+    if (count * SHA256_DIGEST_LENGTH > std::numeric_limits<uint32_t>::max()) {
+        return device->WriteFail(strerror(EOVERFLOW));
+    }
+    posix_fadvise(handle.fd(), 0, length, POSIX_FADV_SEQUENTIAL);
+
+    std::vector<char> hashes(count * SHA256_DIGEST_LENGTH);
+    std::vector<char> extent(extent_size);
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t offset = i * extent_size;
+        size_t len = std::min<uint64_t>(extent_size, length - offset);
+        if (!android::base::ReadFullyAtOffset(handle.fd(), extent.data(), len, offset)) {
+            PLOG(ERROR) << "Failed to read " << partition_name << " at " << offset;
+            return device->WriteFail("Failed to read partition");
+        }
+        SHA256(reinterpret_cast<const uint8_t*>(extent.data()), len,
+               reinterpret_cast<uint8_t*>(&hashes[i * SHA256_DIGEST_LENGTH]));
+    }
+
+    if (!device->WriteStatus(FastbootResult::DATA,
+                             android::base::StringPrintf("%08zx", hashes.size()))) {
+        return false;
+    }
+    if (!device->HandleData(false, &hashes)) {
+        PLOG(ERROR) << "Couldn't send block hashes";
+        return false;
+    }
+    return device->WriteOkay("");
 }
 
 bool UpdateSuper(FastbootDevice* device, const std::string& super_name, bool wipe) {
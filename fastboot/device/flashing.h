@@ -16,10 +16,19 @@
 
 #pragma once
 
+#include <stdint.h>
+
 #include <string>
 #include <vector>
 
 class FastbootDevice;
 
 int Flash(FastbootDevice* device, const std::string& partition_name);
+// Receives |size| bytes of a raw or sparse image and writes them to |partition_name| as they
+// arrive, replying to the host as a flash-stream command.
+bool FlashStream(FastbootDevice* device, const std::string& partition_name, uint32_t size);
+// Replies to a hash-blocks command with the SHA-256 of each |extent_size| bytes of the first
+// |length| bytes of |partition_name|.
+bool HashBlocks(FastbootDevice* device, const std::string& partition_name, uint32_t extent_size,
+                uint64_t length);
 bool UpdateSuper(FastbootDevice* device, const std::string& super_name, bool wipe);
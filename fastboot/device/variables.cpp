@@ -378,6 +378,24 @@ bool GetIsUserspace(FastbootDevice* /* device */, const std::vector<std::string>
     return true;
 }
 
+bool GetHasFlashStream(FastbootDevice* /* device */, const std::vector<std::string>& /* args */,
+                       std::string* message) {
+    *message = "yes";
+    return true;
+}
+
+bool GetHasHashBlocks(FastbootDevice* /* device */, const std::vector<std::string>& /* args */,
+                      std::string* message) {
+    *message = "yes";
+    return true;
+}
+
+bool GetSparseCompression(FastbootDevice* /* device */, const std::vector<std::string>& /* args */,
+                          std::string* message) {
+    *message = "deflate";
+    return true;
+}
+
 std::vector<std::vector<std::string>> GetAllPartitionArgsWithSlot(FastbootDevice* device) {
     std::vector<std::vector<std::string>> args;
     auto partitions = ListPartitions(device);
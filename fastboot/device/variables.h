@@ -50,6 +50,12 @@ bool GetPartitionIsLogical(FastbootDevice* device, const std::vector<std::string
                            std::string* message);
 bool GetIsUserspace(FastbootDevice* device, const std::vector<std::string>& args,
                     std::string* message);
+bool GetHasFlashStream(FastbootDevice* device, const std::vector<std::string>& args,
+                       std::string* message);
+bool GetHasHashBlocks(FastbootDevice* device, const std::vector<std::string>& args,
+                      std::string* message);
+bool GetSparseCompression(FastbootDevice* device, const std::vector<std::string>& args,
+                          std::string* message);
 bool GetHardwareRevision(FastbootDevice* device, const std::vector<std::string>& args,
                          std::string* message);
 bool GetVariant(FastbootDevice* device, const std::vector<std::string>& args, std::string* message);
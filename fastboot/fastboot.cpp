@@ -43,8 +43,19 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#if !defined(_WIN32)
+#include <poll.h>
+#include <sys/wait.h>
+#endif
+
+#include <algorithm>
 #include <chrono>
+#include <deque>
 #include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <optional>
 #include <regex>
 #include <string>
 #include <thread>
@@ -61,6 +72,7 @@
 #include <build/version.h>
 #include <liblp/liblp.h>
 #include <platform_tools_version.h>
+#include <openssl/sha.h>
 #include <sparse/sparse.h>
 #include <ziparchive/zip_archive.h>
 
@@ -90,6 +102,7 @@ static bool g_long_listing = false;
 static constexpr int64_t RESPARSE_LIMIT = 1 * 1024 * 1024 * 1024;
 static uint64_t sparse_limit = 0;
 static int64_t target_sparse_limit = -1;
+static int target_has_flash_stream = -1;
 
 static unsigned g_base_addr = 0x10000000;
 static boot_img_hdr_v2 g_boot_img_hdr = {};
@@ -98,6 +111,7 @@ static std::string g_dtb_path;
 
 static bool g_disable_verity = false;
 static bool g_disable_verification = false;
+static bool g_skip_unchanged = false;
 
 static const std::string convert_fbe_marker_filename("convert_fbe");
 
@@ -419,7 +433,8 @@ static int show_help() {
             "\n"
             "options:\n"
             " -w                         Wipe userdata.\n"
-            " -s SERIAL                  Specify a USB device.\n"
+            " -s SERIAL                  Specify a USB device. Give several to run the\n"
+            "                            commands on each of them at once.\n"
             " -s tcp|udp:HOST[:PORT]     Specify a network device.\n"
             " -S SIZE[K|M|G]             Break into sparse files no larger than SIZE.\n"
             " --force                    Force a flash operation that may be unsafe.\n"
@@ -430,6 +445,8 @@ static int show_help() {
             " --skip-reboot              Don't reboot device after flashing.\n"
             " --disable-verity           Sets disable-verity when flashing vbmeta.\n"
             " --disable-verification     Sets disable-verification when flashing vbmeta.\n"
+            " --skip-unchanged           Only send the parts of each image that differ from\n"
+            "                            what's on the device (userspace fastboot only).\n"
 #if !defined(_WIN32)
             " --wipe-and-use-fbe         Enable file-based encryption, wiping userdata.\n"
 #endif
@@ -611,31 +628,26 @@ static void delete_fbemarker_tmpdir(const std::string& dir) {
     }
 }
 
+// This doesn't print anything on success, since flashall extracts images while it's sending others.
 static int unzip_to_file(ZipArchiveHandle zip, const char* entry_name) {
     unique_fd fd(make_temporary_fd(entry_name));
 
     ZipString zip_entry_name(entry_name);
     ZipEntry zip_entry;
     if (FindEntry(zip, zip_entry_name, &zip_entry) != 0) {
-        fprintf(stderr, "archive does not contain '%s'\n", entry_name);
         errno = ENOENT;
         return -1;
     }
 
-    fprintf(stderr, "extracting %s (%" PRIu32 " MB) to disk...", entry_name,
-            zip_entry.uncompressed_length / 1024 / 1024);
-    double start = now();
     int error = ExtractEntryToFile(zip, &zip_entry, fd);
     if (error != 0) {
-        die("\nfailed to extract '%s': %s", entry_name, ErrorCodeString(error));
+        die("failed to extract '%s': %s", entry_name, ErrorCodeString(error));
     }
 
     if (lseek(fd, 0, SEEK_SET) != 0) {
-        die("\nlseek on extracted file '%s' failed: %s", entry_name, strerror(errno));
+        die("lseek on extracted file '%s' failed: %s", entry_name, strerror(errno));
     }
 
-    fprintf(stderr, " took %.3fs\n", now() - start);
-
     return fd.release();
 }
 
@@ -803,10 +815,9 @@ static void DumpInfo() {
 
 }
 
-static struct sparse_file** load_sparse_files(int fd, int64_t max_size) {
-    struct sparse_file* s = sparse_file_import_auto(fd, false, true);
-    if (!s) die("cannot sparse read file");
-
+// Splits |s| into a null-terminated array of sparse files of at most |max_size| bytes each,
+// taking all of its chunks.
+static struct sparse_file** resparse_file(struct sparse_file* s, int64_t max_size) {
     if (max_size <= 0 || max_size > std::numeric_limits<uint32_t>::max()) {
       die("invalid max size %" PRId64, max_size);
     }
@@ -823,6 +834,13 @@ static struct sparse_file** load_sparse_files(int fd, int64_t max_size) {
     return out_s;
 }
 
+static struct sparse_file** load_sparse_files(int fd, int64_t max_size) {
+    struct sparse_file* s = sparse_file_import_auto(fd, false, true);
+    if (!s) die("cannot sparse read file");
+
+    return resparse_file(s, max_size);
+}
+
 static int64_t get_target_sparse_limit() {
     std::string max_download_size;
     if (fb->GetVar("max-download-size", &max_download_size) != fastboot::SUCCESS ||
@@ -951,9 +969,190 @@ static void rewrite_vbmeta_buffer(struct fastboot_buffer* buf) {
     lseek(fd, 0, SEEK_SET);
 }
 
+// fastbootd can write images as they arrive, rather than downloading them first.
+static bool supports_flash_stream() {
+    if (target_has_flash_stream == -1) {
+        std::string value;
+        target_has_flash_stream =
+                fb->GetVar(FB_VAR_HAS_FLASH_STREAM, &value) == fastboot::SUCCESS && value == "yes";
+    }
+    return target_has_flash_stream;
+}
+
+static bool supports_sparse_compression() {
+    std::string value;
+    if (fb->GetVar(FB_VAR_SPARSE_COMPRESSION, &value) != fastboot::SUCCESS) return false;
+    std::vector<std::string> algorithms = android::base::Split(value, ",");
+    return std::find(algorithms.begin(), algorithms.end(), "deflate") != algorithms.end();
+}
+
+static bool supports_hash_blocks() {
+    std::string value;
+    return fb->GetVar(FB_VAR_HAS_HASH_BLOCKS, &value) == fastboot::SUCCESS && value == "yes";
+}
+
+bool UnchangedBlockFilter::Start(const std::string& partition, sparse_file* s) {
+    int64_t image_size = sparse_file_len(s, false, false);
+    if (kExtentSize % sparse_file_block_size(s) != 0 || image_size <= 0) {
+        return false;
+    }
+
+    Status(android::base::StringPrintf("Comparing '%s'", partition.c_str()));
+    std::vector<char> device_hashes;
+    if (fb->HashBlocks(partition, kExtentSize, image_size, &device_hashes) != fastboot::SUCCESS) {
+        fprintf(stderr, "FAILED (%s)\n", fb->Error().c_str());
+        return false;
+    }
+    size_t hashes_size = device_hashes.size();
+    if (!Start(s, std::move(device_hashes))) {
+        fprintf(stderr, "FAILED (device sent %zu bytes of hashes)\n", hashes_size);
+        return false;
+    }
+    Epilog(0);
+    return true;
+}
+
+bool UnchangedBlockFilter::Start(sparse_file* s, std::vector<char> device_hashes) {
+    block_size_ = sparse_file_block_size(s);
+    image_size_ = sparse_file_len(s, false, false);
+    if (kExtentSize % block_size_ != 0 || image_size_ <= 0) {
+        return false;
+    }
+
+    uint64_t extents = (image_size_ - 1) / kExtentSize + 1;
+    if (device_hashes.size() != extents * SHA256_DIGEST_LENGTH) {
+        return false;
+    }
+    device_hashes_ = std::move(device_hashes);
+    unchanged_.assign(extents, std::nullopt);
+    extent_.resize(kExtentSize);
+    return true;
+}
+
+sparse_file* UnchangedBlockFilter::Filter(sparse_file* s) {
+    out_ = sparse_file_new(block_size_, image_size_);
+    if (!out_) die("Failed to allocate sparse file");
+    out_empty_ = true;
+    data_.clear();
+    offset_ = 0;
+    segments_.clear();
+
+    if (sparse_file_callback(s, false, false, WriteCallback, this) < 0) {
+        die("Failed to read sparse file");
+    }
+    // Anything left over had don't-care blocks after it that weren't passed to the callback.
+    FinishExtent(false);
+
+    if (out_empty_) {
+        sparse_file_destroy(out_);
+        return nullptr;
+    }
+    return out_;
+}
+
+uint64_t UnchangedBlockFilter::skipped_bytes() const {
+    uint64_t result = 0;
+    for (size_t i = 0; i < unchanged_.size(); ++i) {
+        if (unchanged_[i].value_or(false)) {
+            result += std::min<uint64_t>(kExtentSize, image_size_ - i * kExtentSize);
+        }
+    }
+    return result;
+}
+
+int UnchangedBlockFilter::WriteCallback(void* priv, const void* data, size_t len) {
+    reinterpret_cast<UnchangedBlockFilter*>(priv)->Write(reinterpret_cast<const char*>(data), len);
+    return 0;
+}
+
+void UnchangedBlockFilter::Write(const char* data, size_t len) {
+    while (len > 0) {
+        size_t pos = offset_ % kExtentSize;
+        size_t n = std::min<uint64_t>(len, kExtentSize - pos);
+        if (data) {
+            memcpy(&extent_[pos], data, n);
+            if (!segments_.empty() && segments_.back().first + segments_.back().second == pos) {
+                segments_.back().second += n;
+            } else {
+                segments_.emplace_back(pos, n);
+            }
+            data += n;
+        }
+        len -= n;
+        offset_ += n;
+        if (offset_ % kExtentSize == 0 || offset_ == static_cast<uint64_t>(image_size_)) {
+            FinishExtent(true);
+        }
+    }
+}
+
+void UnchangedBlockFilter::FinishExtent(bool complete) {
+    if (segments_.empty()) {
+        return;
+    }
+    uint64_t start = (offset_ - 1) / kExtentSize * kExtentSize;
+    size_t len = offset_ - start;
+
+    if (complete && segments_.size() == 1 && segments_[0].second == len) {
+        size_t index = start / kExtentSize;
+        if (!unchanged_[index]) {
+            uint8_t hash[SHA256_DIGEST_LENGTH];
+            SHA256(reinterpret_cast<const uint8_t*>(extent_.data()), len, hash);
+            unchanged_[index] =
+                    !memcmp(hash, &device_hashes_[index * SHA256_DIGEST_LENGTH], sizeof(hash));
+        }
+        if (*unchanged_[index]) {
+            segments_.clear();
+            return;
+        }
+    }
+
+    for (const auto& [pos, n] : segments_) {
+        AddData(start + pos, &extent_[pos], n);
+    }
+    segments_.clear();
+}
+
+void UnchangedBlockFilter::AddData(uint64_t offset, const char* data, size_t len) {
+    // Keep runs of blocks filled with a single value as fill chunks, rather than sending them.
+    auto fill_value = [&](size_t pos, uint32_t* value) {
+        size_t n = std::min<size_t>(block_size_, len - pos);
+        if (n % sizeof(*value) != 0) return false;
+        memcpy(value, data + pos, sizeof(*value));
+        for (size_t i = sizeof(*value); i < n; i += sizeof(*value)) {
+            if (memcmp(data + pos + i, value, sizeof(*value))) return false;
+        }
+        return true;
+    };
+
+    for (size_t pos = 0; pos < len;) {
+        uint32_t value;
+        bool fill = fill_value(pos, &value);
+        size_t end = pos;
+        uint32_t next;
+        do {
+            end = std::min<size_t>(end + block_size_, len);
+        } while (end < len && fill_value(end, &next) == fill && (!fill || next == value));
+
+        unsigned int block = (offset + pos) / block_size_;
+        int ret;
+        if (fill) {
+            ret = sparse_file_add_fill(out_, value, end - pos, block);
+        } else {
+            data_.emplace_back(data + pos, data + end);
+            ret = sparse_file_add_data(out_, data_.back().data(), end - pos, block);
+        }
+        if (ret < 0) die("Failed to build sparse file");
+        out_empty_ = false;
+        pos = end;
+    }
+}
+
 static void flash_buf(const std::string& partition, struct fastboot_buffer *buf)
 {
     sparse_file** s;
+    bool stream = supports_flash_stream();
+    fb->set_compress_sparse(supports_sparse_compression());
 
     // Rewrite vbmeta if that's what we're flashing and modification has been requested.
     if ((g_disable_verity || g_disable_verification) &&
@@ -961,6 +1160,30 @@ static void flash_buf(const std::string& partition, struct fastboot_buffer *buf)
         rewrite_vbmeta_buffer(buf);
     }
 
+    std::optional<UnchangedBlockFilter> filter;
+    if (g_skip_unchanged && supports_hash_blocks()) {
+        sparse_file* first;
+        if (buf->type == FB_BUFFER_SPARSE) {
+            first = *reinterpret_cast<sparse_file**>(buf->data);
+        } else {
+            lseek(buf->fd, 0, SEEK_SET);
+            first = sparse_file_import_auto(buf->fd, false, false);
+            if (!first) die("cannot sparse read file");
+        }
+
+        filter.emplace();
+        if (!filter->Start(partition, first)) {
+            filter.reset();
+            if (buf->type == FB_BUFFER_FD) sparse_file_destroy(first);
+        } else if (buf->type == FB_BUFFER_FD) {
+            auto files = reinterpret_cast<sparse_file**>(calloc(sizeof(sparse_file*), 2));
+            if (!files) die("Failed to allocate sparse file array");
+            files[0] = first;
+            buf->type = FB_BUFFER_SPARSE;
+            buf->data = files;
+        }
+    }
+
     switch (buf->type) {
         case FB_BUFFER_SPARSE: {
             std::vector<std::pair<sparse_file*, int64_t>> sparse_files;
@@ -971,14 +1194,65 @@ static void flash_buf(const std::string& partition, struct fastboot_buffer *buf)
                 ++s;
             }
 
-            for (size_t i = 0; i < sparse_files.size(); ++i) {
-                const auto& pair = sparse_files[i];
-                fb->FlashPartition(partition, pair.first, pair.second, i + 1, sparse_files.size());
+            auto flash_sparse = [&](sparse_file* file, int64_t sz, size_t current, size_t total) {
+                if (stream) {
+                    fb->FlashStream(partition, file, sz, current, total);
+                } else {
+                    fb->FlashPartition(partition, file, sz, current, total);
+                }
+            };
+
+            if (!filter) {
+                for (size_t i = 0; i < sparse_files.size(); ++i) {
+                    auto [file, sz] = sparse_files[i];
+                    flash_sparse(file, sz, i + 1, sparse_files.size());
+                }
+                break;
             }
+
+            // The filtered file has more chunks than the original, and one rebuilt from an FD
+            // buffer was never split at all, so it may not fit in a download. The pieces are
+            // counted in a first pass, which also makes all the comparisons, so that they can be
+            // numbered as they're sent.
+            auto for_each_piece = [&](auto callback) {
+                for (auto [file, sz] : sparse_files) {
+                    sparse_file* filtered = filter->Filter(file);
+                    if (!filtered) continue;
+
+                    sz = sparse_file_len(filtered, true, false);
+                    int64_t limit = get_sparse_limit(sz);
+                    if (limit == 0) {
+                        callback(filtered, sz);
+                    } else {
+                        sparse_file** pieces = resparse_file(filtered, limit);
+                        for (sparse_file** piece = pieces; *piece; ++piece) {
+                            callback(*piece, sparse_file_len(*piece, true, false));
+                            sparse_file_destroy(*piece);
+                        }
+                        free(pieces);
+                    }
+                    sparse_file_destroy(filtered);
+                }
+            };
+
+            size_t total = 0;
+            for_each_piece([&](sparse_file*, int64_t) { ++total; });
+            size_t current = 0;
+            for_each_piece([&](sparse_file* piece, int64_t sz) {
+                flash_sparse(piece, sz, ++current, total);
+            });
+
+            verbose("skipped %" PRIu64 " unchanged bytes of '%s'", filter->skipped_bytes(),
+                    partition.c_str());
+            if (total == 0) fprintf(stderr, "'%s' is unchanged, skipping it\n", partition.c_str());
             break;
         }
         case FB_BUFFER_FD:
-            fb->FlashPartition(partition, buf->fd, buf->sz);
+            if (stream) {
+                fb->FlashStream(partition, buf->fd, buf->sz);
+            } else {
+                fb->FlashPartition(partition, buf->fd, buf->sz);
+            }
             break;
         default:
             die("unknown buffer type: %d", buf->type);
@@ -1181,14 +1455,186 @@ static void reboot_to_userspace_fastboot() {
     // Reset target_sparse_limit after reboot to userspace fastboot. Max
     // download sizes may differ in bootloader and fastbootd.
     target_sparse_limit = -1;
+    target_has_flash_stream = -1;
 }
 
 class ImageSource {
   public:
     virtual bool ReadFile(const std::string& name, std::vector<char>* out) const = 0;
     virtual int OpenFile(const std::string& name) const = 0;
+
+    // Returns the path of a file with |name|'s contents, extracting it into |dir| if need be, or
+    // "" if there's no such file.
+    virtual std::string ExtractFile(const std::string& name, const std::string& dir) const = 0;
+
+    // Loads |name| to be flashed, resparsing it if it's too big to send in one go.
+    virtual bool LoadBuffer(const std::string& name, fastboot_buffer* buf) const;
 };
 
+bool ImageSource::LoadBuffer(const std::string& name, fastboot_buffer* buf) const {
+    int fd = OpenFile(name);
+    return fd >= 0 && load_buf_fd(fd, buf);
+}
+
+// For -s given more than once: everything flashall or update might need from |source|, extracted
+// and resparsed once before a process is forked for each device, so they all share the work and
+// the memory it uses.
+class SharedImageSource final : public ImageSource {
+  public:
+    // Images are resparsed for the current sparse limit.
+    SharedImageSource(const ImageSource& source, bool skip_secondary);
+
+    // Deletes the files that had to be extracted. Only the parent process should call this.
+    void Cleanup();
+
+    bool ReadFile(const std::string& name, std::vector<char>* out) const override;
+    int OpenFile(const std::string& name) const override;
+    std::string ExtractFile(const std::string& name, const std::string& dir) const override;
+    bool LoadBuffer(const std::string& name, fastboot_buffer* buf) const override;
+
+  private:
+    struct SharedImage {
+        int64_t sz;
+        int64_t image_size;
+        // The resparsed sparse files, if it had to be, and the limit they were resparsed for.
+        sparse_file** files;
+        int64_t limit;
+    };
+
+    void Add(const ImageSource& source, const std::string& name);
+
+    std::string dir_;
+    std::map<std::string, std::string> paths_;
+    std::map<std::string, SharedImage> images_;
+};
+
+static SharedImageSource* g_shared_images = nullptr;
+
+SharedImageSource::SharedImageSource(const ImageSource& source, bool skip_secondary)
+    : dir_(make_temporary_directory()) {
+    Add(source, "android-info.txt");
+    Add(source, "super_empty.img");
+
+    for (size_t i = 0; i < arraysize(images); ++i) {
+        if (images[i].type == ImageType::Extra || (skip_secondary && images[i].IsSecondary())) {
+            continue;
+        }
+        Add(source, images[i].sig_name);
+        double start = now();
+        Add(source, images[i].img_name);
+        auto path = paths_.find(images[i].img_name);
+        if (path == paths_.end()) {
+            continue;
+        }
+
+        // Only announced once it's known to exist, but the time includes extracting it.
+        Status("Preparing '"s + images[i].img_name + "'");
+        last_start_time = start;
+
+        int fd = TEMP_FAILURE_RETRY(open(path->second.c_str(), O_RDONLY | O_BINARY));
+        if (fd == -1) die("cannot open '%s': %s", path->second.c_str(), strerror(errno));
+        SharedImage image = {};
+        image.sz = get_file_size(fd);
+        image.limit = get_sparse_limit(image.sz);
+
+        fastboot_buffer buf;
+        if (!load_buf_fd(fd, &buf)) die("cannot load '%s'", images[i].img_name);
+        image.image_size = buf.image_size;
+        if (buf.type == FB_BUFFER_SPARSE) {
+            // The sparse files read from |fd| when they're sent, so it has to stay open.
+            image.files = reinterpret_cast<sparse_file**>(buf.data);
+        } else {
+            close(fd);
+        }
+        images_.emplace(images[i].img_name, image);
+        Epilog(0);
+    }
+}
+
+void SharedImageSource::Add(const ImageSource& source, const std::string& name) {
+    if (paths_.count(name)) {
+        return;
+    }
+    std::string path = source.ExtractFile(name, dir_);
+    if (!path.empty()) {
+        paths_.emplace(name, path);
+    }
+}
+
+void SharedImageSource::Cleanup() {
+    for (const auto& [name, path] : paths_) {
+        if (android::base::StartsWith(path, dir_ + "/")) {
+            unlink(path.c_str());
+        }
+    }
+    rmdir(dir_.c_str());
+}
+
+bool SharedImageSource::ReadFile(const std::string& name, std::vector<char>* out) const {
+    auto path = paths_.find(name);
+    if (path == paths_.end()) {
+        errno = ENOENT;
+        return false;
+    }
+    return ReadFileToVector(path->second, out);
+}
+
+int SharedImageSource::OpenFile(const std::string& name) const {
+    // Each process opens the files for itself, so they don't share file offsets.
+    auto path = paths_.find(name);
+    if (path == paths_.end()) {
+        errno = ENOENT;
+        return -1;
+    }
+    return TEMP_FAILURE_RETRY(open(path->second.c_str(), O_RDONLY | O_BINARY));
+}
+
+std::string SharedImageSource::ExtractFile(const std::string& name, const std::string&) const {
+    auto path = paths_.find(name);
+    return path == paths_.end() ? "" : path->second;
+}
+
+SharedImageLoad ChooseSharedImageLoad(int64_t device_limit, int64_t shared_limit) {
+    if (device_limit == 0) {
+        return SharedImageLoad::kFd;
+    }
+    // The shared sparse files will do as long as they're small enough for this device.
+    if (shared_limit != 0 && shared_limit <= device_limit) {
+        return SharedImageLoad::kShared;
+    }
+    return SharedImageLoad::kResparse;
+}
+
+bool SharedImageSource::LoadBuffer(const std::string& name, fastboot_buffer* buf) const {
+    auto it = images_.find(name);
+    if (it == images_.end()) {
+        return ImageSource::LoadBuffer(name, buf);
+    }
+    const SharedImage& image = it->second;
+
+    switch (ChooseSharedImageLoad(get_sparse_limit(image.sz), image.files ? image.limit : 0)) {
+        case SharedImageLoad::kFd: {
+            int fd = OpenFile(name);
+            if (fd < 0) {
+                return false;
+            }
+            buf->type = FB_BUFFER_FD;
+            buf->data = nullptr;
+            buf->fd = fd;
+            buf->sz = image.sz;
+            break;
+        }
+        case SharedImageLoad::kShared:
+            buf->type = FB_BUFFER_SPARSE;
+            buf->data = image.files;
+            break;
+        case SharedImageLoad::kResparse:
+            return ImageSource::LoadBuffer(name, buf);
+    }
+    buf->image_size = image.image_size;
+    return true;
+}
+
 class FlashAllTool {
   public:
     FlashAllTool(const ImageSource& source, const std::string& slot_override, bool skip_secondary, bool wipe);
@@ -1200,7 +1646,20 @@ class FlashAllTool {
     void DetermineSecondarySlot();
     void CollectImages();
     void FlashImages(const std::vector<std::pair<const Image*, std::string>>& images);
-    void FlashImage(const Image& image, const std::string& slot, fastboot_buffer* buf);
+    void FlashImage(const Image& image, const std::string& slot, fastboot_buffer* buf,
+                    const std::optional<std::vector<char>>& signature_data);
+
+    // An image read from the source, and resparsed if it's too big to send in one go.
+    struct LoadedImage {
+        bool loaded = false;
+        int load_errno = 0;
+        fastboot_buffer buf;
+        std::optional<std::vector<char>> signature_data;
+        double load_time = 0;
+    };
+
+    // Doesn't talk to the device, so it can run while the previous image is being sent.
+    LoadedImage LoadImage(const Image& image) const;
     void UpdateSuperPartition();
 
     const ImageSource& source_;
@@ -1299,25 +1758,64 @@ void FlashAllTool::CollectImages() {
     }
 }
 
+FlashAllTool::LoadedImage FlashAllTool::LoadImage(const Image& image) const {
+    LoadedImage result;
+    double start = now();
+    if (!source_.LoadBuffer(image.img_name, &result.buf)) {
+        result.load_errno = errno;
+        return result;
+    }
+    result.loaded = true;
+
+    std::vector<char> signature_data;
+    if (source_.ReadFile(image.sig_name, &signature_data)) {
+        result.signature_data = std::move(signature_data);
+    }
+    result.load_time = now() - start;
+    return result;
+}
+
 void FlashAllTool::FlashImages(const std::vector<std::pair<const Image*, std::string>>& images) {
-    for (const auto& [image, slot] : images) {
-        fastboot_buffer buf;
-        int fd = source_.OpenFile(image->img_name);
-        if (fd < 0 || !load_buf_fd(fd, &buf)) {
+    if (images.empty()) {
+        return;
+    }
+
+    // Look up the device's download limit now: loading happens on another thread, which mustn't
+    // talk to the device while this one is.
+    get_sparse_limit(0);
+
+    // Extracting, reading and resparsing the next image happens while the current one is sent
+    // and flashed, so the link isn't left idle in between. Only one image is loaded ahead, to
+    // bound the memory and temporary files used.
+    std::future<LoadedImage> next = std::async(std::launch::async, &FlashAllTool::LoadImage, this,
+                                               std::cref(*images[0].first));
+    for (size_t i = 0; i < images.size(); ++i) {
+        const auto& [image, slot] = images[i];
+        double start = now();
+        LoadedImage loaded = next.get();
+        double wait_time = now() - start;
+        if (i + 1 < images.size()) {
+            next = std::async(std::launch::async, &FlashAllTool::LoadImage, this,
+                              std::cref(*images[i + 1].first));
+        }
+
+        if (!loaded.loaded) {
             if (image->optional_if_no_image) {
                 continue;
             }
-            die("could not load '%s': %s", image->img_name, strerror(errno));
+            die("could not load '%s': %s", image->img_name, strerror(loaded.load_errno));
         }
-        FlashImage(*image, slot, &buf);
+        verbose("loaded '%s' in %.3fs, waited %.3fs for it", image->img_name, loaded.load_time,
+                wait_time);
+        FlashImage(*image, slot, &loaded.buf, loaded.signature_data);
     }
 }
 
-void FlashAllTool::FlashImage(const Image& image, const std::string& slot, fastboot_buffer* buf) {
-    auto flash = [&, this](const std::string& partition_name) {
-        std::vector<char> signature_data;
-        if (source_.ReadFile(image.sig_name, &signature_data)) {
-            fb->Download("signature", signature_data);
+void FlashAllTool::FlashImage(const Image& image, const std::string& slot, fastboot_buffer* buf,
+                              const std::optional<std::vector<char>>& signature_data) {
+    auto flash = [&](const std::string& partition_name) {
+        if (signature_data) {
+            fb->Download("signature", *signature_data);
             fb->RawCommand("signature", "installing signature");
         }
 
@@ -1369,6 +1867,7 @@ class ZipImageSource final : public ImageSource {
     explicit ZipImageSource(ZipArchiveHandle zip) : zip_(zip) {}
     bool ReadFile(const std::string& name, std::vector<char>* out) const override;
     int OpenFile(const std::string& name) const override;
+    std::string ExtractFile(const std::string& name, const std::string& dir) const override;
 
   private:
     ZipArchiveHandle zip_;
@@ -1382,7 +1881,33 @@ int ZipImageSource::OpenFile(const std::string& name) const {
     return unzip_to_file(zip_, name.c_str());
 }
 
+std::string ZipImageSource::ExtractFile(const std::string& name, const std::string& dir) const {
+    ZipString zip_entry_name(name.c_str());
+    ZipEntry zip_entry;
+    if (FindEntry(zip_, zip_entry_name, &zip_entry) != 0) {
+        return "";
+    }
+
+    std::string path = dir + "/" + name;
+    unique_fd fd(TEMP_FAILURE_RETRY(
+            open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC | O_BINARY, 0600)));
+    if (fd == -1) {
+        die("failed to create '%s': %s", path.c_str(), strerror(errno));
+    }
+    int error = ExtractEntryToFile(zip_, &zip_entry, fd);
+    if (error != 0) {
+        die("failed to extract '%s': %s", name.c_str(), ErrorCodeString(error));
+    }
+    return path;
+}
+
 static void do_update(const char* filename, const std::string& slot_override, bool skip_secondary) {
+    if (g_shared_images) {
+        FlashAllTool tool(*g_shared_images, slot_override, skip_secondary, false);
+        tool.Flash();
+        return;
+    }
+
     ZipArchiveHandle zip;
     int error = OpenArchive(filename, &zip);
     if (error != 0) {
@@ -1399,6 +1924,7 @@ class LocalImageSource final : public ImageSource {
   public:
     bool ReadFile(const std::string& name, std::vector<char>* out) const override;
     int OpenFile(const std::string& name) const override;
+    std::string ExtractFile(const std::string& name, const std::string& dir) const override;
 };
 
 bool LocalImageSource::ReadFile(const std::string& name, std::vector<char>* out) const {
@@ -1414,11 +1940,211 @@ int LocalImageSource::OpenFile(const std::string& name) const {
     return open(path.c_str(), O_RDONLY | O_BINARY);
 }
 
+std::string LocalImageSource::ExtractFile(const std::string& name, const std::string&) const {
+    auto path = find_item_given_name(name);
+    return access(path.c_str(), R_OK) == 0 ? path : "";
+}
+
 static void do_flashall(const std::string& slot_override, bool skip_secondary, bool wipe) {
+    if (g_shared_images) {
+        FlashAllTool tool(*g_shared_images, slot_override, skip_secondary, wipe);
+        tool.Flash();
+        return;
+    }
+
     FlashAllTool tool(LocalImageSource(), slot_override, skip_secondary, wipe);
     tool.Flash();
 }
 
+#if !defined(_WIN32)
+
+// Returns the download size reported by |device|, or 0 if it doesn't report one. The device is
+// opened by a short-lived child, so that the parent never opens one itself before forking the
+// processes that flash them: on macOS, a process that has used IOKit and CoreFoundation can't
+// use them again after fork() without exec().
+static int64_t get_device_sparse_limit(const char* device) {
+    int fds[2];
+    if (pipe(fds) == -1) die("pipe failed: %s", strerror(errno));
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == -1) die("fork failed: %s", strerror(errno));
+    if (pid == 0) {
+        close(fds[0]);
+        serial = device;
+        int64_t limit;
+        {
+            std::unique_ptr<Transport> transport(open_device());
+            fastboot::FastBootDriver driver(transport.get());
+            fb = &driver;
+            limit = get_target_sparse_limit();
+            fb = nullptr;
+        }
+        _exit(android::base::WriteFully(fds[1], &limit, sizeof(limit)) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    unique_fd output(fds[0]);
+    int64_t limit;
+    if (!android::base::ReadFully(output.get(), &limit, sizeof(limit))) {
+        limit = 0;
+    }
+    if (TEMP_FAILURE_RETRY(waitpid(pid, nullptr, 0)) == -1) {
+        die("waitpid failed: %s", strerror(errno));
+    }
+    return limit;
+}
+
+// Returns the smallest download size reported by any of |serials|, or 0 if none of them do.
+static int64_t get_shared_sparse_limit(const std::vector<const char*>& serials) {
+    int64_t limit = 0;
+    for (const char* device : serials) {
+        int64_t device_limit = get_device_sparse_limit(device);
+        if (device_limit > 0 && (limit == 0 || device_limit < limit)) {
+            limit = device_limit;
+        }
+    }
+    return limit;
+}
+
+// For -s given more than once: if the commands include flashall or update, prepares their images
+// once for all of the devices.
+static void prepare_shared_images(const std::vector<const char*>& serials,
+                                  const std::vector<std::string>& args, bool skip_secondary) {
+    auto command = std::find_if(args.begin(), args.end(), [](const std::string& arg) {
+        return arg == "flashall" || arg == "update";
+    });
+    if (command == args.end()) {
+        return;
+    }
+
+    // Resparse for the device that takes the smallest downloads, so every device can use them.
+    if (sparse_limit == 0) {
+        target_sparse_limit = get_shared_sparse_limit(serials);
+    }
+
+    if (*command == "flashall") {
+        g_shared_images = new SharedImageSource(LocalImageSource(), skip_secondary);
+    } else {
+        std::string filename = command + 1 != args.end() ? *(command + 1) : "update.zip";
+        ZipArchiveHandle zip;
+        int error = OpenArchive(filename.c_str(), &zip);
+        if (error != 0) {
+            die("failed to open zip file '%s': %s", filename.c_str(), ErrorCodeString(error));
+        }
+        g_shared_images = new SharedImageSource(ZipImageSource(zip), skip_secondary);
+        CloseArchive(zip);
+    }
+
+    // Each device looks up its own limit again.
+    target_sparse_limit = -1;
+}
+
+// For -s given more than once: forks a process for each device, which returns from here with
+// |serial| set to run the commands. A device failing only stops its own process. The parent
+// passes on the processes' output a line at a time, prefixed with their serials, then reports
+// how each one did and exits.
+static void fork_for_each_device(const std::vector<const char*>& serials) {
+    struct Child {
+        const char* serial;
+        pid_t pid;
+        unique_fd output;
+        std::string line;
+        double time;
+    };
+    std::vector<Child> children;
+    const double start = now();
+
+    fflush(stdout);
+    fflush(stderr);
+    for (const char* device : serials) {
+        int fds[2];
+        if (pipe(fds) == -1) die("pipe failed: %s", strerror(errno));
+
+        pid_t pid = fork();
+        if (pid == -1) die("fork failed: %s", strerror(errno));
+        if (pid == 0) {
+            for (auto& child : children) {
+                child.output.reset();
+            }
+            close(fds[0]);
+            dup2(fds[1], STDOUT_FILENO);
+            dup2(fds[1], STDERR_FILENO);
+            close(fds[1]);
+            setvbuf(stdout, nullptr, _IOLBF, 0);
+            serial = device;
+            return;
+        }
+        close(fds[1]);
+        children.push_back({device, pid, unique_fd(fds[0]), "", 0});
+    }
+
+    size_t running = children.size();
+    while (running > 0) {
+        std::vector<pollfd> fds;
+        std::vector<Child*> readers;
+        for (auto& child : children) {
+            if (child.output != -1) {
+                fds.push_back({child.output.get(), POLLIN, 0});
+                readers.push_back(&child);
+            }
+        }
+        if (poll(fds.data(), fds.size(), -1) == -1) {
+            if (errno == EINTR) continue;
+            die("poll failed: %s", strerror(errno));
+        }
+
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (fds[i].revents == 0) continue;
+            Child* child = readers[i];
+
+            char buf[4096];
+            ssize_t n = TEMP_FAILURE_RETRY(read(child->output.get(), buf, sizeof(buf)));
+            if (n > 0) {
+                child->line.append(buf, n);
+                size_t end;
+                while ((end = child->line.find('\n')) != std::string::npos) {
+                    fprintf(stderr, "%s: %s\n", child->serial, child->line.substr(0, end).c_str());
+                    child->line.erase(0, end + 1);
+                }
+                continue;
+            }
+
+            if (!child->line.empty()) {
+                fprintf(stderr, "%s: %s\n", child->serial, child->line.c_str());
+            }
+            child->output.reset();
+            child->time = now() - start;
+            --running;
+        }
+    }
+
+    if (g_shared_images) {
+        g_shared_images->Cleanup();
+    }
+
+    size_t failed = 0;
+    fprintf(stderr, "--------------------------------------------\n");
+    for (auto& child : children) {
+        int status;
+        if (TEMP_FAILURE_RETRY(waitpid(child.pid, &status, 0)) == -1) {
+            die("waitpid failed: %s", strerror(errno));
+        }
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            fprintf(stderr, "%-22s OKAY [%7.3fs]\n", child.serial, child.time);
+        } else {
+            fprintf(stderr, "%-22s FAILED\n", child.serial);
+            ++failed;
+        }
+    }
+    fprintf(stderr, "Finished %zu devices, %zu failed. Total time: %.3fs\n", children.size(), failed,
+            now() - start);
+    exit(failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+#endif
+
 static std::string next_arg(std::vector<std::string>* args) {
     if (args->empty()) syntax_error("expected argument");
     std::string result = args->front();
@@ -1598,6 +2324,7 @@ int FastBootTool::Main(int argc, char* argv[]) {
     int longindex;
     std::string slot_override;
     std::string next_active;
+    std::vector<const char*> serials;
 
     g_boot_img_hdr.kernel_addr = 0x00008000;
     g_boot_img_hdr.ramdisk_addr = 0x01000000;
@@ -1622,6 +2349,7 @@ int FastBootTool::Main(int argc, char* argv[]) {
         {"set-active", optional_argument, 0, 'a'},
         {"skip-reboot", no_argument, 0, 0},
         {"skip-secondary", no_argument, 0, 0},
+        {"skip-unchanged", no_argument, 0, 0},
         {"slot", required_argument, 0, 0},
         {"tags-offset", required_argument, 0, 0},
         {"dtb", required_argument, 0, 0},
@@ -1670,6 +2398,8 @@ int FastBootTool::Main(int argc, char* argv[]) {
                 skip_reboot = true;
             } else if (name == "skip-secondary") {
                 skip_secondary = true;
+            } else if (name == "skip-unchanged") {
+                g_skip_unchanged = true;
             } else if (name == "slot") {
                 slot_override = optarg;
             } else if (name == "dtb-offset") {
@@ -1703,7 +2433,7 @@ int FastBootTool::Main(int argc, char* argv[]) {
                     g_long_listing = true;
                     break;
                 case 's':
-                    serial = optarg;
+                    serials.push_back(optarg);
                     break;
                 case 'S':
                     if (!android::base::ParseByteCount(optarg, &sparse_limit)) {
@@ -1727,6 +2457,8 @@ int FastBootTool::Main(int argc, char* argv[]) {
     argc -= optind;
     argv += optind;
 
+    if (serials.size() == 1) serial = serials[0];
+
     if (argc == 0 && !wants_wipe && !wants_set_active) syntax_error("no command");
 
     if (argc > 0 && !strcmp(*argv, "devices")) {
@@ -1738,6 +2470,16 @@ int FastBootTool::Main(int argc, char* argv[]) {
         return show_help();
     }
 
+    if (serials.size() > 1) {
+#if defined(_WIN32)
+        die("-s can only be given once on Windows");
+#else
+        prepare_shared_images(serials, std::vector<std::string>(argv, argv + argc),
+                              skip_secondary || slot_override == "all");
+        fork_for_each_device(serials);
+#endif
+    }
+
     Transport* transport = open_device();
     if (transport == nullptr) {
         return 1;
@@ -26,8 +26,18 @@
  * SUCH DAMAGE.
  */
 
+#include <stdint.h>
+
+#include <deque>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include <bootimg.h>
 
+struct sparse_file;
+
 class FastBootTool {
   public:
     int Main(int argc, char* argv[]);
@@ -35,3 +45,62 @@ class FastBootTool {
     void ParseOsPatchLevel(boot_img_hdr_v1*, const char*);
     void ParseOsVersion(boot_img_hdr_v1*, const char*);
 };
+
+// How a process flashing one of several devices loads an image that was prepared for all of them:
+// as is, from the copy resparsed for the device taking the smallest downloads, or resparsed again
+// for itself.
+enum class SharedImageLoad { kFd, kShared, kResparse };
+
+// |device_limit| is the size this device needs the image resparsed to, or 0 if it takes the image
+// in one go. |shared_limit| is the size the shared copy was resparsed to, or 0 if it wasn't.
+SharedImageLoad ChooseSharedImageLoad(int64_t device_limit, int64_t shared_limit);
+
+// For --skip-unchanged: rebuilds an image's sparse files without the extents whose contents match
+// what's already on the device. They're left as "don't care", so the device doesn't touch them.
+// Extents that aren't entirely covered by one sparse file's data are always sent.
+class UnchangedBlockFilter {
+  public:
+    // The size of the extents the device hashes. Each one is either sent in full or skipped.
+    static constexpr uint32_t kExtentSize = 256 * 1024;
+
+    // Fetches the hashes of |partition|'s current contents to compare |s|, the image's first
+    // sparse file, against. Returns false if the device couldn't provide them.
+    bool Start(const std::string& partition, sparse_file* s);
+
+    // Compares |s| against |device_hashes|, the SHA-256 of each extent of the partition, instead
+    // of asking the device. Returns false if they don't cover the image.
+    bool Start(sparse_file* s, std::vector<char> device_hashes);
+
+    // Returns a copy of |s| with only its changed extents, or nullptr if there's nothing left.
+    // The copy's data is only valid until the next call. Filtering the same file again only
+    // repeats the comparisons that weren't already made.
+    sparse_file* Filter(sparse_file* s);
+
+    // How much of the image has been found to be unchanged so far.
+    uint64_t skipped_bytes() const;
+
+  private:
+    static int WriteCallback(void* priv, const void* data, size_t len);
+
+    void Write(const char* data, size_t len);
+    void FinishExtent(bool complete);
+    void AddData(uint64_t offset, const char* data, size_t len);
+
+    std::vector<char> device_hashes_;
+    int64_t image_size_ = 0;
+    unsigned int block_size_ = 0;
+
+    // Whether each extent matched the device's hash, once it's been compared.
+    std::vector<std::optional<bool>> unchanged_;
+
+    // The filtered sparse file being built, and the copies of changed data it points to.
+    sparse_file* out_ = nullptr;
+    bool out_empty_ = true;
+    std::deque<std::vector<char>> data_;
+
+    // The offset of the next byte of the expanded image, and what's been seen of the extent it's
+    // in: the (offset, length) of each run of data, with don't-care gaps between them.
+    uint64_t offset_ = 0;
+    std::vector<char> extent_;
+    std::vector<std::pair<size_t, size_t>> segments_;
+};
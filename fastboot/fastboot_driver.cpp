@@ -30,6 +30,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -46,6 +47,7 @@
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 
+#include "compressed_sparse.h"
 #include "constants.h"
 #include "transport.h"
 
@@ -53,6 +55,9 @@ using android::base::StringPrintf;
 
 namespace fastboot {
 
+// Downloads and compressions of less than this say more about latency than throughput.
+static constexpr size_t kMinRateSampleSize = 8 * 1024 * 1024;
+
 /*************************** PUBLIC *******************************/
 FastBootDriver::FastBootDriver(Transport* transport, DriverCallbacks driver_callbacks,
                                bool no_checks)
@@ -97,6 +102,27 @@ RetCode FastBootDriver::GetVar(const std::string& key, std::string* val,
     return RawCommand(FB_CMD_GETVAR ":" + key, val, info);
 }
 
+RetCode FastBootDriver::HashBlocks(const std::string& partition, uint32_t extent_size,
+                                   uint64_t length, std::vector<char>* hashes) {
+    std::string cmd = StringPrintf(FB_CMD_HASH_BLOCKS ":%s:%x:%" PRIx64, partition.c_str(),
+                                   extent_size, length);
+    RetCode ret;
+    int dsize = 0;
+    if ((ret = RawCommand(cmd, nullptr, nullptr, &dsize))) {
+        return ret;
+    }
+    if (!dsize) {
+        error_ = "Device sent no block hashes";
+        return BAD_DEV_RESP;
+    }
+
+    hashes->resize(dsize);
+    if ((ret = ReadBuffer(*hashes))) {
+        return ret;
+    }
+    return HandleResponse();
+}
+
 RetCode FastBootDriver::GetVarAll(std::vector<std::string>* response) {
     std::string tmp;
     return GetVar("all", &tmp, response);
@@ -148,6 +174,22 @@ RetCode FastBootDriver::FlashPartition(const std::string& partition, sparse_file
     return Flash(partition);
 }
 
+RetCode FastBootDriver::FlashStream(const std::string& partition, int fd, uint32_t size) {
+    prolog_(StringPrintf("Writing '%s' (%u KB)", partition.c_str(), size / 1024));
+    auto result = SendData(FB_CMD_FLASH_STREAM ":" + partition, fd, size, nullptr, nullptr);
+    epilog_(result);
+    return result;
+}
+
+RetCode FastBootDriver::FlashStream(const std::string& partition, sparse_file* s, uint32_t size,
+                                    size_t current, size_t total) {
+    prolog_(StringPrintf("Writing sparse '%s' %zu/%zu (%u KB)", partition.c_str(), current, total,
+                         size / 1024));
+    auto result = SendData(FB_CMD_FLASH_STREAM ":" + partition, s, false, nullptr, nullptr);
+    epilog_(result);
+    return result;
+}
+
 RetCode FastBootDriver::Partitions(std::vector<std::tuple<std::string, uint64_t>>* partitions) {
     std::vector<std::string> all;
     RetCode ret;
@@ -179,6 +221,11 @@ RetCode FastBootDriver::Download(const std::string& name, int fd, size_t size,
 
 RetCode FastBootDriver::Download(int fd, size_t size, std::string* response,
                                  std::vector<std::string>* info) {
+    return SendData(FB_CMD_DOWNLOAD, fd, size, response, info);
+}
+
+RetCode FastBootDriver::SendData(const std::string& command, int fd, size_t size,
+                                 std::string* response, std::vector<std::string>* info) {
     RetCode ret;
 
     if ((size <= 0 || size > MAX_DOWNLOAD_SIZE) && !disable_checks_) {
@@ -187,14 +234,16 @@ RetCode FastBootDriver::Download(int fd, size_t size, std::string* response,
     }
 
     uint32_t u32size = static_cast<uint32_t>(size);
-    if ((ret = DownloadCommand(u32size, response, info))) {
+    if ((ret = DataCommand(command, u32size, response, info))) {
         return ret;
     }
 
     // Write the buffer
+    auto start = std::chrono::steady_clock::now();
     if ((ret = SendBuffer(fd, size))) {
         return ret;
     }
+    RecordLinkRate(size, start);
 
     // Wait for response
     return HandleResponse(response, info);
@@ -242,6 +291,11 @@ RetCode FastBootDriver::Download(const std::string& partition, struct sparse_fil
 
 RetCode FastBootDriver::Download(sparse_file* s, bool use_crc, std::string* response,
                                  std::vector<std::string>* info) {
+    return SendData(FB_CMD_DOWNLOAD, s, use_crc, response, info);
+}
+
+RetCode FastBootDriver::SendData(const std::string& command, sparse_file* s, bool use_crc,
+                                 std::string* response, std::vector<std::string>* info) {
     error_ = "";
     int64_t size = sparse_file_len(s, true, use_crc);
     if (size <= 0 || size > MAX_DOWNLOAD_SIZE) {
@@ -250,10 +304,37 @@ RetCode FastBootDriver::Download(sparse_file* s, bool use_crc, std::string* resp
     }
 
     RetCode ret;
+    if (compress_sparse_ && !use_crc && ShouldCompress()) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<char> compressed;
+        if (!CompressSparseFile(s, &compressed, &error_)) {
+            return IO_ERROR;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (static_cast<uint64_t>(size) >= kMinRateSampleSize && elapsed.count() > 0) {
+            compress_rate_ = size / elapsed.count();
+            compress_ratio_ = static_cast<double>(compressed.size()) / size;
+        }
+
+        // Splitting up raw chunks adds headers, so incompressible data can end up a little larger.
+        if (compressed.size() < static_cast<uint64_t>(size)) {
+            if ((ret = DataCommand(command, compressed.size(), response, info))) {
+                return ret;
+            }
+            start = std::chrono::steady_clock::now();
+            if ((ret = SendBuffer(compressed))) {
+                return ret;
+            }
+            RecordLinkRate(compressed.size(), start);
+            return HandleResponse(response, info);
+        }
+    }
+
     uint32_t u32size = static_cast<uint32_t>(size);
-    if ((ret = DownloadCommand(u32size, response, info))) {
+    if ((ret = DataCommand(command, u32size, response, info))) {
         return ret;
     }
+    auto start = std::chrono::steady_clock::now();
 
     struct SparseCBPrivate {
         FastBootDriver* self;
@@ -276,10 +357,29 @@ RetCode FastBootDriver::Download(sparse_file* s, bool use_crc, std::string* resp
     if (cb_priv.tpbuf.size() && (ret = SendBuffer(cb_priv.tpbuf))) {
         return ret;
     }
+    RecordLinkRate(size, start);
 
     return HandleResponse(response, info);
 }
 
+bool FastBootDriver::ShouldCompress() const {
+    // The link is measured first, with raw data, and then compression.
+    if (link_rate_ == 0) {
+        return false;
+    }
+    if (compress_rate_ == 0) {
+        return true;
+    }
+    return 1 / compress_rate_ + compress_ratio_ / link_rate_ < 1 / link_rate_;
+}
+
+void FastBootDriver::RecordLinkRate(size_t size, std::chrono::steady_clock::time_point start) {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (size >= kMinRateSampleSize && elapsed.count() > 0) {
+        link_rate_ = size / elapsed.count();
+    }
+}
+
 RetCode FastBootDriver::Upload(const std::string& outfile, std::string* response,
                                std::vector<std::string>* info) {
     prolog_("Uploading '" + outfile + "'");
@@ -392,7 +492,12 @@ RetCode FastBootDriver::RawCommand(const std::string& cmd, std::string* response
 
 RetCode FastBootDriver::DownloadCommand(uint32_t size, std::string* response,
                                         std::vector<std::string>* info) {
-    std::string cmd(android::base::StringPrintf("%s:%08" PRIx32, FB_CMD_DOWNLOAD, size));
+    return DataCommand(FB_CMD_DOWNLOAD, size, response, info);
+}
+
+RetCode FastBootDriver::DataCommand(const std::string& command, uint32_t size,
+                                    std::string* response, std::vector<std::string>* info) {
+    std::string cmd(android::base::StringPrintf("%s:%08" PRIx32, command.c_str(), size));
     RetCode ret;
     if ((ret = RawCommand(cmd, response, info))) {
         return ret;
@@ -26,6 +26,7 @@
  * SUCH DAMAGE.
  */
 #pragma once
+#include <chrono>
 #include <cstdlib>
 #include <deque>
 #include <limits>
@@ -93,8 +94,17 @@ class FastBootDriver {
                   std::vector<std::string>* info = nullptr);
     RetCode Flash(const std::string& partition, std::string* response = nullptr,
                   std::vector<std::string>* info = nullptr);
+    // Writes an image to |partition| as it's sent, without downloading it first. Only devices
+    // reporting "has-flash-stream" support this.
+    RetCode FlashStream(const std::string& partition, int fd, uint32_t sz);
+    RetCode FlashStream(const std::string& partition, sparse_file* s, uint32_t sz, size_t current,
+                        size_t total);
     RetCode GetVar(const std::string& key, std::string* val,
                    std::vector<std::string>* info = nullptr);
+    // Fetches the SHA-256 of each |extent_size| bytes of the first |length| bytes of |partition|.
+    // Only devices reporting "has-hash-blocks" support this.
+    RetCode HashBlocks(const std::string& partition, uint32_t extent_size, uint64_t length,
+                       std::vector<char>* hashes);
     RetCode GetVarAll(std::vector<std::string>* response);
     RetCode Reboot(std::string* response = nullptr, std::vector<std::string>* info = nullptr);
     RetCode RebootTo(std::string target, std::string* response = nullptr,
@@ -121,6 +131,11 @@ class FastBootDriver {
     std::string Error();
     RetCode WaitForDisconnect();
 
+    // Whether sparse files may be sent with their raw data compressed. Only devices reporting
+    // "deflate" in "sparse-compression" support this. Even then, each one is only compressed if
+    // that's expected to get it to the device sooner (see ShouldCompress).
+    void set_compress_sparse(bool compress) { compress_sparse_ = compress; }
+
     // Note: set_transport will return the previous transport.
     Transport* set_transport(Transport* transport);
     Transport* transport() const { return transport_; }
@@ -143,6 +158,14 @@ class FastBootDriver {
     Transport* transport_;
 
   private:
+    // Sends "|command|:%08x" and then, once the device has replied with DATA, the data itself.
+    RetCode SendData(const std::string& command, int fd, size_t size, std::string* response,
+                     std::vector<std::string>* info);
+    RetCode SendData(const std::string& command, sparse_file* s, bool use_crc,
+                     std::string* response, std::vector<std::string>* info);
+    RetCode DataCommand(const std::string& command, uint32_t size, std::string* response,
+                        std::vector<std::string>* info);
+
     RetCode SendBuffer(int fd, size_t size);
     RetCode SendBuffer(const std::vector<char>& buf);
     RetCode SendBuffer(const void* buf, size_t size);
@@ -155,11 +178,25 @@ class FastBootDriver {
 
     int SparseWriteCallback(std::vector<char>& tpbuf, const char* data, size_t len);
 
+    // Whether compressing a sparse file should get it to the device sooner than sending it raw,
+    // going by the downloads and compressions so far. A compressed download can't start until
+    // all of it has been compressed, since its size goes first, so that only pays off when the
+    // link is slow compared to compression.
+    bool ShouldCompress() const;
+    void RecordLinkRate(size_t size, std::chrono::steady_clock::time_point start);
+
     std::string error_;
     std::function<void(const std::string&)> prolog_;
     std::function<void(int)> epilog_;
     std::function<void(const std::string&)> info_;
     bool disable_checks_;
+    bool compress_sparse_ = false;
+
+    // What's been measured so far, or 0: the bytes per second that downloads go at and that
+    // sparse files compress at, and the compressed size over the sparse size.
+    double link_rate_ = 0;
+    double compress_rate_ = 0;
+    double compress_ratio_ = 0;
 };
 
 }  // namespace fastboot
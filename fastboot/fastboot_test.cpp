@@ -16,7 +16,11 @@
 
 #include "fastboot.h"
 
+#include <random>
+
 #include <gtest/gtest.h>
+#include <openssl/sha.h>
+#include <sparse/sparse.h>
 
 TEST(FastBoot, ParseOsPatchLevel) {
     FastBootTool fb;
@@ -201,3 +205,211 @@ TEST(FastBoot, ParseRequirementLineMalformed) {
     // No spaces allowed before between require-for-product and :.
     ParseRequirementLineTestMalformed("require-for-product :");
 }
+
+TEST(FastBoot, ChooseSharedImageLoad) {
+    constexpr int64_t kMiB = 1024 * 1024;
+
+    // A device that takes the whole image in one go gets it as is, resparsed or not.
+    EXPECT_EQ(SharedImageLoad::kFd, ChooseSharedImageLoad(0, 0));
+    EXPECT_EQ(SharedImageLoad::kFd, ChooseSharedImageLoad(0, 256 * kMiB));
+
+    // The shared copy's pieces fit anything with at least as big a limit.
+    EXPECT_EQ(SharedImageLoad::kShared, ChooseSharedImageLoad(256 * kMiB, 256 * kMiB));
+    EXPECT_EQ(SharedImageLoad::kShared, ChooseSharedImageLoad(512 * kMiB, 256 * kMiB));
+
+    // A device that takes smaller downloads than the shared copy was resparsed for, or one that
+    // needs the image resparsed when the shared copy wasn't, resparses it for itself.
+    EXPECT_EQ(SharedImageLoad::kResparse, ChooseSharedImageLoad(128 * kMiB, 256 * kMiB));
+    EXPECT_EQ(SharedImageLoad::kResparse, ChooseSharedImageLoad(128 * kMiB, 0));
+}
+
+static constexpr unsigned int kBlockSize = 4096;
+static constexpr size_t kExtentSize = UnchangedBlockFilter::kExtentSize;
+
+static std::string RandomData(size_t len, unsigned int seed) {
+    std::mt19937 random(seed);
+    std::string result(len, '\0');
+    for (char& c : result) {
+        c = static_cast<char>(random());
+    }
+    return result;
+}
+
+// What a device holding |contents| would send for UnchangedBlockFilter::Start.
+static std::vector<char> HashExtents(const std::string& contents) {
+    std::vector<char> hashes;
+    for (size_t offset = 0; offset < contents.size(); offset += kExtentSize) {
+        uint8_t hash[SHA256_DIGEST_LENGTH];
+        size_t len = std::min(kExtentSize, contents.size() - offset);
+        SHA256(reinterpret_cast<const uint8_t*>(&contents[offset]), len, hash);
+        hashes.insert(hashes.end(), hash, hash + sizeof(hash));
+    }
+    return hashes;
+}
+
+static int ExpandCallback(void* priv, const void* data, size_t len) {
+    auto image = reinterpret_cast<std::string*>(priv);
+    if (data) {
+        image->append(reinterpret_cast<const char*>(data), len);
+    } else {
+        image->append(len, '?');
+    }
+    return 0;
+}
+
+// Expands |s|, with '?' for each don't-care byte.
+static std::string Expand(sparse_file* s) {
+    std::string image;
+    EXPECT_EQ(0, sparse_file_callback(s, false, false, ExpandCallback, &image));
+    image.resize(sparse_file_len(s, false, false), '?');
+    return image;
+}
+
+TEST(UnchangedBlockFilter, MatchingExtentsDropped) {
+    std::string image = RandomData(3 * kExtentSize, 1);
+    std::string device = image;
+    device[kExtentSize + 100] ^= 1;
+
+    sparse_file* s = sparse_file_new(kBlockSize, image.size());
+    ASSERT_EQ(0, sparse_file_add_data(s, &image[0], image.size(), 0));
+
+    UnchangedBlockFilter filter;
+    ASSERT_TRUE(filter.Start(s, HashExtents(device)));
+    sparse_file* filtered = filter.Filter(s);
+    ASSERT_NE(nullptr, filtered);
+    std::string expected = std::string(kExtentSize, '?') + image.substr(kExtentSize, kExtentSize) +
+                           std::string(kExtentSize, '?');
+    EXPECT_EQ(expected, Expand(filtered));
+    EXPECT_EQ(2 * kExtentSize, filter.skipped_bytes());
+    sparse_file_destroy(filtered);
+
+    // Filtering again gives the same result, without counting anything twice.
+    filtered = filter.Filter(s);
+    ASSERT_NE(nullptr, filtered);
+    EXPECT_EQ(expected, Expand(filtered));
+    EXPECT_EQ(2 * kExtentSize, filter.skipped_bytes());
+    sparse_file_destroy(filtered);
+
+    UnchangedBlockFilter unchanged;
+    ASSERT_TRUE(unchanged.Start(s, HashExtents(image)));
+    EXPECT_EQ(nullptr, unchanged.Filter(s));
+    EXPECT_EQ(image.size(), unchanged.skipped_bytes());
+
+    // The hashes have to cover the image.
+    UnchangedBlockFilter short_hashes;
+    EXPECT_FALSE(short_hashes.Start(s, HashExtents(image.substr(kExtentSize))));
+    sparse_file_destroy(s);
+}
+
+TEST(UnchangedBlockFilter, PartialLastExtent) {
+    std::string image = RandomData(2 * kExtentSize + 5 * kBlockSize, 2);
+    sparse_file* s = sparse_file_new(kBlockSize, image.size());
+    ASSERT_EQ(0, sparse_file_add_data(s, &image[0], image.size(), 0));
+
+    UnchangedBlockFilter unchanged;
+    ASSERT_TRUE(unchanged.Start(s, HashExtents(image)));
+    EXPECT_EQ(nullptr, unchanged.Filter(s));
+    EXPECT_EQ(image.size(), unchanged.skipped_bytes());
+
+    std::string device = image;
+    device.back() ^= 1;
+    UnchangedBlockFilter filter;
+    ASSERT_TRUE(filter.Start(s, HashExtents(device)));
+    sparse_file* filtered = filter.Filter(s);
+    ASSERT_NE(nullptr, filtered);
+    EXPECT_EQ(std::string(2 * kExtentSize, '?') + image.substr(2 * kExtentSize), Expand(filtered));
+    EXPECT_EQ(2 * kExtentSize, filter.skipped_bytes());
+    sparse_file_destroy(filtered);
+    sparse_file_destroy(s);
+}
+
+TEST(UnchangedBlockFilter, ExtentSplitAcrossPieces) {
+    std::string image = RandomData(2 * kExtentSize, 3);
+    sparse_file* s = sparse_file_new(kBlockSize, image.size());
+    ASSERT_EQ(0, sparse_file_add_data(s, &image[0], image.size(), 0));
+
+    // Resparsing splits the second extent between the two pieces.
+    sparse_file* pieces[2] = {};
+    ASSERT_EQ(2, sparse_file_resparse(s, kExtentSize + kExtentSize / 2, pieces, 2));
+    unsigned int split_block = 0;
+    auto first_block = [](void* priv, const void*, size_t, unsigned int block, unsigned int) {
+        auto first = reinterpret_cast<unsigned int*>(priv);
+        if (*first == 0) *first = block;
+        return 0;
+    };
+    ASSERT_EQ(0, sparse_file_foreach_chunk(pieces[1], false, false, first_block, &split_block));
+    size_t split = split_block * kBlockSize;
+    ASSERT_GT(split, kExtentSize);
+    ASSERT_LT(split, 2 * kExtentSize);
+
+    UnchangedBlockFilter filter;
+    ASSERT_TRUE(filter.Start(pieces[0], HashExtents(image)));
+    std::string expanded[2];
+    for (size_t i = 0; i < 2; ++i) {
+        sparse_file* filtered = filter.Filter(pieces[i]);
+        ASSERT_NE(nullptr, filtered);
+        expanded[i] = Expand(filtered);
+        sparse_file_destroy(filtered);
+    }
+
+    // The first extent is entirely in the first piece, and matches. Neither piece can tell
+    // whether the second one does, so each sends its part of it.
+    EXPECT_EQ(std::string(kExtentSize, '?'), expanded[0].substr(0, kExtentSize));
+    EXPECT_EQ(std::string(kExtentSize, '?'), expanded[1].substr(0, kExtentSize));
+    EXPECT_EQ(image.substr(kExtentSize, split - kExtentSize),
+              expanded[0].substr(kExtentSize, split - kExtentSize));
+    EXPECT_EQ(std::string(2 * kExtentSize - split, '?'), expanded[0].substr(split));
+    EXPECT_EQ(std::string(split - kExtentSize, '?'),
+              expanded[1].substr(kExtentSize, split - kExtentSize));
+    EXPECT_EQ(image.substr(split), expanded[1].substr(split));
+    EXPECT_EQ(kExtentSize, filter.skipped_bytes());
+
+    sparse_file_destroy(pieces[0]);
+    sparse_file_destroy(pieces[1]);
+    sparse_file_destroy(s);
+}
+
+TEST(UnchangedBlockFilter, DontCareGap) {
+    std::string image = RandomData(2 * kExtentSize, 4);
+    sparse_file* s = sparse_file_new(kBlockSize, image.size());
+    ASSERT_EQ(0, sparse_file_add_data(s, &image[0], 10 * kBlockSize, 0));
+    ASSERT_EQ(0, sparse_file_add_data(s, &image[20 * kBlockSize], image.size() - 20 * kBlockSize,
+                                      20));
+
+    // The device's hashes match, but the gap's contents aren't known, so the first extent is sent
+    // with the gap left alone.
+    UnchangedBlockFilter filter;
+    ASSERT_TRUE(filter.Start(s, HashExtents(image)));
+    sparse_file* filtered = filter.Filter(s);
+    ASSERT_NE(nullptr, filtered);
+    std::string expected = image.substr(0, kExtentSize) + std::string(kExtentSize, '?');
+    expected.replace(10 * kBlockSize, 10 * kBlockSize, 10 * kBlockSize, '?');
+    EXPECT_EQ(expected, Expand(filtered));
+    EXPECT_EQ(kExtentSize, filter.skipped_bytes());
+    sparse_file_destroy(filtered);
+    sparse_file_destroy(s);
+}
+
+TEST(UnchangedBlockFilter, FillRuns) {
+    // A changed extent that's mostly runs of repeated values, which is how a sparse file's fill
+    // chunks come out of the expanded image.
+    std::string image;
+    for (size_t i = 0; i < 16 * kBlockSize / 4; ++i) {
+        image += std::string("\xef\xbe\xad\xde", 4);
+    }
+    image += RandomData(16 * kBlockSize, 5);
+    image += std::string(kExtentSize - image.size(), '\0');
+    sparse_file* s = sparse_file_new(kBlockSize, image.size());
+    ASSERT_EQ(0, sparse_file_add_data(s, &image[0], image.size(), 0));
+
+    UnchangedBlockFilter filter;
+    ASSERT_TRUE(filter.Start(s, HashExtents(std::string(image.size(), 'x'))));
+    sparse_file* filtered = filter.Filter(s);
+    ASSERT_NE(nullptr, filtered);
+    EXPECT_EQ(image, Expand(filtered));
+
+    // Only the random blocks are sent as data.
+    EXPECT_LT(sparse_file_len(filtered, true, false), 17 * kBlockSize);
+    sparse_file_destroy(filtered);
+    sparse_file_destroy(s);
+}
@@ -33,6 +33,8 @@
 #include <errno.h>
 #include <stdio.h>
 
+#include <algorithm>
+#include <deque>
 #include <list>
 #include <memory>
 #include <vector>
@@ -68,6 +70,7 @@ class Header {
     ~Header() = default;
 
     uint8_t id() const { return bytes_[kIndexId]; }
+    uint16_t sequence() const { return ExtractUint16(bytes_ + kIndexSeqH); }
     const uint8_t* bytes() const { return bytes_; }
 
     void Set(uint8_t id, uint16_t sequence, Flag flag);
@@ -130,9 +133,16 @@ class UdpTransport : public Transport {
                                    uint8_t* rx_data, size_t rx_length, int attempts,
                                    std::string* error);
 
+    // Sends |tx_length| bytes of fastboot data, keeping up to |window_size_| packets
+    // unacknowledged at a time. The device acknowledges every packet it receives, in order or
+    // not, so only the packets that were lost are retransmitted.
+    // Returns the same as SendData().
+    ssize_t SendWindowed(const uint8_t* tx_data, size_t tx_length, std::string* error);
+
     std::unique_ptr<Socket> socket_;
     int sequence_ = -1;
     size_t max_data_length_ = kMinPacketSize - kHeaderSize;
+    size_t window_size_ = 1;
     std::vector<uint8_t> rx_packet_;
 
     DISALLOW_COPY_AND_ASSIGN(UdpTransport);
@@ -150,7 +160,7 @@ std::unique_ptr<UdpTransport> UdpTransport::NewTransport(std::unique_ptr<Socket>
 }
 
 bool UdpTransport::InitializeProtocol(std::string* error) {
-    uint8_t rx_data[4];
+    uint8_t rx_data[6];
 
     sequence_ = 0;
     rx_packet_.resize(kMinPacketSize);
@@ -181,9 +191,10 @@ bool UdpTransport::InitializeProtocol(std::string* error) {
     }
 
     // The first two data bytes contain the version, the second two bytes contain the target max
-    // supported packet size, which must be at least 512 bytes.
+    // supported packet size, which must be at least 512 bytes. Version 2 targets may follow that
+    // with their max window size.
     uint16_t version = ExtractUint16(rx_data);
-    if (version < kProtocolVersion) {
+    if (version < kMinProtocolVersion) {
         *error = android::base::StringPrintf("target reported invalid protocol version %d",
                                              version);
         return false;
@@ -198,6 +209,11 @@ bool UdpTransport::InitializeProtocol(std::string* error) {
     max_data_length_ = packet_size - kHeaderSize;
     rx_packet_.resize(packet_size);
 
+    if (version >= 2 && rx_bytes >= 6) {
+        uint16_t window_size = ExtractUint16(rx_data + 4);
+        window_size_ = std::max<uint16_t>(1, std::min(kHostMaxWindowSize, window_size));
+    }
+
     return true;
 }
 
@@ -324,6 +340,113 @@ ssize_t UdpTransport::SendSinglePacketHelper(
     return total_data_bytes;
 }
 
+ssize_t UdpTransport::SendWindowed(const uint8_t* tx_data, size_t tx_length,
+                                   std::string* error) {
+    if (socket_ == nullptr) {
+        *error = "socket is closed";
+        return -1;
+    }
+
+    struct Packet {
+        Header header;
+        const uint8_t* data;
+        size_t length;
+        bool acked;
+        // When this was last sent, counted in transmissions, and how many packets sent after that
+        // have been acknowledged since.
+        uint64_t sent;
+        int later_acks;
+    };
+    // The packets from the oldest unacknowledged one to the newest one sent.
+    std::deque<Packet> window;
+    uint64_t transmissions = 0;
+    ssize_t total_data_bytes = 0;
+    error->clear();
+
+    auto transmit = [&](Packet* packet) {
+        if (!socket_->Send({{packet->header.bytes(), kHeaderSize}, {packet->data, packet->length}})) {
+            *error = Socket::GetErrorMessage();
+            return false;
+        }
+        packet->sent = ++transmissions;
+        packet->later_acks = 0;
+        return true;
+    };
+
+    int attempts_left = kMaxTransmissionAttempts;
+    while (tx_length > 0 || !window.empty()) {
+        while (tx_length > 0 && window.size() < window_size_) {
+            Packet packet = {};
+            packet.data = tx_data;
+            packet.length = std::min(tx_length, max_data_length_);
+            packet.header.Set(kIdFastboot, sequence_ + window.size(),
+                              tx_length > max_data_length_ ? kFlagContinuation : kFlagNone);
+            window.push_back(packet);
+            if (!transmit(&window.back())) {
+                return -1;
+            }
+            tx_data += packet.length;
+            tx_length -= packet.length;
+        }
+
+        ssize_t bytes = socket_->Receive(rx_packet_.data(), rx_packet_.size(), kResponseTimeoutMs);
+        if (bytes == -1) {
+            if (!socket_->ReceiveTimedOut()) {
+                *error = Socket::GetErrorMessage();
+                return -1;
+            }
+            if (--attempts_left <= 0) {
+                *error = "no response from target";
+                return -1;
+            }
+            for (Packet& packet : window) {
+                if (!packet.acked && !transmit(&packet)) {
+                    return -1;
+                }
+            }
+            continue;
+        } else if (bytes < static_cast<ssize_t>(kHeaderSize)) {
+            *error = "protocol error: incomplete header";
+            return -1;
+        }
+
+        // Anything that isn't a response to a packet in the window is a duplicate or a leftover
+        // from an earlier exchange, and is ignored.
+        uint16_t index = ExtractUint16(&rx_packet_[kIndexSeqH]) - window.front().header.sequence();
+        if (index >= window.size() || !window[index].header.Matches(rx_packet_.data())) {
+            continue;
+        }
+        if (rx_packet_[kIndexId] == kIdError) {
+            *error = "target reported error: " +
+                     std::string(rx_packet_.data() + kHeaderSize, rx_packet_.data() + bytes);
+            return -1;
+        }
+        Packet& acked = window[index];
+        if (acked.acked) {
+            continue;
+        }
+        acked.acked = true;
+        total_data_bytes += bytes - kHeaderSize;
+        attempts_left = kMaxTransmissionAttempts;
+
+        // Packets that were sent before this one and still haven't been acknowledged were most
+        // likely lost; resend them once enough later packets have got through.
+        for (Packet& packet : window) {
+            if (!packet.acked && packet.sent < acked.sent &&
+                ++packet.later_acks >= kFastRetransmitAcks && !transmit(&packet)) {
+                return -1;
+            }
+        }
+
+        while (!window.empty() && window.front().acked) {
+            window.pop_front();
+            ++sequence_;
+        }
+    }
+
+    return total_data_bytes;
+}
+
 ssize_t UdpTransport::Read(void* data, size_t length) {
     // Read from the target by sending an empty packet.
     std::string error;
@@ -345,8 +468,13 @@ ssize_t UdpTransport::Read(void* data, size_t length) {
 
 ssize_t UdpTransport::Write(const void* data, size_t length) {
     std::string error;
-    ssize_t bytes = SendData(kIdFastboot, reinterpret_cast<const uint8_t*>(data), length, nullptr,
-                             0, kMaxTransmissionAttempts, &error);
+    ssize_t bytes;
+    if (window_size_ > 1 && length > max_data_length_) {
+        bytes = SendWindowed(reinterpret_cast<const uint8_t*>(data), length, &error);
+    } else {
+        bytes = SendData(kIdFastboot, reinterpret_cast<const uint8_t*>(data), length, nullptr, 0,
+                         kMaxTransmissionAttempts, &error);
+    }
 
     if (bytes == -1) {
         fprintf(stderr, "UDP error: %s\n", error.c_str());
@@ -45,11 +45,22 @@ std::unique_ptr<Transport> Connect(const std::string& hostname, int port, std::s
 // Internal namespace for test use only.
 namespace internal {
 
-constexpr uint16_t kProtocolVersion = 1;
+constexpr uint16_t kProtocolVersion = 2;
+
+// Version 1 devices are still supported, they just don't get windowed writes.
+constexpr uint16_t kMinProtocolVersion = 1;
 
 // This will be negotiated with the device so may end up being smaller.
 constexpr uint16_t kHostMaxPacketSize = 8192;
 
+// The most packets we'll have unacknowledged at once when writing to a version 2 device. This will
+// also be negotiated with the device so may end up being smaller.
+constexpr uint16_t kHostMaxWindowSize = 32;
+
+// A packet is retransmitted without waiting for the timeout once this many packets sent after it
+// have been acknowledged.
+constexpr int kFastRetransmitAcks = 3;
+
 // Retransmission constants. Retransmission timeout must be at least 500ms, and the host must
 // attempt to send packets for at least 1 minute once the device has connected. See
 // fastboot_protocol.txt for more information.
@@ -16,6 +16,13 @@
 
 #include "udp.h"
 
+#include <string.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <random>
+
 #include <gtest/gtest.h>
 
 #include "socket.h"
@@ -309,15 +316,21 @@ class UdpTest : public ::testing::Test {
     }
 
     // Sets up |mock_socket_| to correctly initialize the protocol and creates |transport_|. This
-    // can be called multiple times in a test if needed.
-    bool InitializeTransport(uint16_t starting_sequence, int device_max_packet_size = 512) {
+    // can be called multiple times in a test if needed. The device only reports a window size if
+    // |device_window_size| is non-zero.
+    bool InitializeTransport(uint16_t starting_sequence, int device_max_packet_size = 512,
+                             int device_window_size = 0, uint16_t device_version = kProtocolVersion) {
         mock_socket_ = new SocketMock;
         mock_socket_->ExpectSend(QueryPacket(0));
         mock_socket_->AddReceive(QueryPacket(0, starting_sequence));
         mock_socket_->ExpectSend(
                 InitPacket(starting_sequence, kProtocolVersion, kHostMaxPacketSize));
-        mock_socket_->AddReceive(
-                InitPacket(starting_sequence, kProtocolVersion, device_max_packet_size));
+        std::string init_response =
+                InitPacket(starting_sequence, device_version, device_max_packet_size);
+        if (device_window_size != 0) {
+            init_response += PacketValue(device_window_size);
+        }
+        mock_socket_->AddReceive(init_response);
 
         std::string error;
         transport_ = Connect(std::unique_ptr<Socket>(mock_socket_), &error);
@@ -529,3 +542,348 @@ TEST_F(UdpTest, CloseTransport) {
     EXPECT_EQ(-1, transport_->Write("foo", 3));
     EXPECT_EQ(-1, transport_->Read(buffer, sizeof(buffer)));
 }
+
+// Returns |count| packets worth of data for a 512-byte max packet size, and the packets that
+// carry it starting at |sequence|.
+static std::string WindowedData(size_t count, uint16_t sequence, std::vector<std::string>* packets) {
+    std::string data;
+    for (size_t i = 0; i < count; ++i) {
+        std::string chunk(508, 'a' + i % 26);
+        data += chunk;
+        packets->push_back(FastbootPacket(sequence + i, chunk,
+                                          i + 1 < count ? kFlagContinuation : kFlagNone));
+    }
+    return data;
+}
+
+// Tests that a version 2 device reporting a window size gets several packets at once, with more
+// sent as the oldest are acknowledged.
+TEST_F(UdpTest, WindowedWrite) {
+    ASSERT_TRUE(InitializeTransport(0, 512, 4));
+
+    std::vector<std::string> packets;
+    std::string data = WindowedData(6, 1, &packets);
+    for (int i = 0; i < 4; ++i) {
+        mock_socket_->ExpectSend(packets[i]);
+    }
+    mock_socket_->AddReceive(FastbootPacket(1));
+    mock_socket_->ExpectSend(packets[4]);
+    mock_socket_->AddReceive(FastbootPacket(2));
+    mock_socket_->ExpectSend(packets[5]);
+    for (int i = 3; i <= 6; ++i) {
+        mock_socket_->AddReceive(FastbootPacket(i));
+    }
+    EXPECT_TRUE(Write(data));
+
+    // Reads are still one packet at a time, and pick up the sequence after the write.
+    mock_socket_->ExpectSend(FastbootPacket(7));
+    mock_socket_->AddReceive(FastbootPacket(7, "OKAY"));
+    EXPECT_TRUE(Read("OKAY"));
+}
+
+// Tests that writes that fit in a single packet aren't windowed.
+TEST_F(UdpTest, WindowedWriteSinglePacket) {
+    ASSERT_TRUE(InitializeTransport(0, 512, 4));
+
+    mock_socket_->ExpectSend(FastbootPacket(1, "foo"));
+    mock_socket_->AddReceive(FastbootPacket(1));
+    EXPECT_TRUE(Write("foo"));
+}
+
+// Tests that the device's window size is limited to the host's.
+TEST_F(UdpTest, WindowSizeLimit) {
+    ASSERT_TRUE(InitializeTransport(0, 512, 0xFFFF));
+
+    std::vector<std::string> packets;
+    std::string data = WindowedData(kHostMaxWindowSize + 1, 1, &packets);
+    for (int i = 0; i < kHostMaxWindowSize; ++i) {
+        mock_socket_->ExpectSend(packets[i]);
+    }
+    mock_socket_->AddReceive(FastbootPacket(1));
+    mock_socket_->ExpectSend(packets[kHostMaxWindowSize]);
+    for (int i = 2; i <= kHostMaxWindowSize + 1; ++i) {
+        mock_socket_->AddReceive(FastbootPacket(i));
+    }
+    EXPECT_TRUE(Write(data));
+}
+
+// Tests that windows are only used with version 2 devices.
+TEST_F(UdpTest, WindowRequiresVersion2) {
+    ASSERT_TRUE(InitializeTransport(0, 512, 4, 1));
+
+    std::vector<std::string> packets;
+    std::string data = WindowedData(2, 1, &packets);
+    mock_socket_->ExpectSend(packets[0]);
+    mock_socket_->AddReceive(FastbootPacket(1));
+    mock_socket_->ExpectSend(packets[1]);
+    mock_socket_->AddReceive(FastbootPacket(2));
+    EXPECT_TRUE(Write(data));
+}
+
+// Tests that a timeout only retransmits the packets that haven't been acknowledged.
+TEST_F(UdpTest, WindowedWriteTimeoutRecovery) {
+    ASSERT_TRUE(InitializeTransport(0xFFFE, 512, 4));
+
+    std::vector<std::string> packets;
+    std::string data = WindowedData(4, 0xFFFF, &packets);
+    for (int i = 0; i < 4; ++i) {
+        mock_socket_->ExpectSend(packets[i]);
+    }
+    mock_socket_->AddReceive(FastbootPacket(0xFFFF));
+    mock_socket_->AddReceive(FastbootPacket(1));
+    mock_socket_->AddReceiveTimeout();
+    mock_socket_->ExpectSend(packets[1]);
+    mock_socket_->ExpectSend(packets[3]);
+    mock_socket_->AddReceive(FastbootPacket(0));
+    mock_socket_->AddReceive(FastbootPacket(2));
+    EXPECT_TRUE(Write(data));
+}
+
+// Tests that a packet is retransmitted without waiting for a timeout once enough packets sent
+// after it have been acknowledged.
+TEST_F(UdpTest, WindowedWriteFastRetransmit) {
+    ASSERT_TRUE(InitializeTransport(0, 512, 8));
+
+    std::vector<std::string> packets;
+    std::string data = WindowedData(5, 1, &packets);
+    for (int i = 0; i < 5; ++i) {
+        mock_socket_->ExpectSend(packets[i]);
+    }
+    mock_socket_->AddReceive(FastbootPacket(2));
+    mock_socket_->AddReceive(FastbootPacket(3));
+    mock_socket_->AddReceive(FastbootPacket(4));
+    mock_socket_->ExpectSend(packets[0]);
+    // Packet 1 was sent again after packet 5, so this doesn't count against it.
+    mock_socket_->AddReceive(FastbootPacket(5));
+    mock_socket_->AddReceive(FastbootPacket(1));
+    EXPECT_TRUE(Write(data));
+}
+
+// Tests that duplicate, stale and mismatched responses are ignored.
+TEST_F(UdpTest, WindowedWriteIgnoresUnexpectedResponses) {
+    ASSERT_TRUE(InitializeTransport(0, 512, 2));
+
+    std::vector<std::string> packets;
+    std::string data = WindowedData(3, 1, &packets);
+    mock_socket_->ExpectSend(packets[0]);
+    mock_socket_->ExpectSend(packets[1]);
+    mock_socket_->AddReceive(FastbootPacket(0));
+    mock_socket_->AddReceive(FastbootPacket(3));
+    mock_socket_->AddReceive(QueryPacket(1));
+    mock_socket_->AddReceive(FastbootPacket(2));
+    mock_socket_->AddReceive(FastbootPacket(2));
+    mock_socket_->AddReceive(FastbootPacket(1));
+    mock_socket_->ExpectSend(packets[2]);
+    mock_socket_->AddReceive(FastbootPacket(1));
+    mock_socket_->AddReceive(FastbootPacket(3));
+    EXPECT_TRUE(Write(data));
+}
+
+// Tests that an error response to any packet in the window aborts the write.
+TEST_F(UdpTest, WindowedWriteError) {
+    ASSERT_TRUE(InitializeTransport(0, 512, 4));
+
+    std::vector<std::string> packets;
+    std::string data = WindowedData(3, 1, &packets);
+    for (int i = 0; i < 3; ++i) {
+        mock_socket_->ExpectSend(packets[i]);
+    }
+    mock_socket_->AddReceive(FastbootPacket(1));
+    mock_socket_->AddReceive(ErrorPacket(3, "test error"));
+    EXPECT_FALSE(Write(data));
+}
+
+// Tests that data in the ACK for a windowed packet is rejected, like any other write.
+TEST_F(UdpTest, WindowedWriteOutOfTurnData) {
+    ASSERT_TRUE(InitializeTransport(0, 512, 4));
+
+    std::vector<std::string> packets;
+    std::string data = WindowedData(2, 1, &packets);
+    mock_socket_->ExpectSend(packets[0]);
+    mock_socket_->ExpectSend(packets[1]);
+    mock_socket_->AddReceive(FastbootPacket(1));
+    mock_socket_->AddReceive(FastbootPacket(2, "OKAY"));
+    EXPECT_FALSE(Write(data));
+}
+
+TEST_F(UdpTest, WindowedWriteTimeoutFailure) {
+    ASSERT_TRUE(InitializeTransport(0, 512, 4));
+
+    std::vector<std::string> packets;
+    std::string data = WindowedData(2, 1, &packets);
+    mock_socket_->ExpectSend(packets[0]);
+    mock_socket_->ExpectSend(packets[1]);
+    mock_socket_->AddReceive(FastbootPacket(1));
+    for (int i = 0; i < kMaxTransmissionAttempts - 1; ++i) {
+        mock_socket_->AddReceiveTimeout();
+        mock_socket_->ExpectSend(packets[1]);
+    }
+    mock_socket_->AddReceiveTimeout();
+    EXPECT_FALSE(Write(data));
+}
+
+// A Socket connected to a simulated version 2 device over a link with a given round-trip time and
+// packet loss rate, and 100Mbit/s of bandwidth. Time is simulated as well, so transfers take no
+// real time however slow the link is; elapsed() says how long they would have taken.
+class SimulatedLinkSocket : public Socket {
+  public:
+    SimulatedLinkSocket(uint16_t window_size, double rtt_ms, double loss_rate)
+        : Socket(INVALID_SOCKET),
+          window_size_(window_size),
+          rtt_(rtt_ms / 1000),
+          loss_rate_(loss_rate) {}
+
+    bool Send(const void* data, size_t length) override {
+        // Packets queue up for the link, then take half the round-trip time to arrive.
+        link_free_ = std::max(link_free_, now_) + (length + kPacketOverhead) / kBandwidth;
+        if (!Lost()) {
+            Process(std::string(reinterpret_cast<const char*>(data), length),
+                    link_free_ + rtt_ / 2);
+        }
+        return true;
+    }
+
+    bool Send(std::vector<cutils_socket_buffer_t> buffers) override {
+        std::string data;
+        for (const auto& buffer : buffers) {
+            data.append(reinterpret_cast<const char*>(buffer.data), buffer.length);
+        }
+        return Send(data.data(), data.size());
+    }
+
+    ssize_t Receive(void* data, size_t length, int timeout_ms) override {
+        if (responses_.empty() || responses_.front().first > now_ + timeout_ms / 1000.0) {
+            now_ += timeout_ms / 1000.0;
+            receive_timed_out_ = true;
+            return -1;
+        }
+        now_ = std::max(now_, responses_.front().first);
+        std::string response = std::move(responses_.front().second);
+        responses_.pop_front();
+        receive_timed_out_ = false;
+        if (response.size() > length) {
+            ADD_FAILURE() << "Receive(): not enough bytes (" << length << ")";
+            return -1;
+        }
+        memcpy(data, response.data(), response.size());
+        return response.size();
+    }
+
+    int Close() override { return 0; }
+
+    double elapsed() const { return now_; }
+    const std::string& received() const { return received_; }
+
+  private:
+    static constexpr double kBandwidth = 100e6 / 8;
+    // Ethernet, IP and UDP headers.
+    static constexpr size_t kPacketOverhead = 14 + 20 + 8;
+    static constexpr uint16_t kDeviceMaxPacketSize = 1024;
+
+    bool Lost() { return rng_() < loss_rate_ * std::mt19937::max(); }
+
+    // Handles |packet| arriving at the device at |time|, following the rules in README.md.
+    void Process(const std::string& packet, double time) {
+        uint16_t sequence = ExtractSequence(packet);
+        uint16_t ahead = sequence - expected_;
+        uint16_t behind = expected_ - sequence;
+        if (packet[0] == kIdDeviceQuery) {
+            Respond(QueryPacket(sequence, expected_), time);
+        } else if (ahead == 0) {
+            last_response_ = Handle(packet);
+            Respond(last_response_, time);
+            ++expected_;
+            for (auto it = saved_.find(expected_); it != saved_.end(); it = saved_.find(expected_)) {
+                last_response_ = Handle(it->second);
+                saved_.erase(it);
+                ++expected_;
+            }
+        } else if (ahead < window_size_) {
+            saved_.emplace(sequence, packet);
+            Respond(FastbootPacket(sequence), time);
+        } else if (behind == 1) {
+            Respond(last_response_, time);
+        } else if (behind <= window_size_) {
+            Respond(FastbootPacket(sequence), time);
+        }
+    }
+
+    // Processes a packet in order, and returns the response.
+    std::string Handle(const std::string& packet) {
+        uint16_t sequence = ExtractSequence(packet);
+        if (packet[0] == kIdInitialization) {
+            if (window_size_ == 1) {
+                return InitPacket(sequence, 1, kDeviceMaxPacketSize);
+            }
+            return InitPacket(sequence, 2, kDeviceMaxPacketSize) + PacketValue(window_size_);
+        }
+        if (packet.size() == 4) {
+            return FastbootPacket(sequence, "OKAY");
+        }
+        received_.append(packet, 4, std::string::npos);
+        return FastbootPacket(sequence);
+    }
+
+    void Respond(const std::string& response, double time) {
+        if (!Lost()) {
+            responses_.emplace_back(time + rtt_ / 2, response);
+        }
+    }
+
+    static uint16_t ExtractSequence(const std::string& packet) {
+        return (static_cast<uint8_t>(packet[2]) << 8) | static_cast<uint8_t>(packet[3]);
+    }
+
+    uint16_t window_size_;
+    double rtt_;
+    double loss_rate_;
+    std::mt19937 rng_;
+
+    double now_ = 0;
+    double link_free_ = 0;
+    // Responses on their way to the host, and when they arrive, in order.
+    std::deque<std::pair<double, std::string>> responses_;
+
+    uint16_t expected_ = 0;
+    std::map<uint16_t, std::string> saved_;
+    std::string last_response_;
+    std::string received_;
+};
+
+// Writes 4MiB over links with a range of round-trip times and loss rates, with and without
+// windowing, and checks that it all arrives intact and that windowing is faster.
+TEST(UdpSimulatedLinkTest, WindowedWriteThroughput) {
+    std::string data(4 * 1024 * 1024, '\0');
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = i * 7 + i / 4096;
+    }
+
+    for (double rtt_ms : {0.5, 5.0, 50.0}) {
+        for (double loss_rate : {0.0, 0.01, 0.05}) {
+            double seconds[2];
+            for (int windowed = 0; windowed < 2; ++windowed) {
+                SCOPED_TRACE(testing::Message() << rtt_ms << "ms RTT, " << loss_rate * 100
+                                                << "% loss, windowed " << windowed);
+                auto socket = new SimulatedLinkSocket(windowed ? kHostMaxWindowSize : 1, rtt_ms,
+                                                      loss_rate);
+                std::string error;
+                std::unique_ptr<Transport> transport =
+                        Connect(std::unique_ptr<Socket>(socket), &error);
+                ASSERT_NE(nullptr, transport) << error;
+
+                double start = socket->elapsed();
+                ASSERT_EQ(static_cast<ssize_t>(data.size()),
+                          transport->Write(data.data(), data.size()));
+                seconds[windowed] = socket->elapsed() - start;
+                EXPECT_TRUE(data == socket->received());
+
+                // Make sure the device is still in step with the host.
+                char response[4];
+                EXPECT_EQ(4, transport->Read(response, sizeof(response)));
+            }
+            // The window should be worth several times stop-and-wait's throughput everywhere.
+            EXPECT_LT(seconds[1] * 4, seconds[0])
+                    << rtt_ms << "ms RTT, " << loss_rate * 100 << "% loss";
+        }
+    }
+}
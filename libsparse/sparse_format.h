@@ -42,6 +42,7 @@ typedef struct sparse_header {
 #define CHUNK_TYPE_FILL 0xCAC2
 #define CHUNK_TYPE_DONT_CARE 0xCAC3
 #define CHUNK_TYPE_CRC32 0xCAC4
+#define CHUNK_TYPE_DEFLATE 0xCAC5
 
 typedef struct chunk_header {
   __le16 chunk_type; /* 0xCAC1 -> raw; 0xCAC2 -> fill; 0xCAC3 -> don't care */
@@ -50,10 +51,13 @@ typedef struct chunk_header {
   __le32 total_sz; /* in bytes of chunk input file including chunk header and data */
 } chunk_header_t;
 
-/* Following a Raw or Fill or CRC32 chunk is data.
+/* Following a Raw, Fill, CRC32 or Deflate chunk is data.
  *  For a Raw chunk, it's the data in chunk_sz * blk_sz.
  *  For a Fill chunk, it's 4 bytes of the fill data.
  *  For a CRC32 chunk, it's 4 bytes of CRC32
+ *  For a Deflate chunk, it's a zlib stream that inflates to chunk_sz * blk_sz
+ *  bytes of raw data. These are only sent by fastboot to devices that report
+ *  "deflate" in the "sparse-compression" variable, and libsparse doesn't read them.
  */
 
 #ifdef __cplusplus